@@ -0,0 +1,200 @@
+﻿using CenterDevice.MiniFSWatcher.Events;
+using CenterDevice.MiniFSWatcher.Types;
+using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    // Walks a directory tree in parallel and hands out a synthetic create for
+    // every entry, to seed consumers before they follow live events.
+    //
+    // Every directory is scanned by its own task. Tasks started from a pool
+    // thread go to that thread's local queue, idle pool threads steal from
+    // there, so wide and deep trees both keep all threads busy.
+    //
+    // Scanned events carry the sequence number of the last live event read
+    // before the scan started as a fence. The reader thread observes live
+    // events after the fence and drops scanned entries whose path or one of
+    // its parents was touched by one of them, so live events win over a
+    // directory listing that may already be stale.
+    class BaselineScanner
+    {
+        private const int QUEUE_CAPACITY = 65536;
+
+        private readonly BlockingCollection<FileSystemEvent> scanned = new BlockingCollection<FileSystemEvent>(QUEUE_CAPACITY);
+        private readonly HashSet<string> touched = new HashSet<string>(StringComparer.OrdinalIgnoreCase);
+        private readonly TaskCompletionSource<long> completion = new TaskCompletionSource<long>();
+        private readonly CancellationTokenSource cancellation;
+        private readonly CancellationToken cancellationToken;
+        private int pendingDirectories;
+        private long delivered;
+
+        public uint Fence { get; private set; }
+
+        // Completes with the number of delivered entries once all of them were delivered
+        public Task<long> Completion
+        {
+            get { return completion.Task; }
+        }
+
+        // Takes ownership of the cancellation source, it is disposed once no scan task uses it
+        public BaselineScanner(uint fence, CancellationTokenSource cancellation)
+        {
+            Fence = fence;
+            this.cancellation = cancellation;
+            cancellationToken = cancellation.Token;
+        }
+
+        public void Start(string root)
+        {
+            pendingDirectories = 1;
+            Schedule(Path.GetFullPath(root));
+        }
+
+        // Called by the reader thread for every live event before it is handled
+        public void Observe(FileSystemEvent fileEvent)
+        {
+            if (!IsAfterFence(fileEvent.SequenceNumber))
+            {
+                return;
+            }
+
+            touched.Add(fileEvent.Filename);
+
+            var moveEvent = fileEvent as RenameOrMoveEvent;
+            if (moveEvent != null)
+            {
+                touched.Add(moveEvent.OldFilename);
+            }
+        }
+
+        // Called by the reader thread, hands at most maxEvents scanned entries to deliver.
+        // Returns the number of entries taken from the queue.
+        public int Drain(Action<FileSystemEvent> deliver, int maxEvents)
+        {
+            int taken = 0;
+            FileSystemEvent fileEvent;
+            while (taken < maxEvents && scanned.TryTake(out fileEvent))
+            {
+                taken++;
+                if (!IsTouched(fileEvent.Filename))
+                {
+                    delivered++;
+                    deliver(fileEvent);
+                }
+            }
+
+            if (scanned.IsCompleted && !completion.Task.IsCompleted)
+            {
+                cancellation.Dispose();
+
+                if (cancellationToken.IsCancellationRequested)
+                {
+                    completion.TrySetCanceled();
+                }
+                else
+                {
+                    completion.TrySetResult(delivered);
+                }
+            }
+
+            return taken;
+        }
+
+        // Called once nobody drains the scan anymore, its tasks stop with the watcher's token
+        public void Abandon()
+        {
+            completion.TrySetCanceled();
+        }
+
+        private bool IsAfterFence(uint sequenceNumber)
+        {
+            return (int)(sequenceNumber - Fence) > 0;
+        }
+
+        private bool IsTouched(string path)
+        {
+            if (touched.Count == 0)
+            {
+                return false;
+            }
+
+            for (var current = path; !string.IsNullOrEmpty(current); current = Path.GetDirectoryName(current))
+            {
+                if (touched.Contains(current))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        private void Schedule(string directory)
+        {
+            Task.Factory.StartNew(() => Scan(directory), CancellationToken.None, TaskCreationOptions.None, TaskScheduler.Default);
+        }
+
+        private void Scan(string directory)
+        {
+            try
+            {
+                foreach (var info in new DirectoryInfo(directory).EnumerateFileSystemInfos())
+                {
+                    cancellationToken.ThrowIfCancellationRequested();
+
+                    var isDirectory = info.Attributes.HasFlag(FileAttributes.Directory);
+
+                    // Junctions and symbolic links would lead out of the tree or into a loop
+                    if (isDirectory && !info.Attributes.HasFlag(FileAttributes.ReparsePoint))
+                    {
+                        Interlocked.Increment(ref pendingDirectories);
+                        Schedule(info.FullName);
+                    }
+
+                    scanned.Add(ToEvent(info, isDirectory), cancellationToken);
+                }
+            }
+            catch (OperationCanceledException)
+            {
+            }
+            catch (Exception e) when (e is IOException || e is UnauthorizedAccessException || e is System.Security.SecurityException)
+            {
+                // The directory vanished or can't be listed, live events cover what happens to it now
+                Trace.TraceWarning("Could not scan " + directory + ": " + e.Message);
+            }
+            finally
+            {
+                if (Interlocked.Decrement(ref pendingDirectories) == 0)
+                {
+                    scanned.CompleteAdding();
+                }
+            }
+        }
+
+        private FileSystemEvent ToEvent(FileSystemInfo info, bool isDirectory)
+        {
+            var fileEvent = new FileSystemEvent()
+            {
+                Type = EventType.Create,
+                Filename = info.FullName,
+                IsDirectory = isDirectory,
+                IsBaseline = true,
+                SequenceNumber = Fence,
+                LastWriteTime = info.LastWriteTimeUtc,
+                Attributes = info.Attributes
+            };
+
+            var fileInfo = info as FileInfo;
+            if (fileInfo != null)
+            {
+                fileEvent.Size = fileInfo.Length;
+            }
+            return fileEvent;
+        }
+    }
+}
@@ -0,0 +1,284 @@
+﻿using CenterDevice.MiniFSWatcher.Events;
+using CenterDevice.MiniFSWatcher.Types;
+using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Security.Cryptography;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    public delegate void DigestEventHandler(string name, byte[] digest, ulong processId);
+
+    // Computes the SHA-256 digest of created, changed and moved files on a fixed pool of workers,
+    // so large files do not hold up the events behind them.
+    //
+    // Scheduling rules:
+    // 1. There is at most one job per path. A change of a path whose job has
+    //    not started yet is merged into that job. A change of a path that is
+    //    being hashed cancels that job and queues a new one.
+    // 2. A job skips the file if its size and last write time are the same
+    //    as when its last digest was computed.
+    // 3. Files are read sequentially in large chunks, cancellation is checked
+    //    between chunks.
+    // Digests are kept per path until the file is deleted, a move carries the
+    // state over to the new name, so an unchanged moved file is not read again.
+    class ContentHasher : IDisposable
+    {
+        private const int CHUNK_SIZE = 1024 * 1024;
+
+        private class Job
+        {
+            public string Filename;
+            public ulong ProcessId;
+            public bool Started;
+            public readonly CancellationTokenSource Cancellation = new CancellationTokenSource();
+        }
+
+        private class FileState
+        {
+            public long Size;
+            public DateTime LastWriteTime;
+        }
+
+        private readonly BlockingCollection<Job> queue = new BlockingCollection<Job>();
+        private readonly Dictionary<string, Job> jobs = new Dictionary<string, Job>(StringComparer.OrdinalIgnoreCase);
+        private readonly Dictionary<string, FileState> hashed = new Dictionary<string, FileState>(StringComparer.OrdinalIgnoreCase);
+        private readonly object sync = new object();
+        private readonly Action<string, byte[], ulong> deliver;
+        private readonly CancellationToken cancellationToken;
+
+        public ContentHasher(int workers, Action<string, byte[], ulong> deliver, CancellationToken cancellationToken)
+        {
+            this.deliver = deliver;
+            this.cancellationToken = cancellationToken;
+
+            for (int i = 0; i < workers; i++)
+            {
+                Task.Factory.StartNew(Work, TaskCreationOptions.LongRunning);
+            }
+        }
+
+        // Called with every delivered event
+        public void Observe(FileSystemEvent fileEvent)
+        {
+            if (fileEvent.IsDirectory)
+            {
+                return;
+            }
+
+            switch (fileEvent.Type)
+            {
+                case EventType.Create:
+                case EventType.Change:
+                    // With aggregation a new file arrives as a create only
+                    Schedule(fileEvent.Filename, fileEvent.ProcessId);
+                    break;
+                case EventType.Delete:
+                    Forget(fileEvent.Filename);
+                    break;
+                case EventType.Move:
+                    Rename(((RenameOrMoveEvent)fileEvent).OldFilename, fileEvent.Filename);
+                    Schedule(fileEvent.Filename, fileEvent.ProcessId);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        private void Schedule(string filename, ulong processId)
+        {
+            var job = new Job() { Filename = filename, ProcessId = processId };
+
+            lock (sync)
+            {
+                Job existing;
+                if (jobs.TryGetValue(filename, out existing))
+                {
+                    if (!existing.Started)
+                    {
+                        existing.ProcessId = processId;
+                        return;
+                    }
+
+                    existing.Cancellation.Cancel();
+                }
+
+                jobs[filename] = job;
+            }
+
+            try
+            {
+                queue.Add(job);
+            }
+            catch (InvalidOperationException)
+            {
+                // Hasher has been shut down, the change is not hashed
+            }
+        }
+
+        private void Forget(string filename)
+        {
+            lock (sync)
+            {
+                Job existing;
+                if (jobs.TryGetValue(filename, out existing))
+                {
+                    existing.Cancellation.Cancel();
+                    jobs.Remove(filename);
+                }
+
+                hashed.Remove(filename);
+            }
+        }
+
+        // Moves the state of a file to its new name, a pending job of the old
+        // name is dropped as the new name is scheduled instead
+        private void Rename(string oldFilename, string newFilename)
+        {
+            lock (sync)
+            {
+                FileState state;
+                var known = hashed.TryGetValue(oldFilename, out state);
+
+                Forget(oldFilename);
+
+                if (known)
+                {
+                    hashed[newFilename] = state;
+                }
+                else
+                {
+                    hashed.Remove(newFilename);
+                }
+            }
+        }
+
+        private void Work()
+        {
+            var buffer = new byte[CHUNK_SIZE];
+
+            foreach (var job in queue.GetConsumingEnumerable())
+            {
+                lock (sync)
+                {
+                    Job current;
+                    if (!jobs.TryGetValue(job.Filename, out current) || current != job)
+                    {
+                        // Replaced by a newer change or forgotten before it started
+                        job.Cancellation.Dispose();
+                        continue;
+                    }
+
+                    job.Started = true;
+                }
+
+                try
+                {
+                    var digest = Hash(job, buffer);
+                    if (digest != null)
+                    {
+                        deliver(job.Filename, digest, job.ProcessId);
+                    }
+                }
+                catch (OperationCanceledException)
+                {
+                }
+                catch (Exception e) when (e is IOException || e is UnauthorizedAccessException)
+                {
+                    // The file is gone or locked, a later change will try again
+                    Trace.TraceWarning("Could not hash " + job.Filename + ": " + e.Message);
+                }
+                catch (Exception e)
+                {
+                    Trace.TraceError("Digest handler failed: " + e);
+                }
+                finally
+                {
+                    lock (sync)
+                    {
+                        Job current;
+                        if (jobs.TryGetValue(job.Filename, out current) && current == job)
+                        {
+                            jobs.Remove(job.Filename);
+                        }
+                    }
+                    job.Cancellation.Dispose();
+                }
+            }
+        }
+
+        private byte[] Hash(Job job, byte[] buffer)
+        {
+            using (var linked = CancellationTokenSource.CreateLinkedTokenSource(job.Cancellation.Token, cancellationToken))
+            {
+                return Hash(job, buffer, linked.Token);
+            }
+        }
+
+        private byte[] Hash(Job job, byte[] buffer, CancellationToken token)
+        {
+            token.ThrowIfCancellationRequested();
+
+            var info = new FileInfo(job.Filename);
+            if (!info.Exists)
+            {
+                return null;
+            }
+
+            var state = new FileState() { Size = info.Length, LastWriteTime = info.LastWriteTimeUtc };
+            lock (sync)
+            {
+                FileState last;
+                if (hashed.TryGetValue(job.Filename, out last) && last.Size == state.Size && last.LastWriteTime == state.LastWriteTime)
+                {
+                    return null;
+                }
+            }
+
+            byte[] digest;
+            using (var stream = new FileStream(job.Filename, FileMode.Open, FileAccess.Read, FileShare.ReadWrite | FileShare.Delete, CHUNK_SIZE, FileOptions.SequentialScan))
+            using (var sha = SHA256.Create())
+            {
+                int read;
+                while ((read = stream.Read(buffer, 0, buffer.Length)) > 0)
+                {
+                    token.ThrowIfCancellationRequested();
+                    sha.TransformBlock(buffer, 0, read, null, 0);
+                }
+
+                sha.TransformFinalBlock(buffer, 0, 0);
+                digest = sha.Hash;
+            }
+
+            lock (sync)
+            {
+                Job current;
+                if (!jobs.TryGetValue(job.Filename, out current) || current != job)
+                {
+                    // Forgotten while being hashed
+                    return null;
+                }
+
+                hashed[job.Filename] = state;
+            }
+            return digest;
+        }
+
+        public void Dispose()
+        {
+            queue.CompleteAdding();
+
+            lock (sync)
+            {
+                foreach (var job in jobs.Values)
+                {
+                    job.Cancellation.Cancel();
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,345 @@
+﻿using CenterDevice.MiniFSWatcher.Events;
+using CenterDevice.MiniFSWatcher.Types;
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    // Holds back events per file and merges them until the file is closed,
+    // has been quiet for Window, has been pending for MaxAge or has to make
+    // room because Capacity files are pending (least recently updated first).
+    //
+    // Merge rules for a pending event P and a new event E of the same file:
+    //   Create + Create/Change -> Create
+    //   Create + Delete        -> nothing, both are dropped
+    //   Change + Create/Change -> Change
+    //   Change + Delete        -> Delete
+    //   Delete + Create/Change -> Change (the file has been replaced)
+    //   Delete + Delete        -> Delete
+    // A move of a file with a pending Create becomes a Create of the new name.
+    // Moving a directory delivers the pending events of all files below it.
+    // Otherwise, pending events of both names are delivered, then the move,
+    // and a pending Change follows the file to its new name.
+    //
+    // With CollapseAtomicSaves, the way editors save files is recognized:
+    //   rename O -> B, create or rename T -> O, ..., delete B
+    // ends up as a single Change of O. Moves are held back for that, keyed by
+    // their old name, until a new file takes the place of the old one or the
+    // window passes. Created files are not delivered on close but after the
+    // window, so that a temporary file can still be renamed over the original.
+    //
+    // Not thread safe, all calls are made by the thread reading from the driver.
+    class EventAggregator
+    {
+        private class PendingEvent
+        {
+            public string Key;
+            public FileSystemEvent Event;
+            public TimeSpan FirstSeen;
+            public TimeSpan LastSeen;
+            public LinkedListNode<PendingEvent> ByLastSeen;
+            public LinkedListNode<PendingEvent> ByFirstSeen;
+        }
+
+        private readonly Dictionary<string, PendingEvent> pending = new Dictionary<string, PendingEvent>(StringComparer.OrdinalIgnoreCase);
+        private readonly Dictionary<string, PendingEvent> heldMoves = new Dictionary<string, PendingEvent>(StringComparer.OrdinalIgnoreCase);
+        private readonly Dictionary<string, TimeSpan> backups = new Dictionary<string, TimeSpan>(StringComparer.OrdinalIgnoreCase);
+        private readonly LinkedList<PendingEvent> byLastSeen = new LinkedList<PendingEvent>();
+        private readonly LinkedList<PendingEvent> byFirstSeen = new LinkedList<PendingEvent>();
+        private readonly Stopwatch clock = Stopwatch.StartNew();
+        private readonly Action<FileSystemEvent> deliver;
+
+        public EventAggregator(Action<FileSystemEvent> deliver)
+        {
+            this.deliver = deliver;
+        }
+
+        public TimeSpan Window { get; set; }
+        public TimeSpan MaxAge { get; set; }
+        public int Capacity { get; set; }
+        public bool CollapseAtomicSaves { get; set; }
+
+        public int Count
+        {
+            get
+            {
+                return pending.Count;
+            }
+        }
+
+        public void Add(FileSystemEvent fileEvent)
+        {
+            if (IsBackupDeletion(fileEvent))
+            {
+                return;
+            }
+
+            ReleaseMoveTo(fileEvent.Filename);
+
+            var moveEvent = fileEvent as RenameOrMoveEvent;
+            if (moveEvent != null)
+            {
+                ReleaseMoveTo(moveEvent.OldFilename);
+                AddMove(moveEvent);
+                return;
+            }
+
+            PendingEvent entry;
+            if (!pending.TryGetValue(fileEvent.Filename, out entry))
+            {
+                Insert(fileEvent.Filename, fileEvent);
+                return;
+            }
+
+            if (entry.Event.Type == EventType.Move)
+            {
+                Remove(entry);
+
+                if (fileEvent.Type == EventType.Create)
+                {
+                    // A new file took the place of the one moved away, which is only kept as backup
+                    backups[entry.Event.Filename] = clock.Elapsed;
+                    Insert(fileEvent.Filename, WithType(fileEvent, EventType.Change));
+                }
+                else
+                {
+                    deliver(entry.Event);
+                    Insert(fileEvent.Filename, fileEvent);
+                }
+                return;
+            }
+
+            var merged = Merge(entry.Event.Type, fileEvent.Type);
+            if (merged == EventType.Unknown)
+            {
+                Remove(entry);
+                return;
+            }
+
+            entry.Event = WithType(fileEvent, merged);
+            Touch(entry);
+        }
+
+        public void Close(string filename)
+        {
+            PendingEvent entry;
+            if (pending.TryGetValue(filename, out entry) && !IsHeld(entry))
+            {
+                Flush(entry.Key);
+            }
+        }
+
+        public void FlushExpired()
+        {
+            var now = clock.Elapsed;
+
+            while (byLastSeen.Count > 0 && now - byLastSeen.First.Value.LastSeen >= Window)
+            {
+                Flush(byLastSeen.First.Value.Key);
+            }
+
+            while (byFirstSeen.Count > 0 && now - byFirstSeen.First.Value.FirstSeen >= MaxAge)
+            {
+                Flush(byFirstSeen.First.Value.Key);
+            }
+
+            if (backups.Count > 0)
+            {
+                var expired = new List<string>();
+                foreach (var backup in backups)
+                {
+                    if (now - backup.Value >= Window)
+                    {
+                        expired.Add(backup.Key);
+                    }
+                }
+                expired.ForEach(name => backups.Remove(name));
+            }
+        }
+
+        public void FlushAll()
+        {
+            while (byFirstSeen.Count > 0)
+            {
+                Flush(byFirstSeen.First.Value.Key);
+            }
+            backups.Clear();
+        }
+
+        private void Flush(string key)
+        {
+            PendingEvent entry;
+            if (pending.TryGetValue(key, out entry))
+            {
+                Remove(entry);
+                deliver(entry.Event);
+            }
+        }
+
+        private void AddMove(RenameOrMoveEvent moveEvent)
+        {
+            if (moveEvent.Type == EventType.MoveSubtree)
+            {
+                FlushSubtree(moveEvent.OldFilename);
+                deliver(moveEvent);
+                return;
+            }
+
+            PendingEvent source;
+            pending.TryGetValue(moveEvent.OldFilename, out source);
+
+            if (source != null && source.Event.Type == EventType.Create)
+            {
+                Remove(source);
+                Add(WithType(moveEvent, EventType.Create));
+                return;
+            }
+
+            if (source != null && (CollapseAtomicSaves || source.Event.Type != EventType.Change))
+            {
+                Flush(source.Key);
+                source = null;
+            }
+
+            Flush(moveEvent.Filename);
+
+            if (CollapseAtomicSaves)
+            {
+                Insert(moveEvent.OldFilename, moveEvent);
+                return;
+            }
+
+            if (source != null)
+            {
+                Remove(source);
+            }
+
+            deliver(moveEvent);
+
+            if (source != null)
+            {
+                Add(WithType(moveEvent, EventType.Change));
+            }
+        }
+
+        private void FlushSubtree(string directory)
+        {
+            var prefix = directory + "\\";
+            var below = new List<string>();
+            foreach (var entry in byFirstSeen)
+            {
+                if (entry.Key.StartsWith(prefix, StringComparison.OrdinalIgnoreCase)
+                    || entry.Event.Filename.StartsWith(prefix, StringComparison.OrdinalIgnoreCase))
+                {
+                    below.Add(entry.Key);
+                }
+            }
+            below.ForEach(Flush);
+        }
+
+        private void ReleaseMoveTo(string filename)
+        {
+            PendingEvent entry;
+            if (heldMoves.TryGetValue(filename, out entry))
+            {
+                Flush(entry.Key);
+            }
+        }
+
+        private bool IsBackupDeletion(FileSystemEvent fileEvent)
+        {
+            if (backups.Count == 0 || !backups.Remove(fileEvent.Filename))
+            {
+                return false;
+            }
+
+            return fileEvent.Type == EventType.Delete;
+        }
+
+        private bool IsHeld(PendingEvent entry)
+        {
+            return entry.Event.Type == EventType.Move || (CollapseAtomicSaves && entry.Event.Type == EventType.Create);
+        }
+
+        private static EventType Merge(EventType pendingType, EventType newType)
+        {
+            switch (pendingType)
+            {
+                case EventType.Create:
+                    return newType == EventType.Delete ? EventType.Unknown : EventType.Create;
+                case EventType.Change:
+                    return newType == EventType.Delete ? EventType.Delete : EventType.Change;
+                case EventType.Delete:
+                    return newType == EventType.Delete ? EventType.Delete : EventType.Change;
+                default:
+                    return newType;
+            }
+        }
+
+        private static FileSystemEvent WithType(FileSystemEvent fileEvent, EventType type)
+        {
+            return new FileSystemEvent()
+            {
+                Filename = fileEvent.Filename,
+                ProcessId = fileEvent.ProcessId,
+                ProcessName = fileEvent.ProcessName,
+                ProcessToken = fileEvent.ProcessToken,
+                SequenceNumber = fileEvent.SequenceNumber,
+                IsBaseline = fileEvent.IsBaseline,
+                IsTruncated = fileEvent.IsTruncated,
+                IsDirectory = fileEvent.IsDirectory,
+                FileId = fileEvent.FileId,
+                Size = fileEvent.Size,
+                LastWriteTime = fileEvent.LastWriteTime,
+                Attributes = fileEvent.Attributes,
+                Type = type
+            };
+        }
+
+        private void Insert(string key, FileSystemEvent fileEvent)
+        {
+            while (Capacity > 0 && pending.Count >= Capacity)
+            {
+                Flush(byLastSeen.First.Value.Key);
+            }
+
+            var now = clock.Elapsed;
+            var entry = new PendingEvent()
+            {
+                Key = key,
+                Event = fileEvent,
+                FirstSeen = now,
+                LastSeen = now
+            };
+
+            entry.ByLastSeen = byLastSeen.AddLast(entry);
+            entry.ByFirstSeen = byFirstSeen.AddLast(entry);
+            pending.Add(key, entry);
+
+            if (fileEvent.Type == EventType.Move)
+            {
+                heldMoves[fileEvent.Filename] = entry;
+            }
+        }
+
+        private void Touch(PendingEvent entry)
+        {
+            entry.LastSeen = clock.Elapsed;
+            byLastSeen.Remove(entry.ByLastSeen);
+            byLastSeen.AddLast(entry.ByLastSeen);
+        }
+
+        private void Remove(PendingEvent entry)
+        {
+            pending.Remove(entry.Key);
+            byLastSeen.Remove(entry.ByLastSeen);
+            byFirstSeen.Remove(entry.ByFirstSeen);
+
+            if (entry.Event.Type == EventType.Move)
+            {
+                heldMoves.Remove(entry.Event.Filename);
+            }
+        }
+    }
+}
@@ -0,0 +1,194 @@
+﻿using CenterDevice.MiniFSWatcher.Events;
+using System;
+using System.Runtime.InteropServices;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    public delegate void EventBatchHandler(EventBatch batch);
+
+    // The records of one read from the driver, without an object per record.
+    // Headers are kept in an array of structs and the names of all records in
+    // one character arena. Name strings are only created when asked for, and
+    // the arrays are reused once the batch went back to its pool.
+    //
+    // A batch passed to EventWatcher.OnEventBatch is only valid during the
+    // call. Call Keep to hold on to it, it then has to be disposed.
+    public sealed class EventBatch : IDisposable
+    {
+        // A read returns at most 4 KB of records, these never have to grow
+        private const int INITIAL_RECORDS = 64;
+        private const int INITIAL_NAME_CHARS = 2048;
+
+        private readonly EventBatchPool pool;
+        private EventRecord[] records = new EventRecord[INITIAL_RECORDS];
+        private char[] names = new char[INITIAL_NAME_CHARS];
+        private int nameChars;
+        private bool kept;
+
+        internal ProcessNameTable ProcessNames { get; set; }
+
+        public int Count { get; private set; }
+
+        internal EventBatch(EventBatchPool pool)
+        {
+            this.pool = pool;
+        }
+
+        public EventRecord this[int index]
+        {
+            get
+            {
+                CheckIndex(index);
+                return records[index];
+            }
+        }
+
+        // Creates a new string on every call
+        public string GetFilename(int index)
+        {
+            CheckIndex(index);
+            return GetName(records[index].NameOffset, records[index].NameLength);
+        }
+
+        // Null unless the record is a move
+        public string GetOldFilename(int index)
+        {
+            CheckIndex(index);
+            return records[index].IsMove ? GetName(records[index].OldNameOffset, records[index].OldNameLength) : null;
+        }
+
+        // File name of the executable, null if the driver could not resolve it
+        public string GetProcessName(int index)
+        {
+            CheckIndex(index);
+            return ProcessNames?.GetName(records[index].ProcessToken);
+        }
+
+        public FileSystemEvent ToEvent(int index)
+        {
+            CheckIndex(index);
+            var record = records[index];
+
+            FileSystemEvent fileSystemEvent;
+            if (record.IsMove)
+            {
+                fileSystemEvent = new RenameOrMoveEvent()
+                {
+                    OldFilename = GetOldFilename(index),
+                    ParentId = record.ParentId
+                };
+            }
+            else
+            {
+                fileSystemEvent = new FileSystemEvent()
+                {
+                    Size = record.Size,
+                    LastWriteTime = record.LastWriteTime,
+                    Attributes = record.Attributes
+                };
+            }
+
+            fileSystemEvent.Filename = GetFilename(index);
+            fileSystemEvent.ProcessId = record.ProcessId;
+            fileSystemEvent.ProcessToken = record.ProcessToken;
+            fileSystemEvent.ProcessName = GetProcessName(index);
+            fileSystemEvent.SequenceNumber = record.SequenceNumber;
+            fileSystemEvent.Type = record.Type;
+            fileSystemEvent.IsTruncated = record.IsTruncated;
+            fileSystemEvent.IsDirectory = record.IsDirectory;
+            fileSystemEvent.FileId = record.FileId;
+            return fileSystemEvent;
+        }
+
+        // Keeps the batch after the handler returned instead of passing it back to the pool
+        public void Keep()
+        {
+            kept = true;
+        }
+
+        // Only needed for kept batches, others go back to the pool once the handler returned
+        public void Dispose()
+        {
+            if (kept)
+            {
+                kept = false;
+                Recycle();
+            }
+        }
+
+        internal void Release()
+        {
+            if (!kept)
+            {
+                Recycle();
+            }
+        }
+
+        // Appends a record with its null separated names, a move carries the old name first
+        internal void Add(EventRecord record, IntPtr source, int chars)
+        {
+            if (Count == records.Length)
+            {
+                Array.Resize(ref records, records.Length * 2);
+            }
+
+            if (nameChars + chars > names.Length)
+            {
+                Array.Resize(ref names, Math.Max(names.Length * 2, nameChars + chars));
+            }
+
+            Marshal.Copy(source, names, nameChars, chars);
+
+            var end = nameChars + chars;
+            var firstLength = NameLength(nameChars, end);
+
+            if (record.IsMove)
+            {
+                var second = Math.Min(nameChars + firstLength + 1, end);
+                record.OldNameOffset = nameChars;
+                record.OldNameLength = firstLength;
+                record.NameOffset = second;
+                record.NameLength = NameLength(second, end);
+            }
+            else
+            {
+                record.NameOffset = nameChars;
+                record.NameLength = firstLength;
+            }
+
+            nameChars = end;
+            records[Count++] = record;
+        }
+
+        internal void Clear()
+        {
+            Count = 0;
+            nameChars = 0;
+        }
+
+        private void Recycle()
+        {
+            Clear();
+            pool?.Return(this);
+        }
+
+        private int NameLength(int start, int end)
+        {
+            var terminator = Array.IndexOf(names, '\0', start, end - start);
+            return (terminator < 0 ? end : terminator) - start;
+        }
+
+        private string GetName(int offset, int length)
+        {
+            return PathConverter.ReplaceDevicePath(new string(names, offset, length));
+        }
+
+        private void CheckIndex(int index)
+        {
+            if (index < 0 || index >= Count)
+            {
+                throw new ArgumentOutOfRangeException("index");
+            }
+        }
+    }
+}
@@ -0,0 +1,38 @@
+﻿using System.Collections.Generic;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    // Keeps released batches, so reading from the driver reuses their arrays
+    class EventBatchPool
+    {
+        private readonly Stack<EventBatch> batches = new Stack<EventBatch>();
+        private readonly object sync = new object();
+
+        // Batches beyond this are left to the garbage collector
+        public int Capacity { get; set; } = 16;
+
+        public EventBatch Rent()
+        {
+            lock (sync)
+            {
+                if (batches.Count > 0)
+                {
+                    return batches.Pop();
+                }
+            }
+
+            return new EventBatch(this);
+        }
+
+        public void Return(EventBatch batch)
+        {
+            lock (sync)
+            {
+                if (batches.Count < Capacity)
+                {
+                    batches.Push(batch);
+                }
+            }
+        }
+    }
+}
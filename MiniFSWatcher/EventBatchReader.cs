@@ -0,0 +1,179 @@
+﻿using CenterDevice.MiniFSWatcher.Events;
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    // Pull-based consumption of delivered events in batches, backed by a bounded
+    // buffer that any number of delivering threads add to and one consumer
+    // reads from.
+    //
+    // Batching rules:
+    // 1. Events are buffered in the order they are delivered, i.e. after
+    //    aggregation and DropUnchangedFiles, and after EventWatcher.Index was
+    //    updated. With dispatch workers, only the events of one file keep
+    //    their relative order.
+    // 2. Delivering blocks while Capacity events are buffered, so a slow
+    //    consumer throttles the watcher instead of losing events.
+    // 3. ReadBatchAsync completes as soon as MaxBatchSize events are buffered,
+    //    or once the oldest buffered event has waited MaxLatency, whichever
+    //    comes first. It returns at most MaxBatchSize events, oldest first,
+    //    and never an empty batch while the reader is open.
+    // 4. After Dispose, buffered events are still returned. Once the buffer is
+    //    empty, ReadBatchAsync returns an empty batch, further events are
+    //    dropped.
+    public class EventBatchReader : IDisposable
+    {
+        private struct BufferedEvent
+        {
+            public FileSystemEvent Event;
+            public long Ticks;
+        }
+
+        private readonly Queue<BufferedEvent> buffer = new Queue<BufferedEvent>();
+        private readonly SemaphoreSlim free;
+        private readonly Stopwatch clock = Stopwatch.StartNew();
+        private readonly object sync = new object();
+        private readonly Action<EventBatchReader> detach;
+        private TaskCompletionSource<bool> waiter;
+        private bool closed;
+
+        public int MaxBatchSize { get; private set; }
+        public TimeSpan MaxLatency { get; private set; }
+        public int Capacity { get; private set; }
+
+        internal EventBatchReader(int maxBatchSize, TimeSpan maxLatency, int capacity, Action<EventBatchReader> detach)
+        {
+            if (maxBatchSize <= 0 || capacity < maxBatchSize)
+            {
+                throw new ArgumentOutOfRangeException("capacity", "Capacity must hold at least one batch");
+            }
+
+            if (maxLatency < TimeSpan.Zero || maxLatency.TotalMilliseconds > int.MaxValue)
+            {
+                throw new ArgumentOutOfRangeException("maxLatency");
+            }
+
+            MaxBatchSize = maxBatchSize;
+            MaxLatency = maxLatency;
+            Capacity = capacity;
+            free = new SemaphoreSlim(capacity);
+            this.detach = detach;
+        }
+
+        public async Task<IList<FileSystemEvent>> ReadBatchAsync(CancellationToken cancellationToken = default(CancellationToken))
+        {
+            while (true)
+            {
+                TaskCompletionSource<bool> signal;
+                TimeSpan timeout;
+
+                lock (sync)
+                {
+                    if (buffer.Count >= MaxBatchSize || (buffer.Count > 0 && Age(buffer.Peek()) >= MaxLatency) || closed)
+                    {
+                        return TakeBatch();
+                    }
+
+                    waiter = new TaskCompletionSource<bool>();
+                    signal = waiter;
+                    timeout = buffer.Count > 0 ? MaxLatency - Age(buffer.Peek()) : Timeout.InfiniteTimeSpan;
+                    if (buffer.Count > 0 && timeout < TimeSpan.Zero)
+                    {
+                        timeout = TimeSpan.Zero;
+                    }
+                }
+
+                await Task.WhenAny(signal.Task, Task.Delay(timeout, cancellationToken)).ConfigureAwait(false);
+                cancellationToken.ThrowIfCancellationRequested();
+            }
+        }
+
+        internal void Add(FileSystemEvent fileEvent, CancellationToken cancellationToken)
+        {
+            try
+            {
+                free.Wait(cancellationToken);
+            }
+            catch (OperationCanceledException)
+            {
+                // Watcher is disconnecting, the event is dropped
+                return;
+            }
+
+            TaskCompletionSource<bool> signal = null;
+            lock (sync)
+            {
+                if (closed)
+                {
+                    return;
+                }
+
+                buffer.Enqueue(new BufferedEvent() { Event = fileEvent, Ticks = clock.ElapsedTicks });
+
+                // The consumer waits with a timeout for the first event, only a full batch can wake it early
+                if (waiter != null && (buffer.Count == 1 || buffer.Count == MaxBatchSize))
+                {
+                    signal = waiter;
+                    waiter = null;
+                }
+            }
+
+            Wake(signal);
+        }
+
+        public void Dispose()
+        {
+            TaskCompletionSource<bool> signal;
+            lock (sync)
+            {
+                if (closed)
+                {
+                    return;
+                }
+
+                closed = true;
+                signal = waiter;
+                waiter = null;
+            }
+
+            detach(this);
+
+            // Unblocks all threads waiting for space, they drop their events
+            free.Release(Capacity);
+            Wake(signal);
+        }
+
+        private IList<FileSystemEvent> TakeBatch()
+        {
+            var batch = new List<FileSystemEvent>(Math.Min(buffer.Count, MaxBatchSize));
+            while (batch.Count < MaxBatchSize && buffer.Count > 0)
+            {
+                batch.Add(buffer.Dequeue().Event);
+            }
+
+            if (batch.Count > 0 && !closed)
+            {
+                free.Release(batch.Count);
+            }
+            return batch;
+        }
+
+        private TimeSpan Age(BufferedEvent bufferedEvent)
+        {
+            return TimeSpan.FromSeconds((double)(clock.ElapsedTicks - bufferedEvent.Ticks) / Stopwatch.Frequency);
+        }
+
+        private static void Wake(TaskCompletionSource<bool> signal)
+        {
+            if (signal != null)
+            {
+                // Completed on the pool, so the consumer never continues on a delivering thread
+                ThreadPool.QueueUserWorkItem(state => ((TaskCompletionSource<bool>)state).TrySetResult(true), signal);
+            }
+        }
+    }
+}
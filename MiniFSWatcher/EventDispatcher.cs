@@ -0,0 +1,135 @@
+﻿using CenterDevice.MiniFSWatcher.Events;
+using System;
+using System.Collections.Concurrent;
+using System.Diagnostics;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    // Delivers events on a fixed pool of workers while keeping the order of
+    // events per file.
+    //
+    // Scheduling rules:
+    // 1. Every worker owns one FIFO queue with a fixed capacity. Enqueue blocks
+    //    while the target queue is full, which throttles the reader.
+    // 2. An event goes to the queue selected by the case insensitive hash of
+    //    its filename modulo the number of workers, so all events of one path
+    //    are handled by one worker in arrival order.
+    // 3. A move touches two paths. It is queued on the worker of the new name.
+    //    If the old name belongs to a different worker, a fence is queued
+    //    there at the same time and the move is only delivered after that
+    //    worker has passed the fence, i.e. after all earlier events of the
+    //    old name have been delivered.
+    // Fences never wait and a move only waits for a fence queued before it,
+    // so workers cannot deadlock.
+    class EventDispatcher : IDisposable
+    {
+        private class DispatchItem
+        {
+            public FileSystemEvent Event;
+            public ManualResetEventSlim WaitFor;
+            public ManualResetEventSlim Signal;
+        }
+
+        private readonly BlockingCollection<DispatchItem>[] queues;
+        private readonly Action<FileSystemEvent> deliver;
+        private readonly CancellationToken cancellationToken;
+
+        public EventDispatcher(int workers, int queueCapacity, Action<FileSystemEvent> deliver, CancellationToken cancellationToken)
+        {
+            this.deliver = deliver;
+            this.cancellationToken = cancellationToken;
+
+            queues = new BlockingCollection<DispatchItem>[workers];
+            for (int i = 0; i < workers; i++)
+            {
+                var queue = new BlockingCollection<DispatchItem>(new ConcurrentQueue<DispatchItem>(), queueCapacity);
+                queues[i] = queue;
+                Task.Factory.StartNew(() => Dispatch(queue), TaskCreationOptions.LongRunning);
+            }
+        }
+
+        public void Enqueue(FileSystemEvent fileEvent)
+        {
+            var item = new DispatchItem() { Event = fileEvent };
+            var queue = QueueFor(fileEvent.Filename);
+
+            var moveEvent = fileEvent as RenameOrMoveEvent;
+            if (moveEvent != null)
+            {
+                var oldQueue = QueueFor(moveEvent.OldFilename);
+                if (oldQueue != queue)
+                {
+                    var fence = new ManualResetEventSlim(false);
+                    if (Add(oldQueue, new DispatchItem() { Signal = fence }))
+                    {
+                        item.WaitFor = fence;
+                    }
+                }
+            }
+
+            Add(queue, item);
+        }
+
+        private BlockingCollection<DispatchItem> QueueFor(string filename)
+        {
+            var hash = StringComparer.OrdinalIgnoreCase.GetHashCode(filename ?? string.Empty) & int.MaxValue;
+            return queues[hash % queues.Length];
+        }
+
+        private bool Add(BlockingCollection<DispatchItem> queue, DispatchItem item)
+        {
+            try
+            {
+                queue.Add(item, cancellationToken);
+                return true;
+            }
+            catch (OperationCanceledException)
+            {
+                // Watcher is disconnecting, the event is dropped
+                return false;
+            }
+            catch (InvalidOperationException)
+            {
+                // Dispatcher has been shut down, the event is dropped
+                return false;
+            }
+        }
+
+        private void Dispatch(BlockingCollection<DispatchItem> queue)
+        {
+            foreach (var item in queue.GetConsumingEnumerable())
+            {
+                if (item.Signal != null)
+                {
+                    item.Signal.Set();
+                    continue;
+                }
+
+                if (item.WaitFor != null)
+                {
+                    item.WaitFor.Wait();
+                    item.WaitFor.Dispose();
+                }
+
+                try
+                {
+                    deliver(item.Event);
+                }
+                catch (Exception e)
+                {
+                    Trace.TraceError("Event handler failed: " + e);
+                }
+            }
+        }
+
+        public void Dispose()
+        {
+            foreach (var queue in queues)
+            {
+                queue.CompleteAdding();
+            }
+        }
+    }
+}
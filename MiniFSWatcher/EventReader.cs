@@ -1,87 +1,102 @@
 ﻿using CenterDevice.MiniFSWatcher.Events;
 using CenterDevice.MiniFSWatcher.Types;
 using System;
-using System.Collections.Generic;
+using System.IO;
 using System.Runtime.InteropServices;
-using System.Text;
 
 namespace CenterDevice.MiniFSWatcher
 {
+    // Decodes the records in place, field by field, as marshaling a whole
+    // LogRecord would box it for every record
     class EventReader
     {
-        public static List<FileSystemEvent> ReadFromBuffer(IntPtr buffer, long bufferSize)
+        private static readonly int RecordSize = Marshal.SizeOf(typeof(LogRecord));
+        private static readonly int LengthOffset = Offset(typeof(LogRecord), "Length");
+        private static readonly int SequenceNumberOffset = Offset(typeof(LogRecord), "SequenceNumber");
+        private static readonly int DataOffset = Offset(typeof(LogRecord), "Data");
+
+        private static readonly int EventTypeOffset = Offset(typeof(RecordData), "EventType");
+        private static readonly int FlagsOffset = Offset(typeof(RecordData), "Flags");
+        private static readonly int ProcessIdOffset = Offset(typeof(RecordData), "ProcessId");
+        private static readonly int VolumeSerialNumberOffset = Offset(typeof(RecordData), "VolumeSerialNumber");
+        private static readonly int FileIdOffset = Offset(typeof(RecordData), "FileId");
+        private static readonly int ParentIdOffset = Offset(typeof(RecordData), "ParentId");
+        private static readonly int FileSizeOffset = Offset(typeof(RecordData), "FileSize");
+        private static readonly int LastWriteTimeOffset = Offset(typeof(RecordData), "LastWriteTime");
+        private static readonly int FileAttributesOffset = Offset(typeof(RecordData), "FileAttributes");
+        private static readonly int ProcessTokenOffset = Offset(typeof(RecordData), "ProcessToken");
+
+        private static readonly int LowPartOffset = Offset(typeof(RecordFileId), "LowPart");
+        private static readonly int HighPartOffset = Offset(typeof(RecordFileId), "HighPart");
+
+        public static void ReadIntoBatch(IntPtr buffer, long bufferSize, EventBatch batch)
         {
-            var events = new List<FileSystemEvent>();
             int offset = 0;
-            while (offset + Marshal.SizeOf(typeof(LogRecord)) < bufferSize)
+            while (offset + RecordSize < bufferSize)
             {
                 var recordAddress = IntPtr.Add(buffer, offset);
-                LogRecord record = ReadRecordFromBuffer(recordAddress);
+                var length = Marshal.ReadInt32(recordAddress, LengthOffset);
 
-                ValidateRecordLength(record, bufferSize);
+                ValidateRecordLength(length, bufferSize - offset);
 
-                var stringBytes = record.Length - Marshal.SizeOf(typeof(LogRecord));
-                string[] strings = ReadEventStringsFromBuffer(recordAddress, stringBytes);
+                var nameChars = (length - RecordSize) / sizeof(char);
+                batch.Add(ReadRecord(recordAddress), IntPtr.Add(recordAddress, RecordSize), nameChars);
 
-                if (record.Data.EventType == EventType.Move)
-                {
-                    events.Add(CreateRenameOrMoveEvent(record, strings));
-                }
-                else
-                {
-                    events.Add(CreateFileSystemEvent(record, strings));
-                }
-
-                offset += record.Length;
+                offset += length;
             }
-
-            return events;
         }
 
-        private static void ValidateRecordLength(LogRecord record, long bufferSize)
+        private static void ValidateRecordLength(int length, long remainingSize)
         {
-            if (record.Length <= 0 || record.Length > bufferSize)
+            if (length < RecordSize || length > remainingSize)
             {
                 throw new Exception("Invalid record length");
             }
         }
 
-        private static LogRecord ReadRecordFromBuffer(IntPtr recordAddress)
+        private static EventRecord ReadRecord(IntPtr recordAddress)
         {
-            return Marshal.PtrToStructure<LogRecord>(recordAddress);
-        }
+            var data = IntPtr.Add(recordAddress, DataOffset);
+            var flags = (RecordFlags)Marshal.ReadInt32(data, FlagsOffset);
+            var volumeSerialNumber = ReadUInt64(data, VolumeSerialNumberOffset);
 
-        private static string[] ReadEventStringsFromBuffer(IntPtr recordAddress, int stringBytes)
-        {
-            var stringOffset = IntPtr.Add(recordAddress, Marshal.SizeOf(typeof(LogRecord)));
+            var record = new EventRecord()
+            {
+                Type = (EventType)Marshal.ReadInt32(data, EventTypeOffset),
+                SequenceNumber = (uint)Marshal.ReadInt32(recordAddress, SequenceNumberOffset),
+                ProcessId = ReadUInt64(data, ProcessIdOffset),
+                ProcessToken = (uint)Marshal.ReadInt32(data, ProcessTokenOffset),
+                IsTruncated = (flags & RecordFlags.NameTruncated) != 0,
+                IsDirectory = (flags & RecordFlags.Directory) != 0,
+                FileId = ReadFileIdentifier(data, FileIdOffset, volumeSerialNumber)
+            };
 
-            var data = new byte[stringBytes];
-            Marshal.Copy(stringOffset, data, 0, stringBytes);
+            if (record.IsMove)
+            {
+                record.ParentId = ReadFileIdentifier(data, ParentIdOffset, volumeSerialNumber);
+            }
+            else if ((flags & RecordFlags.Attributes) != 0)
+            {
+                record.Size = Marshal.ReadInt64(data, FileSizeOffset);
+                record.LastWriteTime = DateTime.FromFileTimeUtc(Marshal.ReadInt64(data, LastWriteTimeOffset));
+                record.Attributes = (FileAttributes)Marshal.ReadInt32(data, FileAttributesOffset);
+            }
+            return record;
+        }
 
-            return Encoding.Unicode.GetString(data).Split('\0');
+        private static FileIdentifier ReadFileIdentifier(IntPtr data, int offset, ulong volumeSerialNumber)
+        {
+            return new FileIdentifier(volumeSerialNumber, ReadUInt64(data, offset + LowPartOffset), ReadUInt64(data, offset + HighPartOffset));
         }
 
-        private static FileSystemEvent CreateFileSystemEvent(LogRecord record, string[] strings)
+        private static ulong ReadUInt64(IntPtr address, int offset)
         {
-            var fileSystemEvent = new FileSystemEvent()
-            {
-                Filename = PathConverter.ReplaceDevicePath(strings[0]),
-                ProcessId = record.Data.ProcessId,
-                Type = record.Data.EventType
-            };
-            return fileSystemEvent;
+            return unchecked((ulong)Marshal.ReadInt64(address, offset));
         }
 
-        private static FileSystemEvent CreateRenameOrMoveEvent(LogRecord record, string[] strings)
+        private static int Offset(Type type, string field)
         {
-            var fileSystemEvent = new RenameOrMoveEvent()
-            {
-                Filename = PathConverter.ReplaceDevicePath(strings[1]),
-                OldFilename = PathConverter.ReplaceDevicePath(strings[0]),
-                ProcessId = record.Data.ProcessId,
-                Type = record.Data.EventType
-            };
-            return fileSystemEvent;
+            return Marshal.OffsetOf(type, field).ToInt32();
         }
     }
 }
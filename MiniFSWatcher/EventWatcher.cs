@@ -3,7 +3,9 @@ using CenterDevice.MiniFSWatcher.Types;
 using System;
 using System.Collections.Generic;
 using System.Diagnostics;
+using System.IO;
 using System.Runtime.InteropServices;
+using System.Text;
 using System.Threading;
 using System.Threading.Tasks;
 
@@ -14,26 +16,106 @@ namespace CenterDevice.MiniFSWatcher
 
     public class EventWatcher: IDisposable
     {
-        public readonly DriverVersion Version = new DriverVersion(2,0);
+        public readonly DriverVersion Version = new DriverVersion(5,9);
 
         private const int ALL = 0;
         private const long ERROR_NO_MORE_ITEMS = 259L;
         private const int BUFFER_SIZE = 4096;
+        private const int PROCESS_NAME_BATCH = 64;
+        private const uint PROCESS_FILTER_INCLUDE = 1;
+        private const int BASELINE_BATCH = 4096;
         private const string RECYCLE_BIN_PREFIX = "C:\\$RECYCLE.BIN\\";
         private bool disposed = false;
 
         private readonly TimeSpan eventReadDelay = TimeSpan.FromMilliseconds(100);
-        private Dictionary<string, FileSystemEvent> postponedEvents = new Dictionary<string, FileSystemEvent>();
+        private readonly EventAggregator aggregator;
         private CancellationTokenSource cancellationTokenSource = new CancellationTokenSource();
         private FilterConnector connector = new FilterConnector();
+        private TraceWriter recorder;
+        private EventDispatcher dispatcher;
+        private ContentHasher hasher;
+        private EventBatchReader[] batchReaders = new EventBatchReader[0];
+        private readonly object batchReaderSync = new object();
+        private readonly MaterialChangeFilter changeFilter = new MaterialChangeFilter();
+        private readonly ProcessNameTable processNames = new ProcessNameTable();
+        private readonly EventBatchPool batchPool = new EventBatchPool();
+        private BaselineScanner baseline;
+        private uint lastSequenceNumber;
 
         public bool AggregateEvents { get; set; }
 
+        // Aggregated events are delivered once their file has been closed, has been
+        // quiet for AggregationWindow or has been pending for AggregationMaxAge.
+        public TimeSpan AggregationWindow
+        {
+            get { return aggregator.Window; }
+            set { aggregator.Window = value; }
+        }
+
+        public TimeSpan AggregationMaxAge
+        {
+            get { return aggregator.MaxAge; }
+            set { aggregator.MaxAge = value; }
+        }
+
+        // Maximum number of files with pending events, the least recently
+        // updated one is delivered early to make room for another one
+        public int AggregationCapacity
+        {
+            get { return aggregator.Capacity; }
+            set { aggregator.Capacity = value; }
+        }
+
+        // Reports the temp file and rename dance of editors saving a file as a single change,
+        // created files are then delivered AggregationWindow after being closed
+        public bool CollapseAtomicSaves
+        {
+            get { return aggregator.CollapseAtomicSaves; }
+            set { aggregator.CollapseAtomicSaves = value; }
+        }
+
+        // Number of workers invoking the handlers. With 0, handlers are invoked
+        // on the thread reading from the driver. Events of the same file are
+        // always delivered in order, see EventDispatcher.
+        public int DispatchWorkers { get; set; }
+
+        // Maximum number of events waiting for each dispatch worker
+        public int DispatchQueueCapacity { get; set; } = 1024;
+
+        // Number of workers computing the digests for OnDigest, 0 disables hashing.
+        // Takes effect on Connect, see ContentHasher.
+        public int HashWorkers { get; set; }
+
+        // Drops changes that left size, last write time and attributes of the file
+        // untouched. Needs DriverParameters.CaptureAttributes, otherwise all changes pass.
+        public bool DropUnchangedFiles { get; set; }
+
+        // Updated with every delivered event before the handlers are invoked
+        public PathIndex Index { get; set; }
+
         public FileEventHandler OnChange { get; set; }
         public FileEventHandler OnCreate { get; set; }
         public FileEventHandler OnDelete { get; set; }
         public MoveEventHandler OnRenameOrMove { get; set; }
 
+        // SHA-256 of a changed file, invoked on a hash worker after the change was delivered
+        public DigestEventHandler OnDigest { get; set; }
+
+        // Every batch of records read from the driver, invoked on the reader thread before
+        // aggregation and filtering. Records only become FileSystemEvent objects if one of
+        // the other handlers, Index, a batch reader, hashing or a baseline scan needs them.
+        public EventBatchHandler OnEventBatch { get; set; }
+
+        public EventWatcher()
+        {
+            aggregator = new EventAggregator(DeliverEvent)
+            {
+                Window = TimeSpan.FromSeconds(2),
+                MaxAge = TimeSpan.FromSeconds(30),
+                Capacity = 10000
+            };
+        }
+
         public void Connect()
         {
             connector.Connect();
@@ -49,25 +131,87 @@ namespace CenterDevice.MiniFSWatcher
                 Trace.TraceWarning("Driver version differs from client version!");
             }
 
+            if (DispatchWorkers > 0)
+            {
+                dispatcher = new EventDispatcher(DispatchWorkers, DispatchQueueCapacity, Deliver, cancellationTokenSource.Token);
+            }
+
+            if (HashWorkers > 0)
+            {
+                hasher = new ContentHasher(HashWorkers, DeliverDigest, cancellationTokenSource.Token);
+            }
+
             Task.Factory.StartNew(ForwardEvents, TaskCreationOptions.LongRunning, cancellationTokenSource.Token);
         }
 
         private void ForwardEvents(object val)
         {
-            while (!cancellationTokenSource.IsCancellationRequested)
-            {
-                var events = GetEvents();
+            var buffer = Marshal.AllocHGlobal(BUFFER_SIZE);
 
-                foreach (var fileEvent in events)
+            try
+            {
+                while (!cancellationTokenSource.IsCancellationRequested)
                 {
-                    HandleFileEvent(fileEvent);
+                    var currentBaseline = baseline;
+                    var batch = batchPool.Rent();
+                    int count;
+
+                    try
+                    {
+                        GetEvents(buffer, batch);
+                        count = batch.Count;
+                        HandleBatch(batch, currentBaseline);
+                    }
+                    finally
+                    {
+                        batch.Release();
+                    }
+
+                    var baselineEvents = DeliverBaseline(currentBaseline);
+
+                    if (AggregateEvents)
+                    {
+                        aggregator.FlushExpired();
+                    }
+
+                    if (count == 0 && baselineEvents == 0)
+                    {
+                        Task.Delay(eventReadDelay).Wait();
+                    }
                 }
+            }
+            finally
+            {
+                Marshal.FreeHGlobal(buffer);
+            }
+        }
 
-                if (events.Count == 0)
+        private void HandleBatch(EventBatch batch, BaselineScanner currentBaseline)
+        {
+            if (batch.Count == 0)
+            {
+                return;
+            }
+
+            Volatile.Write(ref lastSequenceNumber, batch[batch.Count - 1].SequenceNumber);
+
+            if (NeedsEvents(currentBaseline))
+            {
+                for (int i = 0; i < batch.Count; i++)
                 {
-                    Task.Delay(eventReadDelay).Wait();
+                    var fileEvent = batch.ToEvent(i);
+                    currentBaseline?.Observe(fileEvent);
+                    HandleFileEvent(fileEvent);
                 }
             }
+
+            OnEventBatch?.Invoke(batch);
+        }
+
+        private bool NeedsEvents(BaselineScanner currentBaseline)
+        {
+            return OnChange != null || OnCreate != null || OnDelete != null || OnRenameOrMove != null ||
+                Index != null || hasher != null || batchReaders.Length > 0 || currentBaseline != null;
         }
 
         public void Disconnect()
@@ -75,24 +219,117 @@ namespace CenterDevice.MiniFSWatcher
             cancellationTokenSource.Cancel();
             cancellationTokenSource = new CancellationTokenSource();
             connector.Disconnect();
+
+            Interlocked.Exchange(ref baseline, null)?.Abandon();
+
+            dispatcher?.Dispose();
+            dispatcher = null;
+
+            hasher?.Dispose();
+            hasher = null;
+        }
+
+        public void StartRecording(Stream trace)
+        {
+            var previous = Interlocked.Exchange(ref recorder, new TraceWriter(trace, GetDriverVersion()));
+            previous?.Dispose();
+        }
+
+        public void StopRecording()
+        {
+            var previous = Interlocked.Exchange(ref recorder, null);
+            previous?.Dispose();
+        }
+
+        public TraceReplayResult Replay(Stream trace)
+        {
+            return TraceReplay.Run(trace, this);
+        }
+
+        // Delivers a create with IsBaseline set for every file and directory below root,
+        // walked in parallel while live events keep flowing. Entries touched by a live
+        // event read after the scan started are dropped, the live event wins. Baseline
+        // entries are not aggregated. Needs a connected watcher, completes with the
+        // number of delivered entries.
+        public Task<long> ScanBaseline(string root, CancellationToken cancellationToken = default(CancellationToken))
+        {
+            var linked = CancellationTokenSource.CreateLinkedTokenSource(cancellationToken, cancellationTokenSource.Token);
+            var scanner = new BaselineScanner(Volatile.Read(ref lastSequenceNumber), linked);
+
+            if (Interlocked.CompareExchange(ref baseline, scanner, null) != null)
+            {
+                linked.Dispose();
+                throw new InvalidOperationException("A baseline scan is already running");
+            }
+
+            scanner.Start(root);
+            return scanner.Completion;
+        }
+
+        // Pull-based alternative to the handlers, see EventBatchReader for the batching rules.
+        // Every open reader receives all delivered events, dispose it to stop.
+        public EventBatchReader OpenBatchReader(int maxBatchSize, TimeSpan maxLatency, int capacity = 4096)
+        {
+            var reader = new EventBatchReader(maxBatchSize, maxLatency, capacity, CloseBatchReader);
+            lock (batchReaderSync)
+            {
+                var readers = new List<EventBatchReader>(batchReaders);
+                readers.Add(reader);
+                batchReaders = readers.ToArray();
+            }
+            return reader;
+        }
+
+        private void CloseBatchReader(EventBatchReader reader)
+        {
+            lock (batchReaderSync)
+            {
+                var readers = new List<EventBatchReader>(batchReaders);
+                readers.Remove(reader);
+                batchReaders = readers.ToArray();
+            }
         }
 
-        private void HandleFileEvent(FileSystemEvent fileEvent)
+        private int DeliverBaseline(BaselineScanner currentBaseline)
+        {
+            if (currentBaseline == null)
+            {
+                return 0;
+            }
+
+            var taken = currentBaseline.Drain(DeliverEvent, BASELINE_BATCH);
+            if (currentBaseline.Completion.IsCompleted)
+            {
+                Interlocked.CompareExchange(ref baseline, null, currentBaseline);
+            }
+            return taken;
+        }
+
+        internal void HandleFileEvent(FileSystemEvent fileEvent)
         {
             if (fileEvent.Type == EventType.Close)
             {
-                FlushPostponedEvents(fileEvent);
+                aggregator.Close(fileEvent.Filename);
+            }
+            else if (EventShouldBeIgnored(fileEvent))
+            {
+                return;
             }
-            else if (CanBePostponed(fileEvent) && AggregateEvents)
+            else if (AggregateEvents)
             {
-                PostponeEventDelivery(fileEvent);
+                aggregator.Add(fileEvent);
             }
-            else if (!EventShouldBeIgnored(fileEvent))
+            else
             {
-                DeliverEvent(fileEvent, AggregateEvents);
+                DeliverEvent(fileEvent);
             }
         }
 
+        internal void FlushAggregatedEvents()
+        {
+            aggregator.FlushAll();
+        }
+
         private bool EventShouldBeIgnored(FileSystemEvent fileEvent)
         {
             if (fileEvent is RenameOrMoveEvent)
@@ -103,8 +340,41 @@ namespace CenterDevice.MiniFSWatcher
             return false;
         }
 
-        private void DeliverEvent(FileSystemEvent fileEvent, bool postponeDelivery)
+        private void DeliverEvent(FileSystemEvent fileEvent)
         {
+            if (DropUnchangedFiles && !changeFilter.ShouldDeliver(fileEvent))
+            {
+                return;
+            }
+
+            var currentDispatcher = dispatcher;
+            if (currentDispatcher != null)
+            {
+                currentDispatcher.Enqueue(fileEvent);
+            }
+            else
+            {
+                Deliver(fileEvent);
+            }
+
+            hasher?.Observe(fileEvent);
+        }
+
+        private void DeliverDigest(string name, byte[] digest, ulong processId)
+        {
+            OnDigest?.Invoke(name, digest, processId);
+        }
+
+        private void Deliver(FileSystemEvent fileEvent)
+        {
+            Index?.Apply(fileEvent);
+
+            var token = cancellationTokenSource.Token;
+            foreach (var reader in batchReaders)
+            {
+                reader.Add(fileEvent, token);
+            }
+
             switch (fileEvent.Type)
             {
                 case EventType.Change:
@@ -117,6 +387,7 @@ namespace CenterDevice.MiniFSWatcher
                     OnDelete?.Invoke(fileEvent.Filename, fileEvent.ProcessId);
                     break;
                 case EventType.Move:
+                case EventType.MoveSubtree:
                     OnRenameOrMove?.Invoke(fileEvent.Filename, ((RenameOrMoveEvent) fileEvent).OldFilename, fileEvent.ProcessId);
                     break;
                 default:
@@ -124,29 +395,6 @@ namespace CenterDevice.MiniFSWatcher
             }
         }
 
-        private bool CanBePostponed(FileSystemEvent fileEvent)
-        {
-            return fileEvent.Type == EventType.Change || fileEvent.Type == EventType.Create;
-        }
-
-        private void FlushPostponedEvents(FileSystemEvent fileEvent)
-        {
-            if (postponedEvents.ContainsKey(fileEvent.Filename))
-            {
-                var postponedEvent = postponedEvents[fileEvent.Filename];
-                postponedEvents.Remove(fileEvent.Filename);
-                DeliverEvent(postponedEvent, false);
-            }
-        }
-
-        private void PostponeEventDelivery(FileSystemEvent fileEvent)
-        {
-            if (!postponedEvents.ContainsKey(fileEvent.Filename))
-            {
-                postponedEvents.Add(fileEvent.Filename, fileEvent);
-            }
-        }
-
         public void RemoveProcessFilter()
         {
             WatchProcess(ALL);
@@ -188,6 +436,66 @@ namespace CenterDevice.MiniFSWatcher
             connector.Send(message, PathConverter.ReplaceDriveLetter(path));
         }
 
+        // Drops the events of processes whose executable file name matches one of the
+        // wildcard patterns, or with include set, all events of other processes. The
+        // driver decides once per process, so events of new processes never slip through.
+        public void SetProcessFilter(IEnumerable<string> patterns, bool include = false)
+        {
+            var data = new List<byte>(BitConverter.GetBytes(include ? PROCESS_FILTER_INCLUDE : 0));
+            foreach (var pattern in patterns)
+            {
+                if (string.IsNullOrEmpty(pattern))
+                {
+                    throw new ArgumentException("Process filter patterns must not be empty");
+                }
+
+                data.AddRange(Encoding.Unicode.GetBytes(pattern + '\0'));
+            }
+            data.AddRange(Encoding.Unicode.GetBytes("\0"));
+
+            CommandMessage message = new CommandMessage();
+            message.Command = MinispyCommand.SetProcessFilter;
+            connector.Send(message, data.ToArray());
+        }
+
+        public void RemoveProcessNameFilter()
+        {
+            SetProcessFilter(new string[0]);
+        }
+
+        // Only reports files with one of these extensions, e.g. "docx" or ".png", in addition
+        // to the path filter. Directories are always reported.
+        public void SetExtensionFilter(IEnumerable<string> extensions)
+        {
+            var data = new List<byte>();
+            foreach (var extension in extensions)
+            {
+                if (string.IsNullOrEmpty(extension))
+                {
+                    throw new ArgumentException("Extensions must not be empty");
+                }
+
+                data.AddRange(Encoding.Unicode.GetBytes(extension + '\0'));
+            }
+            data.AddRange(Encoding.Unicode.GetBytes("\0"));
+
+            CommandMessage message = new CommandMessage();
+            message.Command = MinispyCommand.SetExtensionFilter;
+            connector.Send(message, data.ToArray());
+        }
+
+        public void RemoveExtensionFilter()
+        {
+            SetExtensionFilter(new string[0]);
+        }
+
+        public void SetParameters(DriverParameters parameters)
+        {
+            CommandMessage message = new CommandMessage();
+            message.Command = MinispyCommand.SetParameters;
+            connector.Send(message, parameters);
+        }
+
         public DriverVersion GetDriverVersion()
         {
             CommandMessage message = new CommandMessage();
@@ -204,25 +512,42 @@ namespace CenterDevice.MiniFSWatcher
             return driverVersion;
         }
 
-        public static uint GetCurrentThreadId()
+        public DriverStatistics GetStatistics()
         {
-            return NativeMethods.GetCurrentThreadId();
-        }
+            CommandMessage message = new CommandMessage();
+            message.Command = MinispyCommand.GetStatistics;
 
-        public static int GetCurrentProcessId()
-        {
-            return Process.GetCurrentProcess().Id;
+            IntPtr resultSize;
+            var buffer = Marshal.AllocHGlobal(Marshal.SizeOf(typeof(DriverStatistics)));
+
+            try
+            {
+                HResult hResult = connector.SendAndRead(message, buffer, out resultSize);
+                Marshal.ThrowExceptionForHR(hResult.Result);
+
+                return Marshal.PtrToStructure<DriverStatistics>(buffer);
+            }
+            finally
+            {
+                Marshal.FreeHGlobal(buffer);
+            }
         }
 
-        private List<FileSystemEvent> GetEvents()
+        public DriverBenchmark RunBenchmark(uint iterations)
         {
             CommandMessage message = new CommandMessage();
-            message.Command = MinispyCommand.GetMiniSpyLog;
-            var buffer = Marshal.AllocHGlobal(BUFFER_SIZE);
+            message.Command = MinispyCommand.RunBenchmark;
+
+            IntPtr resultSize;
+            var size = Marshal.SizeOf(typeof(DriverBenchmark));
+            var buffer = Marshal.AllocHGlobal(size);
 
             try
             {
-                return GetFileSystemEvents(message, buffer);
+                HResult hResult = connector.SendAndRead(message, BitConverter.GetBytes(iterations), buffer, size, out resultSize);
+                Marshal.ThrowExceptionForHR(hResult.Result);
+
+                return Marshal.PtrToStructure<DriverBenchmark>(buffer);
             }
             finally
             {
@@ -230,8 +555,27 @@ namespace CenterDevice.MiniFSWatcher
             }
         }
 
-        private List<FileSystemEvent> GetFileSystemEvents(CommandMessage message, IntPtr buffer)
+        // File name of the executable of a process the driver has seen
+        public string GetProcessName(ulong processId)
         {
+            return processNames.GetNameOfProcess(processId);
+        }
+
+        public static uint GetCurrentThreadId()
+        {
+            return NativeMethods.GetCurrentThreadId();
+        }
+
+        public static int GetCurrentProcessId()
+        {
+            return Process.GetCurrentProcess().Id;
+        }
+
+        private void GetEvents(IntPtr buffer, EventBatch batch)
+        {
+            CommandMessage message = new CommandMessage();
+            message.Command = MinispyCommand.GetMiniSpyLog;
+
             IntPtr resultSize;
             HResult hResult = connector.SendAndRead(message, buffer, out resultSize);
 
@@ -241,12 +585,63 @@ namespace CenterDevice.MiniFSWatcher
                 {
                     Marshal.ThrowExceptionForHR(hResult.Result);
                 }
-
-                return new List<FileSystemEvent>();
             }
             else
             {
-                return EventReader.ReadFromBuffer(buffer, resultSize.ToInt64());
+                recorder?.Write(buffer, resultSize.ToInt64());
+                EventReader.ReadIntoBatch(buffer, resultSize.ToInt64(), batch);
+                ResolveProcessNames(batch);
+            }
+        }
+
+        private void ResolveProcessNames(EventBatch batch)
+        {
+            for (int i = 0; i < batch.Count; i++)
+            {
+                if (!processNames.Contains(batch[i].ProcessToken))
+                {
+                    SyncProcessNames();
+                    break;
+                }
+            }
+
+            batch.ProcessNames = processNames;
+        }
+
+        private void SyncProcessNames()
+        {
+            CommandMessage message = new CommandMessage();
+            message.Command = MinispyCommand.GetProcessNames;
+
+            var entrySize = Marshal.SizeOf(typeof(ProcessNameEntry));
+            var size = entrySize * PROCESS_NAME_BATCH;
+            var buffer = Marshal.AllocHGlobal(size);
+
+            try
+            {
+                int count;
+                do
+                {
+                    IntPtr resultSize;
+                    HResult hResult = connector.SendAndRead(message, BitConverter.GetBytes(processNames.LastToken), buffer, size, out resultSize);
+                    if (hResult.IsError)
+                    {
+                        // Names are informational, events are delivered without them
+                        Trace.TraceWarning("Could not read process names: " + hResult.Result);
+                        return;
+                    }
+
+                    count = (int)(resultSize.ToInt64() / entrySize);
+                    for (int i = 0; i < count; i++)
+                    {
+                        processNames.Add(Marshal.PtrToStructure<ProcessNameEntry>(IntPtr.Add(buffer, i * entrySize)));
+                    }
+                }
+                while (count == PROCESS_NAME_BATCH);
+            }
+            finally
+            {
+                Marshal.FreeHGlobal(buffer);
             }
         }
 
@@ -262,6 +657,7 @@ namespace CenterDevice.MiniFSWatcher
 
             if (disposing)
             {
+                StopRecording();
                 cancellationTokenSource.Dispose();
             }
 
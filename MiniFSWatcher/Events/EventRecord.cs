@@ -0,0 +1,40 @@
+﻿using CenterDevice.MiniFSWatcher.Types;
+using System;
+using System.IO;
+
+namespace CenterDevice.MiniFSWatcher.Events
+{
+    // Header of one record of an EventBatch. The names are kept in the batch,
+    // see EventBatch.GetFilename.
+    public struct EventRecord
+    {
+        public EventType Type { get; internal set; }
+        public uint SequenceNumber { get; internal set; }
+        public ulong ProcessId { get; internal set; }
+        internal uint ProcessToken { get; set; }
+
+        public bool IsTruncated { get; internal set; }
+        public bool IsDirectory { get; internal set; }
+
+        public FileIdentifier FileId { get; internal set; }
+
+        // Only set for moves
+        public FileIdentifier ParentId { get; internal set; }
+
+        // Only set if the driver captures attributes, see FileSystemEvent
+        public long? Size { get; internal set; }
+        public DateTime? LastWriteTime { get; internal set; }
+        public FileAttributes? Attributes { get; internal set; }
+
+        // Characters of the names in the arena of the batch, the old name is only set for moves
+        internal int NameOffset { get; set; }
+        internal int NameLength { get; set; }
+        internal int OldNameOffset { get; set; }
+        internal int OldNameLength { get; set; }
+
+        public bool IsMove
+        {
+            get { return Type == EventType.Move || Type == EventType.MoveSubtree; }
+        }
+    }
+}
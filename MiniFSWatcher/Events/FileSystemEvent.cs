@@ -1,4 +1,6 @@
 ﻿using CenterDevice.MiniFSWatcher.Types;
+using System;
+using System.IO;
 
 namespace CenterDevice.MiniFSWatcher.Events
 {
@@ -7,5 +9,31 @@ namespace CenterDevice.MiniFSWatcher.Events
         public EventType Type { get; internal set; }
         public string Filename { get; internal set; }
         public ulong ProcessId { get; internal set; }
+
+        // Driver sequence number of the record, baseline entries carry the fence of their scan
+        public uint SequenceNumber { get; internal set; }
+
+        // Synthetic create of an entry found by EventWatcher.ScanBaseline
+        public bool IsBaseline { get; internal set; }
+
+        // File name of the executable, null if the driver could not resolve it
+        public string ProcessName { get; internal set; }
+        internal uint ProcessToken { get; set; }
+
+        // Set if the driver had to cut off a path because it did not fit into the record
+        public bool IsTruncated { get; internal set; }
+
+        public bool IsDirectory { get; internal set; }
+
+        public FileIdentifier FileId { get; internal set; }
+
+        // Only set for moves
+        public FileIdentifier ParentId { get; internal set; }
+
+        // State of the file after a create or change, only set if the driver
+        // captures attributes, see DriverParameters.CaptureAttributes
+        public long? Size { get; internal set; }
+        public DateTime? LastWriteTime { get; internal set; }
+        public FileAttributes? Attributes { get; internal set; }
     }
 }
@@ -79,6 +79,25 @@ namespace CenterDevice.MiniFSWatcher
             }
         }
 
+        public void Send<T>(CommandMessage message, T data) where T : struct
+        {
+            var size = Marshal.SizeOf(typeof(T));
+            var bytes = new byte[size];
+            IntPtr pnt = Marshal.AllocHGlobal(size);
+
+            try
+            {
+                Marshal.StructureToPtr(data, pnt, false);
+                Marshal.Copy(pnt, bytes, 0, size);
+            }
+            finally
+            {
+                Marshal.FreeHGlobal(pnt);
+            }
+
+            Send(message, bytes);
+        }
+
         public HResult SendAndRead(CommandMessage message, IntPtr buffer, out IntPtr resultSize)
         {
             VerifyConnected();
@@ -97,6 +116,26 @@ namespace CenterDevice.MiniFSWatcher
             }
         }
 
+        public HResult SendAndRead(CommandMessage message, byte[] data, IntPtr buffer, int bufferSize, out IntPtr resultSize)
+        {
+            VerifyConnected();
+
+            var size = Marshal.SizeOf(message) + data.Length;
+            IntPtr command = Marshal.AllocHGlobal(size);
+
+            try
+            {
+                Marshal.StructureToPtr(message, command, false);
+                IntPtr address = IntPtr.Add(command, Marshal.SizeOf(typeof(CommandMessage)));
+                Marshal.Copy(data, 0, address, data.Length);
+                return new HResult(NativeMethods.FilterSendMessage(port, command, size, buffer, bufferSize, out resultSize));
+            }
+            finally
+            {
+                Marshal.FreeHGlobal(command);
+            }
+        }
+
         private void VerifyConnected()
         {
             if (!Connected)
@@ -0,0 +1,79 @@
+﻿using CenterDevice.MiniFSWatcher.Events;
+using CenterDevice.MiniFSWatcher.Types;
+using System;
+using System.Collections.Generic;
+using System.IO;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    // Drops changes that left size, last write time and attributes of a file as
+    // they were when it was last reported. Files are identified by their ID, so
+    // their state survives renames. Events without captured attributes or file
+    // ID always pass.
+    class MaterialChangeFilter
+    {
+        private struct FileState
+        {
+            public long Size;
+            public DateTime LastWriteTime;
+            public FileAttributes Attributes;
+
+            public bool SameAs(FileState other)
+            {
+                return Size == other.Size && LastWriteTime == other.LastWriteTime && Attributes == other.Attributes;
+            }
+        }
+
+        private readonly Dictionary<FileIdentifier, FileState> states = new Dictionary<FileIdentifier, FileState>();
+
+        // Once this many files are known, they are all forgotten, which
+        // at worst lets one unchanged event per file pass
+        public int Capacity { get; set; } = 100000;
+
+        public bool ShouldDeliver(FileSystemEvent fileEvent)
+        {
+            if (fileEvent.FileId.IsEmpty)
+            {
+                return true;
+            }
+
+            if (fileEvent.Type == EventType.Delete)
+            {
+                states.Remove(fileEvent.FileId);
+                return true;
+            }
+
+            if (fileEvent.Type != EventType.Create && fileEvent.Type != EventType.Change)
+            {
+                return true;
+            }
+
+            if (!fileEvent.Size.HasValue)
+            {
+                states.Remove(fileEvent.FileId);
+                return true;
+            }
+
+            var state = new FileState()
+            {
+                Size = fileEvent.Size.Value,
+                LastWriteTime = fileEvent.LastWriteTime.Value,
+                Attributes = fileEvent.Attributes.Value
+            };
+
+            FileState previous;
+            if (fileEvent.Type == EventType.Change && states.TryGetValue(fileEvent.FileId, out previous) && previous.SameAs(state))
+            {
+                return false;
+            }
+
+            if (states.Count >= Capacity)
+            {
+                states.Clear();
+            }
+
+            states[fileEvent.FileId] = state;
+            return true;
+        }
+    }
+}
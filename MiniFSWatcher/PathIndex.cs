@@ -0,0 +1,268 @@
+﻿using CenterDevice.MiniFSWatcher.Events;
+using CenterDevice.MiniFSWatcher.Types;
+using System;
+using System.Collections.Generic;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    // In-memory tree of the paths seen in events. Each node only stores its own
+    // name, so moving a directory re-parents one node in O(depth) and every
+    // path below it follows without being touched.
+    public class PathIndex
+    {
+        private static readonly char[] SEPARATORS = new[] { '\\' };
+
+        private class Node
+        {
+            public string Name;
+            public Node Parent;
+            public FileIdentifier FileId;
+            public Dictionary<string, Node> Children;
+        }
+
+        private readonly Node root = new Node();
+        private readonly Dictionary<FileIdentifier, Node> byFileId = new Dictionary<FileIdentifier, Node>();
+        private readonly object sync = new object();
+        private int count;
+
+        public int Count
+        {
+            get
+            {
+                lock (sync)
+                {
+                    return count;
+                }
+            }
+        }
+
+        public void Apply(FileSystemEvent fileEvent)
+        {
+            switch (fileEvent.Type)
+            {
+                case EventType.Create:
+                case EventType.Change:
+                    Add(fileEvent.Filename, fileEvent.FileId);
+                    break;
+                case EventType.Delete:
+                    Remove(fileEvent.Filename);
+                    break;
+                case EventType.Move:
+                case EventType.MoveSubtree:
+                    var moveEvent = (RenameOrMoveEvent)fileEvent;
+                    if (!Move(moveEvent.OldFilename, moveEvent.Filename))
+                    {
+                        Add(moveEvent.Filename, moveEvent.FileId);
+                    }
+                    else if (!moveEvent.FileId.IsEmpty)
+                    {
+                        lock (sync)
+                        {
+                            SetFileId(Find(moveEvent.Filename), moveEvent.FileId);
+                        }
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        public void Add(string path, FileIdentifier fileId = default(FileIdentifier))
+        {
+            lock (sync)
+            {
+                var node = root;
+                foreach (var name in Split(path))
+                {
+                    node = GetOrAddChild(node, name);
+                }
+
+                if (!fileId.IsEmpty)
+                {
+                    SetFileId(node, fileId);
+                }
+            }
+        }
+
+        // Removes the path and everything below it
+        public bool Remove(string path)
+        {
+            lock (sync)
+            {
+                var node = Find(path);
+                if (node == null || node == root)
+                {
+                    return false;
+                }
+
+                Detach(node);
+                Forget(node);
+                return true;
+            }
+        }
+
+        // Moves the path and everything below it, replacing an existing target
+        public bool Move(string oldPath, string newPath)
+        {
+            lock (sync)
+            {
+                var node = Find(oldPath);
+                if (node == null || node == root)
+                {
+                    return false;
+                }
+
+                var names = Split(newPath);
+                if (names.Length == 0)
+                {
+                    return false;
+                }
+
+                var parent = root;
+                for (int i = 0; i < names.Length - 1; i++)
+                {
+                    parent = GetOrAddChild(parent, names[i]);
+                }
+
+                for (var ancestor = parent; ancestor != null; ancestor = ancestor.Parent)
+                {
+                    if (ancestor == node)
+                    {
+                        return false;
+                    }
+                }
+
+                var name = names[names.Length - 1];
+                Node existing;
+                if (parent.Children.TryGetValue(name, out existing) && existing != node)
+                {
+                    Detach(existing);
+                    Forget(existing);
+                }
+
+                Detach(node);
+                node.Name = name;
+                node.Parent = parent;
+                parent.Children[name] = node;
+                return true;
+            }
+        }
+
+        public bool Contains(string path)
+        {
+            lock (sync)
+            {
+                return Find(path) != null;
+            }
+        }
+
+        // ID of the file at the given path or an empty one if it is unknown
+        public FileIdentifier GetFileId(string path)
+        {
+            lock (sync)
+            {
+                var node = Find(path);
+                return node != null ? node.FileId : default(FileIdentifier);
+            }
+        }
+
+        // Current path of the file with the given ID or null if it is unknown
+        public string GetPath(FileIdentifier fileId)
+        {
+            lock (sync)
+            {
+                Node node;
+                if (!byFileId.TryGetValue(fileId, out node))
+                {
+                    return null;
+                }
+
+                var names = new List<string>();
+                for (; node != root; node = node.Parent)
+                {
+                    names.Add(node.Name);
+                }
+                names.Reverse();
+                return string.Join("\\", names);
+            }
+        }
+
+        private static string[] Split(string path)
+        {
+            return path.Split(SEPARATORS, StringSplitOptions.RemoveEmptyEntries);
+        }
+
+        private Node Find(string path)
+        {
+            var node = root;
+            foreach (var name in Split(path))
+            {
+                if (node.Children == null || !node.Children.TryGetValue(name, out node))
+                {
+                    return null;
+                }
+            }
+            return node;
+        }
+
+        private Node GetOrAddChild(Node parent, string name)
+        {
+            if (parent.Children == null)
+            {
+                parent.Children = new Dictionary<string, Node>(StringComparer.OrdinalIgnoreCase);
+            }
+
+            Node child;
+            if (!parent.Children.TryGetValue(name, out child))
+            {
+                child = new Node() { Name = name, Parent = parent };
+                parent.Children.Add(name, child);
+                count++;
+            }
+            return child;
+        }
+
+        private void SetFileId(Node node, FileIdentifier fileId)
+        {
+            Unmap(node);
+            node.FileId = fileId;
+            byFileId[fileId] = node;
+        }
+
+        private void Unmap(Node node)
+        {
+            Node mapped;
+            if (!node.FileId.IsEmpty && byFileId.TryGetValue(node.FileId, out mapped) && mapped == node)
+            {
+                byFileId.Remove(node.FileId);
+            }
+        }
+
+        private static void Detach(Node node)
+        {
+            node.Parent.Children.Remove(node.Name);
+            node.Parent = null;
+        }
+
+        private void Forget(Node node)
+        {
+            var pending = new Stack<Node>();
+            pending.Push(node);
+            while (pending.Count > 0)
+            {
+                var current = pending.Pop();
+                count--;
+
+                Unmap(current);
+
+                if (current.Children != null)
+                {
+                    foreach (var child in current.Children.Values)
+                    {
+                        pending.Push(child);
+                    }
+                }
+            }
+        }
+    }
+}
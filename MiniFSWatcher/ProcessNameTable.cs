@@ -0,0 +1,67 @@
+﻿using CenterDevice.MiniFSWatcher.Types;
+using System.Collections.Generic;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    // Client side copy of the process names cached by the driver. Records only
+    // carry a token, new tokens are fetched in batches when they first show up.
+    class ProcessNameTable
+    {
+        private readonly object syncRoot = new object();
+        private readonly Dictionary<uint, ProcessNameEntry> byToken = new Dictionary<uint, ProcessNameEntry>();
+        private readonly Dictionary<ulong, uint> tokenByProcess = new Dictionary<ulong, uint>();
+
+        // The driver keeps this many tokens, older ones are dropped here as well
+        public int Capacity { get; set; } = 1024;
+
+        public uint LastToken { get; private set; }
+
+        public bool Contains(uint token)
+        {
+            lock (syncRoot)
+            {
+                return token == 0 || byToken.ContainsKey(token);
+            }
+        }
+
+        public void Add(ProcessNameEntry entry)
+        {
+            lock (syncRoot)
+            {
+                byToken[entry.Token] = entry;
+                tokenByProcess[entry.ProcessId] = entry.Token;
+                LastToken = entry.Token;
+
+                var stale = unchecked(entry.Token - (uint)Capacity);
+                ProcessNameEntry old;
+                uint token;
+                if (byToken.TryGetValue(stale, out old))
+                {
+                    byToken.Remove(stale);
+                    if (tokenByProcess.TryGetValue(old.ProcessId, out token) && token == stale)
+                    {
+                        tokenByProcess.Remove(old.ProcessId);
+                    }
+                }
+            }
+        }
+
+        public string GetName(uint token)
+        {
+            lock (syncRoot)
+            {
+                ProcessNameEntry entry;
+                return byToken.TryGetValue(token, out entry) ? entry.ShortName : null;
+            }
+        }
+
+        public string GetNameOfProcess(ulong processId)
+        {
+            lock (syncRoot)
+            {
+                uint token;
+                return tokenByProcess.TryGetValue(processId, out token) ? GetName(token) : null;
+            }
+        }
+    }
+}
@@ -22,6 +22,9 @@ using System.Runtime.InteropServices;
 // The following GUID is for the ID of the typelib if this project is exposed to COM
 [assembly: Guid("01bfc4ee-8fd7-44ce-a00e-da542116f27d")]
 
+// Lets the tests exercise internal helpers without the driver
+[assembly: InternalsVisibleTo("MiniFSWatcherTest")]
+
 // Version information for an assembly consists of the following four values:
 //
 //      Major Version
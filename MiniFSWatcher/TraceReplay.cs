@@ -0,0 +1,135 @@
+﻿using CenterDevice.MiniFSWatcher.Types;
+using System;
+using System.Diagnostics;
+using System.IO;
+using System.Runtime.InteropServices;
+using System.Text;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    public class TraceReplayResult
+    {
+        public DriverVersion Version { get; internal set; }
+        public long Buffers { get; internal set; }
+        public long Bytes { get; internal set; }
+        public long Events { get; internal set; }
+        public int Gen0Collections { get; internal set; }
+
+        // Time spent decoding buffers into batches and turning their records into events and handling them
+        public TimeSpan DecodeTime { get; internal set; }
+        public TimeSpan DispatchTime { get; internal set; }
+
+        public double EventsPerSecond
+        {
+            get
+            {
+                var total = (DecodeTime + DispatchTime).TotalSeconds;
+                return total > 0 ? Events / total : 0;
+            }
+        }
+    }
+
+    // Replays a trace through the event handling of a (not connected) watcher.
+    // Buffers are replayed back to back, so runs are deterministic and only
+    // measure the user mode pipeline.
+    public static class TraceReplay
+    {
+        public static TraceReplayResult Run(Stream trace, EventWatcher watcher)
+        {
+            var result = new TraceReplayResult();
+            var reader = new BinaryReader(trace, Encoding.ASCII, true);
+
+            var magic = reader.ReadBytes(TraceWriter.MAGIC.Length);
+            if (!StructuralEquals(magic, TraceWriter.MAGIC))
+            {
+                throw new InvalidDataException("Not a MiniFSWatcher trace");
+            }
+
+            result.Version = new DriverVersion(reader.ReadUInt16(), reader.ReadUInt16());
+            if (result.Version.Major != watcher.Version.Major)
+            {
+                throw new InvalidDataException("Trace was recorded with an incompatible driver version");
+            }
+
+            var decode = new Stopwatch();
+            var dispatch = new Stopwatch();
+            var collections = GC.CollectionCount(0);
+            IntPtr buffer = IntPtr.Zero;
+            int bufferSize = 0;
+            var batch = new EventBatch(null);
+
+            try
+            {
+                while (trace.Position < trace.Length)
+                {
+                    reader.ReadInt64();
+                    var size = reader.ReadInt32();
+                    var data = reader.ReadBytes(size);
+
+                    if (data.Length != size)
+                    {
+                        throw new InvalidDataException("Truncated trace");
+                    }
+
+                    if (bufferSize < size)
+                    {
+                        Marshal.FreeHGlobal(buffer);
+                        buffer = Marshal.AllocHGlobal(size);
+                        bufferSize = size;
+                    }
+
+                    Marshal.Copy(data, 0, buffer, size);
+
+                    decode.Start();
+                    batch.Clear();
+                    EventReader.ReadIntoBatch(buffer, size, batch);
+                    decode.Stop();
+
+                    dispatch.Start();
+                    for (int i = 0; i < batch.Count; i++)
+                    {
+                        watcher.HandleFileEvent(batch.ToEvent(i));
+                    }
+                    dispatch.Stop();
+
+                    result.Buffers++;
+                    result.Bytes += size;
+                    result.Events += batch.Count;
+                }
+
+                // Time based flushing is left out to keep replays deterministic
+                dispatch.Start();
+                watcher.FlushAggregatedEvents();
+                dispatch.Stop();
+            }
+            finally
+            {
+                Marshal.FreeHGlobal(buffer);
+            }
+
+            result.DecodeTime = decode.Elapsed;
+            result.DispatchTime = dispatch.Elapsed;
+            result.Gen0Collections = GC.CollectionCount(0) - collections;
+
+            return result;
+        }
+
+        private static bool StructuralEquals(byte[] a, byte[] b)
+        {
+            if (a.Length != b.Length)
+            {
+                return false;
+            }
+
+            for (int i = 0; i < a.Length; i++)
+            {
+                if (a[i] != b[i])
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+﻿using CenterDevice.MiniFSWatcher.Types;
+using System;
+using System.Diagnostics;
+using System.IO;
+using System.Runtime.InteropServices;
+using System.Text;
+
+namespace CenterDevice.MiniFSWatcher
+{
+    /// <summary>
+    /// Records the raw log buffers received from the driver so that they can
+    /// be replayed later with <see cref="TraceReplay"/>.
+    /// </summary>
+    /// <remarks>
+    /// The trace starts with the 8 byte magic "MFSWTRC1" and the driver version
+    /// (two ushorts). Each buffer follows as a 64 bit timestamp in 100ns units
+    /// relative to the start of the recording, a 32 bit length and the buffer
+    /// exactly as returned by GetMiniSpyLog.
+    /// </remarks>
+    public class TraceWriter : IDisposable
+    {
+        internal static readonly byte[] MAGIC = Encoding.ASCII.GetBytes("MFSWTRC1");
+
+        private readonly object writeLock = new object();
+        private readonly BinaryWriter writer;
+        private readonly Stopwatch stopwatch = Stopwatch.StartNew();
+        private byte[] data = new byte[0];
+
+        public TraceWriter(Stream stream, DriverVersion version)
+        {
+            writer = new BinaryWriter(stream, Encoding.ASCII, true);
+            writer.Write(MAGIC);
+            writer.Write(version.Major);
+            writer.Write(version.Minor);
+        }
+
+        internal void Write(IntPtr buffer, long size)
+        {
+            lock (writeLock)
+            {
+                if (data.Length < size)
+                {
+                    data = new byte[size];
+                }
+
+                Marshal.Copy(buffer, data, 0, (int) size);
+
+                writer.Write(stopwatch.Elapsed.Ticks);
+                writer.Write((int) size);
+                writer.Write(data, 0, (int) size);
+            }
+        }
+
+        public void Dispose()
+        {
+            lock (writeLock)
+            {
+                writer.Flush();
+                writer.Dispose();
+            }
+        }
+    }
+}
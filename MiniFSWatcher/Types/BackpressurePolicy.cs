@@ -0,0 +1,8 @@
+﻿namespace CenterDevice.MiniFSWatcher.Types
+{
+    public enum BackpressurePolicy : uint
+    {
+        DropNewest = 0,
+        DropOldest = 1
+    }
+}
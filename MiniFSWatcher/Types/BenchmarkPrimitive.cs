@@ -0,0 +1,19 @@
+﻿namespace CenterDevice.MiniFSWatcher.Types
+{
+    public enum BenchmarkPrimitive
+    {
+        NameCopy,
+        RecordInit,
+        EventType,
+        PathMatch,
+        Queue,
+        GetLogCopy,
+        HotPath,
+        NameFormat,
+        ProcessLookup,
+        ExtensionTable,
+        ExtensionWildcard,
+        PathPrefix,
+        PathExpression
+    }
+}
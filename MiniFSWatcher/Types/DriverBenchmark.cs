@@ -0,0 +1,25 @@
+﻿using System.Runtime.InteropServices;
+
+namespace CenterDevice.MiniFSWatcher.Types
+{
+    [StructLayout(LayoutKind.Sequential)]
+    public struct DriverBenchmark
+    {
+        public const int Primitives = 13;
+
+        public uint Iterations;
+        uint Reserved;
+
+        // Average nanoseconds per iteration, indexed by BenchmarkPrimitive
+        [MarshalAs(UnmanagedType.ByValArray, SizeConst = Primitives)]
+        public ulong[] Nanoseconds;
+
+        public ulong this[BenchmarkPrimitive primitive]
+        {
+            get
+            {
+                return Nanoseconds[(int) primitive];
+            }
+        }
+    }
+}
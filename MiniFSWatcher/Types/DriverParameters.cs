@@ -0,0 +1,31 @@
+﻿using System.Runtime.InteropServices;
+
+namespace CenterDevice.MiniFSWatcher.Types
+{
+    [StructLayout(LayoutKind.Sequential)]
+    public struct DriverParameters
+    {
+        // Only the selected fields are changed by EventWatcher.SetParameters
+        public ParameterFields ValidFields;
+
+        public int MaxRecords;
+        public NameQueryMethod NameQueryMethod;
+        public uint MaxRecordsPerBatch;
+        public BackpressurePolicy BackpressurePolicy;
+
+        // Log size, last write time and attributes with creates and changes,
+        // this makes writes synchronous
+        [MarshalAs(UnmanagedType.Bool)]
+        public bool CaptureAttributes;
+
+        // Writes dropped by the driver before it queries their name
+        public PagingIoPolicy PagingIoPolicy;
+
+        // Resolve the names of writes after they completed, in batches
+        [MarshalAs(UnmanagedType.Bool)]
+        public bool DeferWriteNames;
+
+        // Milliseconds the changes of a file are merged into one, 0 disables
+        public uint SettleTime;
+    }
+}
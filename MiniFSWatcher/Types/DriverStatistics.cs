@@ -0,0 +1,30 @@
+﻿using System.Runtime.InteropServices;
+
+namespace CenterDevice.MiniFSWatcher.Types
+{
+    [StructLayout(LayoutKind.Sequential)]
+    public struct DriverStatistics
+    {
+        public const int LatencyBuckets = 32;
+
+        public ulong CallbacksSeen;
+        public ulong EarlyRejects;
+        public ulong NameQueries;
+        public ulong NameQueryFailures;
+        public ulong RecordsAllocated;
+        public ulong DroppedExceedAllowance;
+        public ulong DroppedOutOfMemory;
+        public ulong DroppedDraining;
+        public ulong QueueDepthHighWater;
+        public ulong BytesDelivered;
+        public ulong ChangesMerged;
+        public ulong DroppedDeletePending;
+
+        // Log2 buckets of 100ns units, bucket N counts latencies in [2^N, 2^(N+1))
+        [MarshalAs(UnmanagedType.ByValArray, SizeConst = LatencyBuckets)]
+        public ulong[] PreToPostLatency;
+
+        [MarshalAs(UnmanagedType.ByValArray, SizeConst = LatencyBuckets)]
+        public ulong[] PostToDeliveryLatency;
+    }
+}
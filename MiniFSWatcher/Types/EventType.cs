@@ -7,6 +7,7 @@
         Delete = 2,
         Change = 3,
         Move = 4,
-        Close = 5
+        Close = 5,
+        MoveSubtree = 6
     }
 }
@@ -0,0 +1,59 @@
+﻿using System;
+
+namespace CenterDevice.MiniFSWatcher.Types
+{
+    // Identifies a file independent of its name, so it stays the same when the
+    // file is renamed or moved within its volume. File systems with 64 bit IDs
+    // (NTFS) only use Low.
+    public struct FileIdentifier: IEquatable<FileIdentifier>
+    {
+        public readonly ulong VolumeSerialNumber;
+        public readonly ulong Low;
+        public readonly ulong High;
+
+        public FileIdentifier(ulong volumeSerialNumber, ulong low, ulong high)
+        {
+            this.VolumeSerialNumber = volumeSerialNumber;
+            this.Low = low;
+            this.High = high;
+        }
+
+        public bool IsEmpty
+        {
+            get
+            {
+                return Low == 0 && High == 0;
+            }
+        }
+
+        public bool Equals(FileIdentifier other)
+        {
+            return Low == other.Low && High == other.High && VolumeSerialNumber == other.VolumeSerialNumber;
+        }
+
+        public override bool Equals(object obj)
+        {
+            return obj is FileIdentifier && Equals((FileIdentifier)obj);
+        }
+
+        public override int GetHashCode()
+        {
+            return (Low ^ High ^ VolumeSerialNumber).GetHashCode();
+        }
+
+        public override string ToString()
+        {
+            return VolumeSerialNumber.ToString("x") + ":" + High.ToString("x16") + Low.ToString("x16");
+        }
+
+        public static bool operator ==(FileIdentifier a, FileIdentifier b)
+        {
+            return a.Equals(b);
+        }
+
+        public static bool operator !=(FileIdentifier a, FileIdentifier b)
+        {
+            return !a.Equals(b);
+        }
+    }
+}
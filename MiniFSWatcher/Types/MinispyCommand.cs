@@ -6,6 +6,12 @@
         GetMiniSpyVersion,
         SetWatchProcess,
         SetWatchThread,
-        SetPathFilter
+        SetPathFilter,
+        GetStatistics,
+        SetParameters,
+        RunBenchmark,
+        GetProcessNames,
+        SetProcessFilter,
+        SetExtensionFilter
     }
 }
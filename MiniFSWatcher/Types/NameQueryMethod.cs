@@ -0,0 +1,10 @@
+﻿namespace CenterDevice.MiniFSWatcher.Types
+{
+    public enum NameQueryMethod : uint
+    {
+        Default = 0x100,
+        CacheOnly = 0x200,
+        FileSystemOnly = 0x300,
+        AlwaysAllowCacheLookup = 0x400
+    }
+}
@@ -0,0 +1,15 @@
+﻿using System;
+
+namespace CenterDevice.MiniFSWatcher.Types
+{
+    [Flags]
+    public enum PagingIoPolicy : uint
+    {
+        None = 0,
+        SkipPaging = 0x1,
+        SkipSynchronousPaging = 0x2,
+        SkipLazyWriter = 0x4,
+        // Only the first write to a file is reported until a handle to it is closed
+        ReportDirtyOnce = 0x8
+    }
+}
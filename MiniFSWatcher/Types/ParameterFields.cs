@@ -0,0 +1,18 @@
+﻿using System;
+
+namespace CenterDevice.MiniFSWatcher.Types
+{
+    [Flags]
+    public enum ParameterFields : uint
+    {
+        None = 0,
+        MaxRecords = 0x1,
+        NameQueryMethod = 0x2,
+        MaxRecordsPerBatch = 0x4,
+        BackpressurePolicy = 0x8,
+        CaptureAttributes = 0x10,
+        PagingIoPolicy = 0x20,
+        DeferWriteNames = 0x40,
+        SettleTime = 0x80
+    }
+}
@@ -0,0 +1,17 @@
+﻿using System.Runtime.InteropServices;
+
+namespace CenterDevice.MiniFSWatcher.Types
+{
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+    struct ProcessNameEntry
+    {
+        public const int NameLength = 32;
+
+        public uint Token;
+        public uint NameHash;
+        public ulong ProcessId;
+
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = NameLength)]
+        public string ShortName;
+    }
+}
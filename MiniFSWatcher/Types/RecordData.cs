@@ -10,8 +10,17 @@ namespace CenterDevice.MiniFSWatcher.Types
 
         public EventType EventType;
 
-        public int Flags;
+        public RecordFlags Flags;
         public ulong ProcessId;
+
+        public ulong VolumeSerialNumber;
+        public RecordFileId FileId;
+        public RecordFileId ParentId;
+
+        public long FileSize;
+        public long LastWriteTime;
+        public uint FileAttributes;
+        public uint ProcessToken;
     }
 
 }
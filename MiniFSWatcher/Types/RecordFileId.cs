@@ -0,0 +1,11 @@
+﻿using System.Runtime.InteropServices;
+
+namespace CenterDevice.MiniFSWatcher.Types
+{
+    [StructLayout(LayoutKind.Sequential)]
+    struct RecordFileId
+    {
+        public ulong LowPart;
+        public ulong HighPart;
+    }
+}
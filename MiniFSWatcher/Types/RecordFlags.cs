@@ -0,0 +1,13 @@
+﻿using System;
+
+namespace CenterDevice.MiniFSWatcher.Types
+{
+    [Flags]
+    public enum RecordFlags : int
+    {
+        None = 0,
+        NameTruncated = 0x1,
+        Directory = 0x2,
+        Attributes = 0x4
+    }
+}
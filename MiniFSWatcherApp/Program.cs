@@ -1,6 +1,9 @@
 ﻿using CenterDevice.MiniFSWatcher;
+using CenterDevice.MiniFSWatcher.Types;
 using System;
 using System.IO;
+using System.Linq;
+using System.Text;
 using System.Threading.Tasks;
 
 namespace CenterDevice.MiniFSWatcherApp
@@ -9,15 +12,42 @@ namespace CenterDevice.MiniFSWatcherApp
     {
         static void Main(string[] args)
         {
+            if (args.Length >= 2 && args[0] == "--replay")
+            {
+                ReplayTrace(args[1], args.Contains("--collapse-saves"));
+                return;
+            }
+
+            if (args.Length == 3 && args[0] == "--benchmark")
+            {
+                RunBenchmark(uint.Parse(args[1]), args[2]);
+                return;
+            }
+
+            string tracePath = null;
+            if (args.Length >= 2 && args[0] == "--record")
+            {
+                tracePath = args[1];
+                args = args.Skip(2).ToArray();
+            }
+
             var path = (args.Length > 0) ? args[0] : AppDomain.CurrentDomain.BaseDirectory;
 
             Console.WriteLine("FileSystemEventFilter Demo Application");
             Console.WriteLine("======================================\n");
             Console.WriteLine("Listing events in \"" + path + "\"");
-            Console.WriteLine("To watch a different path, run: " + AppDomain.CurrentDomain.FriendlyName + " <pattern>\n");
+            Console.WriteLine("To watch a different path, run: " + AppDomain.CurrentDomain.FriendlyName + " [--record <trace>] <pattern>\n");
+            Console.WriteLine("To replay a recorded trace, run: " + AppDomain.CurrentDomain.FriendlyName + " --replay <trace> [--collapse-saves]\n");
+            Console.WriteLine("To benchmark the driver, run: " + AppDomain.CurrentDomain.FriendlyName + " --benchmark <iterations> <result.json>\n");
 
             //CaptureEventsUsingDefaultWatcher(path);
-            CaptureEventsUsingFilter(path);
+            var filter = CaptureEventsUsingFilter(path);
+
+            if (tracePath != null)
+            {
+                Console.WriteLine("Recording trace to \"" + tracePath + "\"");
+                filter.StartRecording(File.Create(tracePath));
+            }
 
             Console.WriteLine("Press <ESC> to stop exit...");
             do
@@ -28,9 +58,66 @@ namespace CenterDevice.MiniFSWatcherApp
                 }
             } while (Console.ReadKey(true).Key != ConsoleKey.Escape);
 
+            filter.StopRecording();
             Console.WriteLine("Done");
         }
 
+        private static void ReplayTrace(string tracePath, bool collapseAtomicSaves)
+        {
+            var filter = new EventWatcher();
+            filter.AggregateEvents = true;
+            filter.CollapseAtomicSaves = collapseAtomicSaves;
+
+            long delivered = 0;
+            filter.OnChange += (name, process) => delivered++;
+            filter.OnCreate += (name, process) => delivered++;
+            filter.OnDelete += (name, process) => delivered++;
+            filter.OnRenameOrMove += (name, oldName, process) => delivered++;
+
+            using (var trace = File.OpenRead(tracePath))
+            {
+                var result = filter.Replay(trace);
+
+                Console.WriteLine("Driver version:   " + result.Version.Major + "." + result.Version.Minor);
+                Console.WriteLine("Buffers:          " + result.Buffers + " (" + result.Bytes + " bytes)");
+                Console.WriteLine("Events:           " + result.Events + " read, " + delivered + " delivered");
+                Console.WriteLine("Decode time:      " + result.DecodeTime.TotalMilliseconds + " ms");
+                Console.WriteLine("Dispatch time:    " + result.DispatchTime.TotalMilliseconds + " ms");
+                Console.WriteLine("Events/s:         " + result.EventsPerSecond.ToString("F0"));
+                Console.WriteLine("Gen0 collections: " + result.Gen0Collections);
+            }
+        }
+
+        private static void RunBenchmark(uint iterations, string resultPath)
+        {
+            var filter = new EventWatcher();
+            filter.Connect();
+
+            var benchmark = filter.RunBenchmark(iterations);
+            var version = filter.GetDriverVersion();
+            filter.Disconnect();
+
+            var json = new StringBuilder();
+            json.AppendLine("{");
+            json.AppendLine("  \"driver_version\": \"" + version.Major + "." + version.Minor + "\",");
+            json.AppendLine("  \"date\": \"" + DateTime.UtcNow.ToString("o") + "\",");
+            json.AppendLine("  \"iterations\": " + benchmark.Iterations + ",");
+            json.AppendLine("  \"benchmarks\": [");
+
+            var primitives = (BenchmarkPrimitive[]) Enum.GetValues(typeof(BenchmarkPrimitive));
+            for (int i = 0; i < primitives.Length; i++)
+            {
+                Console.WriteLine(primitives[i].ToString().PadRight(12) + benchmark[primitives[i]] + " ns");
+                json.Append("    { \"name\": \"" + primitives[i] + "\", \"time_unit\": \"ns\", \"real_time\": " + benchmark[primitives[i]] + " }");
+                json.AppendLine(i < primitives.Length - 1 ? "," : "");
+            }
+
+            json.AppendLine("  ]");
+            json.AppendLine("}");
+
+            File.WriteAllText(resultPath, json.ToString());
+        }
+
         private static void CaptureEventsUsingDefaultWatcher(string path)
         {
             Console.WriteLine("Capturing events using default file system watcher...");
@@ -56,7 +143,7 @@ namespace CenterDevice.MiniFSWatcherApp
             watcher.EnableRaisingEvents = true;
         }
 
-        private static void CaptureEventsUsingFilter(string path)
+        private static EventWatcher CaptureEventsUsingFilter(string path)
         {
             var filter = new EventWatcher();
 
@@ -83,6 +170,8 @@ namespace CenterDevice.MiniFSWatcherApp
             {
                 Console.WriteLine("Moved: " + oldName + " -> " + name);
             };
+
+            return filter;
         }
     }
 }
@@ -57,6 +57,20 @@ CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
     { IRP_MJ_OPERATION_END }
 };
 
+//
+//  The stream context caches the IDs logged with each record
+//
+
+CONST FLT_CONTEXT_REGISTRATION Contexts[] = {
+    { FLT_STREAM_CONTEXT,
+      0,
+      NULL,
+      sizeof(SPY_STREAM_CONTEXT),
+      SPY_STREAM_CONTEXT_TAG },
+
+    { FLT_CONTEXT_END }
+};
+
 //
 //  This defines what we want to filter with FltMgr
 //
@@ -71,7 +85,7 @@ CONST FLT_REGISTRATION FilterRegistration = {
     0,                                      //  Flags
 #endif // MINISPY_WIN8
 
-    NULL,                               //  Context
+    Contexts,                               //  Context
     Callbacks,                              //  Operation callbacks
 
     SpyFilterUnload,                        //  FilterUnload
@@ -125,11 +125,24 @@ Return Value:
         MiniFSWatcherData.LogSequenceNumber = 0;
         MiniFSWatcherData.MaxRecordsToAllocate = DEFAULT_MAX_RECORDS_TO_ALLOCATE;
         MiniFSWatcherData.RecordsAllocated = 0;
+        MiniFSWatcherData.OutputBufferCount = 0;
+        MiniFSWatcherData.OutputBufferHighWater = 0;
         MiniFSWatcherData.NameQueryMethod = DEFAULT_NAME_QUERY_METHOD;
+        MiniFSWatcherData.MaxRecordsPerBatch = DEFAULT_MAX_RECORDS_PER_BATCH;
+        MiniFSWatcherData.BackpressurePolicy = DEFAULT_BACKPRESSURE_POLICY;
+        MiniFSWatcherData.CaptureAttributes = DEFAULT_CAPTURE_ATTRIBUTES;
+        MiniFSWatcherData.PagingIoPolicy = DEFAULT_PAGING_IO_POLICY;
+        MiniFSWatcherData.ReportedGeneration = 1;
+        MiniFSWatcherData.DeferWriteNames = DEFAULT_DEFER_WRITE_NAMES;
+        MiniFSWatcherData.SettleTime = DEFAULT_SETTLE_TIME;
 		MiniFSWatcherData.ClientPort = NULL;
-		MiniFSWatcherData.WatchPathInUse = FALSE;
+		FltInitializePushLock(&MiniFSWatcherData.WatchPathLock);
 
 		RtlInitUnicodeString(&MiniFSWatcherData.WatchPath, NULL);
+		RtlInitUnicodeString(&MiniFSWatcherData.WatchPrefix, NULL);
+
+        MiniFSWatcherData.Extensions = NULL;
+        FltInitializePushLock( &MiniFSWatcherData.ExtensionLock );
 
         MiniFSWatcherData.DriverObject = DriverObject;
 
@@ -144,6 +157,30 @@ Return Value:
                                          SPY_TAG,
                                          0 );
 
+        //
+        //  Statistics are best effort, the filter works without them.
+        //
+
+        SpyInitializeStatistics();
+
+        //
+        //  So are process names.
+        //
+
+        SpyInitializeProcessCache();
+
+        //
+        //  And deferred write names.
+        //
+
+        SpyInitializeDeferredNames();
+
+        //
+        //  And settling changes.
+        //
+
+        SpyInitializeSettleTable();
+
         //
         // Read the custom parameters for MiniSpy from the registry
         //
@@ -220,7 +257,13 @@ Return Value:
                  FltUnregisterFilter( MiniFSWatcherData.Filter );
              }
 
+             SpyFreeSettleTable();
              ExDeleteNPagedLookasideList( &MiniFSWatcherData.FreeBufferList );
+             SpyFreeStatistics();
+             SpyFreeProcessCache();
+             SpyFreeDeferredNames();
+             FltDeletePushLock( &MiniFSWatcherData.ExtensionLock );
+             FltDeletePushLock( &MiniFSWatcherData.WatchPathLock );
         }
     }
 
@@ -267,6 +310,7 @@ Return Value
     UNREFERENCED_PARAMETER( ConnectionCookie );
 
     FLT_ASSERT( MiniFSWatcherData.ClientPort == NULL );
+    InterlockedIncrement( &MiniFSWatcherData.ReportedGeneration );
     MiniFSWatcherData.ClientPort = ClientPort;
 
 	DbgPrintEx(DPFLTR_IHVDRIVER_ID, 0, "Client connected to MiniSpy\n");
@@ -308,6 +352,8 @@ Return value
 	MiniFSWatcherData.WatchProcess = 0;
 	MiniFSWatcherData.WatchThread = 0;
 	SpyUpdateWatchedPath(NULL);
+	SpySetProcessFilter(0, NULL, 0);
+	SpyUpdateExtensionFilter(NULL);
 	DbgPrintEx(DPFLTR_IHVDRIVER_ID, 0, "Client disconnected from MiniSpy\n");
 }
 
@@ -349,8 +395,20 @@ Return Value:
 
     FltUnregisterFilter( MiniFSWatcherData.Filter );
 
+    //
+    //  The settle timer may still log records to the output list
+    //
+
+    SpyFreeSettleTable();
     SpyEmptyOutputBufferList();
     ExDeleteNPagedLookasideList( &MiniFSWatcherData.FreeBufferList );
+    SpyFreeStatistics();
+    SpyFreeProcessCache();
+    SpyFreeDeferredNames();
+    SpyUpdateExtensionFilter( NULL );
+    FltDeletePushLock( &MiniFSWatcherData.ExtensionLock );
+    SpyUpdateWatchedPath( NULL );
+    FltDeletePushLock( &MiniFSWatcherData.WatchPathLock );
 
     return STATUS_SUCCESS;
 }
@@ -427,6 +485,14 @@ Return Value:
     NTSTATUS status;
 	ULONG dataLength;
 	UNICODE_STRING dataString;
+	MINIFSWATCHER_STATISTICS statistics;
+	MINIFSWATCHER_PARAMETERS parameters;
+	MINIFSWATCHER_BENCHMARK benchmark;
+	ULONG iterations;
+	ULONG afterToken;
+	ULONG filterFlags;
+	PWCHAR patterns;
+	PSPY_EXTENSION_TABLE extensions;
 
     PAGED_CODE();
 
@@ -633,6 +699,218 @@ break;
 					return GetExceptionCode();
 				}
 
+				break;
+			case GetStatistics:
+
+				//
+				//  Return the aggregated runtime statistics.  Verify we have
+				//  a valid user buffer including valid alignment.
+				//
+
+				if ((OutputBufferSize < sizeof(MINIFSWATCHER_STATISTICS)) ||
+					(OutputBuffer == NULL)) {
+
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+
+				if (!IS_ALIGNED(OutputBuffer, sizeof(ULONG))) {
+
+					status = STATUS_DATATYPE_MISALIGNMENT;
+					break;
+				}
+
+				SpyGetStatistics(&statistics);
+
+				try {
+
+					RtlCopyMemory(OutputBuffer, &statistics, sizeof(MINIFSWATCHER_STATISTICS));
+
+				} except(SpyExceptionFilter(GetExceptionInformation(), TRUE)) {
+					return GetExceptionCode();
+				}
+
+				*ReturnOutputBufferLength = sizeof(MINIFSWATCHER_STATISTICS);
+				status = STATUS_SUCCESS;
+				break;
+			case SetParameters:
+				if (dataLength < sizeof(MINIFSWATCHER_PARAMETERS))
+				{
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+
+				try {
+					RtlCopyMemory(&parameters, ((PCOMMAND_MESSAGE)InputBuffer)->Data, sizeof(MINIFSWATCHER_PARAMETERS));
+				} except(SpyExceptionFilter(GetExceptionInformation(), TRUE)) {
+					return GetExceptionCode();
+				}
+
+				if ((OutputBuffer != NULL) && !IS_ALIGNED(OutputBuffer, sizeof(ULONG)))
+				{
+					status = STATUS_DATATYPE_MISALIGNMENT;
+					break;
+				}
+
+				status = SpySetParameters(&parameters);
+				if (!NT_SUCCESS(status))
+				{
+					break;
+				}
+
+				DbgPrintEx(DPFLTR_IHVDRIVER_ID, 0, "Parameters updated (0x%x)\n", parameters.ValidFields);
+
+				//
+				//  Report back the parameters now in effect if the caller
+				//  asked for them
+				//
+
+				if ((OutputBuffer != NULL) && (OutputBufferSize >= sizeof(MINIFSWATCHER_PARAMETERS)))
+				{
+					SpyGetParameters(&parameters);
+
+					try {
+						RtlCopyMemory(OutputBuffer, &parameters, sizeof(MINIFSWATCHER_PARAMETERS));
+					} except(SpyExceptionFilter(GetExceptionInformation(), TRUE)) {
+						return GetExceptionCode();
+					}
+
+					*ReturnOutputBufferLength = sizeof(MINIFSWATCHER_PARAMETERS);
+				}
+
+				break;
+			case RunBenchmark:
+				if ((dataLength < sizeof(ULONG)) ||
+					(OutputBufferSize < sizeof(MINIFSWATCHER_BENCHMARK)) ||
+					(OutputBuffer == NULL))
+				{
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+
+				if (!IS_ALIGNED(OutputBuffer, sizeof(ULONG)))
+				{
+					status = STATUS_DATATYPE_MISALIGNMENT;
+					break;
+				}
+
+				try {
+					iterations = *((PULONG)((PCOMMAND_MESSAGE)InputBuffer)->Data);
+				} except(SpyExceptionFilter(GetExceptionInformation(), TRUE)) {
+					return GetExceptionCode();
+				}
+
+				status = SpyRunBenchmark(iterations, &benchmark);
+				if (!NT_SUCCESS(status))
+				{
+					break;
+				}
+
+				try {
+					RtlCopyMemory(OutputBuffer, &benchmark, sizeof(MINIFSWATCHER_BENCHMARK));
+				} except(SpyExceptionFilter(GetExceptionInformation(), TRUE)) {
+					return GetExceptionCode();
+				}
+
+				*ReturnOutputBufferLength = sizeof(MINIFSWATCHER_BENCHMARK);
+				break;
+
+			case GetProcessNames:
+				if ((dataLength < sizeof(ULONG)) ||
+					(OutputBufferSize < sizeof(PROCESS_NAME_ENTRY)) ||
+					(OutputBuffer == NULL))
+				{
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+
+				if (!IS_ALIGNED(OutputBuffer, sizeof(ULONGLONG)))
+				{
+					status = STATUS_DATATYPE_MISALIGNMENT;
+					break;
+				}
+
+				try {
+					afterToken = *((PULONG)((PCOMMAND_MESSAGE)InputBuffer)->Data);
+
+					*ReturnOutputBufferLength = sizeof(PROCESS_NAME_ENTRY) *
+						SpyCopyProcessNames(afterToken,
+											(PPROCESS_NAME_ENTRY)OutputBuffer,
+											(ULONG)(OutputBufferSize / sizeof(PROCESS_NAME_ENTRY)));
+				} except(SpyExceptionFilter(GetExceptionInformation(), TRUE)) {
+					return GetExceptionCode();
+				}
+
+				status = STATUS_SUCCESS;
+				break;
+
+			case SetProcessFilter:
+				if ((dataLength < FIELD_OFFSET(PROCESS_FILTER, Patterns) + sizeof(WCHAR)) ||
+					(dataLength > FIELD_OFFSET(PROCESS_FILTER, Patterns) + MAX_PROCESS_FILTER_LENGTH * sizeof(WCHAR)))
+				{
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+
+				patterns = ExAllocatePoolWithTag(PagedPool,
+												 dataLength - FIELD_OFFSET(PROCESS_FILTER, Patterns),
+												 SPY_TAG);
+				if (patterns == NULL)
+				{
+					status = STATUS_INSUFFICIENT_RESOURCES;
+					break;
+				}
+
+				try {
+					filterFlags = ((PPROCESS_FILTER)((PCOMMAND_MESSAGE)InputBuffer)->Data)->Flags;
+					RtlCopyMemory(patterns,
+								  ((PPROCESS_FILTER)((PCOMMAND_MESSAGE)InputBuffer)->Data)->Patterns,
+								  dataLength - FIELD_OFFSET(PROCESS_FILTER, Patterns));
+				} except(SpyExceptionFilter(GetExceptionInformation(), TRUE)) {
+					ExFreePoolWithTag(patterns, SPY_TAG);
+					return GetExceptionCode();
+				}
+
+				status = SpySetProcessFilter(filterFlags,
+											 patterns,
+											 (ULONG)((dataLength - FIELD_OFFSET(PROCESS_FILTER, Patterns)) / sizeof(WCHAR)));
+				if (!NT_SUCCESS(status))
+				{
+					ExFreePoolWithTag(patterns, SPY_TAG);
+				}
+
+				break;
+
+			case SetExtensionFilter:
+				if ((dataLength < sizeof(WCHAR)) ||
+					(dataLength > MAX_EXTENSION_FILTER_COUNT * (MAX_EXTENSION_LENGTH + 2) * sizeof(WCHAR) + sizeof(WCHAR)))
+				{
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+
+				patterns = ExAllocatePoolWithTag(PagedPool, dataLength, SPY_TAG);
+				if (patterns == NULL)
+				{
+					status = STATUS_INSUFFICIENT_RESOURCES;
+					break;
+				}
+
+				try {
+					RtlCopyMemory(patterns, ((PCOMMAND_MESSAGE)InputBuffer)->Data, dataLength);
+				} except(SpyExceptionFilter(GetExceptionInformation(), TRUE)) {
+					ExFreePoolWithTag(patterns, SPY_TAG);
+					return GetExceptionCode();
+				}
+
+				status = SpyBuildExtensionTable(patterns, (ULONG)(dataLength / sizeof(WCHAR)), &extensions);
+				ExFreePoolWithTag(patterns, SPY_TAG);
+
+				if (NT_SUCCESS(status))
+				{
+					SpyUpdateExtensionFilter(extensions);
+				}
+
 				break;
             default:
 				status = STATUS_INVALID_PARAMETER;
@@ -697,53 +975,186 @@ Return Value:
 	PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
 	PFLT_FILE_NAME_INFORMATION targetNameInfo = NULL;
 
+	BOOLEAN isRename = FALSE;
+	BOOLEAN isDirectory = FALSE;
+	BOOLEAN queryIds = FALSE;
+	BOOLEAN sourceWatched;
+	BOOLEAN targetWatched;
+
+	ULONG pagingIoPolicy = MiniFSWatcherData.PagingIoPolicy;
+
+	//
+	//  The post-operation callback of a write marks its stream as reported,
+	//  which needs the stream context and so IRQL <= APC_LEVEL
+	//
+
+	BOOLEAN markReported = Data->Iopb->MajorFunction == IRP_MJ_WRITE && FlagOn(pagingIoPolicy, PAGING_IO_REPORT_DIRTY_ONCE);
+
+	SpyStatisticsIncrement(SpyCounterCallbacksSeen);
+
 	if (MiniFSWatcherData.ClientPort == NULL || MiniFSWatcherData.WatchPath.Buffer == NULL)
 	{
+		SpyStatisticsIncrement(SpyCounterEarlyRejects);
 		return FLT_PREOP_SUCCESS_NO_CALLBACK;
 	}
 
 	if (!FlagOn(Data->Flags, FLTFL_CALLBACK_DATA_IRP_OPERATION))
 	{
+		SpyStatisticsIncrement(SpyCounterEarlyRejects);
 		return FLT_PREOP_SUCCESS_NO_CALLBACK;
 	}
 
 	if (FltObjects->FileObject == NULL || FltObjects->FileObject->FileName.Buffer == NULL || FltObjects->FileObject->DeviceObject == NULL)
 	{
+		SpyStatisticsIncrement(SpyCounterEarlyRejects);
 		return FLT_PREOP_SUCCESS_NO_CALLBACK;
 	}
 
+	//
+	//  Writes the paging I/O policy drops are rejected before any name is
+	//  queried.  Closing a file object makes the next write to its stream
+	//  reported again.
+	//
+
+	if (Data->Iopb->MajorFunction == IRP_MJ_WRITE)
+	{
+		if (SpyIsSkippedWrite(pagingIoPolicy, Data->Iopb->IrpFlags, IoGetTopLevelIrp())
+			|| (FlagOn(pagingIoPolicy, PAGING_IO_REPORT_DIRTY_ONCE) && SpyIsReportedStream(FltObjects)))
+		{
+			SpyStatisticsIncrement(SpyCounterEarlyRejects);
+			return FLT_PREOP_SUCCESS_NO_CALLBACK;
+		}
+	}
+	else if (Data->Iopb->MajorFunction == IRP_MJ_CLOSE && FlagOn(pagingIoPolicy, PAGING_IO_REPORT_DIRTY_ONCE))
+	{
+		SpySetReportedStream(FltObjects, FALSE);
+	}
+
 	CONTINUE_IF_MATCHES(MiniFSWatcherData.WatchProcess, PsGetCurrentProcessId());
 
 	CONTINUE_IF_MATCHES(MiniFSWatcherData.WatchThread, PsGetCurrentThreadId());
 
+	if (SpyIsExcludedProcess())
+	{
+		SpyStatisticsIncrement(SpyCounterEarlyRejects);
+		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+	}
+
+	//
+	//  Writes may leave their name to the deferred name work item, which
+	//  also marks their stream and captures their attributes
+	//
+
+	if (Data->Iopb->MajorFunction == IRP_MJ_WRITE && MiniFSWatcherData.DeferWriteNames && MiniFSWatcherData.DeferredWorkItem != NULL
+		&& SpyDeferWriteName(FltObjects, CompletionContext))
+	{
+		return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+	}
+
 	if (Data->Iopb->MajorFunction == IRP_MJ_SET_INFORMATION && Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileRenameInformation)
 	{
 		PFILE_RENAME_INFORMATION info = (PFILE_RENAME_INFORMATION)Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
+		isRename = TRUE;
 		if (info != NULL)
 		{
 			targetNameStatus = FltGetDestinationFileNameInformation(FltObjects->Instance, FltObjects->FileObject, info->RootDirectory, info->FileName, info->FileNameLength, FLT_FILE_NAME_NORMALIZED | MiniFSWatcherData.NameQueryMethod, &targetNameInfo);
+
+			SpyStatisticsIncrement(SpyCounterNameQueries);
+			if (!NT_SUCCESS(targetNameStatus))
+			{
+				SpyStatisticsIncrement(SpyCounterNameQueryFailures);
+			}
 		}
 	}
 
 	nameStatus = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | MiniFSWatcherData.NameQueryMethod, &nameInfo);
+
+	SpyStatisticsIncrement(SpyCounterNameQueries);
+	if (!NT_SUCCESS(nameStatus))
+	{
+		SpyStatisticsIncrement(SpyCounterNameQueryFailures);
+	}
 	
-	if ((NT_SUCCESS(nameStatus) && SpyIsWatchedPath(&nameInfo->Name))
-		|| (NT_SUCCESS(targetNameStatus) && SpyIsWatchedPath(&targetNameInfo->Name)))
+	sourceWatched = NT_SUCCESS(nameStatus) && SpyIsWatchedPath(&nameInfo->Name);
+	targetWatched = NT_SUCCESS(targetNameStatus) && SpyIsWatchedPath(&targetNameInfo->Name);
+
+	if (sourceWatched || targetWatched)
+	{
+		isDirectory = SpyIsDirectory(Data, FltObjects);
+
+		//
+		//  Directories have no extension to filter on, and their renames
+		//  are still needed to follow moved subtrees
+		//
+
+		if (!isDirectory)
+		{
+			sourceWatched = sourceWatched && SpyIsWatchedExtension(&nameInfo->Name);
+			targetWatched = targetWatched && SpyIsWatchedExtension(&targetNameInfo->Name);
+		}
+	}
+
+	if (sourceWatched || targetWatched)
 	{
 		recordList = SpyNewRecord();
 
 		if (recordList) 
 		{
-			USHORT offset = SpyAddRecordName(&recordList->LogRecord, &nameInfo->Name, 0);
+			PCUNICODE_STRING names[MAX_RECORD_NAMES];
+			ULONG nameCount = 0;
+
+			//
+			//  The source name may be missing if only the target matched
+			//
+
+			names[nameCount++] = (nameInfo != NULL) ? &nameInfo->Name : NULL;
 			if (NT_SUCCESS(targetNameStatus) && targetNameInfo != NULL)
 			{
-				SpyAddRecordName(&recordList->LogRecord, &targetNameInfo->Name, offset);
+				names[nameCount++] = &targetNameInfo->Name;
+			}
+
+			SpyPackRecordNames(&recordList->LogRecord, names, nameCount);
+
+			if (isDirectory)
+			{
+				SetFlag(recordList->LogRecord.Data.Flags, RECORD_FLAG_DIRECTORY);
+			}
+
+			//
+			//  The pre-operation callback only takes IDs cached in the stream
+			//  context.  The file object of a create is not opened yet, other
+			//  operations on streams without IDs are synchronized below, their
+			//  post-operation callback queries them.  Closes, cleanups and
+			//  paging I/O must not issue new I/O on the file object, they go
+			//  without IDs if none are cached.
+			//
+
+			if (Data->Iopb->MajorFunction != IRP_MJ_CREATE && !SpyLogCachedFileIds(FltObjects, recordList))
+			{
+				queryIds = SpyMayQueryFileIds(Data);
 			}
 
 			SpyLogPreOperationData(recordList);
 
 			*CompletionContext = recordList;
-			returnStatus = FLT_PREOP_SUCCESS_WITH_CALLBACK;
+
+			//
+			//  Renames are synchronized, so that their post-operation callback
+			//  runs at passive level and can query the file IDs, and so are
+			//  operations on streams whose IDs are not cached yet. So are writes
+			//  if their attributes are to be logged or their stream is to be
+			//  marked as reported.  With PAGING_IO_REPORT_DIRTY_ONCE, that is
+			//  only the first write to a stream.
+			//
+
+			if (isRename || (Data->Iopb->MajorFunction == IRP_MJ_WRITE && MiniFSWatcherData.CaptureAttributes) || markReported || queryIds)
+			{
+				returnStatus = FLT_PREOP_SYNCHRONIZE;
+			}
+			else
+			{
+				returnStatus = FLT_PREOP_SUCCESS_WITH_CALLBACK;
+			}
 		}
 	}
 
@@ -787,8 +1198,8 @@ Arguments:
         to this operation.
 
     CompletionContext - Pointer to the RECORD_LIST structure in which we
-        store the information we are logging.  This was passed from the
-        pre-operation callback
+        store the information we are logging, or a tagged deferred write.
+        This was passed from the pre-operation callback
 
     Flags - Contains information as to why this routine was called.
 
@@ -800,22 +1211,76 @@ Return Value:
 {
     PRECORD_LIST recordList;
 
+	if (CompletionContext == NULL)
+	{
+		return FLT_POSTOP_FINISHED_PROCESSING;
+	}
+
+	if (SPY_IS_DEFERRED_WRITE(CompletionContext))
+	{
+		SpyCompleteDeferredWrite(Data, FltObjects, CompletionContext, Flags);
+		return FLT_POSTOP_FINISHED_PROCESSING;
+	}
+
     recordList = (PRECORD_LIST)CompletionContext;
 
-	if (recordList == NULL)
+    if (FlagOn(Flags,FLTFL_POST_OPERATION_DRAINING))
 	{
+		SpyStatisticsIncrement(SpyCounterDroppedDraining);
+		SpyFreeRecord(recordList);
 		return FLT_POSTOP_FINISHED_PROCESSING;
 	}
 
-    if (FlagOn(Flags,FLTFL_POST_OPERATION_DRAINING) || !NT_SUCCESS(Data->IoStatus.Status)
+    if (!NT_SUCCESS(Data->IoStatus.Status)
 		|| (recordList->LogRecord.Data.EventType = SpyGetEventType(Data, FltObjects)) == FILE_SYSTEM_EVENT_UNKNOWN)
 	{
         SpyFreeRecord( recordList );
         return FLT_POSTOP_FINISHED_PROCESSING;
     }
 
+	//
+	//  Creates, and operations on streams without cached IDs, which the
+	//  pre-operation callback synchronized, get their IDs here
+	//
+
+	if (Data->Iopb->MajorFunction == IRP_MJ_CREATE
+		|| (SpyMayQueryFileIds(Data) && recordList->LogRecord.Data.FileId.LowPart == 0 && recordList->LogRecord.Data.FileId.HighPart == 0
+			&& KeGetCurrentIrql() == PASSIVE_LEVEL))
+	{
+		SpyLogFileIds( FltObjects, recordList );
+	}
+
+	if (recordList->LogRecord.Data.EventType == FILE_SYSTEM_EVENT_MOVE)
+	{
+		SpyLogParentId( FltObjects, recordList );
+
+		if (FlagOn(recordList->LogRecord.Data.Flags, RECORD_FLAG_DIRECTORY))
+		{
+			recordList->LogRecord.Data.EventType = FILE_SYSTEM_EVENT_MOVE_SUBTREE;
+		}
+	}
+
+	if (MiniFSWatcherData.CaptureAttributes
+		&& (recordList->LogRecord.Data.EventType == FILE_SYSTEM_EVENT_CREATE || recordList->LogRecord.Data.EventType == FILE_SYSTEM_EVENT_CHANGE))
+	{
+		SpyLogAttributes( FltObjects, recordList );
+	}
+
+	//
+	//  Only successful writes are marked, failed ones returned above.  The
+	//  pre-operation callback synchronized the write if the policy was set
+	//  then, the policy may have been turned on since.
+	//
+
+	if (Data->Iopb->MajorFunction == IRP_MJ_WRITE && FlagOn(MiniFSWatcherData.PagingIoPolicy, PAGING_IO_REPORT_DIRTY_ONCE)
+		&& KeGetCurrentIrql() <= APC_LEVEL)
+	{
+		SpySetReportedStream( FltObjects, TRUE );
+	}
+
     SpyLogPostOperationData( FltObjects, recordList );
-    SpyLog( recordList );
+
+	SpyLogOrSettle( recordList );
 
     return FLT_POSTOP_FINISHED_PROCESSING;
 }
@@ -26,6 +26,7 @@ Environment:
 #define FILE_SYSTEM_EVENT_CHANGE  3
 #define FILE_SYSTEM_EVENT_MOVE    4
 #define FILE_SYSTEM_EVENT_CLOSE   5
+#define FILE_SYSTEM_EVENT_MOVE_SUBTREE 6
 
 #define DOS_DEVICE_PREFIX_LENGTH 4
 
@@ -40,8 +41,8 @@ Environment:
 //  Version definition
 //
 
-#define MINIFSWATCHER_MAJ_VERSION 2
-#define MINIFSWATCHER_MIN_VERSION 0
+#define MINIFSWATCHER_MAJ_VERSION 5
+#define MINIFSWATCHER_MIN_VERSION 9
 
 typedef struct _MINIFSWATCHERVER {
 
@@ -81,6 +82,25 @@ typedef _Return_type_success_(return >= 0) LONG NTSTATUS;
 #define RECORD_TYPE_FLAG_OUT_OF_MEMORY           0x10000000
 #define RECORD_TYPE_FLAG_MASK                    0xffff0000
 
+//
+//  Flags set in RECORD_DATA.Flags
+//
+
+#define RECORD_FLAG_NAME_TRUNCATED               0x00000001
+#define RECORD_FLAG_DIRECTORY                    0x00000002
+#define RECORD_FLAG_ATTRIBUTES                   0x00000004
+
+//
+//  File system ID of a file, 64 bit IDs (NTFS) are stored in LowPart
+//
+
+typedef struct _RECORD_FILE_ID {
+
+    ULONGLONG LowPart;
+    ULONGLONG HighPart;
+
+} RECORD_FILE_ID, *PRECORD_FILE_ID;
+
 //
 //  The fixed data received for RECORD_TYPE_NORMAL
 //
@@ -94,6 +114,31 @@ typedef struct _RECORD_DATA {
     ULONG Flags;
 
     FILE_ID ProcessId;
+
+    //
+    //  Identify the file independent of its name. ParentId is only set for
+    //  FILE_SYSTEM_EVENT_MOVE and FILE_SYSTEM_EVENT_MOVE_SUBTREE
+    //
+
+    ULONGLONG VolumeSerialNumber;
+    RECORD_FILE_ID FileId;
+    RECORD_FILE_ID ParentId;
+
+    //
+    //  State of the file after the operation, only valid if
+    //  RECORD_FLAG_ATTRIBUTES is set.  See PARAMETER_CAPTURE_ATTRIBUTES.
+    //
+
+    LONGLONG FileSize;
+    LARGE_INTEGER LastWriteTime;
+    ULONG FileAttributes;
+
+    //
+    //  Identifies the executable of the process, 0 if unknown.  Resolved
+    //  with the GetProcessNames command.
+    //
+
+    ULONG ProcessToken;
 } RECORD_DATA, *PRECORD_DATA;
 
 //
@@ -148,7 +193,13 @@ typedef enum _MINIFSWATCHER_COMMAND {
     GetMiniSpyVersion,
 	SetWatchProcess,
 	SetWatchThread,
-	SetPathFilter
+	SetPathFilter,
+	GetStatistics,
+	SetParameters,
+	RunBenchmark,
+	GetProcessNames,
+	SetProcessFilter,
+	SetExtensionFilter
 
 } MINIFSWATCHER_COMMAND;
 
@@ -167,6 +218,189 @@ typedef struct _COMMAND_MESSAGE {
 
 #pragma warning(pop)
 
+//
+//  Runtime statistics returned by the GetStatistics command.  All counters
+//  are cumulative since the driver was loaded and are summed over all
+//  processors.  Latencies are counted in log2 buckets of 100ns units, i.e.
+//  bucket N holds latencies in [2^N, 2^(N+1)), bucket 0 also holds 0 and the
+//  last bucket holds everything larger.
+//
+
+#define STATISTICS_LATENCY_BUCKETS  32
+
+typedef struct _MINIFSWATCHER_STATISTICS {
+
+    ULONGLONG CallbacksSeen;            // Pre-operation callbacks entered
+    ULONGLONG EarlyRejects;             // Rejected before any name query
+    ULONGLONG NameQueries;              // Calls to FltGet*FileNameInformation
+    ULONGLONG NameQueryFailures;        // Name queries that did not succeed
+    ULONGLONG RecordsAllocated;         // Records handed out by SpyNewRecord
+    ULONGLONG DroppedExceedAllowance;   // No record, MaxRecords reached
+    ULONGLONG DroppedOutOfMemory;       // No record, pool allocation failed
+    ULONGLONG DroppedDraining;          // Record freed because the instance was draining
+    ULONGLONG QueueDepthHighWater;      // Maximum length of the output list
+    ULONGLONG BytesDelivered;           // Bytes copied to user mode by GetMiniSpyLog
+    ULONGLONG ChangesMerged;            // Changes merged into a waiting one, see PARAMETER_SETTLE_TIME
+    ULONGLONG DroppedDeletePending;     // Deferred write not logged, its file was being deleted
+
+    ULONGLONG PreToPostLatency[STATISTICS_LATENCY_BUCKETS];
+    ULONGLONG PostToDeliveryLatency[STATISTICS_LATENCY_BUCKETS];
+
+} MINIFSWATCHER_STATISTICS, *PMINIFSWATCHER_STATISTICS;
+
+//
+//  Parameters that can be changed at runtime with the SetParameters command.
+//  Only the fields selected in ValidFields are applied, all others keep their
+//  current value.  On success, the effective parameters are written to the
+//  output buffer if one is given.
+//
+
+#define PARAMETER_MAX_RECORDS                   0x00000001
+#define PARAMETER_NAME_QUERY_METHOD             0x00000002
+#define PARAMETER_MAX_RECORDS_PER_BATCH         0x00000004
+#define PARAMETER_BACKPRESSURE_POLICY           0x00000008
+#define PARAMETER_CAPTURE_ATTRIBUTES            0x00000010
+#define PARAMETER_PAGING_IO_POLICY              0x00000020
+#define PARAMETER_DEFER_WRITE_NAMES             0x00000040
+#define PARAMETER_SETTLE_TIME                   0x00000080
+#define PARAMETER_ALL                           0x000000ff
+
+//
+//  What to do with a new event when MaxRecords records are in use.
+//
+
+#define BACKPRESSURE_DROP_NEWEST    0   // Drop the new event (default)
+#define BACKPRESSURE_DROP_OLDEST    1   // Reuse the oldest undelivered record
+
+//
+//  Writes the pre-operation callback drops before it queries any name.
+//  Paging writes only carry data to disk that an earlier cached or mapped
+//  write already changed.  Lazy writer writes are the subset issued by the
+//  cache manager, those of the mapped page writer still pass if only
+//  PAGING_IO_SKIP_LAZY_WRITER is set.  With PAGING_IO_REPORT_DIRTY_ONCE,
+//  only the first write to a stream is reported until one of its file
+//  objects is closed.
+//
+
+#define PAGING_IO_SKIP_PAGING               0x00000001  // IRP_PAGING_IO
+#define PAGING_IO_SKIP_SYNCHRONOUS_PAGING   0x00000002  // IRP_SYNCHRONOUS_PAGING_IO
+#define PAGING_IO_SKIP_LAZY_WRITER          0x00000004  // Writes from the lazy writer
+#define PAGING_IO_REPORT_DIRTY_ONCE         0x00000008  // One change per stream until closed
+#define PAGING_IO_POLICY_ALL                0x0000000f
+
+#define MIN_RECORDS_TO_ALLOCATE     1
+#define MAX_RECORDS_LIMIT           100000
+
+//
+//  Longest time a change may be held back to merge later changes of the
+//  same file, in milliseconds.
+//
+
+#define MAX_SETTLE_TIME             60000
+
+typedef struct _MINIFSWATCHER_PARAMETERS {
+
+    ULONG ValidFields;
+
+    LONG MaxRecordsToAllocate;      // Record budget, see MAX_RECORDS_LIMIT
+    ULONG NameQueryMethod;          // FLT_FILE_NAME_QUERY_* method
+    ULONG MaxRecordsPerBatch;       // Records per GetMiniSpyLog call, 0 is unlimited
+    ULONG BackpressurePolicy;       // BACKPRESSURE_*
+    ULONG CaptureAttributes;        // Non-zero to log the file state with creates and changes
+    ULONG PagingIoPolicy;           // PAGING_IO_* flags
+    ULONG DeferWriteNames;          // Non-zero to name writes after they completed
+    ULONG SettleTime;               // Milliseconds changes of a file are merged, 0 disables
+
+} MINIFSWATCHER_PARAMETERS, *PMINIFSWATCHER_PARAMETERS;
+
+//
+//  Hot path primitives measured by the RunBenchmark command.  The command
+//  takes the number of iterations (ULONG) as input and returns a
+//  MINIFSWATCHER_BENCHMARK with the average cost of each primitive.
+//
+
+typedef enum _BENCHMARK_PRIMITIVE {
+
+    BenchmarkNameCopy,          // SpyPackRecordNames
+    BenchmarkRecordInit,        // Record allocation, initialization and free
+    BenchmarkEventType,         // SpyGetEventType
+    BenchmarkPathMatch,         // SpyIsWatchedPath
+    BenchmarkQueue,             // Output list insert and remove under the spin lock
+    BenchmarkGetLogCopy,        // Record copy as done by SpyGetLog
+    BenchmarkHotPath,           // All of the above for a single event
+    BenchmarkNameFormat,        // _snwprintf("%wZ"), the former name copy
+    BenchmarkProcessLookup,     // SpyIsExcludedProcess and SpyGetProcessToken
+    BenchmarkExtensionTable,    // SpyMatchExtension with 40 extensions
+    BenchmarkExtensionWildcard, // FsRtlIsNameInExpression with 40 "*.ext" expressions
+    BenchmarkPathPrefix,        // SpyMatchPathPrefix with a "<directory>*" watch path
+    BenchmarkPathExpression,    // FsRtlIsNameInExpression with the same watch path
+    BenchmarkMax
+
+} BENCHMARK_PRIMITIVE;
+
+#define MAX_BENCHMARK_ITERATIONS    1000000
+
+typedef struct _MINIFSWATCHER_BENCHMARK {
+
+    ULONG Iterations;
+    ULONG Reserved;
+
+    ULONGLONG Nanoseconds[BenchmarkMax];    // Average per iteration
+
+} MINIFSWATCHER_BENCHMARK, *PMINIFSWATCHER_BENCHMARK;
+
+//
+//  Executable of a process.  The GetProcessNames command takes the last
+//  token known to the client (ULONG) as input and returns the entries of all
+//  newer tokens still cached, oldest first.
+//
+
+#define PROCESS_NAME_LENGTH 32
+
+typedef struct _PROCESS_NAME_ENTRY {
+
+    ULONG Token;
+    ULONG NameHash;                         // FNV-1a of the upcased image path
+    ULONGLONG ProcessId;
+    WCHAR ShortName[PROCESS_NAME_LENGTH];   // Last path component, truncated
+
+} PROCESS_NAME_ENTRY, *PPROCESS_NAME_ENTRY;
+
+//
+//  Input of the SetProcessFilter command.  Patterns holds null terminated
+//  wildcard expressions for the file name of an executable, followed by an
+//  empty one.  By default the events of matching processes are dropped,
+//  with PROCESS_FILTER_INCLUDE only their events are logged.  An empty list
+//  turns the filter off.
+//
+
+#define PROCESS_FILTER_INCLUDE          0x1
+
+#define MAX_PROCESS_FILTER_PATTERNS     64
+#define MAX_PROCESS_FILTER_LENGTH       8192    // Characters of all patterns
+
+#pragma warning(push)
+#pragma warning(disable:4200) // disable warnings for structures with zero length arrays.
+
+typedef struct _PROCESS_FILTER {
+
+    ULONG Flags;
+    WCHAR Patterns[];
+
+} PROCESS_FILTER, *PPROCESS_FILTER;
+
+#pragma warning(pop)
+
+//
+//  Input of the SetExtensionFilter command: null terminated file extensions,
+//  with or without the dot, followed by an empty one.  Only files with one
+//  of these extensions are logged once their path matched, directories are
+//  not affected.  An empty list turns the filter off.
+//
+
+#define MAX_EXTENSION_LENGTH            16
+#define MAX_EXTENSION_FILTER_COUNT      256
+
 //
 //  The maximum number of BYTES that can be used to store the file name in the
 //  RECORD_LIST structure
@@ -212,16 +446,5 @@ typedef struct _COMMAND_MESSAGE {
 #define FlagOn(_F,_SF)        ((_F) & (_SF))
 #endif
 
-#define CONTINUE_IF_MATCHES(_expected, _actual) \
-		if (_expected > 0) { \
-			if (((LONGLONG)_actual) != _expected) { \
-				return FLT_PREOP_SUCCESS_NO_CALLBACK; \
-			} \
-		} else if (_expected < 0) {\
-			 if (((LONGLONG)_actual) == -1 * _expected) { \
-				return FLT_PREOP_SUCCESS_NO_CALLBACK; \
-			 } \
-		}
-
 #endif /* __MINISPY_H__ */
 
@@ -0,0 +1,552 @@
+/*++
+
+Module Name:
+
+    mspyBench.c
+
+Abstract:
+
+    Micro benchmarks for the routines that run for every logged operation.
+    They run inside the driver, so they measure the very code and pool the
+    filter uses.  Records come from a private lookaside list and are set up
+    like SpyNewRecord does, so a benchmark neither takes from the record
+    budget nor reclaims queued records, consumes sequence numbers or shows
+    up in the statistics.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <stdio.h>
+
+#include "mspyKern.h"
+
+//
+//  A typical normalized name as returned by FltGetFileNameInformation
+//
+
+#define BENCHMARK_FILE_NAME L"\\Device\\HarddiskVolume2\\Users\\Benchmark\\Documents\\Projects\\MiniFSWatcher\\Quarterly Report.docx"
+
+//
+//  A typical watch path, and the prefix it is matched as
+//
+
+#define BENCHMARK_WATCH_PATH L"\\DEVICE\\HARDDISKVOLUME2\\USERS\\BENCHMARK\\DOCUMENTS\\*"
+
+//
+//  Office documents and images, as typically passed to SetExtensionFilter
+//
+
+#define BENCHMARK_EXTENSION_COUNT 40
+
+static const WCHAR BenchmarkExtensions[] =
+    L"doc\0dot\0docm\0dotx\0dotm\0rtf\0odt\0ott\0txt\0pdf\0"
+    L"xls\0xlt\0xlsx\0xlsm\0xltx\0xltm\0xlsb\0ods\0csv\0ppt\0"
+    L"pot\0pps\0pptx\0pptm\0potx\0ppsx\0odp\0vsd\0vsdx\0docx\0"
+    L"jpg\0jpeg\0png\0gif\0bmp\0tif\0tiff\0svg\0heic\0webp\0";
+
+static
+ULONG
+SpyBenchmarkFormatName (
+    _Inout_ PLOG_RECORD LogRecord,
+    _In_ PCUNICODE_STRING Name
+    )
+/*++
+
+Routine Description:
+
+    The name copy as it was done before SpyPackRecordNames, kept as the
+    baseline for BenchmarkNameFormat.
+
+--*/
+{
+    PWCHAR printPointer = (PWCHAR)LogRecord->Names;
+    LONG wcharsCopied;
+    ULONG stringLength;
+
+#pragma prefast(suppress:__WARNING_BANNED_API_USAGE, "reviewed and safe usage")
+    wcharsCopied = _snwprintf( printPointer,
+                               MAX_NAME_WCHARS_LESS_NULL,
+                               L"%wZ",
+                               Name );
+
+    if (wcharsCopied >= 0) {
+
+        stringLength = wcharsCopied * sizeof( WCHAR );
+
+    } else {
+
+        stringLength = MAX_NAME_SPACE_LESS_NULL;
+        printPointer[MAX_NAME_WCHARS_LESS_NULL] = UNICODE_NULL;
+    }
+
+    LogRecord->Length = ROUND_TO_SIZE( (sizeof( LOG_RECORD ) +
+                                        stringLength +
+                                        sizeof( UNICODE_NULL )),
+                                       sizeof( PVOID ) );
+
+    return stringLength + sizeof( UNICODE_NULL );
+}
+
+
+static
+PRECORD_LIST
+SpyBenchmarkNewRecord (
+    _In_ PNPAGED_LOOKASIDE_LIST Records
+    )
+/*++
+
+Routine Description:
+
+    Allocates and initializes a record like SpyNewRecord, without budget,
+    sequence number and counters.
+
+--*/
+{
+    PRECORD_LIST recordList;
+
+    recordList = ExAllocateFromNPagedLookasideList( Records );
+
+    if (recordList != NULL) {
+
+        RtlZeroMemory( recordList, sizeof( RECORD_LIST ) );
+        recordList->LogRecord.RecordType = RECORD_TYPE_NORMAL;
+        recordList->LogRecord.Length = sizeof( LOG_RECORD );
+    }
+
+    return recordList;
+}
+
+
+static
+ULONGLONG
+SpyBenchmarkNanoseconds (
+    _In_ LARGE_INTEGER Start,
+    _In_ LARGE_INTEGER End,
+    _In_ LARGE_INTEGER Frequency,
+    _In_ ULONG Iterations
+    )
+{
+    return (ULONGLONG)(((End.QuadPart - Start.QuadPart) * 1000000000LL) / Frequency.QuadPart) / Iterations;
+}
+
+
+NTSTATUS
+SpyRunBenchmark (
+    _In_ ULONG Iterations,
+    _Out_ PMINIFSWATCHER_BENCHMARK Benchmark
+    )
+/*++
+
+Routine Description:
+
+    Runs every hot path primitive Iterations times in isolation and then
+    all of them together, the way a single write is logged.
+
+    The callback data handed to SpyGetEventType is a synthetic non-empty
+    write to a modified file.  The output list operations use a private
+    list and lock, so queued events of the connected client are not
+    touched.
+
+    NOTE:  This code must be NON-PAGED because it acquires spin locks.
+
+Arguments:
+
+    Iterations - Number of iterations per primitive, at most
+        MAX_BENCHMARK_ITERATIONS.
+
+    Benchmark - Receives the average time per iteration.
+
+Return Value:
+
+    STATUS_SUCCESS, STATUS_INVALID_PARAMETER or
+    STATUS_INSUFFICIENT_RESOURCES if no record could be allocated.
+
+--*/
+{
+    FLT_CALLBACK_DATA data;
+    FLT_IO_PARAMETER_BLOCK iopb;
+    FILE_OBJECT fileObject;
+
+#pragma warning(push)
+#pragma warning(disable:4204) // nonstandard extension used: non-constant aggregate initializer
+
+    FLT_RELATED_OBJECTS fltObjects = { sizeof( FLT_RELATED_OBJECTS ), 0, NULL, NULL, NULL, &fileObject, NULL };
+
+#pragma warning(pop)
+
+    UNICODE_STRING name;
+    UNICODE_STRING watchPath;
+    UNICODE_STRING watchPrefix;
+    PCUNICODE_STRING names[1];
+    PSPY_EXTENSION_TABLE extensions;
+    UNICODE_STRING expressions[BENCHMARK_EXTENSION_COUNT];
+    PWCHAR expressionBuffer;
+    PCWCH extension;
+    ULONG length;
+    ULONG j;
+    NPAGED_LOOKASIDE_LIST records;
+    PRECORD_LIST recordList;
+    PRECORD_LIST hotRecord;
+    PVOID copyBuffer;
+    KSPIN_LOCK queueLock;
+    LIST_ENTRY queue;
+    KIRQL oldIrql;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    __volatile ULONG sink = 0;
+    NTSTATUS status;
+    ULONG i;
+
+    if ((Iterations == 0) || (Iterations > MAX_BENCHMARK_ITERATIONS)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory( Benchmark, sizeof( MINIFSWATCHER_BENCHMARK ) );
+    Benchmark->Iterations = Iterations;
+
+    RtlInitUnicodeString( &name, BENCHMARK_FILE_NAME );
+    RtlInitUnicodeString( &watchPath, BENCHMARK_WATCH_PATH );
+    watchPrefix = watchPath;
+    watchPrefix.Length -= sizeof( WCHAR );
+    names[0] = &name;
+
+    RtlZeroMemory( &data, sizeof( data ) );
+    RtlZeroMemory( &iopb, sizeof( iopb ) );
+    RtlZeroMemory( &fileObject, sizeof( fileObject ) );
+
+    data.Iopb = &iopb;
+    iopb.MajorFunction = IRP_MJ_WRITE;
+    iopb.Parameters.Write.Length = PAGE_SIZE;
+    fileObject.Flags = FO_FILE_MODIFIED;
+
+    KeInitializeSpinLock( &queueLock );
+    InitializeListHead( &queue );
+
+    status = SpyBuildExtensionTable( BenchmarkExtensions,
+                                     sizeof( BenchmarkExtensions ) / sizeof( WCHAR ),
+                                     &extensions );
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    //
+    //  The same extensions as "*.EXT" expressions, upcased as
+    //  FsRtlIsNameInExpression expects them when ignoring case
+    //
+
+    expressionBuffer = ExAllocatePoolWithTag( NonPagedPoolNx,
+                                              BENCHMARK_EXTENSION_COUNT * (MAX_EXTENSION_LENGTH + 2) * sizeof( WCHAR ),
+                                              SPY_TAG );
+
+    if (expressionBuffer == NULL) {
+
+        ExFreePoolWithTag( extensions, SPY_TAG );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    extension = BenchmarkExtensions;
+
+    for (i = 0; i < BENCHMARK_EXTENSION_COUNT; i++) {
+
+        length = (ULONG)wcslen( extension );
+
+        expressions[i].Buffer = &expressionBuffer[i * (MAX_EXTENSION_LENGTH + 2)];
+        expressions[i].Buffer[0] = L'*';
+        expressions[i].Buffer[1] = L'.';
+
+        for (j = 0; j < length; j++) {
+
+            expressions[i].Buffer[j + 2] = RtlUpcaseUnicodeChar( extension[j] );
+        }
+
+        expressions[i].Length = (USHORT)((length + 2) * sizeof( WCHAR ));
+        expressions[i].MaximumLength = expressions[i].Length;
+
+        extension += length + 1;
+    }
+
+    copyBuffer = ExAllocatePoolWithTag( NonPagedPoolNx, RECORD_SIZE, SPY_TAG );
+
+    if (copyBuffer == NULL) {
+
+        ExFreePoolWithTag( expressionBuffer, SPY_TAG );
+        ExFreePoolWithTag( extensions, SPY_TAG );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExInitializeNPagedLookasideList( &records,
+                                     NULL,
+                                     NULL,
+                                     POOL_NX_ALLOCATION,
+                                     RECORD_SIZE,
+                                     SPY_TAG,
+                                     0 );
+
+    recordList = SpyBenchmarkNewRecord( &records );
+
+    if (recordList == NULL) {
+
+        ExDeleteNPagedLookasideList( &records );
+        ExFreePoolWithTag( copyBuffer, SPY_TAG );
+        ExFreePoolWithTag( expressionBuffer, SPY_TAG );
+        ExFreePoolWithTag( extensions, SPY_TAG );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeQueryPerformanceCounter( &frequency );
+
+    //
+    //  Name copy
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        sink += SpyPackRecordNames( &recordList->LogRecord, names, 1 );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkNameCopy] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Name copy through the printf formatter, for comparison
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        sink += SpyBenchmarkFormatName( &recordList->LogRecord, &name );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkNameFormat] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Record allocation and initialization
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        hotRecord = SpyBenchmarkNewRecord( &records );
+
+        if (hotRecord != NULL) {
+
+            ExFreeToNPagedLookasideList( &records, hotRecord );
+        }
+    }
+
+    Benchmark->Nanoseconds[BenchmarkRecordInit] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Event classification
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        sink += SpyGetEventType( &data, &fltObjects );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkEventType] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Path matching against the current watch path
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        sink += SpyIsWatchedPath( &name );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkPathMatch] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Process verdict and token of the current process, as looked up for
+    //  every operation
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        sink += SpyIsExcludedProcess();
+        sink += SpyGetProcessToken();
+    }
+
+    Benchmark->Nanoseconds[BenchmarkProcessLookup] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Watch path as a prefix and as a wildcard expression
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        sink += SpyMatchPathPrefix( &name, &watchPrefix );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkPathPrefix] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        sink += FsRtlIsNameInExpression( &watchPath, &name, TRUE, NULL );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkPathExpression] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Extension lookup in the sorted table
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        sink += SpyMatchExtension( extensions, &name );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkExtensionTable] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  The same lookup as a list of wildcard expressions
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        for (j = 0; j < BENCHMARK_EXTENSION_COUNT; j++) {
+
+            if (FsRtlIsNameInExpression( &expressions[j], &name, TRUE, NULL )) {
+
+                sink++;
+                break;
+            }
+        }
+    }
+
+    Benchmark->Nanoseconds[BenchmarkExtensionWildcard] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Queue insert and remove, as in SpyLog and SpyGetLog
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        KeAcquireSpinLock( &queueLock, &oldIrql );
+        InsertTailList( &queue, &recordList->List );
+        KeReleaseSpinLock( &queueLock, oldIrql );
+
+        KeAcquireSpinLock( &queueLock, &oldIrql );
+        RemoveHeadList( &queue );
+        KeReleaseSpinLock( &queueLock, oldIrql );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkQueue] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Record copy into the output buffer
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        RtlCopyMemory( copyBuffer, &recordList->LogRecord, recordList->LogRecord.Length );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkGetLogCopy] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    //
+    //  Everything together for a single logged write
+    //
+
+    start = KeQueryPerformanceCounter( NULL );
+
+    for (i = 0; i < Iterations; i++) {
+
+        if (SpyIsExcludedProcess()) {
+
+            sink++;
+        }
+
+        if (!SpyIsWatchedPath( &name )) {
+
+            sink++;
+        }
+
+        if (!SpyIsWatchedExtension( &name )) {
+
+            sink++;
+        }
+
+        hotRecord = SpyBenchmarkNewRecord( &records );
+
+        if (hotRecord == NULL) {
+
+            continue;
+        }
+
+        SpyPackRecordNames( &hotRecord->LogRecord, names, 1 );
+        SpyLogPreOperationData( hotRecord );
+
+        //
+        //  SpyLogPostOperationData without its latency statistics
+        //
+
+        hotRecord->LogRecord.Data.EventType = SpyGetEventType( &data, &fltObjects );
+        KeQuerySystemTime( &hotRecord->LogRecord.Data.CompletionTime );
+
+        KeAcquireSpinLock( &queueLock, &oldIrql );
+        InsertTailList( &queue, &hotRecord->List );
+        KeReleaseSpinLock( &queueLock, oldIrql );
+
+        KeAcquireSpinLock( &queueLock, &oldIrql );
+        RemoveHeadList( &queue );
+        KeReleaseSpinLock( &queueLock, oldIrql );
+
+        RtlCopyMemory( copyBuffer, &hotRecord->LogRecord, hotRecord->LogRecord.Length );
+        ExFreeToNPagedLookasideList( &records, hotRecord );
+    }
+
+    Benchmark->Nanoseconds[BenchmarkHotPath] =
+        SpyBenchmarkNanoseconds( start, KeQueryPerformanceCounter( NULL ), frequency, Iterations );
+
+    ExFreeToNPagedLookasideList( &records, recordList );
+    ExDeleteNPagedLookasideList( &records );
+    ExFreePoolWithTag( copyBuffer, SPY_TAG );
+    ExFreePoolWithTag( expressionBuffer, SPY_TAG );
+    ExFreePoolWithTag( extensions, SPY_TAG );
+
+    UNREFERENCED_PARAMETER( sink );
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,554 @@
+/*++
+
+Module Name:
+
+    mspyDefer.c
+
+Abstract:
+
+    Deferred name resolution for writes, see PARAMETER_DEFER_WRITE_NAMES.
+
+    Querying the normalized name of every write in the pre-operation
+    callback delays the write itself.  Instead, the pre-operation callback
+    only references the file object and the instance and notes the process
+    and the time.  Completed writes are queued to a single generic work
+    item, which resolves and matches the names of all writes queued since
+    its last wakeup.  Only writes to watched files get a record, together
+    with their file IDs, and are logged.
+
+    The name is the one of the file when the work item runs, not when it
+    was written, so a change can be reported after the rename of its file.
+    Writes to files that were deleted in the meantime are dropped.  The
+    file object is released after the record is logged, so its CLOSE always
+    comes later.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "mspyKern.h"
+
+static
+VOID
+SpyQueueDeferredWrite (
+    _In_ PSPY_DEFERRED_WRITE Write
+    );
+
+static
+VOID
+SpyFreeDeferredWrite (
+    _In_ PSPY_DEFERRED_WRITE Write
+    );
+
+static
+VOID
+SpyResolveDeferredNames (
+    _In_ PFLT_GENERIC_WORKITEM FltWorkItem,
+    _In_ PVOID FltObject,
+    _In_opt_ PVOID Context
+    );
+
+static
+VOID
+SpyResolveDeferredName (
+    _In_ PSPY_DEFERRED_WRITE Write
+    );
+
+//---------------------------------------------------------------------------
+//  Deferred name routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyInitializeDeferredNames (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Allocates the work item resolving deferred names.  Without it, writes
+    are always named in the pre-operation callback.
+
+Return Value:
+
+    STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+
+--*/
+{
+    InitializeListHead( &MiniFSWatcherData.DeferredList );
+    KeInitializeSpinLock( &MiniFSWatcherData.DeferredLock );
+    MiniFSWatcherData.DeferredWorkerQueued = FALSE;
+    MiniFSWatcherData.DeferredWrites = 0;
+
+    ExInitializeNPagedLookasideList( &MiniFSWatcherData.DeferredWriteList,
+                                     NULL,
+                                     NULL,
+                                     POOL_NX_ALLOCATION,
+                                     sizeof( SPY_DEFERRED_WRITE ),
+                                     SPY_TAG,
+                                     0 );
+
+    MiniFSWatcherData.DeferredWorkItem = FltAllocateGenericWorkItem();
+
+    if (MiniFSWatcherData.DeferredWorkItem == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+SpyFreeDeferredNames (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Frees the work item.  The filter must already be unregistered, which
+    waits for the work item to finish, so no write is left queued.
+
+--*/
+{
+    FLT_ASSERT( IsListEmpty( &MiniFSWatcherData.DeferredList ) );
+
+    if (MiniFSWatcherData.DeferredWorkItem != NULL) {
+
+        FltFreeGenericWorkItem( MiniFSWatcherData.DeferredWorkItem );
+        MiniFSWatcherData.DeferredWorkItem = NULL;
+    }
+
+    ExDeleteNPagedLookasideList( &MiniFSWatcherData.DeferredWriteList );
+}
+
+BOOLEAN
+SpyDeferWriteName (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Outptr_result_maybenull_ PVOID *CompletionContext
+    )
+/*++
+
+Routine Description:
+
+    Defers a write without querying its name or IDs.  The write keeps a
+    reference to the file object and the instance until its name was
+    resolved or it is dropped.  No record is allocated yet, writes to
+    files that aren't watched don't count against MaxRecords.
+
+    NOTE:  This code must be NON-PAGED because it is called on the paging
+           path.
+
+Arguments:
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+    CompletionContext - Receives the tagged deferred write.
+
+Return Value:
+
+    TRUE if the write was deferred.  Otherwise, because too many writes
+    are waiting or no memory is left, it has to be named right away.
+
+--*/
+{
+    PSPY_DEFERRED_WRITE write;
+
+    *CompletionContext = NULL;
+
+    if (InterlockedIncrement( &MiniFSWatcherData.DeferredWrites ) > MiniFSWatcherData.MaxRecordsToAllocate) {
+
+        InterlockedDecrement( &MiniFSWatcherData.DeferredWrites );
+        return FALSE;
+    }
+
+    write = ExAllocateFromNPagedLookasideList( &MiniFSWatcherData.DeferredWriteList );
+
+    if (write == NULL) {
+
+        InterlockedDecrement( &MiniFSWatcherData.DeferredWrites );
+        return FALSE;
+    }
+
+    if (!NT_SUCCESS( FltObjectReference( FltObjects->Instance ) )) {
+
+        ExFreeToNPagedLookasideList( &MiniFSWatcherData.DeferredWriteList, write );
+        InterlockedDecrement( &MiniFSWatcherData.DeferredWrites );
+        return FALSE;
+    }
+
+    ObReferenceObject( FltObjects->FileObject );
+    write->Instance = FltObjects->Instance;
+    write->FileObject = FltObjects->FileObject;
+
+    write->ProcessId = (FILE_ID)PsGetCurrentProcessId();
+    write->ProcessToken = SpyGetProcessToken();
+    KeQuerySystemTime( &write->OriginatingTime );
+
+    *CompletionContext = SPY_DEFERRED_WRITE_CONTEXT( write );
+
+    return TRUE;
+}
+
+VOID
+SpyCompleteDeferredWrite (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    )
+/*++
+
+Routine Description:
+
+    Post-operation part of a deferred write.  Writes that changed the file
+    are queued for the work item, all others are dropped.
+
+    NOTE:  This code must be NON-PAGED because it can be called at DPC
+           level.
+
+Arguments:
+
+    Data - Contains information about the given operation.
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+    CompletionContext - The tagged deferred write.
+
+    Flags - Contains information as to why this routine was called.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_DEFERRED_WRITE write = SPY_DEFERRED_WRITE_FROM_CONTEXT( CompletionContext );
+
+    if (FlagOn( Flags, FLTFL_POST_OPERATION_DRAINING )) {
+
+        SpyStatisticsIncrement( SpyCounterDroppedDraining );
+        SpyFreeDeferredWrite( write );
+        return;
+    }
+
+    if (!NT_SUCCESS( Data->IoStatus.Status ) ||
+        SpyGetEventType( Data, FltObjects ) != FILE_SYSTEM_EVENT_CHANGE) {
+
+        SpyFreeDeferredWrite( write );
+        return;
+    }
+
+    KeQuerySystemTime( &write->CompletionTime );
+
+    SpyStatisticsAddLatency( FALSE,
+                             write->OriginatingTime.QuadPart,
+                             write->CompletionTime.QuadPart );
+
+    SpyQueueDeferredWrite( write );
+}
+
+static
+VOID
+SpyQueueDeferredWrite (
+    _In_ PSPY_DEFERRED_WRITE Write
+    )
+/*++
+
+Routine Description:
+
+    Queues a completed write for the work item and wakes it up unless it
+    is already pending.
+
+    NOTE:  This code must be NON-PAGED because it can be called at DPC
+           level and uses a spin-lock.
+
+Arguments:
+
+    Write - The write, its name is not resolved yet.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LIST_ENTRY dropped;
+    BOOLEAN queue;
+    KIRQL oldIrql;
+    NTSTATUS status;
+
+    KeAcquireSpinLock( &MiniFSWatcherData.DeferredLock, &oldIrql );
+
+    InsertTailList( &MiniFSWatcherData.DeferredList, &Write->List );
+    queue = !MiniFSWatcherData.DeferredWorkerQueued;
+    MiniFSWatcherData.DeferredWorkerQueued = TRUE;
+
+    KeReleaseSpinLock( &MiniFSWatcherData.DeferredLock, oldIrql );
+
+    if (!queue) {
+
+        return;
+    }
+
+    status = FltQueueGenericWorkItem( MiniFSWatcherData.DeferredWorkItem,
+                                      MiniFSWatcherData.Filter,
+                                      SpyResolveDeferredNames,
+                                      DelayedWorkQueue,
+                                      NULL );
+
+    if (NT_SUCCESS( status )) {
+
+        return;
+    }
+
+    //
+    //  The filter is being unloaded.  Nobody else will take the queued
+    //  writes, their references must not keep the instances alive.
+    //
+
+    InitializeListHead( &dropped );
+
+    KeAcquireSpinLock( &MiniFSWatcherData.DeferredLock, &oldIrql );
+
+    if (!IsListEmpty( &MiniFSWatcherData.DeferredList )) {
+
+        AppendTailList( &dropped, &MiniFSWatcherData.DeferredList );
+        RemoveEntryList( &MiniFSWatcherData.DeferredList );
+        InitializeListHead( &MiniFSWatcherData.DeferredList );
+    }
+
+    MiniFSWatcherData.DeferredWorkerQueued = FALSE;
+
+    KeReleaseSpinLock( &MiniFSWatcherData.DeferredLock, oldIrql );
+
+    while (!IsListEmpty( &dropped )) {
+
+        SpyFreeDeferredWrite( CONTAINING_RECORD( RemoveHeadList( &dropped ), SPY_DEFERRED_WRITE, List ) );
+    }
+}
+
+static
+VOID
+SpyFreeDeferredWrite (
+    _In_ PSPY_DEFERRED_WRITE Write
+    )
+/*++
+
+Routine Description:
+
+    Releases the references of a deferred write and frees it.
+
+    NOTE:  This code must be NON-PAGED because it can be called at DPC
+           level.
+
+Arguments:
+
+    Write - The write to free.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ObDereferenceObject( Write->FileObject );
+    FltObjectDereference( Write->Instance );
+
+    ExFreeToNPagedLookasideList( &MiniFSWatcherData.DeferredWriteList, Write );
+    InterlockedDecrement( &MiniFSWatcherData.DeferredWrites );
+}
+
+static
+VOID
+SpyResolveDeferredNames (
+    _In_ PFLT_GENERIC_WORKITEM FltWorkItem,
+    _In_ PVOID FltObject,
+    _In_opt_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Work item routine.  Takes all queued writes at once and resolves them,
+    until no more writes were queued in the meantime.
+
+Arguments:
+
+    FltWorkItem - unused
+
+    FltObject - unused
+
+    Context - unused
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LIST_ENTRY batch;
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER( FltWorkItem );
+    UNREFERENCED_PARAMETER( FltObject );
+    UNREFERENCED_PARAMETER( Context );
+
+    for (;;) {
+
+        InitializeListHead( &batch );
+
+        KeAcquireSpinLock( &MiniFSWatcherData.DeferredLock, &oldIrql );
+
+        if (IsListEmpty( &MiniFSWatcherData.DeferredList )) {
+
+            MiniFSWatcherData.DeferredWorkerQueued = FALSE;
+            KeReleaseSpinLock( &MiniFSWatcherData.DeferredLock, oldIrql );
+            return;
+        }
+
+        //
+        //  Move the whole list, AppendTailList takes its head as an entry
+        //
+
+        AppendTailList( &batch, &MiniFSWatcherData.DeferredList );
+        RemoveEntryList( &MiniFSWatcherData.DeferredList );
+        InitializeListHead( &MiniFSWatcherData.DeferredList );
+
+        KeReleaseSpinLock( &MiniFSWatcherData.DeferredLock, oldIrql );
+
+        while (!IsListEmpty( &batch )) {
+
+            SpyResolveDeferredName( CONTAINING_RECORD( RemoveHeadList( &batch ), SPY_DEFERRED_WRITE, List ) );
+        }
+    }
+}
+
+static
+VOID
+SpyResolveDeferredName (
+    _In_ PSPY_DEFERRED_WRITE Write
+    )
+/*++
+
+Routine Description:
+
+    Queries the name of a deferred write and, if the name is watched and
+    the file is not known to be deleted, logs a change with the IDs of the
+    file.  The write is freed in any case.
+
+Arguments:
+
+    Write - The write to resolve.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    //
+    //  The routines logging IDs and attributes only use the instance and
+    //  the file object
+    //
+
+    FLT_RELATED_OBJECTS fltObjects = { sizeof( FLT_RELATED_OBJECTS ),
+                                       0,
+                                       MiniFSWatcherData.Filter,
+                                       NULL,
+                                       Write->Instance,
+                                       Write->FileObject,
+                                       NULL };
+
+    FILE_STANDARD_INFORMATION standardInfo;
+    PFLT_FILE_NAME_INFORMATION nameInfo;
+    PRECORD_LIST recordList = NULL;
+    PRECORD_DATA recordData;
+    PCUNICODE_STRING names[1];
+    NTSTATUS status;
+
+    status = FltGetFileNameInformationUnsafe( Write->FileObject,
+                                              Write->Instance,
+                                              FLT_FILE_NAME_NORMALIZED | MiniFSWatcherData.NameQueryMethod,
+                                              &nameInfo );
+
+    SpyStatisticsIncrement( SpyCounterNameQueries );
+
+    if (!NT_SUCCESS( status )) {
+
+        SpyStatisticsIncrement( SpyCounterNameQueryFailures );
+        SpyFreeDeferredWrite( Write );
+        return;
+    }
+
+    if (SpyIsWatchedPath( &nameInfo->Name ) &&
+        SpyIsWatchedExtension( &nameInfo->Name )) {
+
+        //
+        //  The DELETE of the file may have been logged already.  Only a
+        //  confirmed pending delete drops the write, the query fails with
+        //  STATUS_FILE_CLOSED once the file object was cleaned up and the
+        //  data written is still a change then.
+        //
+
+        status = FltQueryInformationFile( Write->Instance,
+                                          Write->FileObject,
+                                          &standardInfo,
+                                          sizeof( standardInfo ),
+                                          FileStandardInformation,
+                                          NULL );
+
+        if (NT_SUCCESS( status ) && standardInfo.DeletePending) {
+
+            SpyStatisticsIncrement( SpyCounterDroppedDeletePending );
+
+        } else {
+
+            recordList = SpyNewRecord();
+        }
+    }
+
+    if (recordList != NULL) {
+
+        names[0] = &nameInfo->Name;
+        SpyPackRecordNames( &recordList->LogRecord, names, 1 );
+    }
+
+    FltReleaseFileNameInformation( nameInfo );
+
+    if (recordList == NULL) {
+
+        SpyFreeDeferredWrite( Write );
+        return;
+    }
+
+    recordData = &recordList->LogRecord.Data;
+    recordData->EventType = FILE_SYSTEM_EVENT_CHANGE;
+    recordData->ProcessId = Write->ProcessId;
+    recordData->ProcessToken = Write->ProcessToken;
+    recordData->OriginatingTime = Write->OriginatingTime;
+    recordData->CompletionTime = Write->CompletionTime;
+
+    SpyLogFileIds( &fltObjects, recordList );
+
+    if (MiniFSWatcherData.CaptureAttributes) {
+
+        SpyLogAttributes( &fltObjects, recordList );
+    }
+
+    //
+    //  Like a write named in the pre-operation callback, only a logged
+    //  write marks its stream
+    //
+
+    if (FlagOn( MiniFSWatcherData.PagingIoPolicy, PAGING_IO_REPORT_DIRTY_ONCE )) {
+
+        SpySetReportedStream( &fltObjects, TRUE );
+    }
+
+    SpyLogOrSettle( recordList );
+
+    SpyFreeDeferredWrite( Write );
+}
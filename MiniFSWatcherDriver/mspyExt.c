@@ -0,0 +1,390 @@
+/*++
+
+Module Name:
+
+    mspyExt.c
+
+Abstract:
+
+    Extension filter, applied to the final component of a path after it
+    matched the watch path.
+
+    The extensions set with SetExtensionFilter are upcased and kept in a
+    sorted table, so a lookup is a binary search over a few fixed size
+    entries instead of matching a list of wildcard expressions one by one.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "mspyKern.h"
+
+static
+LONG
+SpyCompareExtension (
+    _In_reads_(Length) PCWCH Name,
+    _In_ USHORT Length,
+    _In_ PSPY_EXTENSION Extension
+    );
+
+//---------------------------------------------------------------------------
+//  Extension filter routines
+//---------------------------------------------------------------------------
+
+static
+LONG
+SpyCompareExtension (
+    _In_reads_(Length) PCWCH Name,
+    _In_ USHORT Length,
+    _In_ PSPY_EXTENSION Extension
+    )
+/*++
+
+Routine Description:
+
+    Orders an upcased extension relative to a table entry.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Name - The upcased extension, without the dot.
+
+    Length - Length of Name in characters.
+
+    Extension - The table entry.
+
+Return Value:
+
+    Less than, equal to or greater than zero.
+
+--*/
+{
+    USHORT i;
+
+    for (i = 0; i < Length && i < Extension->Length; i++) {
+
+        if (Name[i] != Extension->Name[i]) {
+
+            return (Name[i] < Extension->Name[i]) ? -1 : 1;
+        }
+    }
+
+    return (LONG)Length - (LONG)Extension->Length;
+}
+
+NTSTATUS
+SpyBuildExtensionTable (
+    _In_reads_(Length) PCWCH Extensions,
+    _In_ ULONG Length,
+    _Outptr_result_maybenull_ PSPY_EXTENSION_TABLE *Table
+    )
+/*++
+
+Routine Description:
+
+    Builds a sorted table from a list of extensions.  A leading dot is
+    ignored, duplicates are only kept once.
+
+Arguments:
+
+    Extensions - Null terminated extensions, followed by an empty one.
+
+    Length - Length of Extensions in characters.
+
+    Table - Receives the table, NULL if the list is empty.  It is freed
+        with ExFreePoolWithTag.
+
+Return Value:
+
+    STATUS_SUCCESS or an error status.
+
+--*/
+{
+    PSPY_EXTENSION_TABLE table;
+    SPY_EXTENSION extension;
+    ULONG count = 0;
+    ULONG offset = 0;
+    ULONG position;
+    ULONG i;
+
+    *Table = NULL;
+
+    if (Length == 0 || Extensions[Length - 1] != UNICODE_NULL) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    //  Count and validate the extensions first
+    //
+
+    while (Extensions[offset] != UNICODE_NULL) {
+
+        if (Extensions[offset] == L'.') {
+
+            offset++;
+        }
+
+        for (i = 0; offset + i < Length && Extensions[offset + i] != UNICODE_NULL; i++) {
+
+            if (Extensions[offset + i] == L'.' || Extensions[offset + i] == L'\\') {
+
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+
+        if (i == 0 || i > MAX_EXTENSION_LENGTH || ++count > MAX_EXTENSION_FILTER_COUNT) {
+
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        offset += i + 1;
+
+        if (offset >= Length) {
+
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    if (count == 0) {
+
+        return STATUS_SUCCESS;
+    }
+
+    table = ExAllocatePoolWithTag( NonPagedPoolNx,
+                                   FIELD_OFFSET( SPY_EXTENSION_TABLE, Entries ) + count * sizeof( SPY_EXTENSION ),
+                                   SPY_TAG );
+
+    if (table == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    table->Count = 0;
+
+    for (offset = 0; Extensions[offset] != UNICODE_NULL; offset += extension.Length + 1) {
+
+        if (Extensions[offset] == L'.') {
+
+            offset++;
+        }
+
+        RtlZeroMemory( &extension, sizeof( extension ) );
+
+        for (i = 0; Extensions[offset + i] != UNICODE_NULL; i++) {
+
+            extension.Name[i] = RtlUpcaseUnicodeChar( Extensions[offset + i] );
+        }
+
+        extension.Length = (USHORT)i;
+
+        //
+        //  Insertion sort, the table is small and only built once
+        //
+
+        for (position = 0; position < table->Count; position++) {
+
+            if (SpyCompareExtension( extension.Name, extension.Length, &table->Entries[position] ) <= 0) {
+
+                break;
+            }
+        }
+
+        if (position < table->Count &&
+            SpyCompareExtension( extension.Name, extension.Length, &table->Entries[position] ) == 0) {
+
+            continue;
+        }
+
+        RtlMoveMemory( &table->Entries[position + 1],
+                       &table->Entries[position],
+                       (table->Count - position) * sizeof( SPY_EXTENSION ) );
+
+        table->Entries[position] = extension;
+        table->Count++;
+    }
+
+    *Table = table;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+SpyMatchExtension (
+    _In_ PSPY_EXTENSION_TABLE Table,
+    _In_ PCUNICODE_STRING Path
+    )
+/*++
+
+Routine Description:
+
+    Tells whether the extension of the final component of a path is in
+    the table.  A stream name after the file name is ignored, so
+    "file.txt:stream.x" matches on "TXT".
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Table - The extension table.
+
+    Path - The path to check.
+
+Return Value:
+
+    TRUE if the extension is in the table.
+
+--*/
+{
+    WCHAR name[MAX_EXTENSION_LENGTH];
+    USHORT end = Path->Length / sizeof( WCHAR );
+    USHORT start;
+    USHORT length;
+    USHORT i;
+    LONG low = 0;
+    LONG high = (LONG)Table->Count - 1;
+    LONG middle;
+    LONG order;
+
+    //
+    //  Find the final component, the file name in it ends at the first
+    //  colon, everything after that is stream name and type
+    //
+
+    for (start = end; start > 0; start--) {
+
+        if (Path->Buffer[start - 1] == L'\\') {
+
+            break;
+        }
+    }
+
+    for (i = start; i < end; i++) {
+
+        if (Path->Buffer[i] == L':') {
+
+            end = i;
+            break;
+        }
+    }
+
+    for (i = end; i > start; i--) {
+
+        if (Path->Buffer[i - 1] == L'.') {
+
+            break;
+        }
+    }
+
+    if (i == start || end - i == 0 || end - i > MAX_EXTENSION_LENGTH) {
+
+        return FALSE;
+    }
+
+    length = (USHORT)(end - i);
+
+    for (end = 0; end < length; end++) {
+
+        name[end] = RtlUpcaseUnicodeChar( Path->Buffer[i + end] );
+    }
+
+    while (low <= high) {
+
+        middle = (low + high) / 2;
+        order = SpyCompareExtension( name, length, &Table->Entries[middle] );
+
+        if (order == 0) {
+
+            return TRUE;
+        }
+
+        if (order < 0) {
+
+            high = middle - 1;
+
+        } else {
+
+            low = middle + 1;
+        }
+    }
+
+    return FALSE;
+}
+
+BOOLEAN
+SpyIsWatchedExtension (
+    _In_ PCUNICODE_STRING Path
+    )
+/*++
+
+Routine Description:
+
+    Checks a path against the current extension filter.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Path - The path to check.
+
+Return Value:
+
+    TRUE if there is no extension filter or the extension is in it.
+
+--*/
+{
+    BOOLEAN result = TRUE;
+
+    if (MiniFSWatcherData.Extensions == NULL) {
+
+        return TRUE;
+    }
+
+    FltAcquirePushLockShared( &MiniFSWatcherData.ExtensionLock );
+
+    if (MiniFSWatcherData.Extensions != NULL) {
+
+        result = SpyMatchExtension( MiniFSWatcherData.Extensions, Path );
+    }
+
+    FltReleasePushLock( &MiniFSWatcherData.ExtensionLock );
+
+    return result;
+}
+
+VOID
+SpyUpdateExtensionFilter (
+    _In_opt_ PSPY_EXTENSION_TABLE Table
+    )
+/*++
+
+Routine Description:
+
+    Replaces the extension filter and frees the previous one.
+
+Arguments:
+
+    Table - The new table, NULL to turn the filter off.  It is owned by the
+        filter afterwards.
+
+--*/
+{
+    PSPY_EXTENSION_TABLE previous;
+
+    FltAcquirePushLockExclusive( &MiniFSWatcherData.ExtensionLock );
+
+    previous = MiniFSWatcherData.Extensions;
+    MiniFSWatcherData.Extensions = Table;
+
+    FltReleasePushLock( &MiniFSWatcherData.ExtensionLock );
+
+    if (previous != NULL) {
+
+        ExFreePoolWithTag( previous, SPY_TAG );
+    }
+}
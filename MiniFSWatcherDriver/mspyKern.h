@@ -31,6 +31,7 @@ Environment:
 //
 
 #define SPY_TAG 'wsfM'
+#define SPY_STREAM_CONTEXT_TAG 'csfM'
 
 //
 //  Win8 define for support of NPFS/MSFS
@@ -39,6 +40,251 @@ Environment:
 //  older ECPs
 //
 
+//---------------------------------------------------------------------------
+//      Statistics
+//---------------------------------------------------------------------------
+
+//
+//  Indices of the plain counters kept per processor.  They map one to one
+//  onto the leading ULONGLONG fields of MINIFSWATCHER_STATISTICS.
+//
+
+typedef enum _SPY_COUNTER {
+
+    SpyCounterCallbacksSeen,
+    SpyCounterEarlyRejects,
+    SpyCounterNameQueries,
+    SpyCounterNameQueryFailures,
+    SpyCounterRecordsAllocated,
+    SpyCounterDroppedExceedAllowance,
+    SpyCounterDroppedOutOfMemory,
+    SpyCounterDroppedDraining,
+    SpyCounterBytesDelivered,
+    SpyCounterChangesMerged,
+    SpyCounterDroppedDeletePending,
+    SpyCounterMax
+
+} SPY_COUNTER;
+
+//
+//  Statistics kept for a single processor.  Each processor only ever touches
+//  its own slot, so the interlocked updates below never contend across
+//  processors; the alignment keeps two slots off the same cache line.
+//
+
+typedef struct DECLSPEC_CACHEALIGN _SPY_CPU_STATISTICS {
+
+    __volatile LONG64 Counters[SpyCounterMax];
+    __volatile LONG64 PreToPostLatency[STATISTICS_LATENCY_BUCKETS];
+    __volatile LONG64 PostToDeliveryLatency[STATISTICS_LATENCY_BUCKETS];
+
+} SPY_CPU_STATISTICS, *PSPY_CPU_STATISTICS;
+
+//
+//  Process image names, see mspyProc.c.  Must be a power of two.
+//
+
+#define SPY_PROCESS_CACHE_SIZE 1024
+#define SPY_PROCESS_WAYS 4
+
+typedef struct _SPY_PROCESS_VERDICT {
+
+    ULONG Generation;
+    BOOLEAN Excluded;
+
+} SPY_PROCESS_VERDICT, *PSPY_PROCESS_VERDICT;
+
+//
+//  Tokens of the process ids hashed to the same bucket.  A free way has
+//  token 0, a full bucket replaces its ways round robin.
+//
+
+typedef struct _SPY_PROCESS_BUCKET {
+
+    ULONG_PTR ProcessIds[SPY_PROCESS_WAYS];
+    ULONG Tokens[SPY_PROCESS_WAYS];
+    ULONG NextVictim;
+
+} SPY_PROCESS_BUCKET, *PSPY_PROCESS_BUCKET;
+
+//
+//  A cached process whose verdict is decided again, see
+//  SpyRefreshProcessVerdicts
+//
+
+typedef struct _SPY_PROCESS_REFRESH {
+
+    HANDLE ProcessId;
+    ULONG Token;
+    ULONG NameHash;
+    BOOLEAN Resolved;
+    BOOLEAN Excluded;
+
+} SPY_PROCESS_REFRESH, *PSPY_PROCESS_REFRESH;
+
+typedef struct _SPY_PROCESS_CACHE {
+
+    KSPIN_LOCK Lock;
+    ULONG LastToken;
+
+    //
+    //  Incremented whenever the process filter changes.  While the verdicts
+    //  of the cached processes are refreshed, those of the previous
+    //  generation still count.
+    //
+
+    ULONG Generation;
+    BOOLEAN Refreshing;
+
+    //
+    //  Token of a process id, the bucket is indexed by a hash of the id
+    //
+
+    SPY_PROCESS_BUCKET TokenByProcess[SPY_PROCESS_CACHE_SIZE / SPY_PROCESS_WAYS];
+
+    //
+    //  Entries indexed by token
+    //
+
+    PROCESS_NAME_ENTRY Entries[SPY_PROCESS_CACHE_SIZE];
+    SPY_PROCESS_VERDICT Verdicts[SPY_PROCESS_CACHE_SIZE];
+
+    //
+    //  Process filter, see SetProcessFilter.  Only used at PASSIVE_LEVEL.
+    //  The filter lock serializes changes of the filter with the refresh
+    //  of the verdicts.
+    //
+
+    EX_PUSH_LOCK FilterLock;
+    EX_PUSH_LOCK PatternLock;
+    __volatile ULONG PatternCount;
+    ULONG PatternFlags;
+    PWCHAR PatternBuffer;
+    UNICODE_STRING Patterns[MAX_PROCESS_FILTER_PATTERNS];
+
+} SPY_PROCESS_CACHE, *PSPY_PROCESS_CACHE;
+
+//
+//  A write whose name is resolved after it completed, see mspyDefer.c.  It
+//  references the file object and the instance until then.  The record is
+//  only allocated once the name is known to be watched.
+//
+
+typedef struct _SPY_DEFERRED_WRITE {
+
+    LIST_ENTRY List;
+
+    PFLT_INSTANCE Instance;
+    PFILE_OBJECT FileObject;
+
+    FILE_ID ProcessId;
+    ULONG ProcessToken;
+    LARGE_INTEGER OriginatingTime;
+    LARGE_INTEGER CompletionTime;
+
+} SPY_DEFERRED_WRITE, *PSPY_DEFERRED_WRITE;
+
+//
+//  The completion context of a deferred write is tagged in its lowest bit,
+//  to tell it from a record.  Both are pool allocations, so the bit is free.
+//
+
+#define SPY_DEFERRED_WRITE_CONTEXT(Write)   ((PVOID)((ULONG_PTR)(Write) | 1))
+#define SPY_IS_DEFERRED_WRITE(Context)      FlagOn( (ULONG_PTR)(Context), 1 )
+#define SPY_DEFERRED_WRITE_FROM_CONTEXT(Context) \
+    ((PSPY_DEFERRED_WRITE)((ULONG_PTR)(Context) & ~(ULONG_PTR)1))
+
+//
+//  Changes waiting to settle, see mspySettle.c.  Both sizes must be powers
+//  of two.  Slot N is protected by lock N modulo SPY_SETTLE_LOCKS, each
+//  lock has a cache line of its own.
+//
+
+#define SPY_SETTLE_TABLE_SIZE   256
+#define SPY_SETTLE_LOCKS        16
+
+typedef struct DECLSPEC_CACHEALIGN _SPY_SETTLE_LOCK {
+
+    KSPIN_LOCK Lock;
+
+} SPY_SETTLE_LOCK, *PSPY_SETTLE_LOCK;
+
+typedef struct _SPY_SETTLE_ENTRY {
+
+    //
+    //  Latest change of the file, NULL if the slot is free.  The file is
+    //  identified by the IDs in the record.
+    //
+
+    PRECORD_LIST Record;
+
+    //
+    //  Closes of the file that completed while its change waited, they are
+    //  logged after it
+    //
+
+    LIST_ENTRY Closes;
+
+    //
+    //  Interrupt time of the first change, the record is logged SettleTime
+    //  after it
+    //
+
+    ULONGLONG FirstChange;
+
+} SPY_SETTLE_ENTRY, *PSPY_SETTLE_ENTRY;
+
+typedef struct _SPY_SETTLE_TABLE {
+
+    SPY_SETTLE_LOCK Locks[SPY_SETTLE_LOCKS];
+    SPY_SETTLE_ENTRY Entries[SPY_SETTLE_TABLE_SIZE];
+
+    //
+    //  Occupied slots
+    //
+
+    __volatile LONG Pending;
+
+    //
+    //  The timer logs settled records, TimerArmed is set from arming it
+    //  until its DPC starts
+    //
+
+    KTIMER Timer;
+    KDPC Dpc;
+    __volatile LONG TimerArmed;
+
+    //
+    //  Set when the table is freed, the timer is not armed anymore
+    //
+
+    __volatile LONG ShuttingDown;
+
+} SPY_SETTLE_TABLE, *PSPY_SETTLE_TABLE;
+
+//
+//  Extension filter, see mspyExt.c.  Entries are upcased and sorted.
+//
+
+typedef struct _SPY_EXTENSION {
+
+    USHORT Length;
+    WCHAR Name[MAX_EXTENSION_LENGTH];
+
+} SPY_EXTENSION, *PSPY_EXTENSION;
+
+#pragma warning(push)
+#pragma warning(disable:4200) // disable warnings for structures with zero length arrays.
+
+typedef struct _SPY_EXTENSION_TABLE {
+
+    ULONG Count;
+    SPY_EXTENSION Entries[];
+
+} SPY_EXTENSION_TABLE, *PSPY_EXTENSION_TABLE;
+
+#pragma warning(pop)
+
 //---------------------------------------------------------------------------
 //      Global variables
 //---------------------------------------------------------------------------
@@ -77,6 +323,14 @@ typedef struct _MINISPY_DATA {
     KSPIN_LOCK OutputBufferLock;
     LIST_ENTRY OutputBufferList;
 
+    //
+    //  Number of records on OutputBufferList and the largest value it has
+    //  reached.  Both are protected by OutputBufferLock.
+    //
+
+    ULONG OutputBufferCount;
+    ULONG OutputBufferHighWater;
+
     //
     //  Lookaside list used for allocating buffers.
     //
@@ -120,6 +374,63 @@ typedef struct _MINISPY_DATA {
 
     ULONG NameQueryMethod;
 
+    //
+    //  Maximum number of records returned by one GetMiniSpyLog call, zero
+    //  for as many as fit into the output buffer.
+    //
+
+    ULONG MaxRecordsPerBatch;
+
+    //
+    //  BACKPRESSURE_* policy applied once MaxRecordsToAllocate is reached.
+    //
+
+    ULONG BackpressurePolicy;
+
+    //
+    //  Whether size, last write time and attributes are logged with creates
+    //  and changes.  Writes are synchronized while this is set, so that
+    //  their post-operation callback can query the file.
+    //
+
+    ULONG CaptureAttributes;
+
+    //
+    //  PAGING_IO_* flags selecting the writes that are not logged.  A
+    //  stream counts as reported while the ReportedGeneration of its stream
+    //  context equals this one, so that a new client does not inherit the
+    //  state of the previous one.
+    //
+
+    ULONG PagingIoPolicy;
+    __volatile LONG ReportedGeneration;
+
+    //
+    //  Whether the names of writes are resolved by a work item after they
+    //  completed instead of in the pre-operation callback.  Completed
+    //  writes wait in DeferredList until then, DeferredWorkerQueued is set
+    //  while the work item is queued or running.  At most
+    //  MaxRecordsToAllocate writes are deferred at once, DeferredWrites
+    //  counts them.
+    //
+
+    ULONG DeferWriteNames;
+    LIST_ENTRY DeferredList;
+    KSPIN_LOCK DeferredLock;
+    BOOLEAN DeferredWorkerQueued;
+    PFLT_GENERIC_WORKITEM DeferredWorkItem;
+    NPAGED_LOOKASIDE_LIST DeferredWriteList;
+    __volatile LONG DeferredWrites;
+
+    //
+    //  Milliseconds a change waits in the settle table for more changes of
+    //  its file, zero to log changes right away.  The table is NULL if it
+    //  could not be allocated.
+    //
+
+    ULONG SettleTime;
+    PSPY_SETTLE_TABLE SettleTable;
+
     //
     //  Global debug flags
     //
@@ -130,9 +441,37 @@ typedef struct _MINISPY_DATA {
 
 	LONGLONG WatchThread;
 
+	//
+	//  Upcased watch path.  If it is a directory followed by a single
+	//  asterisk, WatchPrefix points to the directory part of its buffer.
+	//
+
+	EX_PUSH_LOCK WatchPathLock;
+
 	UNICODE_STRING WatchPath;
 
-	__volatile LONG WatchPathInUse;
+	UNICODE_STRING WatchPrefix;
+
+    //
+    //  Per processor statistics, NULL if they could not be allocated.
+    //
+
+    PSPY_CPU_STATISTICS Statistics;
+    ULONG StatisticsCount;
+
+    //
+    //  Process image names, NULL if they could not be allocated.
+    //
+
+    PSPY_PROCESS_CACHE ProcessCache;
+    BOOLEAN ProcessNotifyRegistered;
+
+    //
+    //  Extension filter, NULL if all extensions are logged.
+    //
+
+    EX_PUSH_LOCK ExtensionLock;
+    PSPY_EXTENSION_TABLE Extensions;
 
 } MINIFSWATCHER_DATA, *PMINIFSWATCHER_DATA;
 
@@ -148,6 +487,24 @@ extern MINIFSWATCHER_DATA MiniFSWatcherData;
 #define DEFAULT_NAME_QUERY_METHOD           FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP
 #define NAME_QUERY_METHOD                   L"NameQueryMethod"
 
+#define DEFAULT_MAX_RECORDS_PER_BATCH       0
+#define MAX_RECORDS_PER_BATCH               L"MaxRecordsPerBatch"
+
+#define DEFAULT_BACKPRESSURE_POLICY         BACKPRESSURE_DROP_NEWEST
+#define BACKPRESSURE_POLICY                 L"BackpressurePolicy"
+
+#define DEFAULT_CAPTURE_ATTRIBUTES          0
+#define CAPTURE_ATTRIBUTES                  L"CaptureAttributes"
+
+#define DEFAULT_PAGING_IO_POLICY            0
+#define PAGING_IO_POLICY                    L"PagingIoPolicy"
+
+#define DEFAULT_DEFER_WRITE_NAMES           0
+#define DEFER_WRITE_NAMES                   L"DeferWriteNames"
+
+#define DEFAULT_SETTLE_TIME                 0
+#define SETTLE_TIME                         L"SettleTime"
+
 //---------------------------------------------------------------------------
 //  Registration structure
 //---------------------------------------------------------------------------
@@ -189,6 +546,16 @@ SpyReadDriverParameters (
     _In_ PUNICODE_STRING RegistryPath
     );
 
+NTSTATUS
+SpySetParameters (
+    _In_ PMINIFSWATCHER_PARAMETERS Parameters
+    );
+
+VOID
+SpyGetParameters (
+    _Out_ PMINIFSWATCHER_PARAMETERS Parameters
+    );
+
 LONG
 SpyExceptionFilter (
     _In_ PEXCEPTION_POINTERS ExceptionPointer,
@@ -209,6 +576,186 @@ SpyFreeBuffer (
     _In_ PVOID Buffer
     );
 
+//---------------------------------------------------------------------------
+//  Statistics routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyInitializeStatistics (
+    VOID
+    );
+
+VOID
+SpyFreeStatistics (
+    VOID
+    );
+
+VOID
+SpyStatisticsAdd (
+    _In_ SPY_COUNTER Counter,
+    _In_ LONG64 Value
+    );
+
+#define SpyStatisticsIncrement(_counter) SpyStatisticsAdd( (_counter), 1 )
+
+VOID
+SpyStatisticsAddLatency (
+    _In_ BOOLEAN PostToDelivery,
+    _In_ LONGLONG Start,
+    _In_ LONGLONG End
+    );
+
+VOID
+SpyGetStatistics (
+    _Out_ PMINIFSWATCHER_STATISTICS Statistics
+    );
+
+//
+//  Returns from the pre-operation callback unless _actual is watched by the
+//  process or thread filter _expected, see SetWatchProcess.  Rejects are
+//  counted as early rejects.
+//
+
+#define CONTINUE_IF_MATCHES(_expected, _actual) \
+		if (_expected > 0) { \
+			if (((LONGLONG)_actual) != _expected) { \
+				SpyStatisticsIncrement(SpyCounterEarlyRejects); \
+				return FLT_PREOP_SUCCESS_NO_CALLBACK; \
+			} \
+		} else if (_expected < 0) {\
+			 if (((LONGLONG)_actual) == -1 * _expected) { \
+				SpyStatisticsIncrement(SpyCounterEarlyRejects); \
+				return FLT_PREOP_SUCCESS_NO_CALLBACK; \
+			 } \
+		}
+
+//---------------------------------------------------------------------------
+//  Process cache routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyInitializeProcessCache (
+    VOID
+    );
+
+VOID
+SpyFreeProcessCache (
+    VOID
+    );
+
+ULONG
+SpyGetProcessToken (
+    VOID
+    );
+
+BOOLEAN
+SpyIsExcludedProcess (
+    VOID
+    );
+
+NTSTATUS
+SpySetProcessFilter (
+    _In_ ULONG Flags,
+    _In_reads_opt_(Length) PWCHAR Patterns,
+    _In_ ULONG Length
+    );
+
+ULONG
+SpyCopyProcessNames (
+    _In_ ULONG AfterToken,
+    _Out_writes_(Count) PPROCESS_NAME_ENTRY Entries,
+    _In_ ULONG Count
+    );
+
+//---------------------------------------------------------------------------
+//  Extension filter routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyBuildExtensionTable (
+    _In_reads_(Length) PCWCH Extensions,
+    _In_ ULONG Length,
+    _Outptr_result_maybenull_ PSPY_EXTENSION_TABLE *Table
+    );
+
+BOOLEAN
+SpyMatchExtension (
+    _In_ PSPY_EXTENSION_TABLE Table,
+    _In_ PCUNICODE_STRING Path
+    );
+
+BOOLEAN
+SpyIsWatchedExtension (
+    _In_ PCUNICODE_STRING Path
+    );
+
+VOID
+SpyUpdateExtensionFilter (
+    _In_opt_ PSPY_EXTENSION_TABLE Table
+    );
+
+//---------------------------------------------------------------------------
+//  Deferred name routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyInitializeDeferredNames (
+    VOID
+    );
+
+VOID
+SpyFreeDeferredNames (
+    VOID
+    );
+
+BOOLEAN
+SpyDeferWriteName (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Outptr_result_maybenull_ PVOID *CompletionContext
+    );
+
+VOID
+SpyCompleteDeferredWrite (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    );
+
+//---------------------------------------------------------------------------
+//  Settle table routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyInitializeSettleTable (
+    VOID
+    );
+
+VOID
+SpyFreeSettleTable (
+    VOID
+    );
+
+VOID
+SpyFlushSettleTable (
+    VOID
+    );
+
+VOID
+SpyLogOrSettle (
+    _In_ PRECORD_LIST RecordList
+    );
+
+//---------------------------------------------------------------------------
+//  Benchmark routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyRunBenchmark (
+    _In_ ULONG Iterations,
+    _Out_ PMINIFSWATCHER_BENCHMARK Benchmark
+    );
+
 //---------------------------------------------------------------------------
 //  Logging routines
 //---------------------------------------------------------------------------
@@ -224,19 +771,88 @@ ULONG SpyGetEventType(
 
 BOOLEAN SpyIsWatchedPath(_In_ PUNICODE_STRING path);
 
+BOOLEAN
+SpyMatchPathPrefix (
+    _In_ PCUNICODE_STRING Path,
+    _In_ PCUNICODE_STRING Prefix
+    );
+
+BOOLEAN
+SpyIsDirectory (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+    );
+
 BOOLEAN SpyUpdateWatchedPath(_In_ PUNICODE_STRING path);
 
+BOOLEAN
+SpyIsSkippedWrite (
+    _In_ ULONG Policy,
+    _In_ ULONG IrpFlags,
+    _In_opt_ PIRP TopLevelIrp
+    );
+
+BOOLEAN
+SpyIsReportedStream (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+    );
+
+VOID
+SpySetReportedStream (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ BOOLEAN Reported
+    );
+
+PRECORD_LIST
+SpyReclaimOldestRecord (
+    VOID
+    );
+
 VOID
 SpyFreeRecord (
     _In_ PRECORD_LIST Record
     );
 
-USHORT
-SpyAddRecordName(
-	_Inout_ PLOG_RECORD LogRecord,
-	_In_ PUNICODE_STRING Name,
-	_In_ USHORT ByteOffset
-);
+//
+//  A record holds at most the source and the target name of a rename
+//
+
+#define MAX_RECORD_NAMES 2
+
+//
+//  Longest name of a single link we expect when querying parent IDs
+//
+
+#define MAX_LINK_NAME_LENGTH 256
+
+//
+//  IDs of a stream, queried once and then kept as its stream context.
+//  The layout up to FileId matches FILE_ID_INFORMATION, which is only
+//  declared for Windows 8 and later, so is the FileIdInformation class.
+//
+
+typedef struct _SPY_STREAM_CONTEXT {
+
+    ULONGLONG VolumeSerialNumber;
+    RECORD_FILE_ID FileId;
+
+    //
+    //  MiniFSWatcherData.ReportedGeneration once a write was reported, see
+    //  PAGING_IO_REPORT_DIRTY_ONCE
+    //
+
+    __volatile LONG ReportedGeneration;
+
+} SPY_STREAM_CONTEXT, *PSPY_STREAM_CONTEXT;
+
+#define SPY_FILE_ID_INFORMATION ((FILE_INFORMATION_CLASS)59)
+
+ULONG
+SpyPackRecordNames (
+    _Inout_ PLOG_RECORD LogRecord,
+    _In_reads_(NameCount) PCUNICODE_STRING *Names,
+    _In_ ULONG NameCount
+    );
 
 VOID
 SpyLogPreOperationData (
@@ -249,11 +865,45 @@ SpyLogPostOperationData (
     _Inout_ PRECORD_LIST RecordList
     );
 
+BOOLEAN
+SpyMayQueryFileIds (
+    _In_ PFLT_CALLBACK_DATA Data
+    );
+
+BOOLEAN
+SpyLogCachedFileIds (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PRECORD_LIST RecordList
+    );
+
+VOID
+SpyLogFileIds (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PRECORD_LIST RecordList
+    );
+
+VOID
+SpyLogParentId (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PRECORD_LIST RecordList
+    );
+
+VOID
+SpyLogAttributes (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PRECORD_LIST RecordList
+    );
+
 VOID
 SpyLog (
     _In_ PRECORD_LIST RecordList
     );
 
+VOID
+SpyFreeRecordList (
+    _Inout_ PLIST_ENTRY ListHead
+    );
+
 NTSTATUS
 SpyGetLog (
     _Out_writes_bytes_to_(OutputBufferLength,*ReturnOutputBufferLength) PUCHAR OutputBuffer,
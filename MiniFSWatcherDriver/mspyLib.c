@@ -18,6 +18,10 @@ Environment:
 #include <initguid.h>
 #include <stdio.h>
 
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+
 #include "mspyKern.h"
 
 //
@@ -29,11 +33,31 @@ Environment:
 #include <wsk.h>
 #endif
 
+//---------------------------------------------------------------------------
+//  Local function prototypes
+//---------------------------------------------------------------------------
+
+static
+BOOLEAN
+SpyReadRegistryValue (
+    _In_ HANDLE Key,
+    _In_ PCWSTR Name,
+    _Out_ PULONG Value
+    );
+
+static
+NTSTATUS
+SpyQueryFileIds (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Out_ PSPY_STREAM_CONTEXT Ids
+    );
+
 //---------------------------------------------------------------------------
 //  Assign text sections for each routine.
 //---------------------------------------------------------------------------
 
 #ifdef ALLOC_PRAGMA
+    #pragma alloc_text(INIT, SpyReadRegistryValue)
     #pragma alloc_text(INIT, SpyReadDriverParameters)
 #endif
 
@@ -206,6 +230,231 @@ Return Value:
 }
 
 
+//---------------------------------------------------------------------------
+//                    Statistics routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyInitializeStatistics (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Allocates one statistics slot per possible processor.  Statistics are
+    optional: if this fails, the driver keeps working and the counters stay
+    at zero.
+
+Return Value:
+
+    STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+
+--*/
+{
+    ULONG count = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+
+    MiniFSWatcherData.Statistics = ExAllocatePoolWithTag( NonPagedPoolNx,
+                                                          count * sizeof( SPY_CPU_STATISTICS ),
+                                                          SPY_TAG );
+
+    if (MiniFSWatcherData.Statistics == NULL) {
+
+        MiniFSWatcherData.StatisticsCount = 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( MiniFSWatcherData.Statistics, count * sizeof( SPY_CPU_STATISTICS ) );
+    MiniFSWatcherData.StatisticsCount = count;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+SpyFreeStatistics (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Frees the per processor statistics.
+
+--*/
+{
+    if (MiniFSWatcherData.Statistics != NULL) {
+
+        ExFreePoolWithTag( MiniFSWatcherData.Statistics, SPY_TAG );
+        MiniFSWatcherData.Statistics = NULL;
+        MiniFSWatcherData.StatisticsCount = 0;
+    }
+}
+
+
+static
+PSPY_CPU_STATISTICS
+SpyCurrentCpuStatistics (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Returns the statistics slot of the current processor.  The caller may be
+    rescheduled to another processor afterwards, which is why all updates to
+    the slot are interlocked; they just rarely contend.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+--*/
+{
+    ULONG index;
+
+    if (MiniFSWatcherData.Statistics == NULL) {
+
+        return NULL;
+    }
+
+    index = KeGetCurrentProcessorNumberEx( NULL );
+
+    return &MiniFSWatcherData.Statistics[index % MiniFSWatcherData.StatisticsCount];
+}
+
+
+VOID
+SpyStatisticsAdd (
+    _In_ SPY_COUNTER Counter,
+    _In_ LONG64 Value
+    )
+/*++
+
+Routine Description:
+
+    Adds Value to the given counter of the current processor.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+--*/
+{
+    PSPY_CPU_STATISTICS cpuStatistics = SpyCurrentCpuStatistics();
+
+    if (cpuStatistics != NULL) {
+
+        InterlockedAdd64( &cpuStatistics->Counters[Counter], Value );
+    }
+}
+
+
+VOID
+SpyStatisticsAddLatency (
+    _In_ BOOLEAN PostToDelivery,
+    _In_ LONGLONG Start,
+    _In_ LONGLONG End
+    )
+/*++
+
+Routine Description:
+
+    Counts the latency between two system times in the matching log2 bucket
+    of the pre-to-post or the post-to-delivery histogram.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    PostToDelivery - TRUE for the post-to-delivery histogram, FALSE for the
+        pre-to-post histogram.
+
+    Start, End - System times in 100ns units.
+
+--*/
+{
+    PSPY_CPU_STATISTICS cpuStatistics = SpyCurrentCpuStatistics();
+    LONGLONG latency = End - Start;
+    ULONG bucket = 0;
+
+    if (cpuStatistics == NULL) {
+
+        return;
+    }
+
+    if (latency > MAXLONG) {
+
+        bucket = STATISTICS_LATENCY_BUCKETS - 1;
+
+    } else if (latency > 1) {
+
+        BitScanReverse( &bucket, (ULONG)latency );
+    }
+
+    if (PostToDelivery) {
+
+        InterlockedIncrement64( &cpuStatistics->PostToDeliveryLatency[bucket] );
+
+    } else {
+
+        InterlockedIncrement64( &cpuStatistics->PreToPostLatency[bucket] );
+    }
+}
+
+
+VOID
+SpyGetStatistics (
+    _Out_ PMINIFSWATCHER_STATISTICS Statistics
+    )
+/*++
+
+Routine Description:
+
+    Sums the statistics of all processors.  The result is not a consistent
+    snapshot, counters may move while they are being read.
+
+Arguments:
+
+    Statistics - Receives the aggregated statistics.
+
+--*/
+{
+    PSPY_CPU_STATISTICS cpuStatistics;
+    KIRQL oldIrql;
+    ULONG cpu;
+    ULONG i;
+
+    RtlZeroMemory( Statistics, sizeof( MINIFSWATCHER_STATISTICS ) );
+
+    for (cpu = 0; cpu < MiniFSWatcherData.StatisticsCount; cpu++) {
+
+        cpuStatistics = &MiniFSWatcherData.Statistics[cpu];
+
+        Statistics->CallbacksSeen += cpuStatistics->Counters[SpyCounterCallbacksSeen];
+        Statistics->EarlyRejects += cpuStatistics->Counters[SpyCounterEarlyRejects];
+        Statistics->NameQueries += cpuStatistics->Counters[SpyCounterNameQueries];
+        Statistics->NameQueryFailures += cpuStatistics->Counters[SpyCounterNameQueryFailures];
+        Statistics->RecordsAllocated += cpuStatistics->Counters[SpyCounterRecordsAllocated];
+        Statistics->DroppedExceedAllowance += cpuStatistics->Counters[SpyCounterDroppedExceedAllowance];
+        Statistics->DroppedOutOfMemory += cpuStatistics->Counters[SpyCounterDroppedOutOfMemory];
+        Statistics->DroppedDraining += cpuStatistics->Counters[SpyCounterDroppedDraining];
+        Statistics->BytesDelivered += cpuStatistics->Counters[SpyCounterBytesDelivered];
+        Statistics->ChangesMerged += cpuStatistics->Counters[SpyCounterChangesMerged];
+        Statistics->DroppedDeletePending += cpuStatistics->Counters[SpyCounterDroppedDeletePending];
+
+        for (i = 0; i < STATISTICS_LATENCY_BUCKETS; i++) {
+
+            Statistics->PreToPostLatency[i] += cpuStatistics->PreToPostLatency[i];
+            Statistics->PostToDeliveryLatency[i] += cpuStatistics->PostToDeliveryLatency[i];
+        }
+    }
+
+    KeAcquireSpinLock( &MiniFSWatcherData.OutputBufferLock, &oldIrql );
+    Statistics->QueueDepthHighWater = MiniFSWatcherData.OutputBufferHighWater;
+    KeReleaseSpinLock( &MiniFSWatcherData.OutputBufferLock, oldIrql );
+}
+
+
 //---------------------------------------------------------------------------
 //                    Logging routines
 //---------------------------------------------------------------------------
@@ -218,8 +467,8 @@ SpyNewRecord (
 
 Routine Description:
 
-    Allocates a new RECORD_LIST structure if there is enough memory to do so. A
-    sequence number is updated for each request for a new record.
+    Allocates a new RECORD_LIST structure if there is enough memory to do so.
+    The record gets its sequence number when it is logged.
 
     NOTE:  This code must be NON-PAGED because it can be called on the
            paging path or at DPC level.
@@ -243,6 +492,24 @@ Return Value:
 
     newRecord = SpyAllocateBuffer( &initialRecordType );
 
+    if ((newRecord == NULL) &&
+        (initialRecordType == RECORD_TYPE_FLAG_EXCEED_MEMORY_ALLOWANCE) &&
+        (MiniFSWatcherData.BackpressurePolicy == BACKPRESSURE_DROP_OLDEST)) {
+
+        //
+        //  Sacrifice the oldest undelivered record for the new event.  The
+        //  flag tells user mode that an event was lost.
+        //
+
+        newRecord = SpyReclaimOldestRecord();
+
+        if (newRecord != NULL) {
+
+            SpyStatisticsIncrement( SpyCounterDroppedExceedAllowance );
+            initialRecordType |= (newRecord->LogRecord.RecordType & RECORD_TYPE_FLAG_STATIC);
+        }
+    }
+
     if (newRecord == NULL) {
 
         //
@@ -269,14 +536,70 @@ Return Value:
 
         newRecord->LogRecord.RecordType = initialRecordType;
         newRecord->LogRecord.Length = sizeof(LOG_RECORD);
-        newRecord->LogRecord.SequenceNumber = InterlockedIncrement( &MiniFSWatcherData.LogSequenceNumber );
+        newRecord->LogRecord.SequenceNumber = 0;
         RtlZeroMemory( &newRecord->LogRecord.Data, sizeof( RECORD_DATA ) );
+
+        SpyStatisticsIncrement( SpyCounterRecordsAllocated );
+
+    } else if (FlagOn( initialRecordType, RECORD_TYPE_FLAG_EXCEED_MEMORY_ALLOWANCE )) {
+
+        SpyStatisticsIncrement( SpyCounterDroppedExceedAllowance );
+
+    } else {
+
+        SpyStatisticsIncrement( SpyCounterDroppedOutOfMemory );
     }
 
     return( newRecord );
 }
 
 
+PRECORD_LIST
+SpyReclaimOldestRecord (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Removes the oldest record from the output list so its buffer can be
+    reused for a new event.  Used by the BACKPRESSURE_DROP_OLDEST policy.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level and uses a spin-lock
+
+Arguments:
+
+    None
+
+Return Value:
+
+    The removed record or NULL if the output list is empty.
+
+--*/
+{
+    PLIST_ENTRY pList = NULL;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock( &MiniFSWatcherData.OutputBufferLock, &oldIrql );
+
+    if (!IsListEmpty( &MiniFSWatcherData.OutputBufferList )) {
+
+        pList = RemoveHeadList( &MiniFSWatcherData.OutputBufferList );
+        MiniFSWatcherData.OutputBufferCount--;
+    }
+
+    KeReleaseSpinLock( &MiniFSWatcherData.OutputBufferLock, oldIrql );
+
+    if (pList == NULL) {
+
+        return NULL;
+    }
+
+    return CONTAINING_RECORD( pList, RECORD_LIST, List );
+}
+
+
 VOID
 SpyFreeRecord (
     _In_ PRECORD_LIST Record
@@ -315,133 +638,474 @@ Return Value:
     }
 }
 
-USHORT
-SpyAddRecordName(
-	_Inout_ PLOG_RECORD LogRecord,
-	_In_ PUNICODE_STRING Name,
-	_In_ USHORT ByteOffset
-)
+ULONG
+SpyPackRecordNames (
+    _Inout_ PLOG_RECORD LogRecord,
+    _In_reads_(NameCount) PCUNICODE_STRING *Names,
+    _In_ ULONG NameCount
+    )
 /*++
 
 Routine Description:
 
-Sets the given file name in the LogRecord.
+    Packs the given names one after another into LogRecord->Names, each
+    followed by a NULL, and updates the record length.
 
-NOTE:  This code must be NON-PAGED because it can be called on the
-paging path.
+    Every name gets its own NULL, even if it had to be truncated or is
+    empty, so user mode always finds NameCount strings.  If the names do
+    not fit, the space is shared fairly: names shorter than their share are
+    copied completely and the rest of the space is split evenly between
+    the longer ones.  RECORD_FLAG_NAME_TRUNCATED tells user mode when this
+    happened.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
 
 Arguments:
 
-LogRecord - The record in which to set the name.
+    LogRecord - The record in which to set the names.
+
+    Names - The names to insert, NULL entries are packed as empty strings.
 
-Name - The name to insert
+    NameCount - Number of entries in Names, at most MAX_RECORD_NAMES.
 
 Return Value:
 
-None.
+    The number of bytes used in LogRecord->Names including the NULLs.
 
 --*/
 {
+    ULONG nameBytes[MAX_RECORD_NAMES];
+    BOOLEAN assigned[MAX_RECORD_NAMES];
+    ULONG remaining;
+    ULONG unassigned;
+    ULONG share;
+    ULONG length;
+    ULONG offset = 0;
+    ULONG i;
+    BOOLEAN progress;
+    PUCHAR names = (PUCHAR)LogRecord->Names;
+
+    FLT_ASSERT( NameCount > 0 && NameCount <= MAX_RECORD_NAMES );
+
+    if (NameCount > MAX_RECORD_NAMES) {
+
+        NameCount = MAX_RECORD_NAMES;
+    }
 
-	PWCHAR printPointer = (PWCHAR)LogRecord->Names;
-	SHORT charsToSkip = ByteOffset / sizeof(WCHAR);
-	SHORT wcharsCopied;
-	USHORT stringLength;
+    //
+    //  Space for the characters, after reserving one NULL per name
+    //
 
-	if (Name == NULL || charsToSkip >= MAX_NAME_WCHARS_LESS_NULL)
-	{
-		return 0;
-	}
+    remaining = MAX_NAME_SPACE - NameCount * sizeof( UNICODE_NULL );
+    unassigned = NameCount;
 
-#pragma prefast(suppress:__WARNING_BANNED_API_USAGE, "reviewed and safe usage")
-	wcharsCopied = (SHORT)_snwprintf(printPointer + charsToSkip,
-		MAX_NAME_WCHARS_LESS_NULL - charsToSkip,
-		L"%wZ",
-		Name);
+    for (i = 0; i < NameCount; i++) {
 
-	if (wcharsCopied >= 0)
-	{
-		stringLength = ByteOffset + (wcharsCopied * sizeof(WCHAR));
-	}
-	else 
-	{
+        nameBytes[i] = (Names[i] == NULL) ? 0 : (Names[i]->Length & ~(sizeof( WCHAR ) - 1));
+        assigned[i] = FALSE;
+    }
 
-		//
-		//  There wasn't enough buffer space, so manually truncate in a NULL
-		//  because we can't trust _snwprintf to do so in that case.
-		//
+    //
+    //  Hand out complete names as long as they fit into an even share of
+    //  what is left, then split the rest between the remaining names.
+    //
 
-		stringLength = MAX_NAME_SPACE_LESS_NULL;
-		printPointer[MAX_NAME_WCHARS_LESS_NULL] = UNICODE_NULL;
-	}
+    do {
 
-	//
-	//  We will always round up log-record length to sizeof(PVOID) so that
-	//  the next log record starts on the right PVOID boundary to prevent
-	//  IA64 alignment faults.  The length of the record of course
-	//  includes the additional NULL at the end.
-	//
+        progress = FALSE;
+        share = (remaining / unassigned) & ~(sizeof( WCHAR ) - 1);
 
-	LogRecord->Length = ROUND_TO_SIZE((sizeof(LOG_RECORD) +
-		stringLength +
-		sizeof(UNICODE_NULL)),
-		sizeof(PVOID));
+        for (i = 0; i < NameCount; i++) {
 
-	FLT_ASSERT(LogRecord->Length <= MAX_LOG_RECORD_LENGTH);
+            if (!assigned[i] && nameBytes[i] <= share) {
 
-	return stringLength + sizeof(UNICODE_NULL);
-}
+                assigned[i] = TRUE;
+                remaining -= nameBytes[i];
+                unassigned--;
+                progress = TRUE;
+            }
+        }
 
-BOOLEAN SpyIsWatchedPath(_In_ PUNICODE_STRING path) 
-{
-	BOOLEAN result = FALSE;
-	if (!InterlockedExchange(&MiniFSWatcherData.WatchPathInUse, TRUE)) 
-	{
-		result = FsRtlIsNameInExpression(&MiniFSWatcherData.WatchPath, path, TRUE, NULL);
-		MiniFSWatcherData.WatchPathInUse = FALSE;
-	}
-	return result;
-}
+    } while (progress && unassigned > 0);
 
-BOOLEAN SpyUpdateWatchedPath(_In_ PUNICODE_STRING path)
-{
-	BOOLEAN result = FALSE;
-	if (!InterlockedExchange(&MiniFSWatcherData.WatchPathInUse, TRUE)) 
-	{
-		if (MiniFSWatcherData.WatchPath.Buffer != NULL) 
-		{
-			RtlFreeUnicodeString(&MiniFSWatcherData.WatchPath);
-		}
-		if (path != NULL && path->Buffer != NULL)
-		{
-			RtlUpcaseUnicodeString(&MiniFSWatcherData.WatchPath, path, TRUE);
-		}
+    for (i = 0; i < NameCount; i++) {
 
-		result = TRUE;
-		MiniFSWatcherData.WatchPathInUse = FALSE;
-	}
-	return result;
-}
+        length = assigned[i] ? nameBytes[i] : share;
 
-ULONG SpyGetEventType(
-	_In_ PFLT_CALLBACK_DATA Data,
-	_In_ PCFLT_RELATED_OBJECTS FltObjects
-)
-{
-	// Get file rename information
-	if (Data->Iopb->MajorFunction == IRP_MJ_SET_INFORMATION) {
+        if (length < nameBytes[i]) {
 
-		if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileRenameInformation) 
-		{
-			return FILE_SYSTEM_EVENT_MOVE;
-		}
-		// Get File delete information
-		else if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileDispositionInformation) 
-		{
-			PFILE_DISPOSITION_INFORMATION info = (PFILE_DISPOSITION_INFORMATION)Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
-			if (info != NULL && info->DeleteFile) 
-			{
-				return FILE_SYSTEM_EVENT_DELETE;
+            SetFlag( LogRecord->Data.Flags, RECORD_FLAG_NAME_TRUNCATED );
+        }
+
+        if (length > 0) {
+
+            RtlCopyMemory( names + offset, Names[i]->Buffer, length );
+        }
+
+        offset += length;
+        *((PWCHAR)(names + offset)) = UNICODE_NULL;
+        offset += sizeof( UNICODE_NULL );
+    }
+
+    //
+    //  We will always round up log-record length to sizeof(PVOID) so that
+    //  the next log record starts on the right PVOID boundary to prevent
+    //  IA64 alignment faults.
+    //
+
+    LogRecord->Length = ROUND_TO_SIZE( sizeof( LOG_RECORD ) + offset, sizeof( PVOID ) );
+
+    FLT_ASSERT( LogRecord->Length <= MAX_LOG_RECORD_LENGTH );
+
+    return offset;
+}
+
+BOOLEAN
+SpyMatchPathPrefix (
+    _In_ PCUNICODE_STRING Path,
+    _In_ PCUNICODE_STRING Prefix
+    )
+/*++
+
+Routine Description:
+
+    Tells whether a path starts with an upcased prefix, ignoring case.
+
+    Runs of ASCII characters are upcased and compared eight at a time with
+    SSE2 on x64.  Everything else is upcased one by one with
+    RtlUpcaseUnicodeChar.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Arguments:
+
+    Path - The path to check.
+
+    Prefix - The upcased prefix.
+
+Return Value:
+
+    TRUE if Path starts with Prefix.
+
+--*/
+{
+    USHORT length = Prefix->Length / sizeof( WCHAR );
+    USHORT i = 0;
+
+#if defined(_M_AMD64)
+    const __m128i nonAscii = _mm_set1_epi16( (SHORT)0xff80 );
+    const __m128i beforeLower = _mm_set1_epi16( L'a' - 1 );
+    const __m128i afterLower = _mm_set1_epi16( L'z' + 1 );
+    const __m128i caseBit = _mm_set1_epi16( 0x20 );
+    __m128i chunk;
+    __m128i lower;
+#endif
+
+    if (Path->Length < Prefix->Length) {
+
+        return FALSE;
+    }
+
+#if defined(_M_AMD64)
+    for (; i + 8 <= length; i += 8) {
+
+        chunk = _mm_loadu_si128( (const __m128i *)&Path->Buffer[i] );
+
+        //
+        //  Leave chunks with non-ASCII characters to the scalar loop
+        //
+
+        if (_mm_movemask_epi8( _mm_cmpeq_epi16( _mm_and_si128( chunk, nonAscii ),
+                                                _mm_setzero_si128() ) ) != 0xffff) {
+
+            break;
+        }
+
+        lower = _mm_and_si128( _mm_cmpgt_epi16( chunk, beforeLower ),
+                               _mm_cmplt_epi16( chunk, afterLower ) );
+        chunk = _mm_sub_epi16( chunk, _mm_and_si128( lower, caseBit ) );
+
+        if (_mm_movemask_epi8( _mm_cmpeq_epi16( chunk,
+                                                _mm_loadu_si128( (const __m128i *)&Prefix->Buffer[i] ) ) ) != 0xffff) {
+
+            return FALSE;
+        }
+    }
+#endif
+
+    for (; i < length; i++) {
+
+        if (RtlUpcaseUnicodeChar( Path->Buffer[i] ) != Prefix->Buffer[i]) {
+
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+BOOLEAN SpyIsWatchedPath(_In_ PUNICODE_STRING path) 
+{
+	BOOLEAN result = FALSE;
+
+	FltAcquirePushLockShared(&MiniFSWatcherData.WatchPathLock);
+
+	if (MiniFSWatcherData.WatchPath.Buffer != NULL)
+	{
+		if (MiniFSWatcherData.WatchPrefix.Buffer != NULL)
+		{
+			result = SpyMatchPathPrefix(path, &MiniFSWatcherData.WatchPrefix);
+		}
+		else
+		{
+			result = FsRtlIsNameInExpression(&MiniFSWatcherData.WatchPath, path, TRUE, NULL);
+		}
+	}
+
+	FltReleasePushLock(&MiniFSWatcherData.WatchPathLock);
+	return result;
+}
+
+BOOLEAN SpyUpdateWatchedPath(_In_ PUNICODE_STRING path)
+{
+	USHORT i;
+
+	FltAcquirePushLockExclusive(&MiniFSWatcherData.WatchPathLock);
+
+	if (MiniFSWatcherData.WatchPath.Buffer != NULL) 
+	{
+		RtlFreeUnicodeString(&MiniFSWatcherData.WatchPath);
+	}
+	RtlInitUnicodeString(&MiniFSWatcherData.WatchPrefix, NULL);
+
+	if (path != NULL && path->Buffer != NULL &&
+		NT_SUCCESS(RtlUpcaseUnicodeString(&MiniFSWatcherData.WatchPath, path, TRUE)))
+	{
+		//
+		//  The usual "<directory>*" expression is a plain prefix match,
+		//  which does not need the general wildcard matcher
+		//
+
+		for (i = 0; i < MiniFSWatcherData.WatchPath.Length / sizeof(WCHAR); i++)
+		{
+			if (FsRtlIsUnicodeCharacterWild(MiniFSWatcherData.WatchPath.Buffer[i]))
+			{
+				break;
+			}
+		}
+
+		if (i > 0 && i + 1 == MiniFSWatcherData.WatchPath.Length / sizeof(WCHAR) &&
+			MiniFSWatcherData.WatchPath.Buffer[i] == L'*')
+		{
+			MiniFSWatcherData.WatchPrefix.Buffer = MiniFSWatcherData.WatchPath.Buffer;
+			MiniFSWatcherData.WatchPrefix.Length = (USHORT)(i * sizeof(WCHAR));
+			MiniFSWatcherData.WatchPrefix.MaximumLength = MiniFSWatcherData.WatchPrefix.Length;
+		}
+	}
+	else
+	{
+		RtlInitUnicodeString(&MiniFSWatcherData.WatchPath, NULL);
+	}
+
+	FltReleasePushLock(&MiniFSWatcherData.WatchPathLock);
+	return TRUE;
+}
+
+BOOLEAN
+SpyIsDirectory (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+    )
+/*++
+
+Routine Description:
+
+    Tells whether the operation targets a directory. For creates, the file
+    object is not opened yet, so the create options are checked instead.
+
+    NOTE:  This must only be called from the pre-operation callback.
+
+Arguments:
+
+    Data - The Data structure that contains the information about the operation.
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+Return Value:
+
+    TRUE if the file is a directory.
+
+--*/
+{
+    BOOLEAN isDirectory = FALSE;
+
+    if (Data->Iopb->MajorFunction == IRP_MJ_CREATE) {
+
+        return BooleanFlagOn( Data->Iopb->Parameters.Create.Options, FILE_DIRECTORY_FILE );
+    }
+
+    if (Data->Iopb->MajorFunction == IRP_MJ_SET_INFORMATION &&
+        NT_SUCCESS( FltIsDirectory( FltObjects->FileObject, FltObjects->Instance, &isDirectory ) )) {
+
+        return isDirectory;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN
+SpyIsSkippedWrite (
+    _In_ ULONG Policy,
+    _In_ ULONG IrpFlags,
+    _In_opt_ PIRP TopLevelIrp
+    )
+/*++
+
+Routine Description:
+
+    Tells whether the paging I/O policy drops a write.  This only looks at
+    its arguments, so the pre-operation callback can decide before it
+    touches the file object.
+
+    NOTE:  This code must be NON-PAGED because it is called on the paging
+           path.
+
+Arguments:
+
+    Policy - PAGING_IO_* flags.
+
+    IrpFlags - The IRP flags of the write.
+
+    TopLevelIrp - The top level IRP of the current thread, the cache manager
+        sets it to FSRTL_CACHE_TOP_LEVEL_IRP for lazy writer writes.
+
+Return Value:
+
+    TRUE if the write is not to be logged.
+
+--*/
+{
+    if (FlagOn( Policy, PAGING_IO_SKIP_LAZY_WRITER ) &&
+        (TopLevelIrp == (PIRP)FSRTL_CACHE_TOP_LEVEL_IRP)) {
+
+        return TRUE;
+    }
+
+    if (!FlagOn( IrpFlags, IRP_PAGING_IO )) {
+
+        return FALSE;
+    }
+
+    return FlagOn( Policy, PAGING_IO_SKIP_PAGING ) ||
+           (FlagOn( Policy, PAGING_IO_SKIP_SYNCHRONOUS_PAGING ) &&
+            FlagOn( IrpFlags, IRP_SYNCHRONOUS_PAGING_IO ));
+}
+
+BOOLEAN
+SpyIsReportedStream (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+    )
+/*++
+
+Routine Description:
+
+    Tells whether a write to the stream was reported since one of its file
+    objects was last closed.  Streams without a stream context never count
+    as reported.
+
+    NOTE:  This code must be NON-PAGED because it is called on the paging
+           path.
+
+Arguments:
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+Return Value:
+
+    TRUE if the stream was reported.
+
+--*/
+{
+    PSPY_STREAM_CONTEXT context;
+    BOOLEAN reported;
+
+    if (!NT_SUCCESS( FltGetStreamContext( FltObjects->Instance,
+                                          FltObjects->FileObject,
+                                          &context ) )) {
+
+        return FALSE;
+    }
+
+    reported = (context->ReportedGeneration == MiniFSWatcherData.ReportedGeneration);
+    FltReleaseContext( context );
+
+    return reported;
+}
+
+VOID
+SpySetReportedStream (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ BOOLEAN Reported
+    )
+/*++
+
+Routine Description:
+
+    Marks the stream as reported or not.  The stream context is created by
+    SpyLogFileIds when the first record of the stream is logged, without
+    it nothing is marked.
+
+    NOTE:  This has to be called at IRQL <= APC_LEVEL, the pre-operation
+           callback synchronizes writes to mark their stream.  It must be
+           NON-PAGED because it is called on the paging path.
+
+Arguments:
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+    Reported - Whether a write was reported.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_STREAM_CONTEXT context;
+
+    if (!NT_SUCCESS( FltGetStreamContext( FltObjects->Instance,
+                                          FltObjects->FileObject,
+                                          &context ) )) {
+
+        return;
+    }
+
+    InterlockedExchange( &context->ReportedGeneration,
+                         Reported ? MiniFSWatcherData.ReportedGeneration : 0 );
+    FltReleaseContext( context );
+}
+
+ULONG SpyGetEventType(
+	_In_ PFLT_CALLBACK_DATA Data,
+	_In_ PCFLT_RELATED_OBJECTS FltObjects
+)
+{
+	// Get file rename information
+	if (Data->Iopb->MajorFunction == IRP_MJ_SET_INFORMATION) {
+
+		if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileRenameInformation) 
+		{
+			return FILE_SYSTEM_EVENT_MOVE;
+		}
+		// Get File delete information
+		else if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileDispositionInformation) 
+		{
+			PFILE_DISPOSITION_INFORMATION info = (PFILE_DISPOSITION_INFORMATION)Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
+			if (info != NULL && info->DeleteFile) 
+			{
+				return FILE_SYSTEM_EVENT_DELETE;
 			}
 		}
 		else if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileAllocationInformation)
@@ -504,37 +1168,532 @@ Return Value:
 
     None.
 
---*/
-{
-    PRECORD_DATA recordData = &RecordList->LogRecord.Data;
+--*/
+{
+    PRECORD_DATA recordData = &RecordList->LogRecord.Data;
+
+    recordData->ProcessId       = (FILE_ID)PsGetCurrentProcessId();
+    recordData->ProcessToken    = SpyGetProcessToken();
+
+    KeQuerySystemTime( &recordData->OriginatingTime );
+}
+
+
+VOID
+SpyLogPostOperationData (
+	_In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    This is called from the post-operation callback routine to copy the
+    necessary information into the log record.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level.
+
+Arguments:
+
+    Data - The Data structure that contains the information we want to record.
+
+    RecordList - Where we want to save the data
+
+Return Value:
+
+    None.
+
+--*/
+{
+	UNREFERENCED_PARAMETER(FltObjects);
+
+    PRECORD_DATA recordData = &RecordList->LogRecord.Data;
+
+    KeQuerySystemTime( &recordData->CompletionTime );
+
+    SpyStatisticsAddLatency( FALSE,
+                             recordData->OriginatingTime.QuadPart,
+                             recordData->CompletionTime.QuadPart );
+}
+
+static
+NTSTATUS
+SpyQueryFileIds (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Out_ PSPY_STREAM_CONTEXT Ids
+    )
+/*++
+
+Routine Description:
+
+    This queries the volume serial number and file ID of a stream. Before
+    Windows 8, FileIdInformation is not available and the 64 bit file ID
+    and the 32 bit volume serial number are queried separately.
+
+    NOTE:  This has to be called at PASSIVE_LEVEL.
+
+Arguments:
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+    Ids - Receives the IDs.
+
+Return Value:
+
+    The status of the query.
+
+--*/
+{
+    FILE_INTERNAL_INFORMATION internalInfo;
+    FILE_FS_VOLUME_INFORMATION volumeInfo;
+    IO_STATUS_BLOCK ioStatus;
+    NTSTATUS status;
+
+    RtlZeroMemory( Ids, sizeof( SPY_STREAM_CONTEXT ) );
+
+    status = FltQueryInformationFile( FltObjects->Instance,
+                                      FltObjects->FileObject,
+                                      Ids,
+                                      RTL_SIZEOF_THROUGH_FIELD( SPY_STREAM_CONTEXT, FileId ),
+                                      SPY_FILE_ID_INFORMATION,
+                                      NULL );
+
+    if (status != STATUS_INVALID_INFO_CLASS && status != STATUS_INVALID_PARAMETER) {
+
+        return status;
+    }
+
+    status = FltQueryInformationFile( FltObjects->Instance,
+                                      FltObjects->FileObject,
+                                      &internalInfo,
+                                      sizeof( internalInfo ),
+                                      FileInternalInformation,
+                                      NULL );
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    Ids->FileId.LowPart = internalInfo.IndexNumber.QuadPart;
+
+    //
+    //  The volume label does not fit, but the serial number comes first
+    //
+
+    status = FltQueryVolumeInformation( FltObjects->Instance,
+                                        &ioStatus,
+                                        &volumeInfo,
+                                        sizeof( volumeInfo ),
+                                        FileFsVolumeInformation );
+
+    if (NT_SUCCESS( status ) || status == STATUS_BUFFER_OVERFLOW) {
+
+        Ids->VolumeSerialNumber = volumeInfo.VolumeSerialNumber;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+SpyMayQueryFileIds (
+    _In_ PFLT_CALLBACK_DATA Data
+    )
+/*++
+
+Routine Description:
+
+    Tells whether the IDs of the file of an operation may be queried.  The
+    file object of a close or cleanup is being torn down, and paging I/O
+    may hold file system resources, so new I/O on the file object could
+    fail or deadlock.
+
+    NOTE:  This code must be NON-PAGED because it is called on the paging
+           path.
+
+Arguments:
+
+    Data - The operation.
+
+Return Value:
+
+    TRUE if SpyLogFileIds may query the IDs for this operation.
+
+--*/
+{
+    return (Data->Iopb->MajorFunction != IRP_MJ_CLOSE) &&
+           (Data->Iopb->MajorFunction != IRP_MJ_CLEANUP) &&
+           !FlagOn( Data->Iopb->IrpFlags, IRP_PAGING_IO );
+}
+
+BOOLEAN
+SpyLogCachedFileIds (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    This stores the volume serial number and the file ID in the log record
+    if they are already cached in the stream context.  Nothing is queried,
+    so this is safe for operations that must not issue new I/O on the file
+    object, like closes and paging I/O.
+
+    NOTE:  This must not be called above APC_LEVEL.
+
+Arguments:
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+    RecordList - Where we want to save the data
+
+Return Value:
+
+    TRUE if the IDs were cached.
+
+--*/
+{
+    PRECORD_DATA recordData = &RecordList->LogRecord.Data;
+    PSPY_STREAM_CONTEXT context;
+
+    if (!NT_SUCCESS( FltGetStreamContext( FltObjects->Instance,
+                                          FltObjects->FileObject,
+                                          &context ) )) {
+
+        return FALSE;
+    }
+
+    recordData->VolumeSerialNumber = context->VolumeSerialNumber;
+    recordData->FileId = context->FileId;
+    FltReleaseContext( context );
+
+    return TRUE;
+}
+
+VOID
+SpyLogFileIds (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    This stores the volume serial number and the file ID in the log record.
+    They are queried once per stream and then taken from its stream context.
+
+    NOTE:  This must not be called above APC_LEVEL and not before the file
+           object has been opened.  Below PASSIVE_LEVEL, only IDs already
+           cached are logged.  Pre-operation callbacks use
+           SpyLogCachedFileIds instead, the query is left to a synchronized
+           post-operation callback or the deferred name work item.
+
+Arguments:
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+    RecordList - Where we want to save the data
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_DATA recordData = &RecordList->LogRecord.Data;
+    PSPY_STREAM_CONTEXT context = NULL;
+    SPY_STREAM_CONTEXT ids;
+    NTSTATUS status;
+
+    status = FltGetStreamContext( FltObjects->Instance,
+                                  FltObjects->FileObject,
+                                  &context );
+
+    if (NT_SUCCESS( status )) {
+
+        recordData->VolumeSerialNumber = context->VolumeSerialNumber;
+        recordData->FileId = context->FileId;
+        FltReleaseContext( context );
+        return;
+    }
+
+    if (KeGetCurrentIrql() != PASSIVE_LEVEL ||
+        !NT_SUCCESS( SpyQueryFileIds( FltObjects, &ids ) )) {
+
+        return;
+    }
+
+    recordData->VolumeSerialNumber = ids.VolumeSerialNumber;
+    recordData->FileId = ids.FileId;
+
+    //
+    //  Some file systems do not support stream contexts, their IDs are
+    //  queried each time
+    //
+
+    if (status != STATUS_NOT_FOUND) {
+
+        return;
+    }
+
+    status = FltAllocateContext( MiniFSWatcherData.Filter,
+                                 FLT_STREAM_CONTEXT,
+                                 sizeof( SPY_STREAM_CONTEXT ),
+                                 NonPagedPool,
+                                 &context );
+
+    if (NT_SUCCESS( status )) {
+
+        *context = ids;
+
+        //
+        //  If another thread was faster, it has set the same IDs
+        //
+
+        (VOID)FltSetStreamContext( FltObjects->Instance,
+                                   FltObjects->FileObject,
+                                   FLT_SET_CONTEXT_KEEP_IF_EXISTS,
+                                   context,
+                                   NULL );
+
+        FltReleaseContext( context );
+    }
+}
+
+VOID
+SpyLogParentId (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    This stores the ID of the parent directory in the log record. The parent
+    is taken from the first link of the file, so files with several hard
+    links report just one of their parents.
+
+    NOTE:  This has to be called at PASSIVE_LEVEL, i.e. from the
+           post-operation callback of a synchronized operation.
+
+Arguments:
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+    RecordList - Where we want to save the data
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_DATA recordData = &RecordList->LogRecord.Data;
+    NTSTATUS status;
+
+    union {
+        FILE_LINKS_INFORMATION Info;
+        UCHAR Buffer[sizeof( FILE_LINKS_INFORMATION ) + MAX_LINK_NAME_LENGTH * sizeof( WCHAR )];
+    } links;
+
+    if (KeGetCurrentIrql() != PASSIVE_LEVEL) {
+
+        return;
+    }
+
+    //
+    //  If the file has more links than fit into the buffer, the first
+    //  entry and thus its parent ID is still returned
+    //
+
+    status = FltQueryInformationFile( FltObjects->Instance,
+                                      FltObjects->FileObject,
+                                      &links,
+                                      sizeof( links ),
+                                      FileHardLinkInformation,
+                                      NULL );
+
+    if ((NT_SUCCESS( status ) || status == STATUS_BUFFER_OVERFLOW) && links.Info.EntriesReturned > 0) {
+
+        recordData->ParentId.LowPart = (ULONGLONG)links.Info.Entry.ParentFileId;
+    }
+}
+
+VOID
+SpyLogAttributes (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    This stores the size, last write time and attributes of the file after
+    the operation in the log record, so that clients can tell whether the
+    content changed without querying the file themselves.
+
+    NOTE:  Nothing is logged above PASSIVE_LEVEL, e.g. for paging writes.
+
+Arguments:
+
+    FltObjects - Pointer to the io objects involved in this operation.
+
+    RecordList - Where we want to save the data
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PRECORD_DATA recordData = &RecordList->LogRecord.Data;
+    FILE_NETWORK_OPEN_INFORMATION info;
+    NTSTATUS status;
+
+    if (KeGetCurrentIrql() != PASSIVE_LEVEL) {
+
+        return;
+    }
+
+    status = FltQueryInformationFile( FltObjects->Instance,
+                                      FltObjects->FileObject,
+                                      &info,
+                                      sizeof( info ),
+                                      FileNetworkOpenInformation,
+                                      NULL );
+
+    if (NT_SUCCESS( status )) {
+
+        recordData->FileSize = info.EndOfFile.QuadPart;
+        recordData->LastWriteTime = info.LastWriteTime;
+        recordData->FileAttributes = info.FileAttributes;
+        SetFlag( recordData->Flags, RECORD_FLAG_ATTRIBUTES );
+    }
+}
+
+VOID
+SpyLog (
+    _In_ PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    This routine inserts the given log record into the list to be sent
+    to the user mode application.  Sequence numbers are assigned here, so
+    they grow in the order records are delivered, no matter in which order
+    their operations completed.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level and uses a spin-lock
+
+Arguments:
+
+    RecordList - The record to append to the MiniSpyData.OutputBufferList
+
+Return Value:
+
+    The function returns STATUS_SUCCESS.
+
+
+
+--*/
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&MiniFSWatcherData.OutputBufferLock, &oldIrql);
+    RecordList->LogRecord.SequenceNumber = InterlockedIncrement( &MiniFSWatcherData.LogSequenceNumber );
+    InsertTailList(&MiniFSWatcherData.OutputBufferList, &RecordList->List);
+
+    MiniFSWatcherData.OutputBufferCount++;
+    if (MiniFSWatcherData.OutputBufferCount > MiniFSWatcherData.OutputBufferHighWater) {
+        MiniFSWatcherData.OutputBufferHighWater = MiniFSWatcherData.OutputBufferCount;
+    }
+
+    KeReleaseSpinLock(&MiniFSWatcherData.OutputBufferLock, oldIrql);
+}
+
+
+static
+VOID
+SpyDetachListPrefix (
+    _Inout_ PLIST_ENTRY ListHead,
+    _In_ PLIST_ENTRY LastEntry,
+    _Out_ PLIST_ENTRY DetachedHead
+    )
+/*++
+
+Routine Description:
+
+    Moves all entries from the first one up to and including LastEntry from
+    ListHead to the new list DetachedHead, keeping their order.
+
+--*/
+{
+    PLIST_ENTRY firstEntry = ListHead->Flink;
+    PLIST_ENTRY nextEntry = LastEntry->Flink;
+
+    ListHead->Flink = nextEntry;
+    nextEntry->Blink = ListHead;
+
+    DetachedHead->Flink = firstEntry;
+    firstEntry->Blink = DetachedHead;
+    DetachedHead->Blink = LastEntry;
+    LastEntry->Flink = DetachedHead;
+}
+
+
+static
+VOID
+SpyReattachList (
+    _Inout_ PLIST_ENTRY ListHead,
+    _Inout_ PLIST_ENTRY DetachedHead
+    )
+/*++
+
+Routine Description:
+
+    Moves all entries of DetachedHead back to the front of ListHead,
+    keeping their order.
+
+--*/
+{
+    PLIST_ENTRY firstEntry = DetachedHead->Flink;
+    PLIST_ENTRY lastEntry = DetachedHead->Blink;
+
+    if (IsListEmpty( DetachedHead )) {
+
+        return;
+    }
+
+    lastEntry->Flink = ListHead->Flink;
+    ListHead->Flink->Blink = lastEntry;
 
-	recordData->Flags			= 0L;
-    recordData->ProcessId       = (FILE_ID)PsGetCurrentProcessId();
+    ListHead->Flink = firstEntry;
+    firstEntry->Blink = ListHead;
 
-    KeQuerySystemTime( &recordData->OriginatingTime );
+    InitializeListHead( DetachedHead );
 }
 
 
 VOID
-SpyLogPostOperationData (
-	_In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _Inout_ PRECORD_LIST RecordList
+SpyFreeRecordList (
+    _Inout_ PLIST_ENTRY ListHead
     )
 /*++
 
 Routine Description:
 
-    This is called from the post-operation callback routine to copy the
-    necessary information into the log record.
+    Frees all records on the given list and returns them to the allocator
+    with a single update of the in use count.
 
-    NOTE:  This code must be NON-PAGED because it can be called on the
-           paging path or at DPC level.
+    NOTE:  This code must be NON-PAGED because it can be called at DPC level.
 
 Arguments:
 
-    Data - The Data structure that contains the information we want to record.
-
-    RecordList - Where we want to save the data
+    ListHead - The list to free, it is empty afterwards.
 
 Return Value:
 
@@ -542,44 +1701,30 @@ Return Value:
 
 --*/
 {
-	UNREFERENCED_PARAMETER(FltObjects);
-
-    PRECORD_DATA recordData = &RecordList->LogRecord.Data;
-	recordData->Flags = 0;
-    KeQuerySystemTime( &recordData->CompletionTime );
-}
-
-VOID
-SpyLog (
-    _In_ PRECORD_LIST RecordList
-    )
-/*++
-
-Routine Description:
-
-    This routine inserts the given log record into the list to be sent
-    to the user mode application.
-
-    NOTE:  This code must be NON-PAGED because it can be called on the
-           paging path or at DPC level and uses a spin-lock
+    PLIST_ENTRY pList;
+    PRECORD_LIST pRecordList;
+    LONG freed = 0;
 
-Arguments:
+    while (!IsListEmpty( ListHead )) {
 
-    RecordList - The record to append to the MiniSpyData.OutputBufferList
+        pList = RemoveHeadList( ListHead );
+        pRecordList = CONTAINING_RECORD( pList, RECORD_LIST, List );
 
-Return Value:
+        if (FlagOn( pRecordList->LogRecord.RecordType, RECORD_TYPE_FLAG_STATIC )) {
 
-    The function returns STATUS_SUCCESS.
+            SpyFreeRecord( pRecordList );
 
+        } else {
 
+            ExFreeToNPagedLookasideList( &MiniFSWatcherData.FreeBufferList, pRecordList );
+            freed++;
+        }
+    }
 
---*/
-{
-    KIRQL oldIrql;
+    if (freed > 0) {
 
-    KeAcquireSpinLock(&MiniFSWatcherData.OutputBufferLock, &oldIrql);
-    InsertTailList(&MiniFSWatcherData.OutputBufferList, &RecordList->List);
-    KeReleaseSpinLock(&MiniFSWatcherData.OutputBufferLock, oldIrql);
+        InterlockedAdd( &MiniFSWatcherData.RecordsAllocated, -freed );
+    }
 }
 
 
@@ -596,6 +1741,10 @@ Routine Description:
     The LOG_RECORDs are variable sizes and are tightly packed in the
     OutputBuffer.
 
+    The records that fit are detached from the output list in a single
+    lock hold and copied without holding the lock, so producers in SpyLog
+    only compete with the drain once per call instead of once per record.
+
     NOTE:  This code must be NON-PAGED because it uses a spin-lock.
 
 Arguments:
@@ -618,16 +1767,34 @@ Return Value:
 --*/
 {
     PLIST_ENTRY pList;
+    PLIST_ENTRY lastEntry = NULL;
+    LIST_ENTRY batch;
+    LIST_ENTRY delivered;
     ULONG bytesWritten = 0;
+    ULONG batchLength = 0;
     PLOG_RECORD pLogRecord;
     NTSTATUS status = STATUS_NO_MORE_ENTRIES;
     PRECORD_LIST pRecordList;
     KIRQL oldIrql;
     BOOLEAN recordsAvailable = FALSE;
+    LARGE_INTEGER deliveryTime;
+    ULONG maxRecords = MiniFSWatcherData.MaxRecordsPerBatch;
+    ULONG recordCount = 0;
+
+    InitializeListHead( &batch );
+    InitializeListHead( &delivered );
+
+    KeQuerySystemTime( &deliveryTime );
 
     KeAcquireSpinLock( &MiniFSWatcherData.OutputBufferLock, &oldIrql );
 
-    while (!IsListEmpty( &MiniFSWatcherData.OutputBufferList ) && (OutputBufferLength > 0)) {
+    //
+    //  Find the longest prefix of the list that fits into the output buffer
+    //
+
+    for (pList = MiniFSWatcherData.OutputBufferList.Flink;
+         pList != &MiniFSWatcherData.OutputBufferList;
+         pList = pList->Flink) {
 
         //
         //  Mark we have records
@@ -635,11 +1802,10 @@ Return Value:
 
         recordsAvailable = TRUE;
 
-        //
-        //  Get the next available record
-        //
+        if ((maxRecords != 0) && (recordCount >= maxRecords)) {
 
-        pList = RemoveHeadList( &MiniFSWatcherData.OutputBufferList );
+            break;
+        }
 
         pRecordList = CONTAINING_RECORD( pList, RECORD_LIST, List );
 
@@ -661,54 +1827,71 @@ Return Value:
         }
 
         //
-        //  Put it back if we've run out of room.
+        //  Stop once we've run out of room.
         //
 
-        if (OutputBufferLength < pLogRecord->Length) {
+        if (OutputBufferLength - batchLength < pLogRecord->Length) {
 
-            InsertHeadList( &MiniFSWatcherData.OutputBufferList, pList );
             break;
         }
 
-        KeReleaseSpinLock( &MiniFSWatcherData.OutputBufferLock, oldIrql );
+        batchLength += pLogRecord->Length;
+        recordCount++;
+        lastEntry = pList;
+    }
 
-        //
-        //  The lock is released, return the data, adjust pointers.
-        //  Protect access to raw user-mode OutputBuffer with an exception handler
-        //
+    if (lastEntry != NULL) {
+
+        SpyDetachListPrefix( &MiniFSWatcherData.OutputBufferList, lastEntry, &batch );
+        MiniFSWatcherData.OutputBufferCount -= recordCount;
+    }
+
+    KeReleaseSpinLock( &MiniFSWatcherData.OutputBufferLock, oldIrql );
+
+    //
+    //  The lock is released, return the data, adjust pointers.
+    //  Protect access to raw user-mode OutputBuffer with an exception handler
+    //
+
+    while (!IsListEmpty( &batch )) {
+
+        pRecordList = CONTAINING_RECORD( batch.Flink, RECORD_LIST, List );
+        pLogRecord = &pRecordList->LogRecord;
 
         try {
             RtlCopyMemory( OutputBuffer, pLogRecord, pLogRecord->Length );
         } except (SpyExceptionFilter( GetExceptionInformation(), TRUE )) {
 
             //
-            //  Put the record back in
+            //  Put the records we could not copy back in
             //
 
             KeAcquireSpinLock( &MiniFSWatcherData.OutputBufferLock, &oldIrql );
-            InsertHeadList( &MiniFSWatcherData.OutputBufferList, pList );
+            SpyReattachList( &MiniFSWatcherData.OutputBufferList, &batch );
+            MiniFSWatcherData.OutputBufferCount += recordCount;
             KeReleaseSpinLock( &MiniFSWatcherData.OutputBufferLock, oldIrql );
 
+            SpyFreeRecordList( &delivered );
+
             return GetExceptionCode();
 
         }
 
         bytesWritten += pLogRecord->Length;
 
-        OutputBufferLength -= pLogRecord->Length;
-
         OutputBuffer += pLogRecord->Length;
 
-        SpyFreeRecord( pRecordList );
+        SpyStatisticsAddLatency( TRUE,
+                                 pLogRecord->Data.CompletionTime.QuadPart,
+                                 deliveryTime.QuadPart );
 
-        //
-        //  Relock the list
-        //
-
-        KeAcquireSpinLock( &MiniFSWatcherData.OutputBufferLock, &oldIrql );
+        InsertTailList( &delivered, RemoveHeadList( &batch ) );
+        recordCount--;
     }
 
-    KeReleaseSpinLock( &MiniFSWatcherData.OutputBufferLock, oldIrql );
+    SpyFreeRecordList( &delivered );
+
+    SpyStatisticsAdd( SpyCounterBytesDelivered, bytesWritten );
 
     //
     //  Set proper status
@@ -763,31 +1946,87 @@ Return Value:
 
 --*/
 {
-    PLIST_ENTRY pList;
-    PRECORD_LIST pRecordList;
+    LIST_ENTRY records;
     KIRQL oldIrql;
 
-    KeAcquireSpinLock( &MiniFSWatcherData.OutputBufferLock, &oldIrql );
-
-    while (!IsListEmpty( &MiniFSWatcherData.OutputBufferList )) {
-
-        pList = RemoveHeadList( &MiniFSWatcherData.OutputBufferList );
-        KeReleaseSpinLock( &MiniFSWatcherData.OutputBufferLock, oldIrql );
+    InitializeListHead( &records );
 
-        pRecordList = CONTAINING_RECORD( pList, RECORD_LIST, List );
+    KeAcquireSpinLock( &MiniFSWatcherData.OutputBufferLock, &oldIrql );
 
-        SpyFreeRecord( pRecordList );
+    if (!IsListEmpty( &MiniFSWatcherData.OutputBufferList )) {
 
-        KeAcquireSpinLock( &MiniFSWatcherData.OutputBufferLock, &oldIrql );
+        SpyDetachListPrefix( &MiniFSWatcherData.OutputBufferList,
+                             MiniFSWatcherData.OutputBufferList.Blink,
+                             &records );
+        MiniFSWatcherData.OutputBufferCount = 0;
     }
 
     KeReleaseSpinLock( &MiniFSWatcherData.OutputBufferLock, oldIrql );
+
+    SpyFreeRecordList( &records );
 }
 
 //---------------------------------------------------------------------------
 //                    Logging routines
 //---------------------------------------------------------------------------
 
+static
+BOOLEAN
+SpyReadRegistryValue (
+    _In_ HANDLE Key,
+    _In_ PCWSTR Name,
+    _Out_ PULONG Value
+    )
+/*++
+
+Routine Description:
+
+    Reads a single REG_DWORD value below the given key.
+
+Arguments:
+
+    Key - Handle of the opened driver key.
+
+    Name - Name of the value to read.
+
+    Value - Receives the value if it exists.
+
+Return Value:
+
+    TRUE if the value was read, FALSE otherwise.
+
+--*/
+{
+    NTSTATUS status;
+    ULONG resultLength;
+    UNICODE_STRING valueName;
+    PKEY_VALUE_PARTIAL_INFORMATION pValuePartialInfo;
+    UCHAR buffer[sizeof( KEY_VALUE_PARTIAL_INFORMATION ) + sizeof( LONG )];
+
+    PAGED_CODE();
+
+    RtlInitUnicodeString( &valueName, Name );
+
+    status = ZwQueryValueKey( Key,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (!NT_SUCCESS( status )) {
+
+        return FALSE;
+    }
+
+    pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+    FLT_ASSERT( pValuePartialInfo->Type == REG_DWORD );
+    *Value = *((PULONG)&(pValuePartialInfo->Data));
+
+    return TRUE;
+}
+
+
 VOID
 SpyReadDriverParameters (
     _In_ PUNICODE_STRING RegistryPath
@@ -803,7 +2042,16 @@ Routine Description:
     This processes the following registry keys:
     hklm\system\CurrentControlSet\Services\Minispy\MaxRecords
     hklm\system\CurrentControlSet\Services\Minispy\NameQueryMethod
+    hklm\system\CurrentControlSet\Services\Minispy\MaxRecordsPerBatch
+    hklm\system\CurrentControlSet\Services\Minispy\BackpressurePolicy
+    hklm\system\CurrentControlSet\Services\Minispy\CaptureAttributes
+    hklm\system\CurrentControlSet\Services\Minispy\PagingIoPolicy
+    hklm\system\CurrentControlSet\Services\Minispy\DeferWriteNames
+    hklm\system\CurrentControlSet\Services\Minispy\SettleTime
 
+    The values are validated like the ones sent with SetParameters, but
+    each one on its own.  An invalid value keeps the default of its
+    parameter only and is reported to the debugger.
 
 Arguments:
 
@@ -819,10 +2067,10 @@ Return Value:
     OBJECT_ATTRIBUTES attributes;
     HANDLE driverRegKey;
     NTSTATUS status;
-    ULONG resultLength;
-    UNICODE_STRING valueName;
-    PKEY_VALUE_PARTIAL_INFORMATION pValuePartialInfo;
-    UCHAR buffer[sizeof( KEY_VALUE_PARTIAL_INFORMATION ) + sizeof( LONG )];
+    MINIFSWATCHER_PARAMETERS parameters;
+    ULONG validFields;
+    ULONG field;
+    ULONG value;
 
     //
     //  Open the registry
@@ -843,46 +2091,244 @@ Return Value:
         return;
     }
 
-    //
-    // Read the MaxRecordsToAllocate entry from the registry
-    //
+    RtlZeroMemory( &parameters, sizeof( parameters ) );
 
-    RtlInitUnicodeString( &valueName, MAX_RECORDS_TO_ALLOCATE );
+    if (SpyReadRegistryValue( driverRegKey, MAX_RECORDS_TO_ALLOCATE, &value )) {
 
-    status = ZwQueryValueKey( driverRegKey,
-                              &valueName,
-                              KeyValuePartialInformation,
-                              buffer,
-                              sizeof(buffer),
-                              &resultLength );
+        parameters.ValidFields |= PARAMETER_MAX_RECORDS;
+        parameters.MaxRecordsToAllocate = (LONG)value;
+    }
 
-    if (NT_SUCCESS( status )) {
+    if (SpyReadRegistryValue( driverRegKey, NAME_QUERY_METHOD, &value )) {
+
+        parameters.ValidFields |= PARAMETER_NAME_QUERY_METHOD;
+        parameters.NameQueryMethod = value;
+    }
+
+    if (SpyReadRegistryValue( driverRegKey, MAX_RECORDS_PER_BATCH, &value )) {
 
-        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
-        FLT_ASSERT( pValuePartialInfo->Type == REG_DWORD );
-        MiniFSWatcherData.MaxRecordsToAllocate = *((PLONG)&(pValuePartialInfo->Data));
+        parameters.ValidFields |= PARAMETER_MAX_RECORDS_PER_BATCH;
+        parameters.MaxRecordsPerBatch = value;
     }
 
+    if (SpyReadRegistryValue( driverRegKey, BACKPRESSURE_POLICY, &value )) {
+
+        parameters.ValidFields |= PARAMETER_BACKPRESSURE_POLICY;
+        parameters.BackpressurePolicy = value;
+    }
+
+    if (SpyReadRegistryValue( driverRegKey, CAPTURE_ATTRIBUTES, &value )) {
+
+        parameters.ValidFields |= PARAMETER_CAPTURE_ATTRIBUTES;
+        parameters.CaptureAttributes = value;
+    }
+
+    if (SpyReadRegistryValue( driverRegKey, PAGING_IO_POLICY, &value )) {
+
+        parameters.ValidFields |= PARAMETER_PAGING_IO_POLICY;
+        parameters.PagingIoPolicy = value;
+    }
+
+    if (SpyReadRegistryValue( driverRegKey, DEFER_WRITE_NAMES, &value )) {
+
+        parameters.ValidFields |= PARAMETER_DEFER_WRITE_NAMES;
+        parameters.DeferWriteNames = value;
+    }
+
+    if (SpyReadRegistryValue( driverRegKey, SETTLE_TIME, &value )) {
+
+        parameters.ValidFields |= PARAMETER_SETTLE_TIME;
+        parameters.SettleTime = value;
+    }
+
+    ZwClose(driverRegKey);
+
     //
-    // Read the NameQueryMethod entry from the registry
+    //  SpySetParameters applies all selected fields or none, so a single
+    //  bad value must not discard the others
     //
 
-    RtlInitUnicodeString( &valueName, NAME_QUERY_METHOD );
+    validFields = parameters.ValidFields;
 
-    status = ZwQueryValueKey( driverRegKey,
-                              &valueName,
-                              KeyValuePartialInformation,
-                              buffer,
-                              sizeof(buffer),
-                              &resultLength );
+    for (field = 1; FlagOn( PARAMETER_ALL, field ); field <<= 1) {
 
-    if (NT_SUCCESS( status )) {
+        if (!FlagOn( validFields, field )) {
+
+            continue;
+        }
+
+        parameters.ValidFields = field;
 
-        pValuePartialInfo = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
-        FLT_ASSERT( pValuePartialInfo->Type == REG_DWORD );
-        MiniFSWatcherData.NameQueryMethod = *((PLONG)&(pValuePartialInfo->Data));
+        if (!NT_SUCCESS( SpySetParameters( &parameters ) )) {
+
+            DbgPrintEx( DPFLTR_IHVDRIVER_ID,
+                        DPFLTR_WARNING_LEVEL,
+                        "MiniFSWatcher: invalid registry parameter 0x%x ignored\n",
+                        field );
+        }
     }
+}
 
-    ZwClose(driverRegKey);
+
+NTSTATUS
+SpySetParameters (
+    _In_ PMINIFSWATCHER_PARAMETERS Parameters
+    )
+/*++
+
+Routine Description:
+
+    Validates the selected parameters and applies them.  Either all selected
+    parameters are applied or none.
+
+    Every parameter is a single aligned ULONG that the logging path reads
+    without a lock, so each one changes atomically.  Records already in use
+    stay valid when the record budget shrinks: SpyAllocateBuffer simply
+    stops handing out new buffers until enough records were delivered, and
+    the lookaside list releases its spare buffers on its own.
+
+Arguments:
+
+    Parameters - The parameters to set.
+
+Return Value:
+
+    STATUS_SUCCESS or STATUS_INVALID_PARAMETER.
+
+--*/
+{
+    if (FlagOn( Parameters->ValidFields, ~PARAMETER_ALL )) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_MAX_RECORDS ) &&
+        ((Parameters->MaxRecordsToAllocate < MIN_RECORDS_TO_ALLOCATE) ||
+         (Parameters->MaxRecordsToAllocate > MAX_RECORDS_LIMIT))) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_NAME_QUERY_METHOD ) &&
+        (Parameters->NameQueryMethod != FLT_FILE_NAME_QUERY_DEFAULT) &&
+        (Parameters->NameQueryMethod != FLT_FILE_NAME_QUERY_CACHE_ONLY) &&
+        (Parameters->NameQueryMethod != FLT_FILE_NAME_QUERY_FILESYSTEM_ONLY) &&
+        (Parameters->NameQueryMethod != FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_MAX_RECORDS_PER_BATCH ) &&
+        (Parameters->MaxRecordsPerBatch > MAX_RECORDS_LIMIT)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_BACKPRESSURE_POLICY ) &&
+        (Parameters->BackpressurePolicy != BACKPRESSURE_DROP_NEWEST) &&
+        (Parameters->BackpressurePolicy != BACKPRESSURE_DROP_OLDEST)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_PAGING_IO_POLICY ) &&
+        FlagOn( Parameters->PagingIoPolicy, ~PAGING_IO_POLICY_ALL )) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_SETTLE_TIME ) &&
+        (Parameters->SettleTime > MAX_SETTLE_TIME)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_MAX_RECORDS )) {
+
+        InterlockedExchange( &MiniFSWatcherData.MaxRecordsToAllocate,
+                             Parameters->MaxRecordsToAllocate );
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_NAME_QUERY_METHOD )) {
+
+        InterlockedExchange( (__volatile LONG *)&MiniFSWatcherData.NameQueryMethod,
+                             (LONG)Parameters->NameQueryMethod );
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_MAX_RECORDS_PER_BATCH )) {
+
+        InterlockedExchange( (__volatile LONG *)&MiniFSWatcherData.MaxRecordsPerBatch,
+                             (LONG)Parameters->MaxRecordsPerBatch );
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_BACKPRESSURE_POLICY )) {
+
+        InterlockedExchange( (__volatile LONG *)&MiniFSWatcherData.BackpressurePolicy,
+                             (LONG)Parameters->BackpressurePolicy );
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_CAPTURE_ATTRIBUTES )) {
+
+        InterlockedExchange( (__volatile LONG *)&MiniFSWatcherData.CaptureAttributes,
+                             (Parameters->CaptureAttributes != 0) );
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_PAGING_IO_POLICY )) {
+
+        //
+        //  Streams reported under the old policy are reported again
+        //
+
+        InterlockedIncrement( &MiniFSWatcherData.ReportedGeneration );
+        InterlockedExchange( (__volatile LONG *)&MiniFSWatcherData.PagingIoPolicy,
+                             (LONG)Parameters->PagingIoPolicy );
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_DEFER_WRITE_NAMES )) {
+
+        InterlockedExchange( (__volatile LONG *)&MiniFSWatcherData.DeferWriteNames,
+                             (Parameters->DeferWriteNames != 0) );
+    }
+
+    if (FlagOn( Parameters->ValidFields, PARAMETER_SETTLE_TIME ) &&
+        (Parameters->SettleTime != MiniFSWatcherData.SettleTime)) {
+
+        //
+        //  Changes held back under the old time are logged now
+        //
+
+        InterlockedExchange( (__volatile LONG *)&MiniFSWatcherData.SettleTime,
+                             (LONG)Parameters->SettleTime );
+        SpyFlushSettleTable();
+    }
+
+    return STATUS_SUCCESS;
 }
 
+
+VOID
+SpyGetParameters (
+    _Out_ PMINIFSWATCHER_PARAMETERS Parameters
+    )
+/*++
+
+Routine Description:
+
+    Returns the parameters currently in effect.
+
+Arguments:
+
+    Parameters - Receives the parameters.
+
+--*/
+{
+    Parameters->ValidFields = PARAMETER_ALL;
+    Parameters->MaxRecordsToAllocate = MiniFSWatcherData.MaxRecordsToAllocate;
+    Parameters->NameQueryMethod = MiniFSWatcherData.NameQueryMethod;
+    Parameters->MaxRecordsPerBatch = MiniFSWatcherData.MaxRecordsPerBatch;
+    Parameters->BackpressurePolicy = MiniFSWatcherData.BackpressurePolicy;
+    Parameters->CaptureAttributes = MiniFSWatcherData.CaptureAttributes;
+    Parameters->PagingIoPolicy = MiniFSWatcherData.PagingIoPolicy;
+    Parameters->DeferWriteNames = MiniFSWatcherData.DeferWriteNames;
+    Parameters->SettleTime = MiniFSWatcherData.SettleTime;
+}
@@ -0,0 +1,991 @@
+/*++
+
+Module Name:
+
+    mspyProc.c
+
+Abstract:
+
+    Cache of process image names.  Records only carry a small token for
+    their process, clients resolve tokens with the GetProcessNames command.
+
+    Every process seen gets a new token.  Entries are kept in a ring indexed
+    by token, so a token stays resolvable until SPY_PROCESS_CACHE_SIZE newer
+    processes were seen, and clients sync incrementally by asking for all
+    tokens after the last one they know.  A set associative table finds the
+    token of a process id, so a few live processes hashing to the same
+    bucket don't evict each other.  Only when a bucket overflows, the
+    process is resolved again and gets a new token.
+
+    Processes are added when they are created and, for processes started
+    before the driver was loaded, on their first logged operation.
+
+    The cache also keeps whether the events of a process are excluded by
+    the image name patterns set with SetProcessFilter.  The verdict is
+    decided once when the process is added, so the pre-operation callback
+    only needs a lookup.  Changing the patterns starts a new generation and
+    decides again for every cached process before SetProcessFilter returns,
+    so operations above PASSIVE_LEVEL, which can't resolve a process, see
+    either the old or the new verdict.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "mspyKern.h"
+
+#define SPY_PROCESS_BUCKET(Cache, ProcessId) \
+    (&(Cache)->TokenByProcess[(((ULONG_PTR)(ProcessId)) >> 2) & (SPY_PROCESS_CACHE_SIZE / SPY_PROCESS_WAYS - 1)])
+#define SPY_TOKEN_SLOT(Token)       ((Token) & (SPY_PROCESS_CACHE_SIZE - 1))
+
+#define FNV_OFFSET_BASIS    2166136261u
+#define FNV_PRIME           16777619u
+
+static
+VOID
+SpyProcessNotify (
+    _In_ HANDLE ParentId,
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Create
+    );
+
+static
+ULONG
+SpyAddProcess (
+    _In_ HANDLE ProcessId,
+    _In_ PEPROCESS Process,
+    _Out_opt_ PBOOLEAN Excluded
+    );
+
+static
+BOOLEAN
+SpyFindProcess (
+    _In_ HANDLE ProcessId,
+    _Out_ PULONG Token,
+    _Out_ PBOOLEAN Excluded
+    );
+
+static
+ULONG
+SpyFindProcessWay (
+    _In_ PSPY_PROCESS_CACHE Cache,
+    _In_ PSPY_PROCESS_BUCKET Bucket,
+    _In_ HANDLE ProcessId
+    );
+
+static
+ULONG
+SpyHashImageName (
+    _In_ PUNICODE_STRING ImageName,
+    _Out_ PUNICODE_STRING FileName
+    );
+
+static
+BOOLEAN
+SpyMatchProcessFilter (
+    _In_ PUNICODE_STRING Name
+    );
+
+static
+VOID
+SpyRefreshProcessVerdicts (
+    _In_ PSPY_PROCESS_CACHE Cache
+    );
+
+static
+VOID
+SpyFreeProcessPatterns (
+    _In_ PSPY_PROCESS_CACHE Cache
+    );
+
+//---------------------------------------------------------------------------
+//  Process cache routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyInitializeProcessCache (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Allocates the process cache and registers for process notifications.
+    Process names are optional: if the cache can't be allocated, records
+    carry no process token.  Without notifications, processes are still
+    added on their first logged operation.
+
+Return Value:
+
+    STATUS_SUCCESS or an error status.
+
+--*/
+{
+    PSPY_PROCESS_CACHE cache;
+    NTSTATUS status;
+
+    cache = ExAllocatePoolWithTag( NonPagedPoolNx,
+                                   sizeof( SPY_PROCESS_CACHE ),
+                                   SPY_TAG );
+
+    if (cache == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( cache, sizeof( SPY_PROCESS_CACHE ) );
+    KeInitializeSpinLock( &cache->Lock );
+    FltInitializePushLock( &cache->FilterLock );
+    FltInitializePushLock( &cache->PatternLock );
+
+    MiniFSWatcherData.ProcessCache = cache;
+
+    status = PsSetCreateProcessNotifyRoutine( SpyProcessNotify, FALSE );
+    MiniFSWatcherData.ProcessNotifyRegistered = NT_SUCCESS( status );
+
+    return status;
+}
+
+VOID
+SpyFreeProcessCache (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Unregisters from process notifications and frees the process cache.
+
+--*/
+{
+    if (MiniFSWatcherData.ProcessNotifyRegistered) {
+
+        PsSetCreateProcessNotifyRoutine( SpyProcessNotify, TRUE );
+        MiniFSWatcherData.ProcessNotifyRegistered = FALSE;
+    }
+
+    if (MiniFSWatcherData.ProcessCache != NULL) {
+
+        SpyFreeProcessPatterns( MiniFSWatcherData.ProcessCache );
+        FltDeletePushLock( &MiniFSWatcherData.ProcessCache->PatternLock );
+        FltDeletePushLock( &MiniFSWatcherData.ProcessCache->FilterLock );
+        ExFreePoolWithTag( MiniFSWatcherData.ProcessCache, SPY_TAG );
+        MiniFSWatcherData.ProcessCache = NULL;
+    }
+}
+
+static
+VOID
+SpyProcessNotify (
+    _In_ HANDLE ParentId,
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Create
+    )
+/*++
+
+Routine Description:
+
+    Adds new processes to the cache and stops mapping the ids of exited
+    processes to their token.  The entries of exited processes are kept,
+    records still waiting for delivery refer to them.
+
+    NOTE:  This code must be NON-PAGED because it uses a spin-lock.
+
+Arguments:
+
+    ParentId - unused
+
+    ProcessId - The process created or exited.
+
+    Create - TRUE if the process has been created.
+
+--*/
+{
+    PSPY_PROCESS_CACHE cache = MiniFSWatcherData.ProcessCache;
+    PSPY_PROCESS_BUCKET bucket;
+    PEPROCESS process;
+    KIRQL oldIrql;
+    ULONG way;
+
+    UNREFERENCED_PARAMETER( ParentId );
+
+    if (cache == NULL) {
+
+        return;
+    }
+
+    if (Create) {
+
+        if (NT_SUCCESS( PsLookupProcessByProcessId( ProcessId, &process ) )) {
+
+            SpyAddProcess( ProcessId, process, NULL );
+            ObDereferenceObject( process );
+        }
+
+        return;
+    }
+
+    bucket = SPY_PROCESS_BUCKET( cache, ProcessId );
+
+    KeAcquireSpinLock( &cache->Lock, &oldIrql );
+
+    way = SpyFindProcessWay( cache, bucket, ProcessId );
+    if (way < SPY_PROCESS_WAYS) {
+
+        bucket->Tokens[way] = 0;
+    }
+
+    KeReleaseSpinLock( &cache->Lock, oldIrql );
+}
+
+static
+ULONG
+SpyAddProcess (
+    _In_ HANDLE ProcessId,
+    _In_ PEPROCESS Process,
+    _Out_opt_ PBOOLEAN Excluded
+    )
+/*++
+
+Routine Description:
+
+    Resolves the image name of a process and adds it with a new token,
+    together with its verdict for the current process filter.
+
+    NOTE:  This has to be called at PASSIVE_LEVEL, but must be NON-PAGED
+           because it uses a spin-lock.
+
+Arguments:
+
+    ProcessId - The id of the process.
+
+    Process - The process.
+
+    Excluded - Receives whether the events of the process are excluded.
+
+Return Value:
+
+    The token of the process, 0 if its name could not be resolved.
+
+--*/
+{
+    PSPY_PROCESS_CACHE cache = MiniFSWatcherData.ProcessCache;
+    PSPY_PROCESS_BUCKET bucket = SPY_PROCESS_BUCKET( cache, ProcessId );
+    PUNICODE_STRING imageName = NULL;
+    PROCESS_NAME_ENTRY newEntry;
+    UNICODE_STRING fileName;
+    BOOLEAN excluded;
+    KIRQL oldIrql;
+    ULONG token;
+    ULONG way;
+    ULONG i;
+
+    if (Excluded != NULL) {
+
+        *Excluded = FALSE;
+    }
+
+    if (!NT_SUCCESS( SeLocateProcessImageName( Process, &imageName ) )) {
+
+        return 0;
+    }
+
+    RtlZeroMemory( &newEntry, sizeof( newEntry ) );
+    newEntry.ProcessId = (ULONGLONG)ProcessId;
+    newEntry.NameHash = SpyHashImageName( imageName, &fileName );
+
+    for (i = 0; i < fileName.Length / sizeof( WCHAR ) && i < PROCESS_NAME_LENGTH - 1; i++) {
+
+        newEntry.ShortName[i] = fileName.Buffer[i];
+    }
+
+    //
+    //  Patterns are matched against the whole file name, not the
+    //  truncated short name.  The pattern lock is held until the verdict
+    //  is stored, so a change of the filter either sees the process or
+    //  happens before it is matched.
+    //
+
+    FltAcquirePushLockShared( &cache->PatternLock );
+
+    excluded = SpyMatchProcessFilter( &fileName );
+
+    ExFreePool( imageName );
+
+    KeAcquireSpinLock( &cache->Lock, &oldIrql );
+
+    token = ++cache->LastToken;
+    if (token == 0) {
+
+        token = ++cache->LastToken;
+    }
+
+    newEntry.Token = token;
+    cache->Entries[SPY_TOKEN_SLOT( token )] = newEntry;
+    cache->Verdicts[SPY_TOKEN_SLOT( token )].Generation = cache->Generation;
+    cache->Verdicts[SPY_TOKEN_SLOT( token )].Excluded = excluded;
+
+    //
+    //  Reuse the way of the process, then a free or stale way, before
+    //  evicting another process
+    //
+
+    way = SpyFindProcessWay( cache, bucket, ProcessId );
+
+    for (i = 0; i < SPY_PROCESS_WAYS && way >= SPY_PROCESS_WAYS; i++) {
+
+        if (bucket->Tokens[i] == 0 ||
+            cache->Entries[SPY_TOKEN_SLOT( bucket->Tokens[i] )].Token != bucket->Tokens[i]) {
+
+            way = i;
+        }
+    }
+
+    if (way >= SPY_PROCESS_WAYS) {
+
+        way = bucket->NextVictim;
+        bucket->NextVictim = (way + 1) % SPY_PROCESS_WAYS;
+    }
+
+    bucket->ProcessIds[way] = (ULONG_PTR)ProcessId;
+    bucket->Tokens[way] = token;
+
+    KeReleaseSpinLock( &cache->Lock, oldIrql );
+
+    FltReleasePushLock( &cache->PatternLock );
+
+    if (Excluded != NULL) {
+
+        *Excluded = excluded;
+    }
+
+    return token;
+}
+
+static
+BOOLEAN
+SpyFindProcess (
+    _In_ HANDLE ProcessId,
+    _Out_ PULONG Token,
+    _Out_ PBOOLEAN Excluded
+    )
+/*++
+
+Routine Description:
+
+    Looks up the token and the verdict of a process.
+
+    NOTE:  This code must be NON-PAGED because it uses a spin-lock.
+
+Arguments:
+
+    ProcessId - The id of the process.
+
+    Token - Receives the token of the process, 0 if it is unknown.
+
+    Excluded - Receives whether the events of the process are excluded.
+
+Return Value:
+
+    TRUE if the verdict was decided for the current process filter.
+
+--*/
+{
+    PSPY_PROCESS_CACHE cache = MiniFSWatcherData.ProcessCache;
+    PSPY_PROCESS_BUCKET bucket = SPY_PROCESS_BUCKET( cache, ProcessId );
+    PSPY_PROCESS_VERDICT verdict;
+    BOOLEAN current = FALSE;
+    KIRQL oldIrql;
+    ULONG token = 0;
+    ULONG way;
+
+    *Excluded = FALSE;
+
+    KeAcquireSpinLock( &cache->Lock, &oldIrql );
+
+    way = SpyFindProcessWay( cache, bucket, ProcessId );
+    if (way < SPY_PROCESS_WAYS) {
+
+        token = bucket->Tokens[way];
+    }
+
+    if (token != 0) {
+
+        verdict = &cache->Verdicts[SPY_TOKEN_SLOT( token )];
+
+        if (verdict->Generation == cache->Generation ||
+            (cache->Refreshing && verdict->Generation + 1 == cache->Generation)) {
+
+            *Excluded = verdict->Excluded;
+            current = TRUE;
+        }
+    }
+
+    KeReleaseSpinLock( &cache->Lock, oldIrql );
+
+    *Token = token;
+    return current;
+}
+
+static
+ULONG
+SpyFindProcessWay (
+    _In_ PSPY_PROCESS_CACHE Cache,
+    _In_ PSPY_PROCESS_BUCKET Bucket,
+    _In_ HANDLE ProcessId
+    )
+/*++
+
+Routine Description:
+
+    Finds the way of a bucket holding the token of a process.  Ways whose
+    entry has been reused by a newer token don't match.  The caller holds
+    the cache lock.
+
+    NOTE:  This code must be NON-PAGED because it is called with a
+           spin-lock held.
+
+Arguments:
+
+    Cache - The process cache.
+
+    Bucket - The bucket the process id hashes to.
+
+    ProcessId - The id of the process.
+
+Return Value:
+
+    The way, SPY_PROCESS_WAYS if the process is not in the bucket.
+
+--*/
+{
+    PPROCESS_NAME_ENTRY entry;
+    ULONG way;
+
+    for (way = 0; way < SPY_PROCESS_WAYS; way++) {
+
+        if (Bucket->Tokens[way] == 0 ||
+            Bucket->ProcessIds[way] != (ULONG_PTR)ProcessId) {
+
+            continue;
+        }
+
+        entry = &Cache->Entries[SPY_TOKEN_SLOT( Bucket->Tokens[way] )];
+        if (entry->Token == Bucket->Tokens[way] &&
+            entry->ProcessId == (ULONGLONG)ProcessId) {
+
+            return way;
+        }
+    }
+
+    return SPY_PROCESS_WAYS;
+}
+
+ULONG
+SpyGetProcessToken (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Returns the token of the current process.  Unknown processes are added
+    if we are at PASSIVE_LEVEL.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Return Value:
+
+    The token of the current process, 0 if it is unknown.
+
+--*/
+{
+    HANDLE processId = PsGetCurrentProcessId();
+    BOOLEAN excluded;
+    ULONG token;
+
+    if (MiniFSWatcherData.ProcessCache == NULL) {
+
+        return 0;
+    }
+
+    SpyFindProcess( processId, &token, &excluded );
+
+    if (token == 0 && KeGetCurrentIrql() == PASSIVE_LEVEL) {
+
+        token = SpyAddProcess( processId, PsGetCurrentProcess(), NULL );
+    }
+
+    return token;
+}
+
+BOOLEAN
+SpyIsExcludedProcess (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Tells whether the events of the current process are excluded by the
+    process filter.  Processes without a verdict for the current filter
+    are resolved if we are at PASSIVE_LEVEL and pass otherwise.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path.
+
+Return Value:
+
+    TRUE if the events of the current process should not be logged.
+
+--*/
+{
+    HANDLE processId = PsGetCurrentProcessId();
+    BOOLEAN excluded;
+    ULONG token;
+
+    if (MiniFSWatcherData.ProcessCache == NULL ||
+        MiniFSWatcherData.ProcessCache->PatternCount == 0) {
+
+        return FALSE;
+    }
+
+    if (!SpyFindProcess( processId, &token, &excluded ) &&
+        KeGetCurrentIrql() == PASSIVE_LEVEL) {
+
+        SpyAddProcess( processId, PsGetCurrentProcess(), &excluded );
+    }
+
+    return excluded;
+}
+
+static
+ULONG
+SpyHashImageName (
+    _In_ PUNICODE_STRING ImageName,
+    _Out_ PUNICODE_STRING FileName
+    )
+/*++
+
+Routine Description:
+
+    Hashes the upcased image path of a process and finds its file name.
+
+Arguments:
+
+    ImageName - The image path, as returned by SeLocateProcessImageName.
+
+    FileName - Receives the last component of ImageName.
+
+Return Value:
+
+    The FNV-1a hash of the upcased image path.
+
+--*/
+{
+    ULONG hash = FNV_OFFSET_BASIS;
+    ULONG length = ImageName->Length / sizeof( WCHAR );
+    ULONG start = 0;
+    ULONG i;
+
+    for (i = 0; i < length; i++) {
+
+        hash = (hash ^ RtlUpcaseUnicodeChar( ImageName->Buffer[i] )) * FNV_PRIME;
+
+        if (ImageName->Buffer[i] == L'\\') {
+
+            start = i + 1;
+        }
+    }
+
+    FileName->Buffer = ImageName->Buffer + start;
+    FileName->Length = (USHORT)((length - start) * sizeof( WCHAR ));
+    FileName->MaximumLength = FileName->Length;
+
+    return hash;
+}
+
+static
+BOOLEAN
+SpyMatchProcessFilter (
+    _In_ PUNICODE_STRING Name
+    )
+/*++
+
+Routine Description:
+
+    Matches the file name of an executable against the process filter.
+    The caller holds the pattern lock.
+
+    NOTE:  This has to be called at PASSIVE_LEVEL.
+
+Arguments:
+
+    Name - The file name of the executable, without its directory.
+
+Return Value:
+
+    TRUE if the events of the process are excluded.
+
+--*/
+{
+    PSPY_PROCESS_CACHE cache = MiniFSWatcherData.ProcessCache;
+    BOOLEAN matched = FALSE;
+    BOOLEAN excluded;
+    ULONG i;
+
+    for (i = 0; i < cache->PatternCount && !matched; i++) {
+
+        matched = FsRtlIsNameInExpression( &cache->Patterns[i], Name, TRUE, NULL );
+    }
+
+    if (cache->PatternCount == 0) {
+
+        excluded = FALSE;
+
+    } else if (FlagOn( cache->PatternFlags, PROCESS_FILTER_INCLUDE )) {
+
+        excluded = !matched;
+
+    } else {
+
+        excluded = matched;
+    }
+
+    return excluded;
+}
+
+NTSTATUS
+SpySetProcessFilter (
+    _In_ ULONG Flags,
+    _In_reads_opt_(Length) PWCHAR Patterns,
+    _In_ ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Replaces the image name patterns of the process filter and decides
+    again for the cached processes.  Until they are refreshed, the
+    verdicts for the previous filter are used.
+
+    NOTE:  This has to be called at PASSIVE_LEVEL, but must be NON-PAGED
+           because it uses a spin-lock.
+
+Arguments:
+
+    Flags - PROCESS_FILTER_* flags.
+
+    Patterns - Pool copy of the null terminated patterns, followed by an
+        empty one.  It is upcased and owned by the cache on success.  NULL
+        turns the filter off.
+
+    Length - Length of Patterns in characters.
+
+Return Value:
+
+    STATUS_SUCCESS or an error status.
+
+--*/
+{
+    PSPY_PROCESS_CACHE cache = MiniFSWatcherData.ProcessCache;
+    UNICODE_STRING pattern;
+    ULONG count = 0;
+    ULONG offset = 0;
+    KIRQL oldIrql;
+    ULONG i;
+
+    if (cache == NULL) {
+
+        return (Patterns == NULL) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (Patterns == NULL) {
+
+        Length = 0;
+
+    } else if (Length == 0 || Patterns[Length - 1] != UNICODE_NULL) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    //  Validate before touching the current filter
+    //
+
+    while (offset < Length && Patterns[offset] != UNICODE_NULL) {
+
+        RtlInitUnicodeString( &pattern, &Patterns[offset] );
+        offset += pattern.Length / sizeof( WCHAR ) + 1;
+
+        if (++count > MAX_PROCESS_FILTER_PATTERNS || offset >= Length) {
+
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    //
+    //  FsRtlIsNameInExpression expects upcased expressions when ignoring case
+    //
+
+    for (i = 0; i < Length; i++) {
+
+        Patterns[i] = RtlUpcaseUnicodeChar( Patterns[i] );
+    }
+
+    FltAcquirePushLockExclusive( &cache->FilterLock );
+    FltAcquirePushLockExclusive( &cache->PatternLock );
+
+    SpyFreeProcessPatterns( cache );
+
+    cache->PatternBuffer = Patterns;
+    cache->PatternFlags = Flags;
+
+    for (offset = 0; cache->PatternCount < count; cache->PatternCount++) {
+
+        RtlInitUnicodeString( &cache->Patterns[cache->PatternCount], &Patterns[offset] );
+        offset += cache->Patterns[cache->PatternCount].Length / sizeof( WCHAR ) + 1;
+    }
+
+    KeAcquireSpinLock( &cache->Lock, &oldIrql );
+    cache->Generation++;
+    cache->Refreshing = TRUE;
+    KeReleaseSpinLock( &cache->Lock, oldIrql );
+
+    FltReleasePushLock( &cache->PatternLock );
+
+    //
+    //  Without patterns nothing is excluded, SpyIsExcludedProcess doesn't
+    //  look at the verdicts
+    //
+
+    if (count > 0) {
+
+        SpyRefreshProcessVerdicts( cache );
+    }
+
+    KeAcquireSpinLock( &cache->Lock, &oldIrql );
+    cache->Refreshing = FALSE;
+    KeReleaseSpinLock( &cache->Lock, oldIrql );
+
+    FltReleasePushLock( &cache->FilterLock );
+
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+SpyRefreshProcessVerdicts (
+    _In_ PSPY_PROCESS_CACHE Cache
+    )
+/*++
+
+Routine Description:
+
+    Decides again for the cached processes that are still running after
+    the process filter changed.  Their image names are resolved without
+    holding a lock, processes added meanwhile are already matched against
+    the new filter.  If the snapshot can't be allocated, the processes are
+    resolved on their next operation at PASSIVE_LEVEL instead.
+
+    NOTE:  This has to be called at PASSIVE_LEVEL with the filter lock held
+           exclusively, but must be NON-PAGED because it uses a spin-lock.
+
+Arguments:
+
+    Cache - The process cache.
+
+--*/
+{
+    PSPY_PROCESS_REFRESH processes;
+    PSPY_PROCESS_BUCKET bucket;
+    PUNICODE_STRING imageName;
+    UNICODE_STRING fileName;
+    PEPROCESS process;
+    KIRQL oldIrql;
+    ULONG count = 0;
+    ULONG token;
+    ULONG b;
+    ULONG i;
+
+    processes = ExAllocatePoolWithTag( NonPagedPoolNx,
+                                       SPY_PROCESS_CACHE_SIZE * sizeof( SPY_PROCESS_REFRESH ),
+                                       SPY_TAG );
+
+    if (processes == NULL) {
+
+        return;
+    }
+
+    KeAcquireSpinLock( &Cache->Lock, &oldIrql );
+
+    for (b = 0; b < SPY_PROCESS_CACHE_SIZE / SPY_PROCESS_WAYS; b++) {
+
+        bucket = &Cache->TokenByProcess[b];
+
+        for (i = 0; i < SPY_PROCESS_WAYS; i++) {
+
+            token = bucket->Tokens[i];
+
+            if (token != 0 &&
+                Cache->Entries[SPY_TOKEN_SLOT( token )].Token == token &&
+                Cache->Verdicts[SPY_TOKEN_SLOT( token )].Generation != Cache->Generation) {
+
+                processes[count].ProcessId = (HANDLE)bucket->ProcessIds[i];
+                processes[count].Token = token;
+                processes[count].NameHash = Cache->Entries[SPY_TOKEN_SLOT( token )].NameHash;
+                processes[count].Resolved = FALSE;
+                count++;
+            }
+        }
+    }
+
+    KeReleaseSpinLock( &Cache->Lock, oldIrql );
+
+    for (i = 0; i < count; i++) {
+
+        if (!NT_SUCCESS( PsLookupProcessByProcessId( processes[i].ProcessId, &process ) )) {
+
+            continue;
+        }
+
+        imageName = NULL;
+
+        if (NT_SUCCESS( SeLocateProcessImageName( process, &imageName ) )) {
+
+            //
+            //  The id may have been reused by a process that isn't cached yet
+            //
+
+            if (SpyHashImageName( imageName, &fileName ) == processes[i].NameHash) {
+
+                FltAcquirePushLockShared( &Cache->PatternLock );
+                processes[i].Excluded = SpyMatchProcessFilter( &fileName );
+                processes[i].Resolved = TRUE;
+                FltReleasePushLock( &Cache->PatternLock );
+            }
+
+            ExFreePool( imageName );
+        }
+
+        ObDereferenceObject( process );
+    }
+
+    KeAcquireSpinLock( &Cache->Lock, &oldIrql );
+
+    for (i = 0; i < count; i++) {
+
+        token = processes[i].Token;
+
+        if (processes[i].Resolved &&
+            Cache->Entries[SPY_TOKEN_SLOT( token )].Token == token) {
+
+            Cache->Verdicts[SPY_TOKEN_SLOT( token )].Generation = Cache->Generation;
+            Cache->Verdicts[SPY_TOKEN_SLOT( token )].Excluded = processes[i].Excluded;
+        }
+    }
+
+    KeReleaseSpinLock( &Cache->Lock, oldIrql );
+
+    ExFreePoolWithTag( processes, SPY_TAG );
+}
+
+static
+VOID
+SpyFreeProcessPatterns (
+    _In_ PSPY_PROCESS_CACHE Cache
+    )
+/*++
+
+Routine Description:
+
+    Frees the patterns of the process filter.  The caller holds the pattern
+    lock exclusively or is the only one left using the cache.
+
+Arguments:
+
+    Cache - The process cache.
+
+--*/
+{
+    if (Cache->PatternBuffer != NULL) {
+
+        ExFreePoolWithTag( Cache->PatternBuffer, SPY_TAG );
+        Cache->PatternBuffer = NULL;
+    }
+
+    Cache->PatternCount = 0;
+    Cache->PatternFlags = 0;
+}
+
+ULONG
+SpyCopyProcessNames (
+    _In_ ULONG AfterToken,
+    _Out_writes_(Count) PPROCESS_NAME_ENTRY Entries,
+    _In_ ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Copies the entries of the tokens after AfterToken, oldest first.
+    Tokens whose entries have been reused are skipped.
+
+    NOTE:  Entries may be a user mode buffer, the caller has to guard
+           against exceptions.  It is written without holding the lock.
+
+Arguments:
+
+    AfterToken - The last token known to the client.
+
+    Entries - Receives the entries.
+
+    Count - Maximum number of entries to copy.
+
+Return Value:
+
+    Number of entries copied.
+
+--*/
+{
+    PSPY_PROCESS_CACHE cache = MiniFSWatcherData.ProcessCache;
+    PROCESS_NAME_ENTRY entry;
+    KIRQL oldIrql;
+    ULONG lastToken;
+    ULONG token;
+    ULONG copied = 0;
+
+    if (cache == NULL) {
+
+        return 0;
+    }
+
+    KeAcquireSpinLock( &cache->Lock, &oldIrql );
+    lastToken = cache->LastToken;
+    KeReleaseSpinLock( &cache->Lock, oldIrql );
+
+    token = AfterToken;
+    if (lastToken - token > SPY_PROCESS_CACHE_SIZE) {
+
+        token = lastToken - SPY_PROCESS_CACHE_SIZE;
+    }
+
+    while (token != lastToken && copied < Count) {
+
+        token++;
+
+        KeAcquireSpinLock( &cache->Lock, &oldIrql );
+        entry = cache->Entries[SPY_TOKEN_SLOT( token )];
+        KeReleaseSpinLock( &cache->Lock, oldIrql );
+
+        if (entry.Token == token) {
+
+            Entries[copied++] = entry;
+        }
+    }
+
+    return copied;
+}
@@ -0,0 +1,620 @@
+/*++
+
+Module Name:
+
+    mspySettle.c
+
+Abstract:
+
+    Settle table for changes, see PARAMETER_SETTLE_TIME.
+
+    Every handle that writes to a file produces its own change, so a file
+    written by several processes, or reopened and written over and over,
+    is reported many times.  While SettleTime is set, the first change of
+    a file waits in the settle table instead of being logged.  Further
+    changes of the same file replace the waiting record, so it carries the
+    latest attributes, and the new record is freed.  A timer logs the
+    record once SettleTime has passed since the first change.
+
+    Files are identified by their volume serial number and file ID, records
+    without file ID are logged right away.  The table is direct mapped and
+    bounded, a change of another file in an occupied slot logs the waiting
+    record early.  Each slot is protected by one of SPY_SETTLE_LOCKS spin
+    locks, so changes of different files rarely contend.
+
+    Closes of a file wait behind its change and are logged after it, any
+    other record of the file logs the waiting change and closes first.  So
+    a change is never reported after the close, delete or rename of its
+    file.  A settled record gets a new sequence number when it is logged.
+
+    Depending on the timer, a change is logged between SettleTime and twice
+    SettleTime after the first one.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "mspyKern.h"
+
+#define SPY_SETTLE_LOCK(Table, Slot)    (&(Table)->Locks[(Slot) & (SPY_SETTLE_LOCKS - 1)].Lock)
+
+//
+//  KeQueryInterruptTime counts in 100ns units
+//
+
+#define SPY_SETTLE_TICKS(Milliseconds)  ((ULONGLONG)(Milliseconds) * 10000)
+
+static
+VOID
+SpySettleDpc (
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+    );
+
+static
+ULONG
+SpySettleSlot (
+    _In_ PRECORD_DATA RecordData
+    );
+
+static
+BOOLEAN
+SpyIsSameFile (
+    _In_ PRECORD_DATA First,
+    _In_ PRECORD_DATA Second
+    );
+
+static
+VOID
+SpyTakeSettled (
+    _In_ PSPY_SETTLE_TABLE Table,
+    _In_ BOOLEAN All,
+    _Out_ PLIST_ENTRY Settled,
+    _Out_ PULONGLONG Oldest
+    );
+
+static
+VOID
+SpyArmSettleTimer (
+    _In_ PSPY_SETTLE_TABLE Table,
+    _In_ ULONGLONG Delay
+    );
+
+static
+VOID
+SpyTakeSlot (
+    _In_ PSPY_SETTLE_TABLE Table,
+    _In_ PSPY_SETTLE_ENTRY Entry,
+    _Inout_ PLIST_ENTRY Settled
+    );
+
+//---------------------------------------------------------------------------
+//  Settle table routines
+//---------------------------------------------------------------------------
+
+NTSTATUS
+SpyInitializeSettleTable (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Allocates the settle table.  Without it, changes are always logged
+    right away.
+
+Return Value:
+
+    STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+
+--*/
+{
+    PSPY_SETTLE_TABLE table;
+    ULONG i;
+
+    table = ExAllocatePoolWithTag( NonPagedPoolNx,
+                                   sizeof( SPY_SETTLE_TABLE ),
+                                   SPY_TAG );
+
+    if (table == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( table, sizeof( SPY_SETTLE_TABLE ) );
+
+    for (i = 0; i < SPY_SETTLE_LOCKS; i++) {
+
+        KeInitializeSpinLock( &table->Locks[i].Lock );
+    }
+
+    for (i = 0; i < SPY_SETTLE_TABLE_SIZE; i++) {
+
+        InitializeListHead( &table->Entries[i].Closes );
+    }
+
+    KeInitializeTimer( &table->Timer );
+    KeInitializeDpc( &table->Dpc, SpySettleDpc, table );
+
+    MiniFSWatcherData.SettleTable = table;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+SpyFreeSettleTable (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Frees the settle table and the records waiting in it.  The filter must
+    already be unregistered, so that no more records are added.  The
+    lookaside list of the records must still exist.
+
+--*/
+{
+    PSPY_SETTLE_TABLE table = MiniFSWatcherData.SettleTable;
+    LIST_ENTRY settled;
+    ULONGLONG oldest;
+
+    if (table == NULL) {
+
+        return;
+    }
+
+    //
+    //  Once ShuttingDown is set, the timer is not armed again.  A DPC that
+    //  checked it before may still arm the timer, so it is cancelled after
+    //  that DPC finished.  A DPC queued by the timer meanwhile only sees
+    //  the flag and returns.
+    //
+
+    InterlockedExchange( &table->ShuttingDown, TRUE );
+
+    KeFlushQueuedDpcs();
+    KeCancelTimer( &table->Timer );
+    KeFlushQueuedDpcs();
+
+    SpyTakeSettled( table, TRUE, &settled, &oldest );
+
+    while (!IsListEmpty( &settled )) {
+
+        SpyFreeRecord( CONTAINING_RECORD( RemoveHeadList( &settled ), RECORD_LIST, List ) );
+    }
+
+    MiniFSWatcherData.SettleTable = NULL;
+    ExFreePoolWithTag( table, SPY_TAG );
+}
+
+VOID
+SpyFlushSettleTable (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Logs all waiting records, called when SettleTime changes.
+
+    NOTE:  This code must be NON-PAGED because it uses spin-locks.
+
+--*/
+{
+    PSPY_SETTLE_TABLE table = MiniFSWatcherData.SettleTable;
+    LIST_ENTRY settled;
+    ULONGLONG oldest;
+
+    if (table == NULL) {
+
+        return;
+    }
+
+    SpyTakeSettled( table, TRUE, &settled, &oldest );
+
+    while (!IsListEmpty( &settled )) {
+
+        SpyLog( CONTAINING_RECORD( RemoveHeadList( &settled ), RECORD_LIST, List ) );
+    }
+}
+
+VOID
+SpyLogOrSettle (
+    _In_ PRECORD_LIST RecordList
+    )
+/*++
+
+Routine Description:
+
+    Logs a completed record, unless it is a change that has to settle
+    first.  Replaces SpyLog for records of file system operations.
+
+    NOTE:  This code must be NON-PAGED because it can be called on the
+           paging path or at DPC level and uses spin-locks.
+
+Arguments:
+
+    RecordList - The record to log.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_SETTLE_TABLE table = MiniFSWatcherData.SettleTable;
+    PRECORD_DATA recordData = &RecordList->LogRecord.Data;
+    PSPY_SETTLE_ENTRY entry;
+    PRECORD_LIST waiting;
+    LIST_ENTRY settled;
+    BOOLEAN change;
+    BOOLEAN sameFile;
+    BOOLEAN queued = FALSE;
+    KIRQL oldIrql;
+    ULONG slot;
+
+    //
+    //  With settling turned off, the lock is only needed while records
+    //  from before are still waiting
+    //
+
+    if ((table == NULL) ||
+        ((MiniFSWatcherData.SettleTime == 0) && (table->Pending == 0)) ||
+        ((recordData->FileId.LowPart == 0) && (recordData->FileId.HighPart == 0))) {
+
+        SpyLog( RecordList );
+        return;
+    }
+
+    change = (recordData->EventType == FILE_SYSTEM_EVENT_CHANGE) &&
+             (MiniFSWatcherData.SettleTime != 0);
+
+    slot = SpySettleSlot( recordData );
+    entry = &table->Entries[slot];
+
+    InitializeListHead( &settled );
+
+    KeAcquireSpinLock( SPY_SETTLE_LOCK( table, slot ), &oldIrql );
+
+    waiting = entry->Record;
+    sameFile = (waiting != NULL) && SpyIsSameFile( &waiting->LogRecord.Data, recordData );
+
+    if (change && sameFile) {
+
+        entry->Record = RecordList;
+
+    } else if (change) {
+
+        //
+        //  The window starts with the first change of the file, it is not
+        //  extended by further changes.  The change of another file in the
+        //  slot is logged early.
+        //
+
+        if (waiting != NULL) {
+
+            SpyTakeSlot( table, entry, &settled );
+        }
+
+        entry->Record = RecordList;
+        entry->FirstChange = KeQueryInterruptTime();
+        InterlockedIncrement( &table->Pending );
+
+    } else if (sameFile && (recordData->EventType == FILE_SYSTEM_EVENT_CLOSE)) {
+
+        InsertTailList( &entry->Closes, &RecordList->List );
+        queued = TRUE;
+
+    } else if (sameFile) {
+
+        SpyTakeSlot( table, entry, &settled );
+    }
+
+    KeReleaseSpinLock( SPY_SETTLE_LOCK( table, slot ), oldIrql );
+
+    if (change && sameFile) {
+
+        SpyFreeRecord( waiting );
+        SpyStatisticsIncrement( SpyCounterChangesMerged );
+    }
+
+    while (!IsListEmpty( &settled )) {
+
+        SpyLog( CONTAINING_RECORD( RemoveHeadList( &settled ), RECORD_LIST, List ) );
+    }
+
+    if (change) {
+
+        SpyArmSettleTimer( table, SPY_SETTLE_TICKS( MiniFSWatcherData.SettleTime ) );
+
+    } else if (!queued) {
+
+        SpyLog( RecordList );
+    }
+}
+
+static
+VOID
+SpySettleDpc (
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+    )
+/*++
+
+Routine Description:
+
+    Timer DPC.  Logs the records whose window has passed and arms the
+    timer for the oldest remaining one.
+
+Arguments:
+
+    Dpc - unused
+
+    DeferredContext - The settle table.
+
+    SystemArgument1 - unused
+
+    SystemArgument2 - unused
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSPY_SETTLE_TABLE table = (PSPY_SETTLE_TABLE)DeferredContext;
+    LIST_ENTRY settled;
+    ULONGLONG settleTime;
+    ULONGLONG oldest;
+    ULONGLONG now;
+
+    UNREFERENCED_PARAMETER( Dpc );
+    UNREFERENCED_PARAMETER( SystemArgument1 );
+    UNREFERENCED_PARAMETER( SystemArgument2 );
+
+    _Analysis_assume_( table != NULL );
+
+    if (table->ShuttingDown) {
+
+        return;
+    }
+
+    //
+    //  Cleared first, so a change added during the scan arms the timer again
+    //
+
+    InterlockedExchange( &table->TimerArmed, FALSE );
+
+    SpyTakeSettled( table, FALSE, &settled, &oldest );
+
+    while (!IsListEmpty( &settled )) {
+
+        SpyLog( CONTAINING_RECORD( RemoveHeadList( &settled ), RECORD_LIST, List ) );
+    }
+
+    if (oldest != MAXULONGLONG) {
+
+        settleTime = SPY_SETTLE_TICKS( MiniFSWatcherData.SettleTime );
+        now = KeQueryInterruptTime();
+
+        SpyArmSettleTimer( table, (oldest + settleTime > now) ? (oldest + settleTime - now) : 0 );
+    }
+}
+
+static
+VOID
+SpyTakeSettled (
+    _In_ PSPY_SETTLE_TABLE Table,
+    _In_ BOOLEAN All,
+    _Out_ PLIST_ENTRY Settled,
+    _Out_ PULONGLONG Oldest
+    )
+/*++
+
+Routine Description:
+
+    Removes the records whose window has passed, or all of them, from the
+    table.  Each lock is taken once for all of its slots.
+
+    NOTE:  This code must be NON-PAGED because it uses spin-locks.
+
+Arguments:
+
+    Table - The settle table.
+
+    All - Whether to take all records.
+
+    Settled - Receives the removed records.
+
+    Oldest - Receives the first change time of the oldest remaining record,
+        MAXULONGLONG if none is left.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONGLONG settleTime = SPY_SETTLE_TICKS( MiniFSWatcherData.SettleTime );
+    ULONGLONG now = KeQueryInterruptTime();
+    PSPY_SETTLE_ENTRY entry;
+    KIRQL oldIrql;
+    ULONG lock;
+    ULONG slot;
+
+    InitializeListHead( Settled );
+    *Oldest = MAXULONGLONG;
+
+    for (lock = 0; lock < SPY_SETTLE_LOCKS; lock++) {
+
+        KeAcquireSpinLock( &Table->Locks[lock].Lock, &oldIrql );
+
+        for (slot = lock; slot < SPY_SETTLE_TABLE_SIZE; slot += SPY_SETTLE_LOCKS) {
+
+            entry = &Table->Entries[slot];
+
+            if (entry->Record == NULL) {
+
+                continue;
+            }
+
+            if (All || (now - entry->FirstChange >= settleTime)) {
+
+                SpyTakeSlot( Table, entry, Settled );
+
+            } else if (entry->FirstChange < *Oldest) {
+
+                *Oldest = entry->FirstChange;
+            }
+        }
+
+        KeReleaseSpinLock( &Table->Locks[lock].Lock, oldIrql );
+    }
+}
+
+static
+VOID
+SpyArmSettleTimer (
+    _In_ PSPY_SETTLE_TABLE Table,
+    _In_ ULONGLONG Delay
+    )
+/*++
+
+Routine Description:
+
+    Arms the timer unless it is already armed.  Records are only added with
+    a full window, so an armed timer is never later than the new record.
+
+    NOTE:  This code must be NON-PAGED because it can be called at DPC
+           level.
+
+Arguments:
+
+    Table - The settle table.
+
+    Delay - Relative due time in 100ns units.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LARGE_INTEGER dueTime;
+
+    if (Table->ShuttingDown ||
+        Table->TimerArmed ||
+        InterlockedCompareExchange( &Table->TimerArmed, TRUE, FALSE ) != FALSE) {
+
+        return;
+    }
+
+    dueTime.QuadPart = -(LONGLONG)Delay;
+    KeSetTimer( &Table->Timer, dueTime, &Table->Dpc );
+}
+
+static
+VOID
+SpyTakeSlot (
+    _In_ PSPY_SETTLE_TABLE Table,
+    _In_ PSPY_SETTLE_ENTRY Entry,
+    _Inout_ PLIST_ENTRY Settled
+    )
+/*++
+
+Routine Description:
+
+    Removes the waiting change of an occupied slot and the closes behind
+    it from the table, in the order they are to be logged.  The caller
+    holds the lock of the slot.
+
+    NOTE:  This code must be NON-PAGED because it is called with a
+           spin-lock held.
+
+Arguments:
+
+    Table - The settle table.
+
+    Entry - The slot.
+
+    Settled - The records are appended to this list.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    InsertTailList( Settled, &Entry->Record->List );
+    Entry->Record = NULL;
+
+    //
+    //  Move the whole list, AppendTailList takes its head as an entry
+    //
+
+    if (!IsListEmpty( &Entry->Closes )) {
+
+        AppendTailList( Settled, &Entry->Closes );
+        RemoveEntryList( &Entry->Closes );
+        InitializeListHead( &Entry->Closes );
+    }
+
+    InterlockedDecrement( &Table->Pending );
+}
+
+static
+ULONG
+SpySettleSlot (
+    _In_ PRECORD_DATA RecordData
+    )
+/*++
+
+Routine Description:
+
+    Returns the slot of a file.  File IDs of one volume mostly differ in
+    their low bits, the multiplication spreads them over the upper bits,
+    which index the table.
+
+Arguments:
+
+    RecordData - A record with file ID.
+
+Return Value:
+
+    The index into the entries of the table.
+
+--*/
+{
+    ULONGLONG key;
+
+    key = RecordData->FileId.LowPart ^ RecordData->FileId.HighPart ^ RecordData->VolumeSerialNumber;
+    key *= 0x9E3779B97F4A7C15ull;
+
+    return (ULONG)(key >> 32) & (SPY_SETTLE_TABLE_SIZE - 1);
+}
+
+static
+BOOLEAN
+SpyIsSameFile (
+    _In_ PRECORD_DATA First,
+    _In_ PRECORD_DATA Second
+    )
+/*++
+
+Routine Description:
+
+    Compares the volume serial numbers and file IDs of two records.
+
+--*/
+{
+    return (First->VolumeSerialNumber == Second->VolumeSerialNumber) &&
+           (First->FileId.LowPart == Second->FileId.LowPart) &&
+           (First->FileId.HighPart == Second->FileId.HighPart);
+}
@@ -0,0 +1,107 @@
+//
+//  Watches a directory with fanotify and writes the records as a trace,
+//  which TraceReplay, MiniFSWatcherApp --replay and minifswatcher.hpp read.
+//
+
+#include "producer.hpp"
+#include "trace_writer.hpp"
+
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <iostream>
+
+using namespace minifswatcher::fanotify;
+
+static std::atomic<bool> stop(false);
+
+static void usage()
+{
+    std::cerr << "Usage: fswatcherd [options] <directory>\n"
+                 "  -o <trace>  Writes the trace to a file instead of standard output\n"
+                 "  -x <pid>    Drops the events of a process, may be repeated\n"
+                 "  -i <dir>    Ignores the entries of a directory, may be repeated\n"
+                 "  -c          Reports changes when files are closed, not on every write\n"
+                 "  -a          Logs size, last write time and attributes with creates and changes\n"
+                 "  -s          Prints statistics to standard error on exit\n";
+}
+
+int main(int argc, char** argv)
+{
+    producer_options options;
+    const char* output = nullptr;
+    bool print_statistics = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "o:x:i:cash")) != -1)
+    {
+        switch (option)
+        {
+        case 'o':
+            output = optarg;
+            break;
+        case 'x':
+            options.excluded_processes.push_back(static_cast<pid_t>(std::atoi(optarg)));
+            break;
+        case 'i':
+            options.ignored_directories.push_back(optarg);
+            break;
+        case 'c':
+            options.changes_on_close = true;
+            break;
+        case 'a':
+            options.capture_attributes = true;
+            break;
+        case 's':
+            print_statistics = true;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+
+    if (optind + 1 != argc)
+    {
+        usage();
+        return 2;
+    }
+    options.root = argv[optind];
+
+    struct sigaction action = {};
+    action.sa_handler = [](int) { stop = true; };
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    try
+    {
+        trace_writer trace(output != nullptr ? std::fopen(output, "wb") : fdopen(dup(STDOUT_FILENO), "wb"));
+        fanotify_producer producer(options, [&](const std::byte* data, std::size_t size)
+        {
+            trace.append(data, size);
+            trace.flush();
+        });
+
+        producer.run(stop);
+
+        if (print_statistics)
+        {
+            auto& statistics = producer.statistics();
+            std::fprintf(stderr,
+                         "events read %" PRIu64 ", records logged %" PRIu64 " in %" PRIu64 " batches (%" PRIu64 " bytes)\n"
+                         "dropped outside root %" PRIu64 ", excluded %" PRIu64 ", unresolved %" PRIu64 ", overflows %" PRIu64 "\n",
+                         statistics.events_read, statistics.records_logged, statistics.batches, statistics.bytes_delivered,
+                         statistics.dropped_outside_root, statistics.dropped_excluded, statistics.dropped_unresolved,
+                         statistics.overflows);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "fswatcherd: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
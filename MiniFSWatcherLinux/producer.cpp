@@ -0,0 +1,572 @@
+#include "producer.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdlib>
+
+namespace minifswatcher::fanotify
+{
+    namespace
+    {
+        constexpr std::size_t event_buffer_size = 256 * 1024;
+
+        // Directory paths are cached by handle, the cache starts over when it gets this large
+        constexpr std::size_t max_cached_directories = 64 * 1024;
+
+        constexpr ULONG file_attribute_directory = 0x10;
+        constexpr ULONG file_attribute_normal = 0x80;
+
+        // Seconds from 1601, the FILETIME epoch, to 1970
+        constexpr LONGLONG filetime_epoch_offset = 11644473600LL;
+
+        LONGLONG to_filetime(const timespec& time)
+        {
+            return (time.tv_sec + filetime_epoch_offset) * 10000000LL + time.tv_nsec / 100;
+        }
+
+        LONGLONG filetime_now()
+        {
+            timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            return to_filetime(now);
+        }
+
+        std::string handle_key(const file_handle* handle)
+        {
+            std::string key(reinterpret_cast<const char*>(&handle->handle_type), sizeof(handle->handle_type));
+            key.append(reinterpret_cast<const char*>(handle->f_handle), handle->handle_bytes);
+            return key;
+        }
+
+        // The first bytes of the handle, which is the inode number and generation on most file systems
+        RECORD_FILE_ID to_file_id(const file_handle* handle)
+        {
+            RECORD_FILE_ID id = {};
+            std::memcpy(&id, handle->f_handle, std::min<std::size_t>(handle->handle_bytes, sizeof(id)));
+            return id;
+        }
+
+        void throw_errno(const char* what)
+        {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+    }
+
+    void append_record_name(std::string_view path, name_string& name)
+    {
+        auto bytes = reinterpret_cast<const unsigned char*>(path.data());
+        auto end = bytes + path.size();
+
+        while (bytes < end)
+        {
+            char32_t c = *bytes++;
+            int continuation = 0;
+            char32_t minimum = 0;
+
+            if (c >= 0xF0 && c < 0xF5)
+            {
+                c &= 0x07;
+                continuation = 3;
+                minimum = 0x10000;
+            }
+            else if (c >= 0xE0 && c < 0xF0)
+            {
+                c &= 0x0F;
+                continuation = 2;
+                minimum = 0x800;
+            }
+            else if (c >= 0xC2 && c < 0xE0)
+            {
+                c &= 0x1F;
+                continuation = 1;
+                minimum = 0x80;
+            }
+            else if (c >= 0x80)
+            {
+                c = 0xFFFD;
+            }
+
+            for (; continuation > 0; continuation--)
+            {
+                if (bytes == end || (*bytes & 0xC0) != 0x80)
+                {
+                    c = 0xFFFD;
+                    break;
+                }
+                c = (c << 6) | (*bytes++ & 0x3F);
+            }
+
+            if (continuation == 0 && minimum > 0 && (c < minimum || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)))
+            {
+                c = 0xFFFD;
+            }
+
+            if (c == U'/')
+            {
+                name.push_back(u'\\');
+            }
+            else if (c >= 0x10000)
+            {
+                c -= 0x10000;
+                name.push_back(static_cast<WCHAR>(0xD800 + (c >> 10)));
+                name.push_back(static_cast<WCHAR>(0xDC00 + (c & 0x3FF)));
+            }
+            else
+            {
+                name.push_back(static_cast<WCHAR>(c));
+            }
+        }
+    }
+
+    fanotify_producer::fanotify_producer(producer_options options, sink deliver)
+        : options_(std::move(options)), deliver_(std::move(deliver)), events_(event_buffer_size)
+    {
+        char root[PATH_MAX];
+        if (realpath(options_.root.c_str(), root) == nullptr)
+        {
+            throw_errno("Could not resolve the watched directory");
+        }
+        options_.root = root;
+        options_.excluded_processes.push_back(getpid());
+
+        root_fd_ = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (root_fd_ < 0)
+        {
+            throw_errno("Could not open the watched directory");
+        }
+
+        fanotify_fd_ = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME_TARGET,
+                                     O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+        if (fanotify_fd_ < 0)
+        {
+            auto error = errno;
+            close(root_fd_);
+            throw std::system_error(error, std::generic_category(), "Could not initialize fanotify");
+        }
+
+        uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_RENAME | FAN_CLOSE_WRITE | FAN_ONDIR;
+        if (!options_.changes_on_close)
+        {
+            mask |= FAN_MODIFY;
+        }
+
+        try
+        {
+            if (fanotify_mark(fanotify_fd_, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, root) < 0)
+            {
+                throw_errno("Could not mark the file system");
+            }
+
+            for (auto& directory : options_.ignored_directories)
+            {
+                if (fanotify_mark(fanotify_fd_, FAN_MARK_ADD | FAN_MARK_IGNORE_SURV,
+                                  mask | FAN_EVENT_ON_CHILD, AT_FDCWD, directory.c_str()) < 0)
+                {
+                    throw_errno("Could not ignore a directory");
+                }
+            }
+        }
+        catch (...)
+        {
+            close(fanotify_fd_);
+            close(root_fd_);
+            throw;
+        }
+    }
+
+    fanotify_producer::~fanotify_producer()
+    {
+        close(fanotify_fd_);
+        close(root_fd_);
+    }
+
+    bool fanotify_producer::poll(std::chrono::milliseconds timeout)
+    {
+        pollfd descriptor = { fanotify_fd_, POLLIN, 0 };
+        if (::poll(&descriptor, 1, static_cast<int>(timeout.count())) < 0 && errno != EINTR)
+        {
+            throw_errno("Could not wait for events");
+        }
+
+        bool any = false;
+        for (;;)
+        {
+            auto length = read(fanotify_fd_, events_.data(), events_.size());
+            if (length < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR)
+                {
+                    break;
+                }
+                throw_errno("Could not read events");
+            }
+
+            auto metadata = reinterpret_cast<const fanotify_event_metadata*>(events_.data());
+            for (; FAN_EVENT_OK(metadata, length); metadata = FAN_EVENT_NEXT(metadata, length))
+            {
+                handle(metadata);
+            }
+
+            any = true;
+            flush();
+        }
+
+        return any;
+    }
+
+    void fanotify_producer::run(const std::atomic<bool>& stop, std::chrono::milliseconds interval)
+    {
+        while (!stop.load())
+        {
+            poll(interval);
+        }
+    }
+
+    void fanotify_producer::handle(const fanotify_event_metadata* metadata)
+    {
+        if (metadata->vers != FANOTIFY_METADATA_VERSION)
+        {
+            throw std::runtime_error("Unsupported fanotify metadata version");
+        }
+
+        statistics_.events_read++;
+
+        if (metadata->mask & FAN_Q_OVERFLOW)
+        {
+            statistics_.overflows++;
+            return;
+        }
+
+        fid_name entry;
+        fid_name from;
+        fid_name to;
+        const fanotify_event_info_fid* target = nullptr;
+
+        auto info = reinterpret_cast<const std::byte*>(metadata) + metadata->metadata_len;
+        auto end = reinterpret_cast<const std::byte*>(metadata) + metadata->event_len;
+        while (info + sizeof(fanotify_event_info_header) <= end)
+        {
+            auto header = reinterpret_cast<const fanotify_event_info_header*>(info);
+            if (header->len == 0)
+            {
+                break;
+            }
+
+            auto fid = reinterpret_cast<const fanotify_event_info_fid*>(info);
+            auto handle = reinterpret_cast<const file_handle*>(fid->handle);
+            auto name = reinterpret_cast<const char*>(handle->f_handle) + handle->handle_bytes;
+
+            switch (header->info_type)
+            {
+            case FAN_EVENT_INFO_TYPE_FID:
+                target = fid;
+                break;
+            case FAN_EVENT_INFO_TYPE_DFID:
+                entry = { fid, handle, std::string_view() };
+                break;
+            case FAN_EVENT_INFO_TYPE_DFID_NAME:
+                entry = { fid, handle, std::string_view(name) };
+                break;
+            case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+                from = { fid, handle, std::string_view(name) };
+                break;
+            case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+                to = { fid, handle, std::string_view(name) };
+                break;
+            default:
+                break;
+            }
+
+            info += header->len;
+        }
+
+        auto mask = metadata->mask;
+        bool directory = (mask & FAN_ONDIR) != 0;
+
+        RECORD_DATA data = {};
+        data.OriginatingTime.QuadPart = filetime_now();
+        data.CompletionTime = data.OriginatingTime;
+        data.Flags = directory ? RECORD_FLAG_DIRECTORY : 0;
+        data.ProcessId = metadata->pid;
+
+        if (target != nullptr)
+        {
+            auto handle = reinterpret_cast<const file_handle*>(target->handle);
+            data.VolumeSerialNumber = static_cast<ULONG>(target->fsid.val[0]) |
+                                      (static_cast<ULONGLONG>(static_cast<ULONG>(target->fsid.val[1])) << 32);
+            data.FileId = to_file_id(handle);
+        }
+
+        // The directory cache follows every change of the tree, also those that are not logged
+        std::optional<std::string> path;
+        if (entry.info != nullptr)
+        {
+            path = path_of(entry);
+            if (path && directory && target != nullptr && (mask & FAN_CREATE))
+            {
+                cache_directory(reinterpret_cast<const file_handle*>(target->handle), *path);
+            }
+        }
+
+        std::optional<std::string> old_path;
+        std::optional<std::string> new_path;
+        if (mask & FAN_RENAME)
+        {
+            old_path = path_of(from);
+            new_path = path_of(to);
+            if (directory && old_path && new_path)
+            {
+                rename_cached(*old_path, *new_path);
+            }
+        }
+
+        if (is_excluded(metadata->pid))
+        {
+            statistics_.dropped_excluded++;
+        }
+        else
+        {
+            if (path)
+            {
+                if (mask & FAN_CREATE)
+                {
+                    log(FILE_SYSTEM_EVENT_CREATE, data, *path);
+                }
+
+                if ((mask & FAN_MODIFY) || (options_.changes_on_close && (mask & FAN_CLOSE_WRITE)))
+                {
+                    log(FILE_SYSTEM_EVENT_CHANGE, data, *path);
+                }
+
+                if (mask & FAN_CLOSE_WRITE)
+                {
+                    log(FILE_SYSTEM_EVENT_CLOSE, data, *path);
+                }
+
+                if (mask & FAN_DELETE)
+                {
+                    log(FILE_SYSTEM_EVENT_DELETE, data, *path);
+                }
+            }
+            else if (entry.info != nullptr)
+            {
+                statistics_.dropped_unresolved++;
+            }
+
+            if (mask & FAN_RENAME)
+            {
+                bool from_below = old_path && is_below_root(*old_path);
+                bool to_below = new_path && is_below_root(*new_path);
+
+                if (from_below && to_below)
+                {
+                    data.ParentId = to_file_id(to.handle);
+                    log(directory ? FILE_SYSTEM_EVENT_MOVE_SUBTREE : FILE_SYSTEM_EVENT_MOVE, data, *new_path, &*old_path);
+                }
+                else if (to_below)
+                {
+                    // Moved in from elsewhere, consumers never heard of the old name
+                    log(FILE_SYSTEM_EVENT_CREATE, data, *new_path);
+                }
+                else if (from_below)
+                {
+                    log(FILE_SYSTEM_EVENT_DELETE, data, *old_path);
+                }
+                else if (!old_path || !new_path)
+                {
+                    statistics_.dropped_unresolved++;
+                }
+                else
+                {
+                    statistics_.dropped_outside_root++;
+                }
+            }
+        }
+
+        if (path && directory && (mask & FAN_DELETE))
+        {
+            forget_cached(*path);
+        }
+    }
+
+    void fanotify_producer::log(ULONG event_type, RECORD_DATA data, const std::string& name, const std::string* old_name)
+    {
+        if (old_name == nullptr && !is_below_root(name))
+        {
+            statistics_.dropped_outside_root++;
+            return;
+        }
+
+        data.EventType = event_type;
+
+        if (options_.capture_attributes &&
+            (event_type == FILE_SYSTEM_EVENT_CREATE || event_type == FILE_SYSTEM_EVENT_CHANGE))
+        {
+            struct stat status;
+            if (fstatat(AT_FDCWD, name.c_str(), &status, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+                data.FileSize = status.st_size;
+                data.LastWriteTime.QuadPart = to_filetime(status.st_mtim);
+                data.FileAttributes = S_ISDIR(status.st_mode) ? file_attribute_directory : file_attribute_normal;
+                data.Flags |= RECORD_FLAG_ATTRIBUTES;
+            }
+        }
+
+        name_buffer_.clear();
+        append_record_name(name, name_buffer_);
+
+        auto sequence_number = ++sequence_number_;
+        auto append = [&]()
+        {
+            if (old_name == nullptr)
+            {
+                return batch_.append(data, sequence_number, { name_buffer_ });
+            }
+
+            old_name_buffer_.clear();
+            append_record_name(*old_name, old_name_buffer_);
+            return batch_.append(data, sequence_number, { old_name_buffer_, name_buffer_ });
+        };
+
+        if (!append())
+        {
+            flush();
+            append();
+        }
+
+        statistics_.records_logged++;
+    }
+
+    void fanotify_producer::flush()
+    {
+        if (batch_.empty())
+        {
+            return;
+        }
+
+        statistics_.batches++;
+        statistics_.bytes_delivered += batch_.size();
+        deliver_(batch_.data(), batch_.size());
+        batch_.clear();
+    }
+
+    std::optional<std::string> fanotify_producer::path_of(const fid_name& fid)
+    {
+        if (fid.info == nullptr)
+        {
+            return std::nullopt;
+        }
+
+        auto directory = directory_path(fid.handle);
+        if (!directory || fid.name.empty() || fid.name == ".")
+        {
+            return directory;
+        }
+
+        if (directory->back() != '/')
+        {
+            directory->push_back('/');
+        }
+        directory->append(fid.name);
+        return directory;
+    }
+
+    std::optional<std::string> fanotify_producer::directory_path(const file_handle* handle)
+    {
+        auto key = handle_key(handle);
+        auto cached = directories_.find(key);
+        if (cached != directories_.end())
+        {
+            return cached->second;
+        }
+
+        auto fd = open_by_handle_at(root_fd_, const_cast<file_handle*>(handle), O_PATH | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return std::nullopt;
+        }
+
+        char link[32];
+        char target[PATH_MAX];
+        std::snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        auto length = readlink(link, target, sizeof(target));
+        close(fd);
+
+        if (length <= 0 || length == static_cast<ssize_t>(sizeof(target)))
+        {
+            return std::nullopt;
+        }
+
+        // A directory removed meanwhile still has its former path
+        std::string path(target, length);
+        constexpr std::string_view deleted = " (deleted)";
+        if (path.size() > deleted.size() && path.compare(path.size() - deleted.size(), deleted.size(), deleted) == 0)
+        {
+            path.resize(path.size() - deleted.size());
+            return path;
+        }
+
+        cache_directory(handle, path);
+        return path;
+    }
+
+    void fanotify_producer::cache_directory(const file_handle* handle, const std::string& path)
+    {
+        if (directories_.size() >= max_cached_directories)
+        {
+            directories_.clear();
+        }
+
+        directories_[handle_key(handle)] = path;
+    }
+
+    void fanotify_producer::rename_cached(const std::string& from, const std::string& to)
+    {
+        for (auto& directory : directories_)
+        {
+            auto& path = directory.second;
+            if (path.compare(0, from.size(), from) == 0 && (path.size() == from.size() || path[from.size()] == '/'))
+            {
+                path.replace(0, from.size(), to);
+            }
+        }
+    }
+
+    void fanotify_producer::forget_cached(const std::string& path)
+    {
+        for (auto directory = directories_.begin(); directory != directories_.end();)
+        {
+            auto& cached = directory->second;
+            bool below = cached.compare(0, path.size(), path) == 0 &&
+                         (cached.size() == path.size() || cached[path.size()] == '/');
+            directory = below ? directories_.erase(directory) : std::next(directory);
+        }
+    }
+
+    bool fanotify_producer::is_below_root(const std::string& path) const
+    {
+        auto& root = options_.root;
+        if (root == "/")
+        {
+            return true;
+        }
+
+        return path.compare(0, root.size(), root) == 0 && (path.size() == root.size() || path[root.size()] == '/');
+    }
+
+    bool fanotify_producer::is_excluded(pid_t process_id) const
+    {
+        for (auto excluded : options_.excluded_processes)
+        {
+            if (excluded == process_id)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
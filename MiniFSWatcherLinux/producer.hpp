@@ -0,0 +1,113 @@
+//
+//  Produces the record stream of the MiniFSWatcher driver on Linux, from
+//  fanotify events of the file system a watched directory lives on.
+//
+//  Filtering is done by the kernel as far as it can: the mark only asks
+//  for the event types that become records, and ignore marks drop the
+//  events of excluded directories.  Events are read in large batches, and
+//  all records of one read are handed over as one batch.
+//
+
+#pragma once
+
+#include "record_batch.hpp"
+
+#include <fcntl.h>
+#include <sys/fanotify.h>
+#include <sys/types.h>
+
+#include <optional>
+
+namespace minifswatcher::fanotify
+{
+    struct producer_options
+    {
+        // Only events below root are logged, the whole file system of root is marked
+        std::string root;
+
+        // Directories whose direct children are ignored by the kernel
+        std::vector<std::string> ignored_directories;
+
+        // Processes whose events are dropped, the producer itself always is
+        std::vector<pid_t> excluded_processes;
+
+        // Reports a change when a file written to is closed instead of on every write,
+        // which costs fewer events on busy files but also reports files opened for
+        // writing that were not written to
+        bool changes_on_close = false;
+
+        // Logs size, last write time and attributes with creates and changes
+        bool capture_attributes = false;
+    };
+
+    struct producer_statistics
+    {
+        std::uint64_t events_read = 0;           // fanotify events, the kernel merges some
+        std::uint64_t records_logged = 0;
+        std::uint64_t batches = 0;
+        std::uint64_t bytes_delivered = 0;
+        std::uint64_t dropped_outside_root = 0;
+        std::uint64_t dropped_excluded = 0;
+        std::uint64_t dropped_unresolved = 0;    // The directory was gone before its path was known
+        std::uint64_t overflows = 0;             // The kernel queue overflowed and dropped events
+    };
+
+    class fanotify_producer
+    {
+    public:
+        using sink = std::function<void(const std::byte* data, std::size_t size)>;
+
+        // Needs CAP_SYS_ADMIN for the file system mark and CAP_DAC_READ_SEARCH
+        // to resolve directory handles, throws std::system_error otherwise
+        fanotify_producer(producer_options options, sink deliver);
+        ~fanotify_producer();
+
+        fanotify_producer(const fanotify_producer&) = delete;
+        fanotify_producer& operator=(const fanotify_producer&) = delete;
+
+        // Waits up to timeout for events and hands over everything queued, false if there was nothing
+        bool poll(std::chrono::milliseconds timeout);
+
+        // Polls until stop is set
+        void run(const std::atomic<bool>& stop, std::chrono::milliseconds interval = std::chrono::milliseconds(100));
+
+        const producer_statistics& statistics() const { return statistics_; }
+
+    private:
+        struct fid_name
+        {
+            const fanotify_event_info_fid* info = nullptr;
+            const file_handle* handle = nullptr;
+            std::string_view name;
+        };
+
+        void handle(const fanotify_event_metadata* metadata);
+        void log(ULONG event_type, RECORD_DATA data, const std::string& name, const std::string* old_name = nullptr);
+        void flush();
+
+        std::optional<std::string> path_of(const fid_name& fid);
+        std::optional<std::string> directory_path(const file_handle* handle);
+        void cache_directory(const file_handle* handle, const std::string& path);
+        void rename_cached(const std::string& from, const std::string& to);
+        void forget_cached(const std::string& path);
+
+        bool is_below_root(const std::string& path) const;
+        bool is_excluded(pid_t process_id) const;
+
+        producer_options options_;
+        sink deliver_;
+        int fanotify_fd_ = -1;
+        int root_fd_ = -1;
+        ULONG sequence_number_ = 0;
+        std::vector<std::byte> events_;
+        record_batch batch_;
+        name_string name_buffer_;
+        name_string old_name_buffer_;
+        std::unordered_map<std::string, std::string> directories_;
+        producer_statistics statistics_;
+    };
+
+    // Appends path as a record name: UTF-16 with backslashes as separators, so
+    // consumers split it like a device path. Invalid UTF-8 becomes U+FFFD.
+    void append_record_name(std::string_view path, name_string& name);
+}
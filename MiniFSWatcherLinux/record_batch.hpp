@@ -0,0 +1,116 @@
+//
+//  Packs LOG_RECORDs into a buffer laid out like the result of one
+//  GetMiniSpyLog call, so the consumers of the driver read it unchanged.
+//
+
+#pragma once
+
+#include <minifswatcher.hpp>
+
+#include <algorithm>
+#include <array>
+
+namespace minifswatcher::fanotify
+{
+    // Most names a record carries, the old and new name of a move
+    constexpr std::size_t max_record_names = 2;
+
+    class record_batch
+    {
+    public:
+        static constexpr std::size_t default_capacity = 64 * 1024;
+
+        explicit record_batch(std::size_t capacity = default_capacity) { buffer_.reserve(capacity); }
+
+        // Appends a record, false if it does not fit anymore. Names that do not fit
+        // into a driver record are cut like SpyPackRecordNames does: names shorter
+        // than their share of the space are kept, the longer ones split the rest
+        // evenly and RECORD_FLAG_NAME_TRUNCATED is set.
+        bool append(const RECORD_DATA& data, ULONG sequence_number, std::initializer_list<name_view> names)
+        {
+            std::array<std::size_t, max_record_names> lengths = {};
+            std::array<bool, max_record_names> assigned = {};
+            auto count = std::min(names.size(), max_record_names);
+            auto flags = data.Flags;
+
+            if (count == 0)
+            {
+                throw std::invalid_argument("Records have at least one name");
+            }
+
+            // Space for the characters, after reserving one terminator per name
+            auto remaining = MAX_NAME_SPACE / sizeof(WCHAR) - count;
+            auto unassigned = count;
+            std::size_t share = 0;
+
+            for (std::size_t i = 0; i < count; i++)
+            {
+                lengths[i] = names.begin()[i].size();
+            }
+
+            bool progress;
+            do
+            {
+                progress = false;
+                share = remaining / unassigned;
+
+                for (std::size_t i = 0; i < count; i++)
+                {
+                    if (!assigned[i] && lengths[i] <= share)
+                    {
+                        assigned[i] = true;
+                        remaining -= lengths[i];
+                        unassigned--;
+                        progress = true;
+                    }
+                }
+            } while (progress && unassigned > 0);
+
+            std::size_t characters = 0;
+            for (std::size_t i = 0; i < count; i++)
+            {
+                if (!assigned[i])
+                {
+                    lengths[i] = share;
+                    flags |= RECORD_FLAG_NAME_TRUNCATED;
+                }
+                characters += lengths[i] + 1;
+            }
+
+            auto length = ROUND_TO_SIZE(sizeof(LOG_RECORD) + characters * sizeof(WCHAR), sizeof(PVOID));
+            if (buffer_.size() + length > buffer_.capacity())
+            {
+                return false;
+            }
+
+            auto offset = buffer_.size();
+            buffer_.resize(offset + length);
+
+            auto log_record = reinterpret_cast<LOG_RECORD*>(buffer_.data() + offset);
+            log_record->Length = static_cast<ULONG>(length);
+            log_record->SequenceNumber = sequence_number;
+            log_record->RecordType = RECORD_TYPE_NORMAL;
+            log_record->Data = data;
+            log_record->Data.Flags = flags;
+
+            auto packed = log_record->Names;
+            for (std::size_t i = 0; i < count; i++)
+            {
+                std::copy_n(names.begin()[i].data(), lengths[i], packed);
+                packed += lengths[i];
+                *packed++ = UNICODE_NULL;
+            }
+
+            return true;
+        }
+
+        const std::byte* data() const { return buffer_.data(); }
+        std::size_t size() const { return buffer_.size(); }
+        bool empty() const { return buffer_.empty(); }
+        void clear() { buffer_.clear(); }
+
+    private:
+        // resize() never grows past the reserved capacity, so records never move
+        std::vector<std::byte> buffer_;
+    };
+}
@@ -0,0 +1,244 @@
+//
+//  Tests of the record packing and, where fanotify may be used, of the
+//  records fanotify_producer logs for a small workload. The records are
+//  read back with minifswatcher.hpp, like a consumer of the driver would.
+//
+
+#include "../producer.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace minifswatcher;
+using namespace minifswatcher::fanotify;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+// Exit code ctest reports as skipped, see SKIP_RETURN_CODE in CMakeLists.txt
+static constexpr int skipped = 77;
+
+struct logged
+{
+    ULONG type;
+    name_string name;
+    name_string old_name;
+    ULONG flags;
+};
+
+static std::vector<logged> decode(const std::vector<std::byte>& stream)
+{
+    std::vector<logged> records;
+    for (auto source : record_range(stream.data(), stream.size()))
+    {
+        records.push_back({ source.event_type(), name_string(source.name()), name_string(source.old_name()), source.data().Flags });
+    }
+    return records;
+}
+
+static name_string record_name(std::string_view path)
+{
+    name_string name;
+    append_record_name(path, name);
+    return name;
+}
+
+static void test_record_names()
+{
+    CHECK(record_name("/srv/a.txt") == u"\\srv\\a.txt");
+    CHECK(record_name("/\xC3\xA4\xE2\x82\xAC") == u"\\ä€");
+    CHECK(record_name("/\xF0\x9F\x98\x80") == u"\\\U0001F600");
+
+    // Invalid, overlong and truncated sequences
+    CHECK(record_name("\xFF/a") == u"�\\a");
+    CHECK(record_name("\xC0\xAF") == u"��");
+    CHECK(record_name("a\xE2\x82") == u"a�");
+}
+
+static void test_record_batch()
+{
+    record_batch batch;
+    RECORD_DATA data = {};
+    data.EventType = FILE_SYSTEM_EVENT_MOVE;
+
+    CHECK(batch.append(data, 1, { u"\\old", u"\\new" }));
+
+    // Too long for a record, both names get half of the space
+    name_string long_name(4096, u'x');
+    CHECK(batch.append(data, 2, { long_name, long_name }));
+
+    // A short name is kept, the long one gets the rest
+    CHECK(batch.append(data, 3, { u"\\short", long_name }));
+
+    std::vector<std::byte> stream(batch.data(), batch.data() + batch.size());
+    auto records = decode(stream);
+    CHECK(records.size() == 3);
+    CHECK(records[0].old_name == u"\\old");
+    CHECK(records[0].name == u"\\new");
+    CHECK(!FlagOn(records[0].flags, RECORD_FLAG_NAME_TRUNCATED));
+
+    constexpr std::size_t space = MAX_NAME_SPACE / sizeof(WCHAR) - 2;
+    CHECK(FlagOn(records[1].flags, RECORD_FLAG_NAME_TRUNCATED));
+    CHECK(records[1].old_name.size() == space / 2);
+    CHECK(records[1].name.size() == space / 2);
+    CHECK(records[2].old_name == u"\\short");
+    CHECK(records[2].name.size() == space - 6);
+
+    for (std::size_t offset = 0; offset < batch.size();)
+    {
+        auto length = reinterpret_cast<const LOG_RECORD*>(batch.data() + offset)->Length;
+        CHECK(length <= MAX_LOG_RECORD_LENGTH);
+        offset += length;
+    }
+
+    // A full batch refuses more records
+    record_batch small(sizeof(LOG_RECORD) + 64);
+    CHECK(small.append(data, 1, { u"\\a" }));
+    CHECK(!small.append(data, 2, { u"\\b" }));
+    small.clear();
+    CHECK(small.empty());
+}
+
+static void touch(const std::string& path)
+{
+    auto fd = open(path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd >= 0)
+    {
+        (void)write(fd, "data", 4);
+        close(fd);
+    }
+}
+
+static int test_producer()
+{
+    char base[] = "/dev/shm/fswatcher-test-XXXXXX";
+    if (mkdtemp(base) == nullptr)
+    {
+        std::printf("Skipped, no /dev/shm\n");
+        return skipped;
+    }
+
+    std::string root = std::string(base) + "/root";
+    std::string outside = std::string(base) + "/outside";
+    mkdir(root.c_str(), 0755);
+    mkdir(outside.c_str(), 0755);
+    mkdir((root + "/ignored").c_str(), 0755);
+
+    std::vector<std::byte> stream;
+    producer_options options;
+    options.root = root;
+    options.ignored_directories.push_back(root + "/ignored");
+
+    try
+    {
+        fanotify_producer producer(options, [&](const std::byte* data, std::size_t size)
+        {
+            stream.insert(stream.end(), data, data + size);
+        });
+
+        // The producer's own process is never logged
+        touch(root + "/own");
+
+        auto child = fork();
+        if (child == 0)
+        {
+            mkdir((root + "/dir").c_str(), 0755);
+            touch(root + "/dir/a");
+            rename((root + "/dir/a").c_str(), (root + "/dir/b").c_str());
+            rename((root + "/dir").c_str(), (root + "/moved").c_str());
+            touch(root + "/moved/c");
+            touch(root + "/ignored/d");
+            touch(outside + "/e");
+            rename((outside + "/e").c_str(), (root + "/moved/e").c_str());
+            unlink((root + "/moved/b").c_str());
+            std::_Exit(0);
+        }
+
+        int status = 0;
+        waitpid(child, &status, 0);
+        while (producer.poll(std::chrono::milliseconds(100)))
+        {
+        }
+
+        CHECK(producer.statistics().dropped_excluded > 0);
+        CHECK(producer.statistics().overflows == 0);
+    }
+    catch (const std::system_error& e)
+    {
+        std::printf("Skipped, fanotify is not available: %s\n", e.what());
+        std::system((std::string("rm -rf ") + base).c_str());
+        return skipped;
+    }
+
+    auto records = decode(stream);
+    auto name = [&](const char* path) { return record_name(root + path); };
+
+    std::vector<logged> expected = {
+        { FILE_SYSTEM_EVENT_CREATE, name("/dir"), u"", RECORD_FLAG_DIRECTORY },
+        { FILE_SYSTEM_EVENT_CREATE, name("/dir/a"), u"", 0 },
+        { FILE_SYSTEM_EVENT_CHANGE, name("/dir/a"), u"", 0 },
+        { FILE_SYSTEM_EVENT_CLOSE, name("/dir/a"), u"", 0 },
+        { FILE_SYSTEM_EVENT_MOVE, name("/dir/b"), name("/dir/a"), 0 },
+        { FILE_SYSTEM_EVENT_MOVE_SUBTREE, name("/moved"), name("/dir"), RECORD_FLAG_DIRECTORY },
+        { FILE_SYSTEM_EVENT_CREATE, name("/moved/c"), u"", 0 },
+        { FILE_SYSTEM_EVENT_CHANGE, name("/moved/c"), u"", 0 },
+        { FILE_SYSTEM_EVENT_CLOSE, name("/moved/c"), u"", 0 },
+        { FILE_SYSTEM_EVENT_CREATE, name("/moved/e"), u"", 0 },
+        { FILE_SYSTEM_EVENT_DELETE, name("/moved/b"), u"", 0 },
+    };
+
+    CHECK(records.size() == expected.size());
+    for (std::size_t i = 0; i < std::min(records.size(), expected.size()); i++)
+    {
+        if (records[i].type != expected[i].type || records[i].name != expected[i].name ||
+            records[i].old_name != expected[i].old_name || records[i].flags != expected[i].flags)
+        {
+            std::printf("record %zu: type %u, expected %u\n", i, records[i].type, expected[i].type);
+            failures++;
+        }
+    }
+
+    // Sequence numbers count up without gaps
+    ULONG sequence_number = 0;
+    for (auto source : record_range(stream.data(), stream.size()))
+    {
+        CHECK(source.sequence_number() == ++sequence_number);
+        CHECK(source.process_id() != static_cast<ULONGLONG>(getpid()));
+    }
+
+    std::system((std::string("rm -rf ") + base).c_str());
+    return 0;
+}
+
+int main()
+{
+    test_record_names();
+    test_record_batch();
+    auto result = test_producer();
+
+    if (failures > 0)
+    {
+        std::printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    if (result == skipped)
+    {
+        return skipped;
+    }
+
+    std::printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,181 @@
+//
+//  Runs a workload on a tmpfs directory while fanotify_producer logs it, and
+//  reports the events per second and the CPU time the producer spent per event.
+//
+//  The workload runs in a child process, as the producer drops the events of its
+//  own. Each file is created, written, closed, renamed and deleted again, which
+//  ends up as five records.
+//
+//  Usage: tmpfs_benchmark [-d <directory>] [-f <files>] [-r <rounds>] [-w <writes>] [-c]
+//
+
+#include "producer.hpp"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/magic.h>
+#include <sys/resource.h>
+#include <sys/statfs.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <iostream>
+#include <string>
+
+using namespace minifswatcher::fanotify;
+
+struct workload
+{
+    std::string directory;
+    int files = 1000;
+    int rounds = 20;
+    int writes = 1;
+};
+
+static void check(bool succeeded, const char* what)
+{
+    if (!succeeded)
+    {
+        std::perror(what);
+        std::_Exit(1);
+    }
+}
+
+static void run_workload(const workload& load)
+{
+    char data[4096] = {};
+
+    for (int round = 0; round < load.rounds; round++)
+    {
+        for (int i = 0; i < load.files; i++)
+        {
+            auto name = load.directory + "/file" + std::to_string(i);
+            auto renamed = name + ".done";
+
+            auto fd = open(name.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+            check(fd >= 0, "open");
+            for (int write_count = 0; write_count < load.writes; write_count++)
+            {
+                check(write(fd, data, sizeof(data)) == sizeof(data), "write");
+            }
+            close(fd);
+
+            check(rename(name.c_str(), renamed.c_str()) == 0, "rename");
+            check(unlink(renamed.c_str()) == 0, "unlink");
+        }
+    }
+}
+
+static double cpu_seconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    workload load;
+    producer_options options;
+    std::string base = "/dev/shm";
+
+    int option;
+    while ((option = getopt(argc, argv, "d:f:r:w:c")) != -1)
+    {
+        switch (option)
+        {
+        case 'd':
+            base = optarg;
+            break;
+        case 'f':
+            load.files = std::atoi(optarg);
+            break;
+        case 'r':
+            load.rounds = std::atoi(optarg);
+            break;
+        case 'w':
+            load.writes = std::atoi(optarg);
+            break;
+        case 'c':
+            options.changes_on_close = true;
+            break;
+        default:
+            std::cerr << "Usage: tmpfs_benchmark [-d <directory>] [-f <files>] [-r <rounds>] [-w <writes>] [-c]\n";
+            return 2;
+        }
+    }
+
+    struct statfs file_system;
+    if (statfs(base.c_str(), &file_system) == 0 && file_system.f_type != TMPFS_MAGIC)
+    {
+        std::cerr << "Warning: " << base << " is not on a tmpfs\n";
+    }
+
+    auto directory = base + "/fswatcher-benchmark-XXXXXX";
+    check(mkdtemp(directory.data()) != nullptr, "mkdtemp");
+    load.directory = directory;
+    options.root = directory;
+
+    std::uint64_t records = 0;
+    std::uint64_t bytes = 0;
+
+    try
+    {
+        fanotify_producer producer(options, [&](const std::byte* data, std::size_t size)
+        {
+            for (auto source : minifswatcher::record_range(data, size))
+            {
+                (void)source;
+                records++;
+            }
+            bytes += size;
+        });
+
+        auto cpu_start = cpu_seconds();
+        auto start = std::chrono::steady_clock::now();
+
+        auto child = fork();
+        check(child >= 0, "fork");
+        if (child == 0)
+        {
+            run_workload(load);
+            std::_Exit(0);
+        }
+
+        // Read while the workload runs, then until the queue stays empty
+        int status = 0;
+        bool running = true;
+        while (running)
+        {
+            producer.poll(std::chrono::milliseconds(10));
+            running = waitpid(child, &status, WNOHANG) == 0;
+        }
+        while (producer.poll(std::chrono::milliseconds(100)))
+        {
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        auto cpu = cpu_seconds() - cpu_start;
+        auto& statistics = producer.statistics();
+
+        std::uint64_t operations = 5ull * load.files * load.rounds;
+        std::printf("workload      %" PRIu64 " file operations in %.2f s\n", operations, elapsed.count());
+        std::printf("events read   %" PRIu64 " (%.0f events/s), %" PRIu64 " overflows\n",
+                    statistics.events_read, statistics.events_read / elapsed.count(), statistics.overflows);
+        std::printf("records       %" PRIu64 " (%.0f records/s), %" PRIu64 " batches, %.1f MB\n",
+                    records, records / elapsed.count(), statistics.batches, bytes / (1024.0 * 1024.0));
+        std::printf("producer CPU  %.2f s, %.0f ns/event, %.0f ns/record\n",
+                    cpu, cpu * 1e9 / std::max<std::uint64_t>(statistics.events_read, 1),
+                    cpu * 1e9 / std::max<std::uint64_t>(records, 1));
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "tmpfs_benchmark: " << e.what() << std::endl;
+        rmdir(directory.c_str());
+        return 1;
+    }
+
+    rmdir(directory.c_str());
+    return 0;
+}
@@ -0,0 +1,70 @@
+//
+//  Writes record batches in the trace format of the C# TraceWriter, so
+//  TraceReplay and MiniFSWatcherApp --replay consume them:
+//  the magic "MFSWTRC1", the version as two 16 bit integers, then per
+//  batch a 64 bit timestamp in 100ns units since the start, a 32 bit
+//  length and the batch.  All integers are little endian.
+//
+
+#pragma once
+
+#include <minifswatcher.hpp>
+
+#include <cstdio>
+
+namespace minifswatcher::fanotify
+{
+    class trace_writer
+    {
+    public:
+        // Takes ownership of file
+        explicit trace_writer(std::FILE* file) : file_(file)
+        {
+            if (file_ == nullptr)
+            {
+                throw std::system_error(errno, std::generic_category(), "Could not open trace");
+            }
+
+            USHORT version[] = { MINIFSWATCHER_MAJ_VERSION, MINIFSWATCHER_MIN_VERSION };
+            write("MFSWTRC1", 8);
+            write(version, sizeof(version));
+            flush();
+        }
+
+        ~trace_writer() { std::fclose(file_); }
+
+        trace_writer(const trace_writer&) = delete;
+        trace_writer& operator=(const trace_writer&) = delete;
+
+        void append(const std::byte* data, std::size_t size)
+        {
+            LONGLONG ticks = std::chrono::duration_cast<std::chrono::duration<LONGLONG, std::ratio<1, 10000000>>>(
+                std::chrono::steady_clock::now() - start_).count();
+            LONG length = static_cast<LONG>(size);
+
+            write(&ticks, sizeof(ticks));
+            write(&length, sizeof(length));
+            write(data, size);
+        }
+
+        void flush()
+        {
+            if (std::fflush(file_) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "Could not write trace");
+            }
+        }
+
+    private:
+        void write(const void* data, std::size_t size)
+        {
+            if (std::fwrite(data, 1, size, file_) != size)
+            {
+                throw std::system_error(errno, std::generic_category(), "Could not write trace");
+            }
+        }
+
+        std::FILE* file_;
+        std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+    };
+}
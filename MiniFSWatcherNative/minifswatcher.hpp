@@ -0,0 +1,786 @@
+//
+//  Header only C++17 client for the MiniFSWatcher driver.
+//
+//  Records are not copied or converted: read() fills a caller owned buffer
+//  with one GetMiniSpyLog batch and returns a range of record views into it.
+//  Views, names and iterators stay valid until the buffer is read into
+//  again.  Names are device paths as logged by the driver, e.g.
+//  \Device\HarddiskVolume2\Users\..., and are not null terminated views.
+//
+//  Exclusion is done by the driver, see watch_process(), watch_thread(),
+//  watch_path(), set_process_filter() and set_extension_filter().  The
+//  aggregation of EventWatcher is done by basic_aggregator, which has to
+//  own the events it holds back, see event.
+//
+//  Without the Windows SDK, win32_types.hpp provides the types of
+//  minispy.h.  Names are then std::u16string_views and only transports
+//  other than port_transport can be used, e.g. a mock in tests.
+//
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#include <fltuser.h>
+#else
+#include "win32_types.hpp"
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwctype>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../MiniFSWatcherDriver/minispy.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "fltlib.lib")
+#endif
+
+namespace minifswatcher
+{
+    // std::wstring_view on Windows, std::u16string_view elsewhere
+    using name_view = std::basic_string_view<WCHAR>;
+    using name_string = std::basic_string<WCHAR>;
+
+    inline void throw_if_failed(HRESULT result)
+    {
+        if (FAILED(result))
+        {
+            throw std::system_error(result, std::system_category(), "MiniFSWatcher");
+        }
+    }
+
+    class record
+    {
+    public:
+        explicit record(const LOG_RECORD* log_record) : log_record_(log_record) {}
+
+        ULONG event_type() const { return log_record_->Data.EventType; }
+        ULONG record_type() const { return log_record_->RecordType; }
+        ULONG sequence_number() const { return log_record_->SequenceNumber; }
+        ULONGLONG process_id() const { return log_record_->Data.ProcessId; }
+        ULONG process_token() const { return log_record_->Data.ProcessToken; }
+
+        bool is_truncated() const { return FlagOn(log_record_->Data.Flags, RECORD_FLAG_NAME_TRUNCATED) != 0; }
+        bool is_directory() const { return FlagOn(log_record_->Data.Flags, RECORD_FLAG_DIRECTORY) != 0; }
+        bool is_move() const
+        {
+            return event_type() == FILE_SYSTEM_EVENT_MOVE || event_type() == FILE_SYSTEM_EVENT_MOVE_SUBTREE;
+        }
+
+        // Size, last write time and attributes are only valid if the driver captures attributes
+        bool has_attributes() const { return FlagOn(log_record_->Data.Flags, RECORD_FLAG_ATTRIBUTES) != 0; }
+
+        const RECORD_DATA& data() const { return log_record_->Data; }
+
+        // The file name, the new name for moves
+        name_view name() const { return is_move() ? name_at(1) : name_at(0); }
+
+        // The former name for moves, empty otherwise
+        name_view old_name() const { return is_move() ? name_at(0) : name_view(); }
+
+    private:
+        // A name missing its terminator ends with the record
+        name_view name_at(int index) const
+        {
+            auto names = log_record_->Names;
+            auto end = reinterpret_cast<const WCHAR*>(
+                reinterpret_cast<const std::byte*>(log_record_) + log_record_->Length);
+
+            for (; index > 0 && names < end; index--)
+            {
+                while (names < end && *names != UNICODE_NULL) names++;
+                names++;
+            }
+
+            auto name = names;
+            while (name < end && *name != UNICODE_NULL) name++;
+
+            return names < end ? name_view(names, name - names) : name_view();
+        }
+
+        const LOG_RECORD* log_record_;
+    };
+
+    class record_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = record;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const record*;
+        using reference = record;
+
+        record_iterator() = default;
+        record_iterator(const std::byte* position, const std::byte* end) : position_(position), end_(end)
+        {
+            validate();
+        }
+
+        record operator*() const { return record(reinterpret_cast<const LOG_RECORD*>(position_)); }
+
+        record_iterator& operator++()
+        {
+            position_ += reinterpret_cast<const LOG_RECORD*>(position_)->Length;
+            validate();
+            return *this;
+        }
+
+        record_iterator operator++(int)
+        {
+            auto previous = *this;
+            ++*this;
+            return previous;
+        }
+
+        bool operator==(const record_iterator& other) const { return position_ == other.position_; }
+        bool operator!=(const record_iterator& other) const { return position_ != other.position_; }
+
+    private:
+        // Padding too short for another record ends the batch, as in EventReader
+        void validate()
+        {
+            if (static_cast<std::size_t>(end_ - position_) <= sizeof(LOG_RECORD))
+            {
+                position_ = end_;
+                return;
+            }
+
+            auto length = reinterpret_cast<const LOG_RECORD*>(position_)->Length;
+            if (length < sizeof(LOG_RECORD) || length > static_cast<std::size_t>(end_ - position_))
+            {
+                throw std::runtime_error("Invalid record length");
+            }
+        }
+
+        const std::byte* position_ = nullptr;
+        const std::byte* end_ = nullptr;
+    };
+
+    class record_range
+    {
+    public:
+        record_range() = default;
+        record_range(const void* data, std::size_t size)
+            : begin_(static_cast<const std::byte*>(data)), end_(begin_ + size) {}
+
+        record_iterator begin() const { return record_iterator(begin_, end_); }
+        record_iterator end() const { return record_iterator(end_, end_); }
+        bool empty() const { return begin_ == end_; }
+        std::size_t size_bytes() const { return end_ - begin_; }
+
+    private:
+        const std::byte* begin_ = nullptr;
+        const std::byte* end_ = nullptr;
+    };
+
+    // A record copied out of the receive buffer, so it can be held back by basic_aggregator
+    struct event
+    {
+        event() = default;
+        explicit event(const record& source)
+            : data(source.data()), sequence_number(source.sequence_number()),
+              name(source.name()), old_name(source.old_name()) {}
+
+        ULONG event_type() const { return data.EventType; }
+        bool is_truncated() const { return FlagOn(data.Flags, RECORD_FLAG_NAME_TRUNCATED) != 0; }
+        bool is_directory() const { return FlagOn(data.Flags, RECORD_FLAG_DIRECTORY) != 0; }
+        bool is_move() const
+        {
+            return event_type() == FILE_SYSTEM_EVENT_MOVE || event_type() == FILE_SYSTEM_EVENT_MOVE_SUBTREE;
+        }
+
+        RECORD_DATA data = {};
+        ULONG sequence_number = 0;
+        name_string name;       // The file name, the new name for moves
+        name_string old_name;   // The former name for moves, empty otherwise
+    };
+
+    // Names are compared like StringComparison.OrdinalIgnoreCase in EventAggregator
+    inline name_string fold_case(name_view name)
+    {
+        name_string folded(name);
+        for (auto& c : folded)
+        {
+#ifdef _WIN32
+            c = static_cast<WCHAR>(reinterpret_cast<ULONG_PTR>(CharUpperW(reinterpret_cast<LPWSTR>(static_cast<ULONG_PTR>(c)))));
+#else
+            c = static_cast<WCHAR>(std::towupper(static_cast<std::wint_t>(c)));
+#endif
+        }
+        return folded;
+    }
+
+    struct aggregation_options
+    {
+        // Events of a file are delivered once it has been closed, has been quiet
+        // for window or has been pending for max_age
+        std::chrono::milliseconds window = std::chrono::seconds(2);
+        std::chrono::milliseconds max_age = std::chrono::seconds(30);
+
+        // Maximum number of files with pending events, the least recently
+        // updated one is delivered early to make room for another one
+        std::size_t capacity = 10000;
+
+        // Reports the temp file and rename dance of editors saving a file as a single change,
+        // created files are then delivered window after being closed
+        bool collapse_atomic_saves = false;
+    };
+
+    // Holds back events per file and merges them, a port of the C# EventAggregator
+    // with the same rules:
+    //   Create + Create/Change -> Create
+    //   Create + Delete        -> nothing, both are dropped
+    //   Change + Create/Change -> Change
+    //   Change + Delete        -> Delete
+    //   Delete + Create/Change -> Change (the file has been replaced)
+    //   Delete + Delete        -> Delete
+    // A move of a file with a pending Create becomes a Create of the new name.
+    // Moving a directory delivers the pending events of all files below it.
+    // Otherwise, pending events of both names are delivered, then the move,
+    // and a pending Change follows the file to its new name.
+    //
+    // With collapse_atomic_saves,
+    //   rename O -> B, create or rename T -> O, ..., delete B
+    // ends up as a single Change of O.
+    //
+    // Not thread safe, all calls are made by the thread reading from the driver.
+    template <class Clock = std::chrono::steady_clock>
+    class basic_aggregator
+    {
+    public:
+        using handler = std::function<void(const event&)>;
+
+        explicit basic_aggregator(handler deliver, aggregation_options options = aggregation_options())
+            : deliver_(std::move(deliver)), options_(options) {}
+
+        const aggregation_options& options() const { return options_; }
+        std::size_t size() const { return pending_.size(); }
+
+        // Adds every record of a batch, closes deliver the pending events of their file
+        void add(const record_range& records)
+        {
+            for (auto source : records)
+            {
+                add(source);
+            }
+        }
+
+        void add(const record& source)
+        {
+            if (source.event_type() == FILE_SYSTEM_EVENT_CLOSE)
+            {
+                close(source.name());
+                return;
+            }
+
+            add(event(source));
+        }
+
+        void add(event added)
+        {
+            if (is_backup_deletion(added))
+            {
+                return;
+            }
+
+            release_move_to(added.name);
+
+            if (added.is_move())
+            {
+                release_move_to(added.old_name);
+                add_move(std::move(added));
+                return;
+            }
+
+            auto key = fold_case(added.name);
+            auto found = pending_.find(key);
+            if (found == pending_.end())
+            {
+                insert(std::move(key), std::move(added));
+                return;
+            }
+
+            auto& entry = found->second;
+            if (entry.held.event_type() == FILE_SYSTEM_EVENT_MOVE)
+            {
+                auto moved = take(entry);
+
+                if (added.event_type() == FILE_SYSTEM_EVENT_CREATE)
+                {
+                    // A new file took the place of the one moved away, which is only kept as backup
+                    backups_[fold_case(moved.name)] = Clock::now();
+                    insert(std::move(key), with_type(std::move(added), FILE_SYSTEM_EVENT_CHANGE));
+                }
+                else
+                {
+                    deliver_(moved);
+                    insert(std::move(key), std::move(added));
+                }
+                return;
+            }
+
+            auto merged = merge(entry.held.event_type(), added.event_type());
+            if (merged == FILE_SYSTEM_EVENT_UNKNOWN)
+            {
+                remove(entry);
+                return;
+            }
+
+            entry.held = with_type(std::move(added), merged);
+            touch(entry);
+        }
+
+        void close(name_view name)
+        {
+            auto found = pending_.find(fold_case(name));
+            if (found != pending_.end() && !is_held(found->second))
+            {
+                flush(found->first);
+            }
+        }
+
+        void flush_expired()
+        {
+            auto now = Clock::now();
+
+            while (!by_last_seen_.empty() && now - by_last_seen_.front()->last_seen >= options_.window)
+            {
+                flush(by_last_seen_.front()->key);
+            }
+
+            while (!by_first_seen_.empty() && now - by_first_seen_.front()->first_seen >= options_.max_age)
+            {
+                flush(by_first_seen_.front()->key);
+            }
+
+            for (auto backup = backups_.begin(); backup != backups_.end();)
+            {
+                backup = now - backup->second >= options_.window ? backups_.erase(backup) : std::next(backup);
+            }
+        }
+
+        void flush_all()
+        {
+            while (!by_first_seen_.empty())
+            {
+                flush(by_first_seen_.front()->key);
+            }
+            backups_.clear();
+        }
+
+    private:
+        struct pending_event
+        {
+            name_string key;
+            event held;
+            typename Clock::time_point first_seen;
+            typename Clock::time_point last_seen;
+            typename std::list<pending_event*>::iterator by_last_seen;
+            typename std::list<pending_event*>::iterator by_first_seen;
+        };
+
+        void flush(name_string key)
+        {
+            auto found = pending_.find(key);
+            if (found != pending_.end())
+            {
+                deliver_(take(found->second));
+            }
+        }
+
+        void add_move(event moved)
+        {
+            if (moved.event_type() == FILE_SYSTEM_EVENT_MOVE_SUBTREE)
+            {
+                flush_subtree(moved.old_name);
+                deliver_(moved);
+                return;
+            }
+
+            auto source_key = fold_case(moved.old_name);
+            auto found = pending_.find(source_key);
+            auto source = found != pending_.end() ? &found->second : nullptr;
+
+            if (source != nullptr && source->held.event_type() == FILE_SYSTEM_EVENT_CREATE)
+            {
+                remove(*source);
+                add(with_type(std::move(moved), FILE_SYSTEM_EVENT_CREATE));
+                return;
+            }
+
+            if (source != nullptr && (options_.collapse_atomic_saves || source->held.event_type() != FILE_SYSTEM_EVENT_CHANGE))
+            {
+                flush(source_key);
+                source = nullptr;
+            }
+
+            flush(fold_case(moved.name));
+
+            // A move that only changes the case of the name flushed its source too
+            if (source != nullptr && pending_.find(source_key) == pending_.end())
+            {
+                source = nullptr;
+            }
+
+            if (options_.collapse_atomic_saves)
+            {
+                insert(std::move(source_key), std::move(moved));
+                return;
+            }
+
+            if (source != nullptr)
+            {
+                remove(*source);
+            }
+
+            deliver_(moved);
+
+            if (source != nullptr)
+            {
+                add(with_type(std::move(moved), FILE_SYSTEM_EVENT_CHANGE));
+            }
+        }
+
+        void flush_subtree(name_view directory)
+        {
+            auto prefix = fold_case(directory);
+            prefix.push_back(L'\\');
+
+            std::vector<name_string> below;
+            for (auto entry : by_first_seen_)
+            {
+                if (starts_with(entry->key, prefix) || starts_with(fold_case(entry->held.name), prefix))
+                {
+                    below.push_back(entry->key);
+                }
+            }
+
+            for (auto& key : below)
+            {
+                flush(key);
+            }
+        }
+
+        void release_move_to(name_view name)
+        {
+            auto found = held_moves_.find(fold_case(name));
+            if (found != held_moves_.end())
+            {
+                flush(found->second);
+            }
+        }
+
+        bool is_backup_deletion(const event& added)
+        {
+            if (backups_.empty() || backups_.erase(fold_case(added.name)) == 0)
+            {
+                return false;
+            }
+
+            return added.event_type() == FILE_SYSTEM_EVENT_DELETE;
+        }
+
+        bool is_held(const pending_event& entry) const
+        {
+            return entry.held.event_type() == FILE_SYSTEM_EVENT_MOVE ||
+                   (options_.collapse_atomic_saves && entry.held.event_type() == FILE_SYSTEM_EVENT_CREATE);
+        }
+
+        static ULONG merge(ULONG pending_type, ULONG new_type)
+        {
+            switch (pending_type)
+            {
+            case FILE_SYSTEM_EVENT_CREATE:
+                return new_type == FILE_SYSTEM_EVENT_DELETE ? FILE_SYSTEM_EVENT_UNKNOWN : FILE_SYSTEM_EVENT_CREATE;
+            case FILE_SYSTEM_EVENT_CHANGE:
+                return new_type == FILE_SYSTEM_EVENT_DELETE ? FILE_SYSTEM_EVENT_DELETE : FILE_SYSTEM_EVENT_CHANGE;
+            case FILE_SYSTEM_EVENT_DELETE:
+                return new_type == FILE_SYSTEM_EVENT_DELETE ? FILE_SYSTEM_EVENT_DELETE : FILE_SYSTEM_EVENT_CHANGE;
+            default:
+                return new_type;
+            }
+        }
+
+        // Like EventAggregator.WithType, the result is no move and has no old name
+        static event with_type(event source, ULONG type)
+        {
+            source.data.EventType = type;
+            source.old_name.clear();
+            return source;
+        }
+
+        static bool starts_with(const name_string& name, const name_string& prefix)
+        {
+            return name.compare(0, prefix.size(), prefix) == 0;
+        }
+
+        void insert(name_string key, event added)
+        {
+            while (options_.capacity > 0 && pending_.size() >= options_.capacity)
+            {
+                flush(by_last_seen_.front()->key);
+            }
+
+            auto now = Clock::now();
+            auto& entry = pending_.emplace(key, pending_event()).first->second;
+            entry.key = std::move(key);
+            entry.held = std::move(added);
+            entry.first_seen = now;
+            entry.last_seen = now;
+            entry.by_last_seen = by_last_seen_.insert(by_last_seen_.end(), &entry);
+            entry.by_first_seen = by_first_seen_.insert(by_first_seen_.end(), &entry);
+
+            if (entry.held.event_type() == FILE_SYSTEM_EVENT_MOVE)
+            {
+                held_moves_[fold_case(entry.held.name)] = entry.key;
+            }
+        }
+
+        void touch(pending_event& entry)
+        {
+            entry.last_seen = Clock::now();
+            by_last_seen_.splice(by_last_seen_.end(), by_last_seen_, entry.by_last_seen);
+        }
+
+        // Removes entry and returns its event, entry is invalid afterwards
+        event take(pending_event& entry)
+        {
+            if (entry.held.event_type() == FILE_SYSTEM_EVENT_MOVE)
+            {
+                held_moves_.erase(fold_case(entry.held.name));
+            }
+
+            auto held = std::move(entry.held);
+            by_last_seen_.erase(entry.by_last_seen);
+            by_first_seen_.erase(entry.by_first_seen);
+            pending_.erase(name_string(entry.key));
+            return held;
+        }
+
+        void remove(pending_event& entry)
+        {
+            take(entry);
+        }
+
+        handler deliver_;
+        aggregation_options options_;
+        std::unordered_map<name_string, pending_event> pending_;
+        std::unordered_map<name_string, name_string> held_moves_;
+        std::unordered_map<name_string, typename Clock::time_point> backups_;
+        std::list<pending_event*> by_last_seen_;
+        std::list<pending_event*> by_first_seen_;
+    };
+
+    using aggregator = basic_aggregator<>;
+
+#ifdef _WIN32
+    // The filter manager port of the driver. Tests can use any type with the same send().
+    class port_transport
+    {
+    public:
+        port_transport()
+        {
+            throw_if_failed(FilterConnectCommunicationPort(MINIFSWATCHER_PORT_NAME, 0, nullptr, 0, nullptr, &port_));
+        }
+
+        ~port_transport() { CloseHandle(port_); }
+
+        port_transport(const port_transport&) = delete;
+        port_transport& operator=(const port_transport&) = delete;
+
+        HRESULT send(const void* input, DWORD input_size, void* output, DWORD output_size, DWORD* returned)
+        {
+            return FilterSendMessage(port_, const_cast<void*>(input), input_size, output, output_size, returned);
+        }
+
+    private:
+        HANDLE port_ = INVALID_HANDLE_VALUE;
+    };
+#endif
+
+    template <class Transport>
+    class basic_watcher
+    {
+    public:
+        static constexpr std::size_t default_buffer_size = 64 * 1024;
+
+        template <class... Args>
+        explicit basic_watcher(Args&&... args) : transport_(std::forward<Args>(args)...)
+        {
+            auto driver = version();
+            if (driver.Major != MINIFSWATCHER_MAJ_VERSION)
+            {
+                throw std::runtime_error("Invalid driver version!");
+            }
+        }
+
+        MINIFSWATCHERVER version()
+        {
+            MINIFSWATCHERVER result = {};
+            DWORD returned = 0;
+            throw_if_failed(send(GetMiniSpyVersion, nullptr, 0, &result, sizeof(result), &returned));
+            return result;
+        }
+
+        // Positive IDs only log that process or thread, negative ones exclude it, 0 removes the filter
+        void watch_process(LONGLONG process_id) { throw_if_failed(send(SetWatchProcess, &process_id, sizeof(process_id))); }
+        void watch_thread(LONGLONG thread_id) { throw_if_failed(send(SetWatchThread, &thread_id, sizeof(thread_id))); }
+
+        // Device path expression as understood by FsRtlIsNameInExpression
+        void watch_path(name_view expression)
+        {
+            std::vector<WCHAR> data(expression.begin(), expression.end());
+            data.push_back(UNICODE_NULL);
+            throw_if_failed(send(SetPathFilter, data.data(), static_cast<DWORD>(data.size() * sizeof(WCHAR))));
+        }
+
+        void set_process_filter(std::initializer_list<name_view> patterns, bool include = false)
+        {
+            std::vector<WCHAR> data(sizeof(ULONG) / sizeof(WCHAR));
+            ULONG flags = include ? PROCESS_FILTER_INCLUDE : 0;
+            std::memcpy(data.data(), &flags, sizeof(flags));
+            append_multi_string(data, patterns);
+            throw_if_failed(send(SetProcessFilter, data.data(), static_cast<DWORD>(data.size() * sizeof(WCHAR))));
+        }
+
+        void set_extension_filter(std::initializer_list<name_view> extensions)
+        {
+            std::vector<WCHAR> data;
+            append_multi_string(data, extensions);
+            throw_if_failed(send(SetExtensionFilter, data.data(), static_cast<DWORD>(data.size() * sizeof(WCHAR))));
+        }
+
+        void set_parameters(const MINIFSWATCHER_PARAMETERS& parameters)
+        {
+            throw_if_failed(send(SetParameters, &parameters, sizeof(parameters)));
+        }
+
+        // Reads one batch of records into buffer, empty if there are none
+        record_range read(std::vector<std::byte>& buffer)
+        {
+            if (buffer.empty())
+            {
+                buffer.resize(default_buffer_size);
+            }
+
+            DWORD returned = 0;
+            auto result = send(GetMiniSpyLog, nullptr, 0, buffer.data(), static_cast<DWORD>(buffer.size()), &returned);
+            if (result == HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS))
+            {
+                return record_range();
+            }
+
+            throw_if_failed(result);
+            return record_range(buffer.data(), returned);
+        }
+
+        // Hands every batch to handler until stop is set, waiting interval whenever the queue is empty
+        template <class Handler>
+        void poll(Handler&& handler, const std::atomic<bool>& stop,
+                  std::chrono::milliseconds interval = std::chrono::milliseconds(100))
+        {
+            std::vector<std::byte> buffer(default_buffer_size);
+
+            while (!stop.load())
+            {
+                auto records = read(buffer);
+                if (records.empty())
+                {
+                    std::this_thread::sleep_for(interval);
+                    continue;
+                }
+
+                handler(records);
+            }
+        }
+
+        // Like poll(), but every batch goes through aggregator, which delivers the merged
+        // events. Expired events are delivered after each read, the rest once stop is set.
+        template <class Clock>
+        void poll(basic_aggregator<Clock>& aggregator, const std::atomic<bool>& stop,
+                  std::chrono::milliseconds interval = std::chrono::milliseconds(100))
+        {
+            std::vector<std::byte> buffer(default_buffer_size);
+
+            while (!stop.load())
+            {
+                auto records = read(buffer);
+                aggregator.add(records);
+                aggregator.flush_expired();
+
+                if (records.empty())
+                {
+                    std::this_thread::sleep_for(interval);
+                }
+            }
+
+            aggregator.flush_all();
+        }
+
+        // Process names of all tokens after after_token, see record::process_token()
+        std::vector<PROCESS_NAME_ENTRY> process_names(ULONG after_token)
+        {
+            std::vector<PROCESS_NAME_ENTRY> entries(64);
+            DWORD returned = 0;
+            throw_if_failed(send(GetProcessNames, &after_token, sizeof(after_token),
+                                 entries.data(), static_cast<DWORD>(entries.size() * sizeof(PROCESS_NAME_ENTRY)), &returned));
+            entries.resize(returned / sizeof(PROCESS_NAME_ENTRY));
+            return entries;
+        }
+
+        Transport& transport() { return transport_; }
+
+    private:
+        HRESULT send(MINIFSWATCHER_COMMAND command, const void* data, DWORD data_size,
+                     void* output = nullptr, DWORD output_size = 0, DWORD* returned = nullptr)
+        {
+            std::vector<std::byte> message(FIELD_OFFSET(COMMAND_MESSAGE, Data) + data_size);
+            reinterpret_cast<COMMAND_MESSAGE*>(message.data())->Command = command;
+            if (data_size > 0)
+            {
+                std::memcpy(message.data() + FIELD_OFFSET(COMMAND_MESSAGE, Data), data, data_size);
+            }
+
+            DWORD ignored = 0;
+            return transport_.send(message.data(), static_cast<DWORD>(message.size()),
+                                   output, output_size, returned != nullptr ? returned : &ignored);
+        }
+
+        static void append_multi_string(std::vector<WCHAR>& data, std::initializer_list<name_view> strings)
+        {
+            for (auto string : strings)
+            {
+                if (string.empty())
+                {
+                    throw std::invalid_argument("Empty strings can not be sent in a list");
+                }
+
+                data.insert(data.end(), string.begin(), string.end());
+                data.push_back(UNICODE_NULL);
+            }
+            data.push_back(UNICODE_NULL);
+        }
+
+        Transport transport_;
+    };
+
+#ifdef _WIN32
+    using watcher = basic_watcher<port_transport>;
+#endif
+}
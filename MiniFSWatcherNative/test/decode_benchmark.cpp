@@ -0,0 +1,140 @@
+//
+//  Measures how fast batches are decoded, with and without aggregation.
+//  The batches are built once and replayed by fake_transport, so only the
+//  client is measured.
+//
+//  Usage: decode_benchmark [batches]
+//
+
+#include "records.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+using namespace minifswatcher;
+using namespace minifswatcher::test;
+
+static constexpr std::size_t batch_size = basic_watcher<fake_transport>::default_buffer_size;
+
+// Fills a batch with creates, changes, closes and moves of a few hundred
+// files, with names about as long as those of a user profile
+static std::vector<std::byte> build_batch(unsigned seed)
+{
+    static const ULONG types[] = {
+        FILE_SYSTEM_EVENT_CREATE, FILE_SYSTEM_EVENT_CHANGE, FILE_SYSTEM_EVENT_CHANGE,
+        FILE_SYSTEM_EVENT_CLOSE, FILE_SYSTEM_EVENT_MOVE, FILE_SYSTEM_EVENT_DELETE
+    };
+
+    std::vector<std::byte> batch;
+    for (unsigned i = seed;; i++)
+    {
+        auto number = std::to_string(i % 500);
+        name_string name(N("\\Device\\HarddiskVolume2\\Users\\someone\\Documents\\Projects\\report-"));
+        name.append(number.begin(), number.end());
+        name.append(N(".docx"));
+
+        auto type = types[i % (sizeof(types) / sizeof(types[0]))];
+        auto size = batch.size();
+
+        if (type == FILE_SYSTEM_EVENT_MOVE)
+        {
+            auto old_name = name + N(".tmp");
+            append_record(batch, type, { old_name, name }, 0, i);
+        }
+        else
+        {
+            append_record(batch, type, { name }, 0, i);
+        }
+
+        if (batch.size() > batch_size)
+        {
+            batch.resize(size);
+            return batch;
+        }
+    }
+}
+
+template <class Body>
+static void measure(const char* label, std::size_t batches, std::size_t records, std::size_t bytes, Body body)
+{
+    auto start = std::chrono::steady_clock::now();
+    body();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::printf("%-12s %10.0f records/s %8.1f MB/s %8.1f ns/record (%zu batches)\n", label,
+                records / elapsed.count(), bytes / elapsed.count() / (1024 * 1024),
+                elapsed.count() * 1e9 / records, batches);
+}
+
+int main(int argc, char** argv)
+{
+    std::size_t batches = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+
+    std::vector<std::vector<std::byte>> samples;
+    std::size_t sample_records = 0;
+    std::size_t sample_bytes = 0;
+    for (unsigned seed = 0; seed < 8; seed++)
+    {
+        samples.push_back(build_batch(seed * 97));
+        sample_bytes += samples.back().size();
+        sample_records += std::distance(record_range(samples.back().data(), samples.back().size()).begin(),
+                                        record_range(samples.back().data(), samples.back().size()).end());
+    }
+
+    auto records = sample_records * batches / samples.size();
+    auto bytes = sample_bytes * batches / samples.size();
+
+    basic_watcher<fake_transport> watcher;
+    std::vector<std::byte> buffer(batch_size);
+    std::size_t checksum = 0;
+
+    auto queue = [&]()
+    {
+        for (std::size_t i = 0; i < batches; i++)
+        {
+            watcher.transport().batches.push_back(samples[i % samples.size()]);
+        }
+    };
+
+    // Reading every name is what a consumer does at least
+    queue();
+    measure("iterate", batches, records, bytes, [&]()
+    {
+        for (;;)
+        {
+            auto range = watcher.read(buffer);
+            if (range.empty())
+            {
+                break;
+            }
+
+            for (auto source : range)
+            {
+                checksum += source.name().size() + source.old_name().size();
+            }
+        }
+    });
+
+    queue();
+    std::size_t delivered = 0;
+    aggregator merging([&](const event& e) { delivered++; checksum += e.name.size(); });
+    measure("aggregate", batches, records, bytes, [&]()
+    {
+        for (;;)
+        {
+            auto range = watcher.read(buffer);
+            if (range.empty())
+            {
+                break;
+            }
+
+            merging.add(range);
+            merging.flush_expired();
+        }
+        merging.flush_all();
+    });
+
+    std::printf("%zu of %zu records delivered after aggregation (checksum %zu)\n", delivered, records, checksum);
+    return 0;
+}
@@ -0,0 +1,432 @@
+//
+//  Tests of minifswatcher.hpp against fake_transport, no driver needed.
+//
+
+#include "records.hpp"
+
+#include <cstdio>
+
+using namespace minifswatcher;
+using namespace minifswatcher::test;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+#define CHECK_THROWS(expression, exception) \
+    do { \
+        bool thrown = false; \
+        try { expression; } catch (const exception&) { thrown = true; } \
+        CHECK(thrown); \
+    } while (0)
+
+struct fake_clock
+{
+    using duration = std::chrono::milliseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<fake_clock>;
+    static constexpr bool is_steady = true;
+
+    static time_point current;
+    static time_point now() { return current; }
+    static void advance(duration elapsed) { current += elapsed; }
+};
+
+fake_clock::time_point fake_clock::current;
+
+using test_aggregator = basic_aggregator<fake_clock>;
+
+static std::vector<record> collect(const std::vector<std::byte>& buffer)
+{
+    std::vector<record> records;
+    for (auto source : record_range(buffer.data(), buffer.size()))
+    {
+        records.push_back(source);
+    }
+    return records;
+}
+
+static void test_iterates_records()
+{
+    std::vector<std::byte> buffer;
+    append_record(buffer, FILE_SYSTEM_EVENT_CREATE, { N("\\Device\\Volume\\a.txt") }, 0, 1);
+    append_record(buffer, FILE_SYSTEM_EVENT_CHANGE, { N("\\Device\\Volume\\b.txt") }, RECORD_FLAG_DIRECTORY, 2);
+
+    auto records = collect(buffer);
+    CHECK(records.size() == 2);
+    CHECK(records[0].event_type() == FILE_SYSTEM_EVENT_CREATE);
+    CHECK(records[0].sequence_number() == 1);
+    CHECK(records[0].name() == N("\\Device\\Volume\\a.txt"));
+    CHECK(records[0].old_name().empty());
+    CHECK(!records[0].is_directory());
+    CHECK(records[1].name() == N("\\Device\\Volume\\b.txt"));
+    CHECK(records[1].is_directory());
+    CHECK(record_range().begin() == record_range().end());
+}
+
+static void test_validate_ends_batch_at_padding()
+{
+    std::vector<std::byte> buffer;
+    append_record(buffer, FILE_SYSTEM_EVENT_CHANGE, { N("\\a") });
+
+    // Up to a record header of padding is no record
+    buffer.resize(buffer.size() + sizeof(LOG_RECORD));
+    CHECK(collect(buffer).size() == 1);
+}
+
+static void test_validate_rejects_bad_lengths()
+{
+    std::vector<std::byte> buffer;
+    append_record(buffer, FILE_SYSTEM_EVENT_CHANGE, { N("\\a") });
+    append_record(buffer, FILE_SYSTEM_EVENT_CHANGE, { N("\\b") });
+
+    auto second = reinterpret_cast<LOG_RECORD*>(buffer.data() + reinterpret_cast<LOG_RECORD*>(buffer.data())->Length);
+    auto length = second->Length;
+
+    second->Length = sizeof(LOG_RECORD) - 1;
+    CHECK_THROWS(collect(buffer), std::runtime_error);
+
+    second->Length = length + sizeof(PVOID);
+    CHECK_THROWS(collect(buffer), std::runtime_error);
+
+    // The first record is checked as soon as the iterator is created
+    reinterpret_cast<LOG_RECORD*>(buffer.data())->Length = 0;
+    CHECK_THROWS(record_range(buffer.data(), buffer.size()).begin(), std::runtime_error);
+}
+
+static void test_move_names()
+{
+    std::vector<std::byte> buffer;
+    append_record(buffer, FILE_SYSTEM_EVENT_MOVE, { N("\\Device\\Volume\\old.txt"), N("\\Device\\Volume\\new.txt") });
+    append_record(buffer, FILE_SYSTEM_EVENT_MOVE_SUBTREE, { N("\\Device\\Volume\\from"), N("\\Device\\Volume\\to") });
+
+    auto records = collect(buffer);
+    CHECK(records.size() == 2);
+    CHECK(records[0].is_move());
+    CHECK(records[0].old_name() == N("\\Device\\Volume\\old.txt"));
+    CHECK(records[0].name() == N("\\Device\\Volume\\new.txt"));
+    CHECK(records[1].old_name() == N("\\Device\\Volume\\from"));
+    CHECK(records[1].name() == N("\\Device\\Volume\\to"));
+}
+
+static void test_move_with_missing_new_name()
+{
+    std::vector<std::byte> buffer;
+    append_record(buffer, FILE_SYSTEM_EVENT_MOVE, { N("\\Device\\Volume\\old.txt") });
+
+    // The padding after the only name is all terminators, there is no second name
+    auto records = collect(buffer);
+    CHECK(records[0].old_name() == N("\\Device\\Volume\\old.txt"));
+    CHECK(records[0].name().empty());
+}
+
+static void test_truncated_names()
+{
+    std::vector<std::byte> buffer;
+    append_record(buffer, FILE_SYSTEM_EVENT_MOVE, { N("\\Device\\Vol"), N("\\Device\\Volume\\n") }, RECORD_FLAG_NAME_TRUNCATED);
+
+    auto records = collect(buffer);
+    CHECK(records[0].is_truncated());
+    CHECK(records[0].old_name() == N("\\Device\\Vol"));
+    CHECK(records[0].name() == N("\\Device\\Volume\\n"));
+
+    // A name without a terminator stops at the end of its record, not in the next one
+    std::vector<std::byte> unterminated;
+    append_record(unterminated, FILE_SYSTEM_EVENT_CHANGE, { N("\\abcdefg") });
+    append_record(unterminated, FILE_SYSTEM_EVENT_CHANGE, { N("\\next") });
+
+    auto log_record = reinterpret_cast<LOG_RECORD*>(unterminated.data());
+    auto capacity = (log_record->Length - sizeof(LOG_RECORD)) / sizeof(WCHAR);
+    for (std::size_t i = 0; i < capacity; i++)
+    {
+        log_record->Names[i] = N('x');
+    }
+
+    records = collect(unterminated);
+    CHECK(records.size() == 2);
+    CHECK(records[0].name() == name_string(capacity, N('x')));
+    CHECK(records[1].name() == N("\\next"));
+}
+
+static void test_watcher_commands()
+{
+    basic_watcher<fake_transport> watcher;
+    auto& transport = watcher.transport();
+
+    watcher.watch_path(N("\\DEVICE\\VOLUME\\*"));
+    watcher.set_extension_filter({ N("docx"), N("png") });
+    watcher.watch_process(-42);
+
+    CHECK(transport.commands.size() == 3);
+
+    auto& path = transport.commands[0];
+    auto message = reinterpret_cast<const COMMAND_MESSAGE*>(path.data());
+    name_view expression(reinterpret_cast<const WCHAR*>(message->Data),
+                         (path.size() - FIELD_OFFSET(COMMAND_MESSAGE, Data)) / sizeof(WCHAR));
+    CHECK(message->Command == SetPathFilter);
+    // The expression is sent with its terminator
+    CHECK(expression == name_view(N("\\DEVICE\\VOLUME\\*"), 17));
+
+    auto& extensions = transport.commands[1];
+    name_view list(reinterpret_cast<const WCHAR*>(extensions.data() + FIELD_OFFSET(COMMAND_MESSAGE, Data)),
+                   (extensions.size() - FIELD_OFFSET(COMMAND_MESSAGE, Data)) / sizeof(WCHAR));
+    CHECK(list == name_view(N("docx\0png\0\0"), 10));
+
+    LONGLONG process_id = 0;
+    std::memcpy(&process_id, transport.commands[2].data() + FIELD_OFFSET(COMMAND_MESSAGE, Data), sizeof(process_id));
+    CHECK(process_id == -42);
+
+    CHECK_THROWS(watcher.set_extension_filter({ N("") }), std::invalid_argument);
+}
+
+static void test_watcher_rejects_other_major_version()
+{
+    fake_transport transport;
+    transport.major = MINIFSWATCHER_MAJ_VERSION + 1;
+    CHECK_THROWS(basic_watcher<fake_transport>(std::move(transport)), std::runtime_error);
+}
+
+static void test_watcher_read()
+{
+    basic_watcher<fake_transport> watcher;
+
+    std::vector<std::byte> batch;
+    append_record(batch, FILE_SYSTEM_EVENT_CREATE, { N("\\a") });
+    append_record(batch, FILE_SYSTEM_EVENT_DELETE, { N("\\b") });
+    watcher.transport().batches.push_back(batch);
+
+    std::vector<std::byte> buffer;
+    auto records = watcher.read(buffer);
+    CHECK(records.size_bytes() == batch.size());
+    CHECK(std::distance(records.begin(), records.end()) == 2);
+
+    // An empty queue is no error
+    CHECK(watcher.read(buffer).empty());
+}
+
+struct delivered
+{
+    std::vector<event> events;
+
+    test_aggregator::handler handler()
+    {
+        return [this](const event& e) { events.push_back(e); };
+    }
+};
+
+static event make_event(ULONG type, name_view name, name_view old_name = name_view())
+{
+    event e;
+    e.data.EventType = type;
+    e.name = name_string(name);
+    e.old_name = name_string(old_name);
+    return e;
+}
+
+static void test_aggregator_merges()
+{
+    delivered out;
+    test_aggregator aggregator(out.handler());
+
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CREATE, N("\\a")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\A")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\b")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_DELETE, N("\\b")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CREATE, N("\\c")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_DELETE, N("\\c")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_DELETE, N("\\d")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CREATE, N("\\d")));
+
+    CHECK(out.events.empty());
+    CHECK(aggregator.size() == 3);
+
+    aggregator.flush_all();
+    CHECK(out.events.size() == 3);
+    CHECK(out.events[0].event_type() == FILE_SYSTEM_EVENT_CREATE);
+    CHECK(out.events[0].name == N("\\A"));
+    CHECK(out.events[1].event_type() == FILE_SYSTEM_EVENT_DELETE);
+    CHECK(out.events[2].event_type() == FILE_SYSTEM_EVENT_CHANGE);
+    CHECK(out.events[2].name == N("\\d"));
+}
+
+static void test_aggregator_close_and_expiry()
+{
+    delivered out;
+    aggregation_options options;
+    options.window = std::chrono::milliseconds(100);
+    options.max_age = std::chrono::milliseconds(250);
+    test_aggregator aggregator(out.handler(), options);
+
+    std::vector<std::byte> batch;
+    append_record(batch, FILE_SYSTEM_EVENT_CHANGE, { N("\\a") });
+    append_record(batch, FILE_SYSTEM_EVENT_CLOSE, { N("\\a") });
+    append_record(batch, FILE_SYSTEM_EVENT_CHANGE, { N("\\b") });
+    aggregator.add(record_range(batch.data(), batch.size()));
+
+    CHECK(out.events.size() == 1);
+    CHECK(out.events[0].name == N("\\a"));
+
+    // Changes of b keep it from being quiet, but not from getting too old
+    for (int i = 0; i < 3; i++)
+    {
+        fake_clock::advance(std::chrono::milliseconds(90));
+        aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\b")));
+        aggregator.flush_expired();
+    }
+    CHECK(out.events.size() == 2);
+    CHECK(out.events[1].name == N("\\b"));
+
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\c")));
+    fake_clock::advance(std::chrono::milliseconds(99));
+    aggregator.flush_expired();
+    CHECK(out.events.size() == 2);
+    fake_clock::advance(std::chrono::milliseconds(1));
+    aggregator.flush_expired();
+    CHECK(out.events.size() == 3);
+}
+
+static void test_aggregator_capacity()
+{
+    delivered out;
+    aggregation_options options;
+    options.capacity = 2;
+    test_aggregator aggregator(out.handler(), options);
+
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\a")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\b")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\a")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\c")));
+
+    // b was updated least recently
+    CHECK(out.events.size() == 1);
+    CHECK(out.events[0].name == N("\\b"));
+    CHECK(aggregator.size() == 2);
+}
+
+static void test_aggregator_moves()
+{
+    delivered out;
+    test_aggregator aggregator(out.handler());
+
+    // A created file that is moved is a create of the new name
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CREATE, N("\\tmp")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_MOVE, N("\\new"), N("\\tmp")));
+    aggregator.flush_all();
+    CHECK(out.events.size() == 1);
+    CHECK(out.events[0].event_type() == FILE_SYSTEM_EVENT_CREATE);
+    CHECK(out.events[0].name == N("\\new"));
+    CHECK(out.events[0].old_name.empty());
+
+    // A pending change follows the file to its new name, after the move
+    out.events.clear();
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\x")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_MOVE, N("\\y"), N("\\x")));
+    CHECK(out.events.size() == 1);
+    CHECK(out.events[0].event_type() == FILE_SYSTEM_EVENT_MOVE);
+    aggregator.flush_all();
+    CHECK(out.events.size() == 2);
+    CHECK(out.events[1].event_type() == FILE_SYSTEM_EVENT_CHANGE);
+    CHECK(out.events[1].name == N("\\y"));
+
+    // Moving a directory delivers what is pending below it first
+    out.events.clear();
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\dir\\f")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\other")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_MOVE_SUBTREE, N("\\moved"), N("\\DIR")));
+    CHECK(out.events.size() == 2);
+    CHECK(out.events[0].name == N("\\dir\\f"));
+    CHECK(out.events[1].event_type() == FILE_SYSTEM_EVENT_MOVE_SUBTREE);
+    CHECK(aggregator.size() == 1);
+
+    // Changing only the case of the name delivers the change, then the move
+    out.events.clear();
+    aggregator.flush_all();
+    out.events.clear();
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CHANGE, N("\\case")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_MOVE, N("\\CASE"), N("\\case")));
+    CHECK(out.events.size() == 2);
+    CHECK(out.events[0].event_type() == FILE_SYSTEM_EVENT_CHANGE);
+    CHECK(out.events[1].event_type() == FILE_SYSTEM_EVENT_MOVE);
+    CHECK(aggregator.size() == 0);
+}
+
+static void test_aggregator_atomic_save()
+{
+    delivered out;
+    aggregation_options options;
+    options.collapse_atomic_saves = true;
+    test_aggregator aggregator(out.handler(), options);
+
+    // rename O -> B, create O, close O, delete B
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_MOVE, N("\\doc.bak"), N("\\doc")));
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_CREATE, N("\\doc")));
+    CHECK(out.events.empty());
+
+    aggregator.close(N("\\doc"));
+    CHECK(out.events.size() == 1);
+    CHECK(out.events[0].event_type() == FILE_SYSTEM_EVENT_CHANGE);
+    CHECK(out.events[0].name == N("\\doc"));
+
+    // The backup is gone without a trace
+    aggregator.add(make_event(FILE_SYSTEM_EVENT_DELETE, N("\\doc.bak")));
+    aggregator.flush_all();
+    CHECK(out.events.size() == 1);
+}
+
+static void test_poll_with_aggregator()
+{
+    basic_watcher<fake_transport> watcher;
+
+    std::vector<std::byte> batch;
+    append_record(batch, FILE_SYSTEM_EVENT_CREATE, { N("\\a") });
+    append_record(batch, FILE_SYSTEM_EVENT_CHANGE, { N("\\a") });
+    append_record(batch, FILE_SYSTEM_EVENT_CHANGE, { N("\\b") });
+    watcher.transport().batches.push_back(batch);
+
+    std::atomic<bool> stop(false);
+    watcher.transport().on_empty = [&]() { stop = true; };
+
+    delivered out;
+    test_aggregator aggregator(out.handler());
+    watcher.poll(aggregator, stop, std::chrono::milliseconds(0));
+
+    // Nothing expired, stopping delivers everything that was held back
+    CHECK(out.events.size() == 2);
+    CHECK(out.events[0].event_type() == FILE_SYSTEM_EVENT_CREATE);
+    CHECK(out.events[1].name == N("\\b"));
+}
+
+int main()
+{
+    test_iterates_records();
+    test_validate_ends_batch_at_padding();
+    test_validate_rejects_bad_lengths();
+    test_move_names();
+    test_move_with_missing_new_name();
+    test_truncated_names();
+    test_watcher_commands();
+    test_watcher_rejects_other_major_version();
+    test_watcher_read();
+    test_aggregator_merges();
+    test_aggregator_close_and_expiry();
+    test_aggregator_capacity();
+    test_aggregator_moves();
+    test_aggregator_atomic_save();
+    test_poll_with_aggregator();
+
+    if (failures > 0)
+    {
+        std::printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    std::printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+//
+//  Builds receive buffers laid out like a GetMiniSpyLog batch, and a
+//  transport standing in for the filter port.
+//
+
+#pragma once
+
+#include "../minifswatcher.hpp"
+
+#include <deque>
+#include <functional>
+
+// Names are written with L"" literals on Windows and u"" literals elsewhere
+#ifdef _WIN32
+#define N(text) L##text
+#else
+#define N(text) u##text
+#endif
+
+namespace minifswatcher::test
+{
+    // Appends a record, names are null terminated and the length is rounded
+    // up to sizeof(PVOID) like SpyPackRecordNames does
+    inline void append_record(std::vector<std::byte>& buffer, ULONG event_type,
+                              std::initializer_list<name_view> names, ULONG flags = 0, ULONG sequence_number = 0)
+    {
+        std::vector<WCHAR> packed;
+        for (auto name : names)
+        {
+            packed.insert(packed.end(), name.begin(), name.end());
+            packed.push_back(UNICODE_NULL);
+        }
+
+        auto length = ROUND_TO_SIZE(sizeof(LOG_RECORD) + packed.size() * sizeof(WCHAR), sizeof(PVOID));
+        auto offset = buffer.size();
+        buffer.resize(offset + length);
+
+        auto log_record = reinterpret_cast<LOG_RECORD*>(buffer.data() + offset);
+        log_record->Length = static_cast<ULONG>(length);
+        log_record->SequenceNumber = sequence_number;
+        log_record->RecordType = RECORD_TYPE_NORMAL;
+        log_record->Data.EventType = event_type;
+        log_record->Data.Flags = flags;
+        log_record->Data.ProcessId = 4711;
+        std::memcpy(log_record->Names, packed.data(), packed.size() * sizeof(WCHAR));
+    }
+
+    // Answers GetMiniSpyVersion and hands out queued batches for GetMiniSpyLog,
+    // on_empty is called whenever there is none. Every other command is
+    // recorded and succeeds.
+    class fake_transport
+    {
+    public:
+        std::deque<std::vector<std::byte>> batches;
+        std::vector<std::vector<std::byte>> commands;
+        USHORT major = MINIFSWATCHER_MAJ_VERSION;
+        std::function<void()> on_empty;
+
+        HRESULT send(const void* input, DWORD input_size, void* output, DWORD output_size, DWORD* returned)
+        {
+            auto message = static_cast<const std::byte*>(input);
+            auto command = reinterpret_cast<const COMMAND_MESSAGE*>(message)->Command;
+            *returned = 0;
+
+            switch (command)
+            {
+            case GetMiniSpyVersion:
+            {
+                MINIFSWATCHERVER version = { major, MINIFSWATCHER_MIN_VERSION };
+                if (output == nullptr || output_size < sizeof(version))
+                {
+                    return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+                }
+                std::memcpy(output, &version, sizeof(version));
+                *returned = sizeof(version);
+                return S_OK;
+            }
+            case GetMiniSpyLog:
+            {
+                if (batches.empty())
+                {
+                    if (on_empty)
+                    {
+                        on_empty();
+                    }
+                    return HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS);
+                }
+
+                auto& batch = batches.front();
+                if (output == nullptr || output_size < batch.size())
+                {
+                    return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+                }
+                std::memcpy(output, batch.data(), batch.size());
+                *returned = static_cast<DWORD>(batch.size());
+                batches.pop_front();
+                return S_OK;
+            }
+            default:
+                commands.emplace_back(message, message + input_size);
+                return S_OK;
+            }
+        }
+    };
+}
@@ -0,0 +1,50 @@
+//
+//  The Windows types minispy.h is written against, for builds of
+//  minifswatcher.hpp without the Windows SDK, e.g. the tests against a mock
+//  transport on Linux.  Sizes and alignment follow the 64 bit Windows ABI,
+//  so records laid out by the driver decode the same.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+typedef std::uint8_t UCHAR, *PUCHAR;
+typedef std::uint16_t USHORT;
+typedef std::int32_t LONG;
+typedef std::uint32_t ULONG;
+typedef std::uint32_t DWORD;
+typedef std::int64_t LONGLONG;
+typedef std::uint64_t ULONGLONG;
+typedef std::uintptr_t ULONG_PTR;
+typedef char16_t WCHAR;
+typedef void* PVOID;
+typedef LONG HRESULT;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    } u;
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY;
+
+static_assert(sizeof(WCHAR) == 2, "Names are UTF-16");
+static_assert(sizeof(PVOID) == 8, "Records are laid out for 64 bit Windows");
+
+#define UNICODE_NULL ((WCHAR)0)
+#define _Return_type_success_(expr)
+#define FIELD_OFFSET(type, field) offsetof(type, field)
+
+#define S_OK ((HRESULT)0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#define ERROR_INSUFFICIENT_BUFFER 122L
+#define ERROR_NO_MORE_ITEMS 259L
+#define HRESULT_FROM_WIN32(x) \
+    ((HRESULT)(x) <= 0 ? ((HRESULT)(x)) : ((HRESULT)(((x) & 0x0000FFFF) | (7 << 16) | 0x80000000)))
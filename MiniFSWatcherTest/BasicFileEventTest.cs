@@ -2,8 +2,12 @@
 using Microsoft.VisualStudio.TestTools.UnitTesting;
 using System.IO;
 using CenterDevice.MiniFSWatcher;
+using CenterDevice.MiniFSWatcher.Types;
 using System.Threading.Tasks;
 using System.Diagnostics;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.Linq;
 using System.Threading;
 
 namespace CenterDevice.MiniFSWatcherTest
@@ -136,6 +140,680 @@ namespace CenterDevice.MiniFSWatcherTest
             Assert.AreEqual((ulong)Process.GetCurrentProcess().Id, callbackData.Item2);
         }
 
+        [TestMethod]
+        public void TestStatistics()
+        {
+            var result = new TaskCompletionSource<bool>();
+            filter.OnCreate += (path, process) =>
+            {
+                result.TrySetResult(true);
+            };
+
+            var before = filter.GetStatistics();
+
+            File.Create(Path.Combine(watchDir, Path.GetRandomFileName())).Dispose();
+            result.Task.Wait();
+
+            var after = filter.GetStatistics();
+            Assert.IsTrue(after.CallbacksSeen > before.CallbacksSeen);
+            Assert.IsTrue(after.RecordsAllocated > before.RecordsAllocated);
+            Assert.IsTrue(after.BytesDelivered > before.BytesDelivered);
+            Assert.IsTrue(after.QueueDepthHighWater > 0);
+        }
+
+        [TestMethod]
+        public void TestSetParameters()
+        {
+            var invalid = new DriverParameters()
+            {
+                ValidFields = ParameterFields.MaxRecords,
+                MaxRecords = 0
+            };
+            try
+            {
+                filter.SetParameters(invalid);
+                Assert.Fail("Invalid parameters have been accepted");
+            }
+            catch (ArgumentException)
+            {
+            }
+
+            var result = new TaskCompletionSource<string>();
+            filter.OnCreate += (path, process) =>
+            {
+                result.TrySetResult(path);
+            };
+
+            filter.SetParameters(new DriverParameters()
+            {
+                ValidFields = ParameterFields.MaxRecords | ParameterFields.BackpressurePolicy,
+                MaxRecords = 10,
+                BackpressurePolicy = BackpressurePolicy.DropOldest
+            });
+
+            try
+            {
+                var filePath = Path.Combine(watchDir, Path.GetRandomFileName());
+                File.Create(filePath).Dispose();
+
+                Assert.AreEqual(filePath, result.Task.Result);
+            }
+            finally
+            {
+                filter.SetParameters(new DriverParameters()
+                {
+                    ValidFields = ParameterFields.MaxRecords | ParameterFields.BackpressurePolicy,
+                    MaxRecords = 500,
+                    BackpressurePolicy = BackpressurePolicy.DropNewest
+                });
+            }
+        }
+
+        [TestMethod]
+        public void TestRecordAndReplay()
+        {
+            var trace = new MemoryStream();
+            var recorded = new TaskCompletionSource<string>();
+            filter.OnCreate += (path, process) =>
+            {
+                recorded.TrySetResult(path);
+            };
+
+            filter.StartRecording(trace);
+            var filePath = Path.Combine(watchDir, Path.GetRandomFileName());
+            File.Create(filePath).Dispose();
+            Assert.AreEqual(filePath, recorded.Task.Result);
+            filter.StopRecording();
+
+            string replayed = null;
+            var replayWatcher = new EventWatcher();
+            replayWatcher.OnCreate += (path, process) =>
+            {
+                replayed = path;
+            };
+
+            trace.Position = 0;
+            var result = replayWatcher.Replay(trace);
+
+            Assert.AreEqual(filePath, replayed);
+            Assert.IsTrue(result.Events > 0);
+            Assert.AreEqual(filter.Version.Major, result.Version.Major);
+        }
+
+        [TestMethod]
+        public void TestBenchmark()
+        {
+            var benchmark = filter.RunBenchmark(1000);
+
+            Assert.AreEqual(1000u, benchmark.Iterations);
+            Assert.IsTrue(benchmark[BenchmarkPrimitive.HotPath] >= benchmark[BenchmarkPrimitive.NameCopy]);
+        }
+
+        [TestMethod]
+        public void TestParallelDispatch()
+        {
+            const int workers = 4;
+            filter.Disconnect();
+            filter.DispatchWorkers = workers;
+            filter.Connect();
+            filter.WatchPath(watchDir + "*");
+
+            var slowFile = Path.Combine(watchDir, Path.GetRandomFileName());
+            string fastFile;
+            do
+            {
+                fastFile = Path.Combine(watchDir, Path.GetRandomFileName());
+            } while (Shard(fastFile, workers) == Shard(slowFile, workers));
+
+            var fastDelivered = new ManualResetEventSlim();
+            var slowDelivered = new TaskCompletionSource<bool>();
+            filter.OnCreate += (path, process) =>
+            {
+                if (path == slowFile)
+                {
+                    // Blocks this worker until the other file got through
+                    slowDelivered.SetResult(fastDelivered.Wait(TimeSpan.FromSeconds(10)));
+                }
+                else if (path == fastFile)
+                {
+                    fastDelivered.Set();
+                }
+            };
+
+            File.Create(slowFile).Dispose();
+            File.Create(fastFile).Dispose();
+
+            Assert.IsTrue(slowDelivered.Task.Result);
+        }
+
+        [TestMethod]
+        public void TestAggregationWindow()
+        {
+            filter.AggregateEvents = true;
+            filter.AggregationWindow = TimeSpan.FromMilliseconds(200);
+
+            var result = new TaskCompletionSource<string>();
+            filter.OnChange += (path, process) =>
+            {
+                result.TrySetResult(path);
+            };
+
+            using (var stream = new FileStream(tmpFile, FileMode.Append))
+            {
+                stream.WriteByte(42);
+                stream.Flush(true);
+
+                // Delivered while the file is still open
+                Assert.IsTrue(result.Task.Wait(TimeSpan.FromSeconds(5)));
+                Assert.AreEqual(tmpFile, result.Task.Result);
+            }
+        }
+
+        [TestMethod]
+        public void TestAggregationCancelsCreateAndDelete()
+        {
+            filter.AggregateEvents = true;
+
+            var created = false;
+            var deleted = new TaskCompletionSource<string>();
+            filter.OnCreate += (path, process) =>
+            {
+                created = true;
+            };
+            filter.OnDelete += (path, process) =>
+            {
+                deleted.TrySetResult(path);
+            };
+
+            var filePath = Path.Combine(watchDir, Path.GetRandomFileName());
+            using (new FileStream(filePath, FileMode.CreateNew, FileAccess.Write, FileShare.Delete))
+            {
+                File.Delete(filePath);
+            }
+
+            // Events arrive in order, so the temporary file is done once this one is delivered
+            File.Delete(tmpFile);
+
+            Assert.AreEqual(tmpFile, deleted.Task.Result);
+            Assert.IsFalse(created);
+        }
+
+        [TestMethod]
+        public void TestCollapseAtomicSave()
+        {
+            filter.AggregateEvents = true;
+            filter.CollapseAtomicSaves = true;
+            filter.AggregationWindow = TimeSpan.FromMilliseconds(500);
+
+            var others = 0;
+            var changed = new TaskCompletionSource<string>();
+            filter.OnChange += (path, process) => changed.TrySetResult(path);
+            filter.OnCreate += (path, process) => Interlocked.Increment(ref others);
+            filter.OnDelete += (path, process) => Interlocked.Increment(ref others);
+            filter.OnRenameOrMove += (path, oldPath, process) => Interlocked.Increment(ref others);
+
+            // Save the way word processors do
+            var tempFile = Path.Combine(watchDir, "~WRL0001.tmp");
+            var backupFile = Path.Combine(watchDir, "~WRD0001.tmp");
+            File.WriteAllText(tempFile, "new content");
+            File.Move(tmpFile, backupFile);
+            File.Move(tempFile, tmpFile);
+            File.Delete(backupFile);
+
+            Assert.AreEqual(tmpFile, changed.Task.Result);
+            Thread.Sleep(1000);
+            Assert.AreEqual(0, others);
+        }
+
+        [TestMethod]
+        public void TestMoveDirectory()
+        {
+            filter.Index = new PathIndex();
+
+            var result = new TaskCompletionSource<Tuple<string, string>>();
+            filter.OnRenameOrMove += (path, oldPath, process) =>
+            {
+                result.TrySetResult(new Tuple<string, string>(path, oldPath));
+            };
+
+            var directory = Path.Combine(watchDir, Path.GetRandomFileName());
+            var newDirectory = Path.Combine(watchDir, Path.GetRandomFileName());
+            var fileName = Path.GetRandomFileName();
+            Directory.CreateDirectory(directory);
+            File.Create(Path.Combine(directory, fileName)).Dispose();
+
+            Directory.Move(directory, newDirectory);
+
+            var callbackData = result.Task.Result;
+            Assert.AreEqual(newDirectory, callbackData.Item1);
+            Assert.AreEqual(directory, callbackData.Item2);
+            Assert.IsTrue(filter.Index.Contains(Path.Combine(newDirectory, fileName)));
+            Assert.IsFalse(filter.Index.Contains(Path.Combine(directory, fileName)));
+        }
+
+        [TestMethod]
+        public void TestFileIdSurvivesRename()
+        {
+            filter.Index = new PathIndex();
+
+            var created = new TaskCompletionSource<bool>();
+            var moved = new TaskCompletionSource<bool>();
+            filter.OnCreate += (path, process) => created.TrySetResult(true);
+            filter.OnRenameOrMove += (path, oldPath, process) => moved.TrySetResult(true);
+
+            var filePath = Path.Combine(watchDir, Path.GetRandomFileName());
+            File.Create(filePath).Dispose();
+            created.Task.Wait();
+
+            var fileId = filter.Index.GetFileId(filePath);
+            Assert.IsFalse(fileId.IsEmpty);
+
+            var newPath = Path.Combine(watchDir, Path.GetRandomFileName());
+            File.Move(filePath, newPath);
+            moved.Task.Wait();
+
+            Assert.AreEqual(newPath, filter.Index.GetPath(fileId));
+        }
+
+        [TestMethod]
+        public void TestDropUnchangedFiles()
+        {
+            filter.DropUnchangedFiles = true;
+            filter.SetParameters(new DriverParameters()
+            {
+                ValidFields = ParameterFields.CaptureAttributes,
+                CaptureAttributes = true
+            });
+
+            try
+            {
+                var changes = new BlockingCollection<string>();
+                filter.OnChange += (path, process) => changes.Add(path);
+
+                // Each append grows the file, so neither change may be dropped
+                File.AppendAllText(tmpFile, "first");
+                Assert.AreEqual(tmpFile, changes.Take());
+
+                File.AppendAllText(tmpFile, "second");
+                Assert.AreEqual(tmpFile, changes.Take());
+
+                // Pin the last write time, setting it is not a change itself
+                File.SetLastWriteTimeUtc(tmpFile, new DateTime(2000, 1, 1, 0, 0, 0, DateTimeKind.Utc));
+
+                // The first rewrite reports the pinned time, the second leaves
+                // size, last write time and attributes as reported and is dropped
+                RewriteUnchanged(tmpFile);
+                Assert.AreEqual(tmpFile, changes.Take());
+
+                RewriteUnchanged(tmpFile);
+                string path;
+                Assert.IsFalse(changes.TryTake(out path, TimeSpan.FromSeconds(2)));
+            }
+            finally
+            {
+                filter.SetParameters(new DriverParameters()
+                {
+                    ValidFields = ParameterFields.CaptureAttributes,
+                    CaptureAttributes = false
+                });
+            }
+        }
+
+        // Writes the current content over itself without touching the last write time
+        private static void RewriteUnchanged(string path)
+        {
+            var content = File.ReadAllBytes(path);
+            using (var stream = new FileStream(path, FileMode.Open, FileAccess.Write, FileShare.Read))
+            {
+                long noUpdate = NativeMethods.FILETIME_NO_UPDATE;
+                Assert.IsTrue(NativeMethods.SetFileTime(stream.SafeFileHandle, IntPtr.Zero, IntPtr.Zero, ref noUpdate));
+
+                stream.Write(content, 0, content.Length);
+                stream.Flush(true);
+            }
+        }
+
+        [TestMethod]
+        public void TestProcessName()
+        {
+            var created = new TaskCompletionSource<ulong>();
+            filter.OnCreate += (path, process) => created.TrySetResult(process);
+
+            File.Create(Path.Combine(watchDir, Path.GetRandomFileName())).Dispose();
+            var processId = created.Task.Result;
+
+            // The driver keeps the name of the executable, cut to fit its buffer
+            const int nameLength = 32;
+            var expected = Path.GetFileName(Process.GetCurrentProcess().MainModule.FileName);
+            expected = expected.Substring(0, Math.Min(expected.Length, nameLength - 1));
+
+            Assert.AreEqual(expected, filter.GetProcessName(processId), true);
+        }
+
+        [TestMethod]
+        public void TestProcessFilter()
+        {
+            var created = new BlockingCollection<string>();
+            filter.OnCreate += (path, process) => created.Add(path);
+
+            var executable = Path.GetFileName(Process.GetCurrentProcess().MainModule.FileName);
+            filter.SetProcessFilter(new[] { "*.dll", executable });
+
+            var ignoredPath = Path.Combine(watchDir, Path.GetRandomFileName());
+            var reportedPath = Path.Combine(watchDir, Path.GetRandomFileName());
+            try
+            {
+                File.Create(ignoredPath).Dispose();
+            }
+            finally
+            {
+                filter.RemoveProcessNameFilter();
+            }
+
+            File.Create(reportedPath).Dispose();
+            Assert.AreEqual(reportedPath, created.Take());
+        }
+
+        [TestMethod]
+        public void TestExtensionFilter()
+        {
+            var created = new BlockingCollection<string>();
+            filter.OnCreate += (path, process) => created.Add(path);
+
+            filter.SetExtensionFilter(new[] { "docx", ".PNG" });
+            try
+            {
+                var ignoredPath = Path.Combine(watchDir, Path.GetRandomFileName() + ".tmp");
+                var reportedPath = Path.Combine(watchDir, Path.GetRandomFileName() + ".png");
+
+                File.Create(ignoredPath).Dispose();
+                File.Create(reportedPath).Dispose();
+
+                Assert.AreEqual(reportedPath, created.Take());
+            }
+            finally
+            {
+                filter.RemoveExtensionFilter();
+            }
+        }
+
+        [TestMethod]
+        public void TestReportDirtyOnce()
+        {
+            var events = new BlockingCollection<string>();
+            filter.OnChange += (path, process) => events.Add(path);
+            filter.OnCreate += (path, process) => events.Add(path);
+
+            filter.SetParameters(new DriverParameters()
+            {
+                ValidFields = ParameterFields.PagingIoPolicy,
+                PagingIoPolicy = PagingIoPolicy.SkipPaging | PagingIoPolicy.ReportDirtyOnce
+            });
+
+            try
+            {
+                var markerPath = Path.Combine(watchDir, Path.GetRandomFileName());
+
+                using (var stream = new FileStream(tmpFile, FileMode.Append))
+                {
+                    stream.WriteByte(1);
+                    stream.Flush();
+                    stream.WriteByte(2);
+                    stream.Flush();
+                }
+                File.Create(markerPath).Dispose();
+
+                // The second write to the open file is not reported
+                Assert.AreEqual(tmpFile, events.Take());
+                Assert.AreEqual(markerPath, events.Take());
+            }
+            finally
+            {
+                filter.SetParameters(new DriverParameters()
+                {
+                    ValidFields = ParameterFields.PagingIoPolicy,
+                    PagingIoPolicy = PagingIoPolicy.None
+                });
+            }
+        }
+
+        [TestMethod]
+        public void TestDeferWriteNames()
+        {
+            var changes = new BlockingCollection<string>();
+            filter.OnChange += (path, process) => changes.Add(path);
+
+            filter.SetParameters(new DriverParameters()
+            {
+                ValidFields = ParameterFields.DeferWriteNames,
+                DeferWriteNames = true
+            });
+
+            var ignoredPath = Path.Combine(Path.GetTempPath(), Path.GetRandomFileName());
+            try
+            {
+                File.WriteAllText(ignoredPath, "ignored");
+                File.AppendAllText(tmpFile, "reported");
+
+                Assert.AreEqual(tmpFile, changes.Take());
+            }
+            finally
+            {
+                File.Delete(ignoredPath);
+                filter.SetParameters(new DriverParameters()
+                {
+                    ValidFields = ParameterFields.DeferWriteNames,
+                    DeferWriteNames = false
+                });
+            }
+        }
+
+        [TestMethod]
+        public void TestScanBaseline()
+        {
+            // Outside of the watched path, so no live event competes with the scan
+            var root = Path.Combine(Path.GetTempPath(), Path.GetRandomFileName());
+            var expected = new List<string>();
+            for (int i = 0; i < 4; i++)
+            {
+                var directory = Path.Combine(root, "dir" + i);
+                Directory.CreateDirectory(directory);
+                expected.Add(directory);
+
+                for (int j = 0; j < 25; j++)
+                {
+                    var filePath = Path.Combine(directory, "file" + j);
+                    File.Create(filePath).Dispose();
+                    expected.Add(filePath);
+                }
+            }
+
+            var created = new ConcurrentBag<string>();
+            filter.OnCreate += (path, process) => created.Add(path);
+
+            try
+            {
+                Assert.AreEqual((long)expected.Count, filter.ScanBaseline(root).Result);
+                CollectionAssert.AreEquivalent(expected, created.ToList());
+            }
+            finally
+            {
+                Directory.Delete(root, true);
+            }
+        }
+
+        [TestMethod]
+        public void TestContentDigest()
+        {
+            filter.Disconnect();
+            filter.HashWorkers = 2;
+            filter.Connect();
+            filter.WatchPath(watchDir + "*");
+
+            var result = new TaskCompletionSource<byte[]>();
+            filter.OnDigest += (path, digest, process) =>
+            {
+                if (path == tmpFile)
+                {
+                    result.TrySetResult(digest);
+                }
+            };
+
+            File.AppendAllText(tmpFile, "content");
+
+            using (var sha = System.Security.Cryptography.SHA256.Create())
+            {
+                CollectionAssert.AreEqual(sha.ComputeHash(File.ReadAllBytes(tmpFile)), result.Task.Result);
+            }
+        }
+
+        [TestMethod]
+        public void TestContentDigestOfAggregatedCreate()
+        {
+            filter.Disconnect();
+            filter.HashWorkers = 2;
+            filter.AggregateEvents = true;
+            filter.Connect();
+            filter.WatchPath(watchDir + "*");
+
+            // Create and change merge into one create, which must be hashed too
+            var filePath = Path.Combine(watchDir, Path.GetRandomFileName());
+            var result = new TaskCompletionSource<byte[]>();
+            filter.OnDigest += (path, digest, process) =>
+            {
+                if (path == filePath)
+                {
+                    result.TrySetResult(digest);
+                }
+            };
+
+            File.WriteAllText(filePath, "content");
+
+            using (var sha = System.Security.Cryptography.SHA256.Create())
+            {
+                CollectionAssert.AreEqual(sha.ComputeHash(File.ReadAllBytes(filePath)), result.Task.Result);
+            }
+        }
+
+        [TestMethod]
+        public void TestBatchReader()
+        {
+            var expected = new List<string>();
+            for (int i = 0; i < 3; i++)
+            {
+                expected.Add(Path.Combine(watchDir, Path.GetRandomFileName()));
+            }
+
+            using (var reader = filter.OpenBatchReader(2, TimeSpan.FromMilliseconds(200)))
+            {
+                foreach (var filePath in expected)
+                {
+                    File.Create(filePath).Dispose();
+                }
+
+                var created = new List<string>();
+                while (created.Count < expected.Count)
+                {
+                    var batch = reader.ReadBatchAsync().Result;
+                    Assert.IsTrue(batch.Count > 0 && batch.Count <= 2);
+                    created.AddRange(batch.Where(fileEvent => fileEvent.Type == EventType.Create).Select(fileEvent => fileEvent.Filename));
+                }
+
+                CollectionAssert.AreEquivalent(expected, created);
+            }
+        }
+
+        [TestMethod]
+        public void TestEventBatch()
+        {
+            var kept = new BlockingCollection<EventBatch>();
+            filter.OnEventBatch = batch =>
+            {
+                batch.Keep();
+                kept.Add(batch);
+            };
+
+            try
+            {
+                var filePath = Path.Combine(watchDir, Path.GetRandomFileName());
+                File.Create(filePath).Dispose();
+
+                var created = new List<string>();
+                while (!created.Contains(filePath))
+                {
+                    EventBatch batch;
+                    Assert.IsTrue(kept.TryTake(out batch, TimeSpan.FromSeconds(5)));
+
+                    using (batch)
+                    {
+                        for (int i = 0; i < batch.Count; i++)
+                        {
+                            if (batch[i].Type == EventType.Create)
+                            {
+                                created.Add(batch.GetFilename(i));
+                                Assert.IsNull(batch.GetOldFilename(i));
+                                Assert.AreEqual((ulong)EventWatcher.GetCurrentProcessId(), batch[i].ProcessId);
+                            }
+                        }
+                    }
+                }
+            }
+            finally
+            {
+                filter.OnEventBatch = null;
+            }
+        }
+
+        [TestMethod]
+        public void TestSettleTime()
+        {
+            const int writes = 10;
+            var changes = new BlockingCollection<string>();
+            filter.OnChange += (path, process) => changes.Add(path);
+
+            filter.SetParameters(new DriverParameters()
+            {
+                ValidFields = ParameterFields.SettleTime,
+                SettleTime = 1000
+            });
+
+            try
+            {
+                var before = filter.GetStatistics();
+
+                for (int i = 0; i < writes; i++)
+                {
+                    File.AppendAllText(tmpFile, "change " + i);
+                }
+
+                string path;
+                var reported = 0;
+                while (changes.TryTake(out path, TimeSpan.FromSeconds(3)))
+                {
+                    Assert.AreEqual(tmpFile, path);
+                    reported++;
+                }
+
+                // Every write was either reported or merged into a reported change
+                var merged = filter.GetStatistics().ChangesMerged - before.ChangesMerged;
+                Assert.IsTrue(reported > 0 && reported < writes);
+                Assert.IsTrue(merged >= (ulong)(writes - reported));
+            }
+            finally
+            {
+                filter.SetParameters(new DriverParameters()
+                {
+                    ValidFields = ParameterFields.SettleTime,
+                    SettleTime = 0
+                });
+            }
+        }
+
+        private static int Shard(string path, int workers)
+        {
+            return (StringComparer.OrdinalIgnoreCase.GetHashCode(path) & int.MaxValue) % workers;
+        }
+
         [TestCleanup]
         public void Teardown()
         {
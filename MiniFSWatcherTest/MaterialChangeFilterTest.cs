@@ -0,0 +1,116 @@
+﻿using System;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using System.IO;
+using CenterDevice.MiniFSWatcher;
+using CenterDevice.MiniFSWatcher.Events;
+using CenterDevice.MiniFSWatcher.Types;
+
+namespace CenterDevice.MiniFSWatcherTest
+{
+    // MaterialChangeFilter is pure logic, so it is tested without the driver
+    [TestClass]
+    public class MaterialChangeFilterTest
+    {
+        private static readonly FileIdentifier fileId = new FileIdentifier(1, 42, 0);
+        private static readonly DateTime lastWrite = new DateTime(2000, 1, 1, 0, 0, 0, DateTimeKind.Utc);
+
+        private static FileSystemEvent Event(EventType type, long? size = 10, FileIdentifier? id = null)
+        {
+            return new FileSystemEvent()
+            {
+                Type = type,
+                Filename = @"C:\watched\file.txt",
+                FileId = id ?? fileId,
+                Size = size,
+                LastWriteTime = size.HasValue ? lastWrite : (DateTime?)null,
+                Attributes = size.HasValue ? FileAttributes.Archive : (FileAttributes?)null
+            };
+        }
+
+        [TestMethod]
+        public void TestUnchangedChangeIsDropped()
+        {
+            var filter = new MaterialChangeFilter();
+
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change)));
+            Assert.IsFalse(filter.ShouldDeliver(Event(EventType.Change)));
+        }
+
+        [TestMethod]
+        public void TestChangedStatePasses()
+        {
+            var filter = new MaterialChangeFilter();
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change)));
+
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change, 11)));
+
+            var touched = Event(EventType.Change, 11);
+            touched.LastWriteTime = lastWrite.AddSeconds(1);
+            Assert.IsTrue(filter.ShouldDeliver(touched));
+
+            var hidden = Event(EventType.Change, 11);
+            hidden.LastWriteTime = touched.LastWriteTime;
+            hidden.Attributes = FileAttributes.Archive | FileAttributes.Hidden;
+            Assert.IsTrue(filter.ShouldDeliver(hidden));
+        }
+
+        [TestMethod]
+        public void TestCreateAlwaysPassesAndRecordsState()
+        {
+            var filter = new MaterialChangeFilter();
+
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Create)));
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Create)));
+            Assert.IsFalse(filter.ShouldDeliver(Event(EventType.Change)));
+        }
+
+        [TestMethod]
+        public void TestDeleteForgetsState()
+        {
+            var filter = new MaterialChangeFilter();
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change)));
+
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Delete, null)));
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change)));
+        }
+
+        [TestMethod]
+        public void TestEventsWithoutStatePass()
+        {
+            var filter = new MaterialChangeFilter();
+            var noId = new FileIdentifier(1, 0, 0);
+
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change, id: noId)));
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change, id: noId)));
+
+            // A change without captured attributes also forgets what was known
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change)));
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change, null)));
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change)));
+        }
+
+        [TestMethod]
+        public void TestOtherFilesAreIndependent()
+        {
+            var filter = new MaterialChangeFilter();
+            var otherId = new FileIdentifier(1, 43, 0);
+
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change)));
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change, id: otherId)));
+            Assert.IsFalse(filter.ShouldDeliver(Event(EventType.Change, id: otherId)));
+        }
+
+        [TestMethod]
+        public void TestCapacityForgetsAllFiles()
+        {
+            var filter = new MaterialChangeFilter() { Capacity = 1 };
+            var otherId = new FileIdentifier(1, 43, 0);
+
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change)));
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change, id: otherId)));
+
+            // The first file was forgotten to make room for the second
+            Assert.IsTrue(filter.ShouldDeliver(Event(EventType.Change)));
+        }
+    }
+}